@@ -0,0 +1,1139 @@
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <search.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../ek.h"
+
+// Game state snapshot, about what gets sent to every client each tick
+typedef struct bench_entity {
+	uint16_t id;
+	int32_t x, y, z;
+	int16_t vx, vy, vz;
+	float yaw, pitch;
+	uint8_t flags;
+} bench_entity_t;
+
+#define BENCH_ENTITY_FIELDS(X) \
+	X(u16, id) \
+	X(s32, x) \
+	X(s32, y) \
+	X(s32, z) \
+	X(s16, vx) \
+	X(s16, vy) \
+	X(s16, vz) \
+	X(float, yaw) \
+	X(float, pitch) \
+	X(u8, flags)
+
+PACKET_SCHEMA(bench_entity, bench_entity_t, BENCH_ENTITY_FIELDS)
+PACKET_DELTA(bench_entity, bench_entity_t, BENCH_ENTITY_FIELDS)
+
+#define BENCH_NENTITIES 128
+
+static bench_entity_t entities[BENCH_NENTITIES];
+static bench_entity_t baseline[BENCH_NENTITIES];
+static uint8_t snapshot[BENCH_NENTITIES * sizeof(bench_entity_t) * 2];
+
+static int snapshot_bits;
+
+static void bench_setup(void) {
+	uint32_t seed = 1;
+	for (int i = 0; i < BENCH_NENTITIES; i++) {
+		seed = seed * 1664525 + 1013904223;
+		entities[i] = (bench_entity_t){
+			.id = i,
+			.x = (int32_t)seed >> 12,
+			.y = (int32_t)(seed >> 20) - 2048,
+			.z = (int32_t)seed >> 8,
+			.vx = (int16_t)(seed >> 3) >> 9,
+			.vy = 0,
+			.vz = (int16_t)(seed >> 7) >> 5,
+			.yaw = (float)(seed % 36000) / 100.0f,
+			.pitch = (float)(seed % 900) / 100.0f - 4.5f,
+			.flags = seed >> 28,
+		};
+
+		// Most entities sit still between ticks, some move a bit
+		baseline[i] = entities[i];
+		if (i % 8 == 0) baseline[i].x -= 3, baseline[i].yaw -= 1.0f;
+	}
+}
+
+static int encode_head(void) {
+	int head = 0;
+	for (int i = 0; i < BENCH_NENTITIES; i++) {
+		const bench_entity_t *e = entities + i;
+		packet_write_u16(snapshot, &head, e->id);
+		packet_write_s32(snapshot, &head, e->x);
+		packet_write_s32(snapshot, &head, e->y);
+		packet_write_s32(snapshot, &head, e->z);
+		packet_write_s16(snapshot, &head, e->vx);
+		packet_write_s16(snapshot, &head, e->vy);
+		packet_write_s16(snapshot, &head, e->vz);
+		packet_write_float(snapshot, &head, e->yaw);
+		packet_write_float(snapshot, &head, e->pitch);
+		packet_write_u8(snapshot, &head, e->flags);
+	}
+	return head;
+}
+static int encode_writer(void) {
+	packet_writer_t w;
+	packet_writer_init(&w, snapshot, sizeof(snapshot), 0);
+	for (int i = 0; i < BENCH_NENTITIES; i++) {
+		const bench_entity_t *e = entities + i;
+		packet_writer_u16(&w, e->id);
+		packet_writer_s32(&w, e->x);
+		packet_writer_s32(&w, e->y);
+		packet_writer_s32(&w, e->z);
+		packet_writer_s16(&w, e->vx);
+		packet_writer_s16(&w, e->vy);
+		packet_writer_s16(&w, e->vz);
+		packet_writer_float(&w, e->yaw);
+		packet_writer_float(&w, e->pitch);
+		packet_writer_u8(&w, e->flags);
+	}
+	return packet_writer_flush(&w);
+}
+static int encode_schema(void) {
+	packet_writer_t w;
+	packet_writer_init(&w, snapshot, sizeof(snapshot), 0);
+	for (int i = 0; i < BENCH_NENTITIES; i++) bench_entity_encode(&w, entities + i);
+	return packet_writer_flush(&w);
+}
+static int encode_delta(void) {
+	packet_writer_t w;
+	packet_writer_init(&w, snapshot, sizeof(snapshot), 0);
+	for (int i = 0; i < BENCH_NENTITIES; i++) {
+		bench_entity_delta_encode(&w, baseline + i, entities + i);
+	}
+	return packet_writer_flush(&w);
+}
+static uint64_t decode_head(int bits) {
+	uint64_t sum = 0;
+	int head = 0;
+	while (head < bits) {
+		sum += packet_read_u16(snapshot, &head);
+		sum += packet_read_s32(snapshot, &head);
+		sum += packet_read_s32(snapshot, &head);
+		sum += packet_read_s32(snapshot, &head);
+		sum += packet_read_s16(snapshot, &head);
+		sum += packet_read_s16(snapshot, &head);
+		sum += packet_read_s16(snapshot, &head);
+		sum += packet_read_float(snapshot, &head);
+		sum += packet_read_float(snapshot, &head);
+		sum += packet_read_u8(snapshot, &head);
+	}
+	return sum;
+}
+static uint64_t decode_reader(int bits) {
+	uint64_t sum = 0;
+	packet_reader_t r;
+	packet_reader_init(&r, snapshot, packet_bytecount(bits), 0);
+	while (packet_reader_head(&r) < bits) {
+		sum += packet_reader_u16(&r);
+		sum += packet_reader_s32(&r);
+		sum += packet_reader_s32(&r);
+		sum += packet_reader_s32(&r);
+		sum += packet_reader_s16(&r);
+		sum += packet_reader_s16(&r);
+		sum += packet_reader_s16(&r);
+		sum += packet_reader_float(&r);
+		sum += packet_reader_float(&r);
+		sum += packet_reader_u8(&r);
+	}
+	return sum;
+}
+
+// Sensor style array of samples that mostly stay small
+#define BENCH_NSAMPLES 10000
+
+static int32_t samples[BENCH_NSAMPLES];
+static float fsamples[BENCH_NSAMPLES];
+static uint8_t samplebuf[BENCH_NSAMPLES * sizeof(int32_t) * 3];
+static size_t samplebuf_bits;
+
+static void bench_setup_samples(void) {
+	uint32_t seed = 7;
+	for (int i = 0; i < BENCH_NSAMPLES; i++) {
+		seed = seed * 1664525 + 1013904223;
+		samples[i] = (int32_t)seed >> 20;
+		fsamples[i] = (float)((int32_t)seed >> 16) / 64.0f;
+	}
+}
+
+static size_t encode_samples(void) {
+	packet_writer_t w;
+	packet_writer_init(&w, samplebuf, sizeof(samplebuf), 0);
+	for (int i = 0; i < BENCH_NSAMPLES; i++) packet_writer_s32(&w, samples[i]);
+	for (int i = 0; i < BENCH_NSAMPLES; i++) packet_writer_float(&w, fsamples[i]);
+	return packet_writer_flush(&w);
+}
+static size_t encode_samples_array(void) {
+	packet_writer_t w;
+	packet_writer_init(&w, samplebuf, sizeof(samplebuf), 0);
+	packet_writer_s32_array(&w, samples, BENCH_NSAMPLES);
+	packet_writer_float_array(&w, fsamples, BENCH_NSAMPLES);
+	return packet_writer_flush(&w);
+}
+static uint64_t decode_samples_array(size_t bits) {
+	static int32_t s[BENCH_NSAMPLES];
+	static float f[BENCH_NSAMPLES];
+	packet_reader_t r;
+	packet_reader_init(&r, samplebuf, packet_bytecount(bits), 0);
+	packet_reader_s32_array(&r, s, BENCH_NSAMPLES);
+	packet_reader_float_array(&r, f, BENCH_NSAMPLES);
+	return (uint64_t)s[BENCH_NSAMPLES - 1] + (uint64_t)f[BENCH_NSAMPLES / 2];
+}
+
+// Request bodies, one plain ASCII and one with a mix of scripts
+#define BENCH_TEXT_SIZE (256 * 1024)
+
+static uint8_t text_ascii[BENCH_TEXT_SIZE];
+static uint8_t text_mixed[BENCH_TEXT_SIZE];
+static uint32_t text_utf32[BENCH_TEXT_SIZE];
+
+static void bench_setup_text(void) {
+	static const char *const words[] = {
+		"hello ", "caf\xc3\xa9 ", "\xe6\xb3\x89\xe3\x81\x93\xe3\x81\xaa\xe3\x81\x9f ",
+		"\xf0\x9f\x8d\xab ", "stra\xc3\x9f" "e ", "\xd0\xbc\xd0\xb8\xd1\x80 ",
+	};
+	uint32_t seed = 3;
+	size_t len = 0;
+	for (;;) {
+		seed = seed * 1664525 + 1013904223;
+		const char *const word = words[(seed >> 16) % arrlen(words)];
+		const size_t n = strlen(word);
+		if (len + n > BENCH_TEXT_SIZE) break;
+		memcpy(text_mixed + len, word, n);
+		len += n;
+	}
+	memset(text_mixed + len, ' ', BENCH_TEXT_SIZE - len);
+	for (size_t i = 0; i < BENCH_TEXT_SIZE; i++) text_ascii[i] = 'a' + i % 26;
+}
+
+// Numbers as they show up in JSON or a config file, kept null terminated so
+// strtod can also be timed straight on them
+#define BENCH_NNUMBERS 4096
+
+static char number_text[BENCH_NNUMBERS * 48];
+static strview_t ints[BENCH_NNUMBERS], floats[BENCH_NNUMBERS];
+
+static void bench_setup_numbers(void) {
+	uint64_t seed = 5;
+	size_t len = 0;
+	for (int i = 0; i < BENCH_NNUMBERS; i++) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		const int64_t n = (int64_t)(seed >> (seed % 60 + 1)) * (seed & 1 ? -1 : 1);
+		int w = snprintf(number_text + len, 24, "%lld", (long long)n);
+		ints[i] = (strview_t){ number_text + len, (size_t)w };
+		len += (size_t)w + 1;
+
+		// Half are short like prices, the other half full round trips
+		const double d = (double)(seed >> 11) / (double)(1ull << 53) * 1000.0;
+		w = snprintf(number_text + len, 24, i % 2 ? "%.2f" : "%.17g", d);
+		floats[i] = (strview_t){ number_text + len, (size_t)w };
+		len += (size_t)w + 1;
+	}
+}
+
+// Packets, each op is a whole snapshot or array
+static void bench_encode_head(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(encode_head());
+}
+static void bench_encode_writer(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(encode_writer());
+}
+static void bench_encode_schema(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(encode_schema());
+}
+static void bench_encode_delta(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(encode_delta());
+}
+static void bench_decode_head(size_t iters) {
+	encode_writer();
+	for (size_t i = 0; i < iters; i++) bench_keep(decode_head(snapshot_bits));
+}
+static void bench_decode_reader(size_t iters) {
+	encode_writer();
+	for (size_t i = 0; i < iters; i++) bench_keep(decode_reader(snapshot_bits));
+}
+static void bench_encode_samples(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(encode_samples());
+}
+static void bench_encode_samples_array(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(encode_samples_array());
+}
+static void bench_decode_samples_array(size_t iters) {
+	encode_samples_array();
+	for (size_t i = 0; i < iters; i++) bench_keep(decode_samples_array(samplebuf_bits));
+}
+
+// UTF-8, each op is a whole 256 KiB body
+static void bench_utf8_valid_ascii(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(utf8_valid(text_ascii, BENCH_TEXT_SIZE));
+}
+static void bench_utf8_valid_mixed(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(utf8_valid(text_mixed, BENCH_TEXT_SIZE));
+}
+static void bench_utf8_count_mixed(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(utf8_count(text_mixed, BENCH_TEXT_SIZE));
+}
+static void bench_utf8_to_utf32_mixed(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(utf8_to_utf32(text_mixed, BENCH_TEXT_SIZE, text_utf32));
+	}
+}
+
+// Number parsing, each op is one number
+static void bench_parse_i64(size_t iters) {
+	int64_t n;
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(strview_parse_i64(ints + i % BENCH_NNUMBERS, &n, NULL));
+		bench_keep(n);
+	}
+}
+static void bench_strtoll(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(strtoll(ints[i % BENCH_NNUMBERS].str, NULL, 10));
+}
+static void bench_strtoll_as_str(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(strtoll(strview_as_str(ints + i % BENCH_NNUMBERS), NULL, 10));
+	}
+}
+static void bench_parse_f64(size_t iters) {
+	double d;
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(strview_parse_f64(floats + i % BENCH_NNUMBERS, &d, NULL));
+		bench_keep(d);
+	}
+}
+static void bench_strtod(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(strtod(floats[i % BENCH_NNUMBERS].str, NULL));
+}
+static void bench_strtod_as_str(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(strtod(strview_as_str(floats + i % BENCH_NNUMBERS), NULL));
+	}
+}
+
+// Containers and allocators, each op is one call
+#define BENCH_NKEYS 4096
+
+static uint64_t bench_key_hash(const uint64_t *key) {
+	return xxhash64_single_lane((const uint8_t *)key, sizeof(*key));
+}
+static bool bench_key_eq(const uint64_t *a, const uint64_t *b) {
+	return *a == *b;
+}
+static uint64_t *bench_set, *bench_map;
+
+static void bench_setup_set(void) {
+	bench_set = hset_init(mem_stdlib_alloc(), 16, sizeof(uint64_t),
+		(hset_hash_fn *)bench_key_hash, (hset_eq_fn *)bench_key_eq);
+	bench_map = cmap_init(mem_stdlib_alloc(), 16, sizeof(uint64_t),
+		(hset_hash_fn *)bench_key_hash, (hset_eq_fn *)bench_key_eq);
+	for (uint64_t i = 0; i < BENCH_NKEYS; i++) {
+		bench_set = hset_insert(bench_set, &(uint64_t){ i * 7 });
+		bench_map = cmap_insert(bench_map, &(uint64_t){ i * 7 });
+	}
+}
+
+static void bench_hset_insert(size_t iters) {
+	// Keys that are already there, so the set stays the same size
+	for (size_t i = 0; i < iters; i++) {
+		bench_set = hset_insert(bench_set, &(uint64_t){ i % BENCH_NKEYS * 7 });
+	}
+}
+static void bench_hset_get_hit(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(hset_get(bench_set, &(uint64_t){ i % BENCH_NKEYS * 7 }));
+	}
+}
+static void bench_hset_get_miss(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(hset_get(bench_set, &(uint64_t){ i % BENCH_NKEYS * 7 + 1 }));
+	}
+}
+// Each op visits one kv pair
+static void bench_hset_iterate(size_t iters) {
+	uint64_t sum = 0;
+	for (size_t i = 0; i < iters;) {
+		for (uint64_t *iter = hset_next(bench_set, NULL); iter && i < iters;
+				iter = hset_next(bench_set, iter), i++) sum += *iter;
+	}
+	bench_keep(sum);
+}
+static void bench_cmap_insert(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_map = cmap_insert(bench_map, &(uint64_t){ i % BENCH_NKEYS * 7 });
+	}
+}
+static void bench_cmap_get_hit(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(cmap_get(bench_map, &(uint64_t){ i % BENCH_NKEYS * 7 }));
+	}
+}
+static void bench_cmap_get_miss(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(cmap_get(bench_map, &(uint64_t){ i % BENCH_NKEYS * 7 + 1 }));
+	}
+}
+static void bench_cmap_iterate(size_t iters) {
+	uint64_t sum = 0;
+	for (size_t i = 0; i < iters;) {
+		for (uint64_t *iter = cmap_next(bench_map, NULL); iter && i < iters;
+				iter = cmap_next(bench_map, iter), i++) sum += *iter;
+	}
+	bench_keep(sum);
+}
+static void bench_vec_push(size_t iters) {
+	uint64_t *vec = vec_init(mem_stdlib_alloc(), sizeof(*vec), 16);
+	for (size_t i = 0; i < iters; i++) vec = vec_push(vec, 1, &(uint64_t){ i });
+	bench_keep(vec[*vec_len(vec) - 1]);
+	vec_deinit(vec);
+}
+static void bench_dynpool_alloc_free(size_t iters) {
+	static void *ptrs[64];
+	dynpool_t *pool = dynpool_init(mem_stdlib_alloc(), 64, 48);
+	for (size_t i = 0; i < iters; i++) {
+		void **const slot = ptrs + i % arrlen(ptrs);
+		if (*slot) dynpool_free(pool, *slot);
+		*slot = dynpool_alloc(pool);
+		bench_keep(*slot);
+	}
+	memset(ptrs, 0, sizeof(ptrs));
+	dynpool_deinit(pool);
+}
+static void bench_fixedpool_alloc_free(size_t iters) {
+	static uint64_t buf[64 * 1024 / sizeof(uint64_t)];
+	static void *ptrs[64];
+	fixedpool_init(buf, 48, sizeof(buf));
+	for (size_t i = 0; i < iters; i++) {
+		void **const slot = ptrs + i % arrlen(ptrs);
+		if (*slot) fixedpool_free(buf, *slot);
+		*slot = fixedpool_alloc(buf);
+		bench_keep(*slot);
+	}
+	memset(ptrs, 0, sizeof(ptrs));
+}
+static void bench_fixed_arena_alloc(size_t iters) {
+	static uint64_t buf[64 * 1024 / sizeof(uint64_t)];
+	fixed_arena_init(buf, sizeof(buf));
+	void *const start = fixed_arena_alloc(buf, 0);
+	for (size_t i = 0; i < iters; i++) {
+		void *p = fixed_arena_alloc(buf, 40);
+		if (!p) {
+			fixed_arena_reset_to(buf, start);
+			p = fixed_arena_alloc(buf, 40);
+		}
+		bench_keep(p);
+	}
+}
+
+// Multithreaded benches run on workers that stay up between runs and meet
+// the main thread at a barrier, so a run doesn't pay for creating threads.
+// The main thread is worker 0 and every worker gets all of the iterations.
+#define BENCH_THREADS 4
+
+typedef void (bench_share_fn)(int worker, size_t iters);
+
+static struct {
+	pthread_t threads[BENCH_THREADS - 1];
+	pthread_barrier_t start, done;
+	bench_share_fn *fn;
+	size_t iters;
+	bool stop;
+} workers;
+
+static void *bench_worker(void *arg) {
+	const int worker = (int)(intptr_t)arg;
+	for (;;) {
+		pthread_barrier_wait(&workers.start);
+		if (workers.stop) return NULL;
+		workers.fn(worker, workers.iters);
+		pthread_barrier_wait(&workers.done);
+	}
+}
+static void bench_setup_workers(void) {
+	pthread_barrier_init(&workers.start, NULL, BENCH_THREADS);
+	pthread_barrier_init(&workers.done, NULL, BENCH_THREADS);
+	for (int i = 0; i < BENCH_THREADS - 1; i++) {
+		pthread_create(workers.threads + i, NULL, bench_worker, (void *)(intptr_t)(i + 1));
+	}
+}
+static void bench_stop_workers(void) {
+	workers.stop = true;
+	pthread_barrier_wait(&workers.start);
+	for (int i = 0; i < BENCH_THREADS - 1; i++) pthread_join(workers.threads[i], NULL);
+	pthread_barrier_destroy(&workers.start);
+	pthread_barrier_destroy(&workers.done);
+}
+static void bench_workers_run(bench_share_fn *fn, size_t iters) {
+	workers.fn = fn;
+	workers.iters = iters;
+	pthread_barrier_wait(&workers.start);
+	fn(0, iters);
+	pthread_barrier_wait(&workers.done);
+}
+
+// Waiting on another thread through a queue. Spins for a bit, then gives the
+// core up in case the other thread needs it
+static void bench_backoff(unsigned *spins) {
+	if (++*spins < 64) __builtin_ia32_pause();
+	else sched_yield();
+}
+
+// Handing items between threads, each op is one item
+#define BENCH_QUEUE_SIZE 1024
+#define BENCH_QUEUE_BATCH 32
+
+static uint64_t *bench_spsc, *bench_spsc_back, *bench_mpmc;
+
+static void bench_setup_queues(void) {
+	bench_spsc = spsc_init(mem_stdlib_alloc(), sizeof(uint64_t), BENCH_QUEUE_SIZE);
+	bench_spsc_back = spsc_init(mem_stdlib_alloc(), sizeof(uint64_t), BENCH_QUEUE_SIZE);
+	bench_mpmc = mpmc_init(mem_stdlib_alloc(), sizeof(uint64_t), BENCH_QUEUE_SIZE);
+}
+
+// Push and pop on one thread, what an uncontended handoff costs
+static void bench_spsc_push_pop(size_t iters) {
+	uint64_t x;
+	for (size_t i = 0; i < iters; i++) {
+		spsc_push(bench_spsc, 1, &(uint64_t){ i });
+		spsc_pop(bench_spsc, 1, &x);
+	}
+	bench_keep(x);
+}
+static void bench_mpmc_push_pop(size_t iters) {
+	uint64_t x;
+	for (size_t i = 0; i < iters; i++) {
+		mpmc_push(bench_mpmc, 1, &(uint64_t){ i });
+		mpmc_pop(bench_mpmc, 1, &x);
+	}
+	bench_keep(x);
+}
+
+// Worker 1 sends the items in batches, worker 0 receives them
+static void bench_spsc_stream_share(int worker, size_t iters) {
+	uint64_t items[BENCH_QUEUE_BATCH] = { 0 };
+	unsigned spins = 0;
+	if (worker > 1) return;
+
+	for (size_t done = 0; done < iters;) {
+		size_t n = iters - done < BENCH_QUEUE_BATCH ? iters - done : BENCH_QUEUE_BATCH;
+		n = worker ? spsc_push(bench_spsc, n, items) : spsc_pop(bench_spsc, n, items);
+		if (n) spins = 0;
+		else bench_backoff(&spins);
+		done += n;
+	}
+}
+static void bench_spsc_stream(size_t iters) {
+	bench_workers_run(bench_spsc_stream_share, iters);
+}
+
+// Worker 1 sends an item, worker 0 sends it back, each op is a round trip
+static void bench_spsc_ping_pong_share(int worker, size_t iters) {
+	uint64_t item = 0;
+	unsigned spins = 0;
+	if (worker > 1) return;
+
+	uint64_t *const in = worker ? bench_spsc_back : bench_spsc;
+	uint64_t *const out = worker ? bench_spsc : bench_spsc_back;
+	for (size_t i = 0; i < iters; i++) {
+		if (worker) spsc_push(out, 1, &item);
+		while (!spsc_pop(in, 1, &item)) bench_backoff(&spins);
+		spins = 0;
+		if (!worker) spsc_push(out, 1, &item);
+	}
+}
+static void bench_spsc_ping_pong(size_t iters) {
+	bench_workers_run(bench_spsc_ping_pong_share, iters);
+}
+
+// Half of the workers send, the other half receive
+static void bench_mpmc_stream_share(int worker, size_t iters) {
+	uint64_t items[BENCH_QUEUE_BATCH] = { 0 };
+	unsigned spins = 0;
+	const size_t share = iters / (BENCH_THREADS / 2);
+
+	for (size_t done = 0; done < share;) {
+		size_t n = share - done < BENCH_QUEUE_BATCH ? share - done : BENCH_QUEUE_BATCH;
+		n = worker & 1 ? mpmc_push(bench_mpmc, n, items) : mpmc_pop(bench_mpmc, n, items);
+		if (n) spins = 0;
+		else bench_backoff(&spins);
+		done += n;
+	}
+}
+static void bench_mpmc_stream(size_t iters) {
+	bench_workers_run(bench_mpmc_stream_share, iters);
+}
+
+// Summing an array on pools of different sizes, each op is one element. The
+// serial version is the baseline the pools have to beat.
+#define BENCH_REDUCE_SIZE (4 * 1024 * 1024)
+
+static uint64_t *bench_reduce_data;
+static tpool_t *bench_pools[3];
+
+static void bench_setup_pools(void) {
+	bench_reduce_data = malloc(BENCH_REDUCE_SIZE * sizeof(uint64_t));
+	for (size_t i = 0; i < BENCH_REDUCE_SIZE; i++) bench_reduce_data[i] = i * 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < 3; i++) bench_pools[i] = tpool_init(mem_stdlib_alloc(), 1 << i);
+}
+static void bench_stop_pools(void) {
+	for (int i = 0; i < 3; i++) tpool_deinit(bench_pools[i]);
+	free(bench_reduce_data);
+}
+
+static void bench_reduce_range(void *arg, size_t begin, size_t end) {
+	uint64_t sum = 0;
+	for (size_t i = begin; i < end; i++) sum += bench_reduce_data[i];
+	__atomic_fetch_add((uint64_t *)arg, sum, __ATOMIC_RELAXED);
+}
+static void bench_reduce(tpool_t *pool, size_t iters) {
+	uint64_t sum = 0;
+	for (size_t done = 0; done < iters;) {
+		const size_t n = iters - done < BENCH_REDUCE_SIZE ? iters - done : BENCH_REDUCE_SIZE;
+		if (pool) tpool_parallel_for(pool, 0, n, 0, bench_reduce_range, &sum);
+		else bench_reduce_range(&sum, 0, n);
+		done += n;
+	}
+	bench_keep(sum);
+}
+static void bench_reduce_serial(size_t iters) {
+	bench_reduce(NULL, iters);
+}
+static void bench_reduce_tpool1(size_t iters) {
+	bench_reduce(bench_pools[0], iters);
+}
+static void bench_reduce_tpool2(size_t iters) {
+	bench_reduce(bench_pools[1], iters);
+}
+static void bench_reduce_tpool4(size_t iters) {
+	bench_reduce(bench_pools[2], iters);
+}
+
+// What fork and join costs on a worker, each op is a spawn and a wait
+static void bench_task_nop(void *arg) {
+	bench_keep(arg);
+}
+static void bench_task_spawn_loop(void *arg) {
+	const size_t iters = *(size_t *)arg;
+	for (size_t i = 0; i < iters; i++) {
+		task_wait(bench_pools[0], task_spawn(bench_pools[0], bench_task_nop, NULL));
+	}
+}
+static void bench_task_spawn_wait(size_t iters) {
+	task_wait(bench_pools[0], task_spawn(bench_pools[0], bench_task_spawn_loop, &iters));
+}
+
+// Misses against a map too big for the caches, with and without a Bloom
+// filter in front of it
+#define BENCH_BIG_KEYS (1024 * 1024)
+#define BENCH_PROBES 4096
+
+static uint64_t *bench_big_set;
+static bloom_t *bench_bloom;
+static uint64_t bench_probes[BENCH_PROBES];
+static bool bench_maybe[BENCH_PROBES];
+
+static void bench_setup_bloom(void) {
+	bench_big_set = hset_init(mem_stdlib_alloc(), BENCH_BIG_KEYS, sizeof(uint64_t),
+		(hset_hash_fn *)bench_key_hash, (hset_eq_fn *)bench_key_eq);
+	bench_bloom = bloom_init(mem_stdlib_alloc(), BENCH_BIG_KEYS, 0.01);
+	for (uint64_t i = 0; i < BENCH_BIG_KEYS; i++) {
+		const uint64_t key = i * 2;
+		bench_big_set = hset_insert(bench_big_set, &key);
+		bloom_add(bench_bloom, bench_key_hash(&key));
+	}
+	// Odd keys are never in the map
+	for (uint64_t i = 0; i < BENCH_PROBES; i++) {
+		const uint64_t key = i * 0x9e3779b97f4a7c15ull | 1;
+		bench_probes[i] = bench_key_hash(&key);
+	}
+}
+
+static void bench_big_hset_get_miss(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(hset_get(bench_big_set, &(uint64_t){ i * 0x9e3779b97f4a7c15ull | 1 }));
+	}
+}
+static void bench_big_bloom_then_get_miss(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		const uint64_t key = i * 0x9e3779b97f4a7c15ull | 1;
+		if (bloom_test(bench_bloom, bench_key_hash(&key))) {
+			bench_keep(hset_get(bench_big_set, &key));
+		}
+	}
+}
+static void bench_bloom_test(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(bloom_test(bench_bloom, bench_probes[i % BENCH_PROBES]));
+	}
+}
+// Each op is one hash of a bulk probe
+static void bench_bloom_test_n(size_t iters) {
+	for (size_t i = 0; i < iters; i += BENCH_PROBES) {
+		const size_t n = iters - i < BENCH_PROBES ? iters - i : BENCH_PROBES;
+		bench_keep(bloom_test_n(bench_bloom, bench_probes, n, bench_maybe));
+	}
+}
+
+// Distinct counting, each add is one hash of a key
+static hll_t *bench_hll, *bench_hll_other;
+
+static void bench_setup_hll(void) {
+	bench_hll = hll_init(mem_stdlib_alloc(), 14);
+	bench_hll_other = hll_init(mem_stdlib_alloc(), 14);
+	for (uint64_t i = 0; i < BENCH_BIG_KEYS; i++) {
+		hll_add(i & 1 ? bench_hll : bench_hll_other, bench_key_hash(&i));
+	}
+}
+
+static void bench_hll_add(size_t iters) {
+	for (size_t i = 0; i < iters; i++) hll_add(bench_hll, bench_key_hash(&(uint64_t){ i }));
+}
+static void bench_hll_estimate(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(hll_estimate(bench_hll));
+}
+static void bench_hll_merge(size_t iters) {
+	for (size_t i = 0; i < iters; i++) hll_merge(bench_hll, bench_hll_other);
+}
+
+// Ordered lookups over random keys, against binary search on a sorted array
+// and glibc's tsearch, which is a red-black tree
+#define BENCH_ORDERED_KEYS (1024 * 1024)
+
+static btree_kv_t *bench_sorted;
+static btree_t *bench_btree;
+static void *bench_rbtree;
+
+static int bench_u64_cmp(const void *a, const void *b) {
+	const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Even keys are in, odd keys are for misses
+static uint64_t bench_ordered_key(size_t i) {
+	return (bench_key_hash(&(uint64_t){ i % BENCH_ORDERED_KEYS }) << 1) | (i >= BENCH_ORDERED_KEYS);
+}
+
+static void bench_setup_ordered(void) {
+	bench_sorted = vec_init(mem_stdlib_alloc(), sizeof(*bench_sorted), BENCH_ORDERED_KEYS);
+	for (size_t i = 0; i < BENCH_ORDERED_KEYS; i++) {
+		const uint64_t key = bench_ordered_key(i);
+		bench_sorted = vec_push(bench_sorted, 1, &(btree_kv_t){ key, i });
+	}
+	qsort(bench_sorted, BENCH_ORDERED_KEYS, sizeof(*bench_sorted), bench_u64_cmp);
+	for (size_t i = 0; i < BENCH_ORDERED_KEYS; i++) {
+		tsearch(&bench_sorted[i * 7919 % BENCH_ORDERED_KEYS].key, &bench_rbtree, bench_u64_cmp);
+	}
+	bench_btree = btree_init(mem_stdlib_alloc());
+	btree_bulk_load(bench_btree, bench_sorted);
+}
+static void bench_stop_ordered(void) {
+	btree_deinit(bench_btree);
+	for (size_t i = 0; i < BENCH_ORDERED_KEYS; i++) {
+		tdelete(&bench_sorted[i].key, &bench_rbtree, bench_u64_cmp);
+	}
+	vec_deinit(bench_sorted);
+}
+
+// Index of the first key >= key
+static size_t bench_sorted_lower_bound(uint64_t key) {
+	const btree_kv_t *base = bench_sorted;
+	size_t n = BENCH_ORDERED_KEYS;
+	while (n > 1) {
+		const size_t half = n / 2;
+		base = base[half - 1].key < key ? base + half : base;
+		n -= half;
+	}
+	return base - bench_sorted + (base->key < key);
+}
+
+static void bench_btree_get(size_t iters) {
+	uint64_t val = 0;
+	for (size_t i = 0; i < iters; i++) {
+		btree_get(bench_btree, bench_ordered_key(i * 7919 % BENCH_ORDERED_KEYS), &val);
+	}
+	bench_keep(val);
+}
+static void bench_sorted_get(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		bench_keep(bench_sorted_lower_bound(bench_ordered_key(i * 7919 % BENCH_ORDERED_KEYS)));
+	}
+}
+static void bench_rbtree_get(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		const uint64_t key = bench_ordered_key(i * 7919 % BENCH_ORDERED_KEYS);
+		bench_keep(tfind(&key, &bench_rbtree, bench_u64_cmp));
+	}
+}
+
+static void bench_btree_lower_bound(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		const size_t at = BENCH_ORDERED_KEYS + i * 7919 % BENCH_ORDERED_KEYS;
+		bench_keep(btree_lower_bound(bench_btree, bench_ordered_key(at)));
+	}
+}
+
+// Each op is one kv pair of a 64 pair range
+static void bench_btree_range(size_t iters) {
+	btree_kv_t kv = { 0 };
+	for (size_t i = 0; i < iters; i += 64) {
+		btree_iter_t it = btree_lower_bound(bench_btree, bench_ordered_key(i % BENCH_ORDERED_KEYS));
+		for (int j = 0; j < 64 && btree_next(&it, &kv); j++) bench_keep(kv.val);
+	}
+}
+static void bench_sorted_range(size_t iters) {
+	for (size_t i = 0; i < iters; i += 64) {
+		size_t at = bench_sorted_lower_bound(bench_ordered_key(i % BENCH_ORDERED_KEYS));
+		for (int j = 0; j < 64 && at < BENCH_ORDERED_KEYS; j++) bench_keep(bench_sorted[at++].val);
+	}
+}
+
+// A miss goes in and comes back out, so the size stays the same
+static void bench_btree_insert_remove(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		const uint64_t key = bench_ordered_key(BENCH_ORDERED_KEYS + i * 7919 % BENCH_ORDERED_KEYS);
+		btree_insert(bench_btree, key, i);
+		btree_remove(bench_btree, key, NULL);
+	}
+}
+static void bench_rbtree_insert_remove(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		const uint64_t key = bench_ordered_key(BENCH_ORDERED_KEYS + i * 7919 % BENCH_ORDERED_KEYS);
+		tsearch(&key, &bench_rbtree, bench_u64_cmp);
+		tdelete(&key, &bench_rbtree, bench_u64_cmp);
+	}
+}
+
+// Each op is one kv pair
+static void bench_btree_bulk_load(size_t iters) {
+	btree_t *tree = btree_init(mem_stdlib_alloc());
+	for (size_t done = 0; done < iters;) {
+		const size_t n = iters - done < BENCH_ORDERED_KEYS ? iters - done : BENCH_ORDERED_KEYS;
+		*vec_len(bench_sorted) = n;
+		btree_bulk_load(tree, bench_sorted);
+		done += n;
+	}
+	*vec_len(bench_sorted) = BENCH_ORDERED_KEYS;
+	btree_deinit(tree);
+}
+
+// Routing paths by longest prefix, against checking every route in turn.
+// Routes look like /svc12/v2/items/ and paths add an id to one of them.
+#define BENCH_ROUTES (20 * 1000)
+#define BENCH_ROUTES_SMALL 1000
+#define BENCH_PATHS 4096
+
+static char bench_route_bytes[BENCH_ROUTES][32];
+static strview_t bench_routes[BENCH_ROUTES];
+static char bench_path_bytes[BENCH_PATHS][48];
+static strview_t bench_paths[BENCH_PATHS];
+static art_t *bench_art, *bench_art_small;
+
+static void bench_setup_routes(void) {
+	static const char *const kinds[] = { "items", "users", "orders", "carts", "tags" };
+	bench_art = art_init(mem_stdlib_alloc());
+	bench_art_small = art_init(mem_stdlib_alloc());
+	for (size_t i = 0; i < BENCH_ROUTES; i++) {
+		const int len = snprintf(bench_route_bytes[i], sizeof(bench_route_bytes[i]), "/svc%zu/v%zu/%s/",
+				i / 10, i % 2 + 1, kinds[i / 2 % 5]);
+		bench_routes[i] = (strview_t){ bench_route_bytes[i], len };
+		art_insert(bench_art, bench_routes[i], bench_routes + i);
+		if (i < BENCH_ROUTES_SMALL) art_insert(bench_art_small, bench_routes[i], bench_routes + i);
+	}
+	for (size_t i = 0; i < BENCH_PATHS; i++) {
+		const size_t route = i * 7919 % BENCH_ROUTES_SMALL;
+		const int len = snprintf(bench_path_bytes[i], sizeof(bench_path_bytes[i]), "%.*s%zu",
+				(int)bench_routes[route].len, bench_routes[route].str, i);
+		bench_paths[i] = (strview_t){ bench_path_bytes[i], len };
+	}
+}
+
+static void bench_art_longest_prefix(size_t iters) {
+	void *val = NULL;
+	for (size_t i = 0; i < iters; i++) {
+		art_longest_prefix(bench_art, bench_paths[i % BENCH_PATHS], NULL, &val);
+	}
+	bench_keep(val);
+}
+static void bench_art_longest_prefix_small(size_t iters) {
+	void *val = NULL;
+	for (size_t i = 0; i < iters; i++) {
+		art_longest_prefix(bench_art_small, bench_paths[i % BENCH_PATHS], NULL, &val);
+	}
+	bench_keep(val);
+}
+static void bench_linear_longest_prefix(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		const strview_t path = bench_paths[i % BENCH_PATHS];
+		const strview_t *best = NULL;
+		for (size_t j = 0; j < BENCH_ROUTES; j++) {
+			strview_t head = { path.str, bench_routes[j].len };
+			if (head.len <= path.len && strview_eq(&head, bench_routes + j)
+					&& (!best || head.len > best->len)) {
+				best = bench_routes + j;
+			}
+		}
+		bench_keep(best);
+	}
+}
+static void bench_art_get(size_t iters) {
+	void *val = NULL;
+	for (size_t i = 0; i < iters; i++) {
+		art_get(bench_art, bench_routes[i * 7919 % BENCH_ROUTES], &val);
+	}
+	bench_keep(val);
+}
+static void bench_art_insert_remove(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		art_insert(bench_art, bench_paths[i % BENCH_PATHS], NULL);
+		art_remove(bench_art, bench_paths[i % BENCH_PATHS], NULL);
+	}
+}
+
+// Caches on a Zipfian trace, like a cache in front of a slow backend sees.
+// Each op is a get, and a put on a miss
+#define BENCH_ZIPF_KEYS (64 * 1024)
+#define BENCH_ZIPF_TRACE (1024 * 1024)
+#define BENCH_ZIPF_S 0.99
+#define BENCH_CACHE_CAPACITY 4096
+
+static uint64_t zipf_trace[BENCH_ZIPF_TRACE];
+static cache_t *bench_cache_lru, *bench_cache_clock;
+static cache_sharded_t *bench_cache_sharded;
+
+static void bench_setup_zipf(void) {
+	static double cdf[BENCH_ZIPF_KEYS];
+	double sum = 0.0;
+	for (int i = 0; i < BENCH_ZIPF_KEYS; i++) {
+		sum += 1.0 / pow(i + 1, BENCH_ZIPF_S);
+		cdf[i] = sum;
+	}
+
+	uint64_t seed = 1;
+	for (int i = 0; i < BENCH_ZIPF_TRACE; i++) {
+		seed = seed * 6364136223846793005ull + 1442695040888963407ull;
+		const double u = (double)(seed >> 11) / (double)(1ull << 53) * sum;
+
+		int lo = 0, hi = BENCH_ZIPF_KEYS - 1;
+		while (lo < hi) {
+			const int mid = (lo + hi) / 2;
+			if (cdf[mid] < u) lo = mid + 1;
+			else hi = mid;
+		}
+		// Spread the popular keys out instead of keeping them together
+		zipf_trace[i] = (uint64_t)lo * 0x9e3779b97f4a7c15ull;
+	}
+
+	bench_cache_lru = cache_init(mem_stdlib_alloc(), BENCH_CACHE_CAPACITY, sizeof(uint64_t),
+		(hset_hash_fn *)bench_key_hash, (hset_eq_fn *)bench_key_eq, CACHE_LRU);
+	bench_cache_clock = cache_init(mem_stdlib_alloc(), BENCH_CACHE_CAPACITY, sizeof(uint64_t),
+		(hset_hash_fn *)bench_key_hash, (hset_eq_fn *)bench_key_eq, CACHE_CLOCK);
+	bench_cache_sharded = cache_sharded_init(mem_stdlib_alloc(), 16, BENCH_CACHE_CAPACITY,
+		sizeof(uint64_t), (hset_hash_fn *)bench_key_hash, (hset_eq_fn *)bench_key_eq,
+		CACHE_CLOCK);
+}
+
+// Runs the trace once through a new cache and returns the hit rate
+static double zipf_hit_rate(cache_policy_t policy) {
+	cache_t *cache = cache_init(mem_stdlib_alloc(), BENCH_CACHE_CAPACITY, sizeof(uint64_t),
+		(hset_hash_fn *)bench_key_hash, (hset_eq_fn *)bench_key_eq, policy);
+	for (int i = 0; i < BENCH_ZIPF_TRACE; i++) {
+		if (!cache_get(cache, zipf_trace + i)) cache_put(cache, zipf_trace + i, 1);
+	}
+
+	const cache_stats_t stats = cache_stats(cache);
+	cache_deinit(cache);
+	return (double)stats.hits / (stats.hits + stats.misses);
+}
+
+static void bench_cache_zipf(cache_t *cache, size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		const uint64_t *key = zipf_trace + i % BENCH_ZIPF_TRACE;
+		if (!cache_get(cache, key)) cache_put(cache, key, 1);
+	}
+}
+static void bench_cache_lru_zipf(size_t iters) {
+	bench_cache_zipf(bench_cache_lru, iters);
+}
+static void bench_cache_clock_zipf(size_t iters) {
+	bench_cache_zipf(bench_cache_clock, iters);
+}
+
+// Each worker takes its share of the ops from its own part of the trace
+static void bench_cache_sharded_share(int worker, size_t iters) {
+	const size_t first = worker * (BENCH_ZIPF_TRACE / BENCH_THREADS);
+	iters /= BENCH_THREADS;
+	uint64_t kv;
+	for (size_t i = first; i < first + iters; i++) {
+		const uint64_t *key = zipf_trace + i % BENCH_ZIPF_TRACE;
+		if (!cache_sharded_get(bench_cache_sharded, key, &kv)) {
+			cache_sharded_put(bench_cache_sharded, key, 1);
+		}
+	}
+}
+static void bench_cache_sharded_zipf(size_t iters) {
+	bench_cache_sharded_share(0, iters * BENCH_THREADS);
+}
+// Total throughput of the threads, so ns/op goes down with more cores
+static void bench_cache_sharded_zipf_mt(size_t iters) {
+	bench_workers_run(bench_cache_sharded_share, iters);
+}
+
+// What a hot path pays per message while the background thread keeps up
+static void bench_log_async_drop(size_t iters) {
+	for (size_t i = 0; i < iters; i++) {
+		const bench_entity_t *e = entities + i % BENCH_NENTITIES;
+		log_async(LOG_INFO, "entity %d moved to %d %d %s", e->id, e->x, e->y, "ok");
+	}
+}
+
+static const bench_t benches[] = {
+	BENCH_ADD(bench_encode_head)
+	BENCH_ADD(bench_encode_writer)
+	BENCH_ADD(bench_encode_schema)
+	BENCH_ADD(bench_encode_delta)
+	BENCH_ADD(bench_decode_head)
+	BENCH_ADD(bench_decode_reader)
+	BENCH_ADD(bench_encode_samples)
+	BENCH_ADD(bench_encode_samples_array)
+	BENCH_ADD(bench_decode_samples_array)
+	BENCH_PAD
+	BENCH_ADD(bench_utf8_valid_ascii)
+	BENCH_ADD(bench_utf8_valid_mixed)
+	BENCH_ADD(bench_utf8_count_mixed)
+	BENCH_ADD(bench_utf8_to_utf32_mixed)
+	BENCH_PAD
+	BENCH_ADD(bench_parse_i64)
+	BENCH_ADD(bench_strtoll)
+	BENCH_ADD(bench_strtoll_as_str)
+	BENCH_ADD(bench_parse_f64)
+	BENCH_ADD(bench_strtod)
+	BENCH_ADD(bench_strtod_as_str)
+	BENCH_PAD
+	BENCH_ADD(bench_hset_insert)
+	BENCH_ADD(bench_hset_get_hit)
+	BENCH_ADD(bench_hset_get_miss)
+	BENCH_ADD(bench_hset_iterate)
+	BENCH_ADD(bench_cmap_insert)
+	BENCH_ADD(bench_cmap_get_hit)
+	BENCH_ADD(bench_cmap_get_miss)
+	BENCH_ADD(bench_cmap_iterate)
+	BENCH_ADD(bench_vec_push)
+	BENCH_ADD(bench_dynpool_alloc_free)
+	BENCH_ADD(bench_fixedpool_alloc_free)
+	BENCH_ADD(bench_fixed_arena_alloc)
+	BENCH_PAD
+	BENCH_ADD(bench_spsc_push_pop)
+	BENCH_ADD(bench_mpmc_push_pop)
+	BENCH_ADD(bench_spsc_stream)
+	BENCH_ADD(bench_spsc_ping_pong)
+	BENCH_ADD(bench_mpmc_stream)
+	BENCH_PAD
+	BENCH_ADD(bench_reduce_serial)
+	BENCH_ADD(bench_reduce_tpool1)
+	BENCH_ADD(bench_reduce_tpool2)
+	BENCH_ADD(bench_reduce_tpool4)
+	BENCH_ADD(bench_task_spawn_wait)
+	BENCH_PAD
+	BENCH_ADD(bench_big_hset_get_miss)
+	BENCH_ADD(bench_big_bloom_then_get_miss)
+	BENCH_ADD(bench_bloom_test)
+	BENCH_ADD(bench_bloom_test_n)
+	BENCH_ADD(bench_hll_add)
+	BENCH_ADD(bench_hll_estimate)
+	BENCH_ADD(bench_hll_merge)
+	BENCH_PAD
+	BENCH_ADD(bench_btree_get)
+	BENCH_ADD(bench_sorted_get)
+	BENCH_ADD(bench_rbtree_get)
+	BENCH_ADD(bench_btree_lower_bound)
+	BENCH_ADD(bench_btree_range)
+	BENCH_ADD(bench_sorted_range)
+	BENCH_ADD(bench_btree_insert_remove)
+	BENCH_ADD(bench_rbtree_insert_remove)
+	BENCH_ADD(bench_btree_bulk_load)
+	BENCH_PAD
+	BENCH_ADD(bench_art_longest_prefix)
+	BENCH_ADD(bench_art_longest_prefix_small)
+	BENCH_ADD(bench_linear_longest_prefix)
+	BENCH_ADD(bench_art_get)
+	BENCH_ADD(bench_art_insert_remove)
+	BENCH_PAD
+	BENCH_ADD(bench_cache_lru_zipf)
+	BENCH_ADD(bench_cache_clock_zipf)
+	BENCH_ADD(bench_cache_sharded_zipf)
+	BENCH_ADD(bench_cache_sharded_zipf_mt)
+	BENCH_PAD
+	BENCH_ADD(bench_log_async_drop)
+};
+
+// Usage: bench [--json] [filter]
+int main(int argc, char **argv) {
+	bench_format_t format = BENCH_FORMAT_TEXT;
+	const char *filter = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--json") == 0) format = BENCH_FORMAT_JSON;
+		else filter = argv[i];
+	}
+
+	bench_setup();
+	bench_setup_samples();
+	bench_setup_text();
+	bench_setup_numbers();
+	bench_setup_set();
+	bench_setup_bloom();
+	bench_setup_hll();
+	bench_setup_ordered();
+	bench_setup_routes();
+	bench_setup_zipf();
+	bench_setup_queues();
+	bench_setup_workers();
+	bench_setup_pools();
+	snapshot_bits = encode_writer();
+	samplebuf_bits = encode_samples_array();
+	if (format == BENCH_FORMAT_TEXT) {
+		printf("snapshot: %d entities, %d bytes, %d bytes as a delta\n",
+			BENCH_NENTITIES, packet_bytecount(snapshot_bits),
+			packet_bytecount(encode_delta()));
+		printf("samples: %d int32 and %d float, %d bytes per value, %d bytes as arrays\n",
+			BENCH_NSAMPLES, BENCH_NSAMPLES, packet_bytecount(encode_samples()),
+			packet_bytecount(samplebuf_bits));
+		printf("text: %d bytes\n", BENCH_TEXT_SIZE);
+		printf("zipf: %d keys, s = %.2f, %d entry cache, %.1f%% lru and %.1f%% clock hits\n\n",
+			BENCH_ZIPF_KEYS, BENCH_ZIPF_S, BENCH_CACHE_CAPACITY,
+			zipf_hit_rate(CACHE_LRU) * 100.0, zipf_hit_rate(CACHE_CLOCK) * 100.0);
+	}
+
+	const int devnull = open("/dev/null", O_WRONLY);
+	log_async_start(mem_stdlib_alloc(), 1024 * 1024, LOG_ASYNC_DROP, devnull);
+	benches_run_foreach(benches, arrlen(benches), filter, format, stdout);
+	log_async_stop();
+	hset_deinit(bench_set);
+	cmap_deinit(bench_map);
+	hset_deinit(bench_big_set);
+	bloom_deinit(bench_bloom);
+	hll_deinit(bench_hll);
+	hll_deinit(bench_hll_other);
+	bench_stop_ordered();
+	art_deinit(bench_art);
+	art_deinit(bench_art_small);
+	cache_deinit(bench_cache_lru);
+	cache_deinit(bench_cache_clock);
+	bench_stop_workers();
+	bench_stop_pools();
+	spsc_deinit(bench_spsc);
+	spsc_deinit(bench_spsc_back);
+	mpmc_deinit(bench_mpmc);
+	cache_sharded_deinit(bench_cache_sharded);
+
+	return 0;
+}
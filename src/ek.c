@@ -1,37 +1,80 @@
 #include "ek.h"
 
-#if EK_USE_VEC || EK_USE_STDLIB_MALLOC
+#if EK_USE_VEC || EK_USE_STDLIB_MALLOC || EK_MEM_CHECKS || EK_USE_TEST || EK_USE_HLL \
+	|| EK_USE_STRVIEW
 #	include <stdlib.h>
 #endif
-#if EK_USE_PACKET
+#if EK_MEM_CHECKS
+#	include <stdio.h>
+#endif
+
+#if EK_USE_LOG || EK_USE_TEST
+#	include <time.h>
+#endif
+#if EK_USE_TEST && (defined(__unix__) || defined(__APPLE__))
+#	include <errno.h>
+#	include <poll.h>
+#	include <signal.h>
+#	include <sys/time.h>
+#	include <sys/wait.h>
+#	include <unistd.h>
+#endif
+#if EK_USE_LOG_ASYNC
+#	include <errno.h>
+#	include <pthread.h>
+#	include <sched.h>
+#	include <stdio.h>
+#	include <unistd.h>
+#endif
+
+#if EK_USE_CACHE
+#	include <pthread.h>
+#endif
+#if EK_USE_TPOOL
+#	include <pthread.h>
+#	include <sched.h>
+#	include <unistd.h>
+#endif
+#if EK_USE_BLOOM || EK_USE_HLL
 #	include <math.h>
 #endif
 
+#if EK_USE_PAGE && defined(__unix__)
+#	include <sys/mman.h>
+#	include <unistd.h>
+#	if defined(__linux__)
+#		include <sys/syscall.h>
+#	endif
+#endif
+
 #include <limits.h>
 
 #if EK_USE_STDLIB_MALLOC
 
 #ifndef NDEBUG
+// Any thread can allocate, so the count is only touched atomically
 static size_t mem_stdlib_bytes;
+#define mem_stdlib_count(delta) \
+	__atomic_fetch_add(&mem_stdlib_bytes, (delta), __ATOMIC_RELAXED)
 #endif
 
 static void *mem_realloc_default(void *usr, void *blk, size_t newsize) {
 #ifndef NDEBUG
-	size_t *mem = (size_t *)blk - 1;
+	size_t *mem = blk ? (size_t *)blk - 1 : NULL;
 	if (!blk) {
-		mem_stdlib_bytes += newsize;
-		mem = malloc(newsize + sizeof(size_t));
+		if (!(mem = malloc(newsize + sizeof(size_t)))) return NULL;
+		mem_stdlib_count(newsize);
 		*mem = newsize;
 		return mem + 1;
 	} else if (!newsize) {
-		mem_stdlib_bytes -= *mem;
+		mem_stdlib_count(-*mem);
 		free(mem);
 		return NULL;
 	} else {
-		mem_stdlib_bytes -= *mem;
+		const size_t oldsize = *mem;
 		mem = realloc(mem, newsize + sizeof(size_t));
 		if (!mem) return NULL;
-		mem_stdlib_bytes += newsize;
+		mem_stdlib_count(newsize - oldsize);
 		*mem = newsize;
 		return mem + 1;
 	}
@@ -43,10 +86,12 @@ mem_alloc_t mem_stdlib_alloc(void) {
 	static mem_alloc_fn *const fn = mem_realloc_default;
 	return &fn;
 }
+#ifndef NDEBUG
 size_t mem_stdlib_allocated_bytes(void) {
-	return mem_stdlib_bytes;
+	return __atomic_load_n(&mem_stdlib_bytes, __ATOMIC_RELAXED);
 }
 #endif
+#endif
 
 //
 // EK_USE_STRVIEW
@@ -65,842 +110,6735 @@ const char *strview_as_str(const strview_t *const view) {
 	strview_buf_str(str, STRVIEW_TO_STR_TMP_MAX, view);
 	return str;
 }
-#endif
 
 //
-// EK_USE_LOG
+// Number parsing
 //
-#if EK_USE_LOG
-log_fn *global_log;
+static inline bool strparse_is_digit(char c) {
+	return (unsigned char)(c - '0') < 10;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#	define STRPARSE_SWAR 1
+// Eight ascii digits at once, see Lemire's "Parsing series of integers with SIMD"
+static inline bool strparse_eight_digits(const char *str, uint64_t *v) {
+	memcpy(v, str, sizeof(*v));
+	return (*v & 0xF0F0F0F0F0F0F0F0) == 0x3030303030303030
+		&& ((*v + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) == 0x3030303030303030;
+}
+static inline uint32_t strparse_eight_value(uint64_t v) {
+	v -= 0x3030303030303030;
+	v = v * 10 + (v >> 8);
+	return (uint32_t)((((v & 0x000000FF000000FF) * 0x000F424000000064)
+		+ (((v >> 16) & 0x000000FF000000FF) * 0x0000271000000001)) >> 32);
+}
 #endif
 
-//
-// EK_USE_VEC
-//
-#if EK_USE_VEC
+static size_t strparse_digits(const char *str, size_t len, uint64_t *out, bool *overflow) {
+	uint64_t v = 0;
+	bool of = false;
+	size_t i = 0;
+#if STRPARSE_SWAR
+	for (uint64_t chunk; i + 8 <= len && strparse_eight_digits(str + i, &chunk); i += 8) {
+		of |= __builtin_mul_overflow(v, 100000000, &v);
+		of |= __builtin_add_overflow(v, strparse_eight_value(chunk), &v);
+	}
+#endif
+	for (; i < len && strparse_is_digit(str[i]); i++) {
+		of |= __builtin_mul_overflow(v, 10, &v);
+		of |= __builtin_add_overflow(v, (uint64_t)(str[i] - '0'), &v);
+	}
+	*out = v;
+	*overflow = of;
+	return i;
+}
 
-#define vec_size(elems, capacity) (sizeof(vec_t) * (capacity) * (elems))
-#define vec_from_data(data) ((vec_t *)((uintptr_t)data - offsetof(vec_t, data)))
+size_t strview_parse_u64(const strview_t *const view, uint64_t *out, bool *overflow) {
+	size_t i = view->len && view->str[0] == '+';
+	uint64_t v;
+	bool of;
+	const size_t n = strparse_digits(view->str + i, view->len - i, &v, &of);
+	if (!n) return 0;
+	*out = of ? UINT64_MAX : v;
+	if (overflow) *overflow = of;
+	return i + n;
+}
 
-void *vec_init(mem_alloc_t alloc, size_t elem_size, size_t capacity) {
-	vec_t *vec = mem_alloc(alloc, NULL, vec_size(capacity, elem_size));
-	vec->alloc = alloc;
-	vec->len = 0;
-	vec->capacity = capacity;
-	return vec->data;
+size_t strview_parse_i64(const strview_t *const view, int64_t *out, bool *overflow) {
+	size_t i = view->len && (view->str[0] == '+' || view->str[0] == '-');
+	const bool neg = i && view->str[0] == '-';
+	uint64_t v;
+	bool of;
+	const size_t n = strparse_digits(view->str + i, view->len - i, &v, &of);
+	if (!n) return 0;
+	const uint64_t limit = (uint64_t)INT64_MAX + neg;
+	if (of || v > limit) {
+		of = true;
+		v = limit;
+	}
+	*out = !neg ? (int64_t)v : v == limit ? INT64_MIN : -(int64_t)v;
+	if (overflow) *overflow = of;
+	return i + n;
 }
-void *vec_deinit(void *data) {
-	vec_t *vec = vec_from_data(data);
-	return mem_alloc(vec->alloc, vec, 0);
+
+// 128 bit approximations of the powers of five from 5^-342 to 5^308, normalized
+// so the top bit is set. Generated like fast_float's table.
+#define STRPARSE_POW5_MIN -342
+#define STRPARSE_POW5_MAX 308
+static const uint64_t strparse_pow5[(STRPARSE_POW5_MAX - STRPARSE_POW5_MIN + 1) * 2] = {
+	0xeef453d6923bd65aull, 0x113faa2906a13b3full,
+	0x9558b4661b6565f8ull, 0x4ac7ca59a424c507ull,
+	0xbaaee17fa23ebf76ull, 0x5d79bcf00d2df649ull,
+	0xe95a99df8ace6f53ull, 0xf4d82c2c107973dcull,
+	0x91d8a02bb6c10594ull, 0x79071b9b8a4be869ull,
+	0xb64ec836a47146f9ull, 0x9748e2826cdee284ull,
+	0xe3e27a444d8d98b7ull, 0xfd1b1b2308169b25ull,
+	0x8e6d8c6ab0787f72ull, 0xfe30f0f5e50e20f7ull,
+	0xb208ef855c969f4full, 0xbdbd2d335e51a935ull,
+	0xde8b2b66b3bc4723ull, 0xad2c788035e61382ull,
+	0x8b16fb203055ac76ull, 0x4c3bcb5021afcc31ull,
+	0xaddcb9e83c6b1793ull, 0xdf4abe242a1bbf3dull,
+	0xd953e8624b85dd78ull, 0xd71d6dad34a2af0dull,
+	0x87d4713d6f33aa6bull, 0x8672648c40e5ad68ull,
+	0xa9c98d8ccb009506ull, 0x680efdaf511f18c2ull,
+	0xd43bf0effdc0ba48ull, 0x0212bd1b2566def2ull,
+	0x84a57695fe98746dull, 0x014bb630f7604b57ull,
+	0xa5ced43b7e3e9188ull, 0x419ea3bd35385e2dull,
+	0xcf42894a5dce35eaull, 0x52064cac828675b9ull,
+	0x818995ce7aa0e1b2ull, 0x7343efebd1940993ull,
+	0xa1ebfb4219491a1full, 0x1014ebe6c5f90bf8ull,
+	0xca66fa129f9b60a6ull, 0xd41a26e077774ef6ull,
+	0xfd00b897478238d0ull, 0x8920b098955522b4ull,
+	0x9e20735e8cb16382ull, 0x55b46e5f5d5535b0ull,
+	0xc5a890362fddbc62ull, 0xeb2189f734aa831dull,
+	0xf712b443bbd52b7bull, 0xa5e9ec7501d523e4ull,
+	0x9a6bb0aa55653b2dull, 0x47b233c92125366eull,
+	0xc1069cd4eabe89f8ull, 0x999ec0bb696e840aull,
+	0xf148440a256e2c76ull, 0xc00670ea43ca250dull,
+	0x96cd2a865764dbcaull, 0x380406926a5e5728ull,
+	0xbc807527ed3e12bcull, 0xc605083704f5ecf2ull,
+	0xeba09271e88d976bull, 0xf7864a44c633682eull,
+	0x93445b8731587ea3ull, 0x7ab3ee6afbe0211dull,
+	0xb8157268fdae9e4cull, 0x5960ea05bad82964ull,
+	0xe61acf033d1a45dfull, 0x6fb92487298e33bdull,
+	0x8fd0c16206306babull, 0xa5d3b6d479f8e056ull,
+	0xb3c4f1ba87bc8696ull, 0x8f48a4899877186cull,
+	0xe0b62e2929aba83cull, 0x331acdabfe94de87ull,
+	0x8c71dcd9ba0b4925ull, 0x9ff0c08b7f1d0b14ull,
+	0xaf8e5410288e1b6full, 0x07ecf0ae5ee44dd9ull,
+	0xdb71e91432b1a24aull, 0xc9e82cd9f69d6150ull,
+	0x892731ac9faf056eull, 0xbe311c083a225cd2ull,
+	0xab70fe17c79ac6caull, 0x6dbd630a48aaf406ull,
+	0xd64d3d9db981787dull, 0x092cbbccdad5b108ull,
+	0x85f0468293f0eb4eull, 0x25bbf56008c58ea5ull,
+	0xa76c582338ed2621ull, 0xaf2af2b80af6f24eull,
+	0xd1476e2c07286faaull, 0x1af5af660db4aee1ull,
+	0x82cca4db847945caull, 0x50d98d9fc890ed4dull,
+	0xa37fce126597973cull, 0xe50ff107bab528a0ull,
+	0xcc5fc196fefd7d0cull, 0x1e53ed49a96272c8ull,
+	0xff77b1fcbebcdc4full, 0x25e8e89c13bb0f7aull,
+	0x9faacf3df73609b1ull, 0x77b191618c54e9acull,
+	0xc795830d75038c1dull, 0xd59df5b9ef6a2417ull,
+	0xf97ae3d0d2446f25ull, 0x4b0573286b44ad1dull,
+	0x9becce62836ac577ull, 0x4ee367f9430aec32ull,
+	0xc2e801fb244576d5ull, 0x229c41f793cda73full,
+	0xf3a20279ed56d48aull, 0x6b43527578c1110full,
+	0x9845418c345644d6ull, 0x830a13896b78aaa9ull,
+	0xbe5691ef416bd60cull, 0x23cc986bc656d553ull,
+	0xedec366b11c6cb8full, 0x2cbfbe86b7ec8aa8ull,
+	0x94b3a202eb1c3f39ull, 0x7bf7d71432f3d6a9ull,
+	0xb9e08a83a5e34f07ull, 0xdaf5ccd93fb0cc53ull,
+	0xe858ad248f5c22c9ull, 0xd1b3400f8f9cff68ull,
+	0x91376c36d99995beull, 0x23100809b9c21fa1ull,
+	0xb58547448ffffb2dull, 0xabd40a0c2832a78aull,
+	0xe2e69915b3fff9f9ull, 0x16c90c8f323f516cull,
+	0x8dd01fad907ffc3bull, 0xae3da7d97f6792e3ull,
+	0xb1442798f49ffb4aull, 0x99cd11cfdf41779cull,
+	0xdd95317f31c7fa1dull, 0x40405643d711d583ull,
+	0x8a7d3eef7f1cfc52ull, 0x482835ea666b2572ull,
+	0xad1c8eab5ee43b66ull, 0xda3243650005eecfull,
+	0xd863b256369d4a40ull, 0x90bed43e40076a82ull,
+	0x873e4f75e2224e68ull, 0x5a7744a6e804a291ull,
+	0xa90de3535aaae202ull, 0x711515d0a205cb36ull,
+	0xd3515c2831559a83ull, 0x0d5a5b44ca873e03ull,
+	0x8412d9991ed58091ull, 0xe858790afe9486c2ull,
+	0xa5178fff668ae0b6ull, 0x626e974dbe39a872ull,
+	0xce5d73ff402d98e3ull, 0xfb0a3d212dc8128full,
+	0x80fa687f881c7f8eull, 0x7ce66634bc9d0b99ull,
+	0xa139029f6a239f72ull, 0x1c1fffc1ebc44e80ull,
+	0xc987434744ac874eull, 0xa327ffb266b56220ull,
+	0xfbe9141915d7a922ull, 0x4bf1ff9f0062baa8ull,
+	0x9d71ac8fada6c9b5ull, 0x6f773fc3603db4a9ull,
+	0xc4ce17b399107c22ull, 0xcb550fb4384d21d3ull,
+	0xf6019da07f549b2bull, 0x7e2a53a146606a48ull,
+	0x99c102844f94e0fbull, 0x2eda7444cbfc426dull,
+	0xc0314325637a1939ull, 0xfa911155fefb5308ull,
+	0xf03d93eebc589f88ull, 0x793555ab7eba27caull,
+	0x96267c7535b763b5ull, 0x4bc1558b2f3458deull,
+	0xbbb01b9283253ca2ull, 0x9eb1aaedfb016f16ull,
+	0xea9c227723ee8bcbull, 0x465e15a979c1cadcull,
+	0x92a1958a7675175full, 0x0bfacd89ec191ec9ull,
+	0xb749faed14125d36ull, 0xcef980ec671f667bull,
+	0xe51c79a85916f484ull, 0x82b7e12780e7401aull,
+	0x8f31cc0937ae58d2ull, 0xd1b2ecb8b0908810ull,
+	0xb2fe3f0b8599ef07ull, 0x861fa7e6dcb4aa15ull,
+	0xdfbdcece67006ac9ull, 0x67a791e093e1d49aull,
+	0x8bd6a141006042bdull, 0xe0c8bb2c5c6d24e0ull,
+	0xaecc49914078536dull, 0x58fae9f773886e18ull,
+	0xda7f5bf590966848ull, 0xaf39a475506a899eull,
+	0x888f99797a5e012dull, 0x6d8406c952429603ull,
+	0xaab37fd7d8f58178ull, 0xc8e5087ba6d33b83ull,
+	0xd5605fcdcf32e1d6ull, 0xfb1e4a9a90880a64ull,
+	0x855c3be0a17fcd26ull, 0x5cf2eea09a55067full,
+	0xa6b34ad8c9dfc06full, 0xf42faa48c0ea481eull,
+	0xd0601d8efc57b08bull, 0xf13b94daf124da26ull,
+	0x823c12795db6ce57ull, 0x76c53d08d6b70858ull,
+	0xa2cb1717b52481edull, 0x54768c4b0c64ca6eull,
+	0xcb7ddcdda26da268ull, 0xa9942f5dcf7dfd09ull,
+	0xfe5d54150b090b02ull, 0xd3f93b35435d7c4cull,
+	0x9efa548d26e5a6e1ull, 0xc47bc5014a1a6dafull,
+	0xc6b8e9b0709f109aull, 0x359ab6419ca1091bull,
+	0xf867241c8cc6d4c0ull, 0xc30163d203c94b62ull,
+	0x9b407691d7fc44f8ull, 0x79e0de63425dcf1dull,
+	0xc21094364dfb5636ull, 0x985915fc12f542e4ull,
+	0xf294b943e17a2bc4ull, 0x3e6f5b7b17b2939dull,
+	0x979cf3ca6cec5b5aull, 0xa705992ceecf9c42ull,
+	0xbd8430bd08277231ull, 0x50c6ff782a838353ull,
+	0xece53cec4a314ebdull, 0xa4f8bf5635246428ull,
+	0x940f4613ae5ed136ull, 0x871b7795e136be99ull,
+	0xb913179899f68584ull, 0x28e2557b59846e3full,
+	0xe757dd7ec07426e5ull, 0x331aeada2fe589cfull,
+	0x9096ea6f3848984full, 0x3ff0d2c85def7621ull,
+	0xb4bca50b065abe63ull, 0x0fed077a756b53a9ull,
+	0xe1ebce4dc7f16dfbull, 0xd3e8495912c62894ull,
+	0x8d3360f09cf6e4bdull, 0x64712dd7abbbd95cull,
+	0xb080392cc4349decull, 0xbd8d794d96aacfb3ull,
+	0xdca04777f541c567ull, 0xecf0d7a0fc5583a0ull,
+	0x89e42caaf9491b60ull, 0xf41686c49db57244ull,
+	0xac5d37d5b79b6239ull, 0x311c2875c522ced5ull,
+	0xd77485cb25823ac7ull, 0x7d633293366b828bull,
+	0x86a8d39ef77164bcull, 0xae5dff9c02033197ull,
+	0xa8530886b54dbdebull, 0xd9f57f830283fdfcull,
+	0xd267caa862a12d66ull, 0xd072df63c324fd7bull,
+	0x8380dea93da4bc60ull, 0x4247cb9e59f71e6dull,
+	0xa46116538d0deb78ull, 0x52d9be85f074e608ull,
+	0xcd795be870516656ull, 0x67902e276c921f8bull,
+	0x806bd9714632dff6ull, 0x00ba1cd8a3db53b6ull,
+	0xa086cfcd97bf97f3ull, 0x80e8a40eccd228a4ull,
+	0xc8a883c0fdaf7df0ull, 0x6122cd128006b2cdull,
+	0xfad2a4b13d1b5d6cull, 0x796b805720085f81ull,
+	0x9cc3a6eec6311a63ull, 0xcbe3303674053bb0ull,
+	0xc3f490aa77bd60fcull, 0xbedbfc4411068a9cull,
+	0xf4f1b4d515acb93bull, 0xee92fb5515482d44ull,
+	0x991711052d8bf3c5ull, 0x751bdd152d4d1c4aull,
+	0xbf5cd54678eef0b6ull, 0xd262d45a78a0635dull,
+	0xef340a98172aace4ull, 0x86fb897116c87c34ull,
+	0x9580869f0e7aac0eull, 0xd45d35e6ae3d4da0ull,
+	0xbae0a846d2195712ull, 0x8974836059cca109ull,
+	0xe998d258869facd7ull, 0x2bd1a438703fc94bull,
+	0x91ff83775423cc06ull, 0x7b6306a34627ddcfull,
+	0xb67f6455292cbf08ull, 0x1a3bc84c17b1d542ull,
+	0xe41f3d6a7377eecaull, 0x20caba5f1d9e4a93ull,
+	0x8e938662882af53eull, 0x547eb47b7282ee9cull,
+	0xb23867fb2a35b28dull, 0xe99e619a4f23aa43ull,
+	0xdec681f9f4c31f31ull, 0x6405fa00e2ec94d4ull,
+	0x8b3c113c38f9f37eull, 0xde83bc408dd3dd04ull,
+	0xae0b158b4738705eull, 0x9624ab50b148d445ull,
+	0xd98ddaee19068c76ull, 0x3badd624dd9b0957ull,
+	0x87f8a8d4cfa417c9ull, 0xe54ca5d70a80e5d6ull,
+	0xa9f6d30a038d1dbcull, 0x5e9fcf4ccd211f4cull,
+	0xd47487cc8470652bull, 0x7647c3200069671full,
+	0x84c8d4dfd2c63f3bull, 0x29ecd9f40041e073ull,
+	0xa5fb0a17c777cf09ull, 0xf468107100525890ull,
+	0xcf79cc9db955c2ccull, 0x7182148d4066eeb4ull,
+	0x81ac1fe293d599bfull, 0xc6f14cd848405530ull,
+	0xa21727db38cb002full, 0xb8ada00e5a506a7cull,
+	0xca9cf1d206fdc03bull, 0xa6d90811f0e4851cull,
+	0xfd442e4688bd304aull, 0x908f4a166d1da663ull,
+	0x9e4a9cec15763e2eull, 0x9a598e4e043287feull,
+	0xc5dd44271ad3cdbaull, 0x40eff1e1853f29fdull,
+	0xf7549530e188c128ull, 0xd12bee59e68ef47cull,
+	0x9a94dd3e8cf578b9ull, 0x82bb74f8301958ceull,
+	0xc13a148e3032d6e7ull, 0xe36a52363c1faf01ull,
+	0xf18899b1bc3f8ca1ull, 0xdc44e6c3cb279ac1ull,
+	0x96f5600f15a7b7e5ull, 0x29ab103a5ef8c0b9ull,
+	0xbcb2b812db11a5deull, 0x7415d448f6b6f0e7ull,
+	0xebdf661791d60f56ull, 0x111b495b3464ad21ull,
+	0x936b9fcebb25c995ull, 0xcab10dd900beec34ull,
+	0xb84687c269ef3bfbull, 0x3d5d514f40eea742ull,
+	0xe65829b3046b0afaull, 0x0cb4a5a3112a5112ull,
+	0x8ff71a0fe2c2e6dcull, 0x47f0e785eaba72abull,
+	0xb3f4e093db73a093ull, 0x59ed216765690f56ull,
+	0xe0f218b8d25088b8ull, 0x306869c13ec3532cull,
+	0x8c974f7383725573ull, 0x1e414218c73a13fbull,
+	0xafbd2350644eeacfull, 0xe5d1929ef90898faull,
+	0xdbac6c247d62a583ull, 0xdf45f746b74abf39ull,
+	0x894bc396ce5da772ull, 0x6b8bba8c328eb783ull,
+	0xab9eb47c81f5114full, 0x066ea92f3f326564ull,
+	0xd686619ba27255a2ull, 0xc80a537b0efefebdull,
+	0x8613fd0145877585ull, 0xbd06742ce95f5f36ull,
+	0xa798fc4196e952e7ull, 0x2c48113823b73704ull,
+	0xd17f3b51fca3a7a0ull, 0xf75a15862ca504c5ull,
+	0x82ef85133de648c4ull, 0x9a984d73dbe722fbull,
+	0xa3ab66580d5fdaf5ull, 0xc13e60d0d2e0ebbaull,
+	0xcc963fee10b7d1b3ull, 0x318df905079926a8ull,
+	0xffbbcfe994e5c61full, 0xfdf17746497f7052ull,
+	0x9fd561f1fd0f9bd3ull, 0xfeb6ea8bedefa633ull,
+	0xc7caba6e7c5382c8ull, 0xfe64a52ee96b8fc0ull,
+	0xf9bd690a1b68637bull, 0x3dfdce7aa3c673b0ull,
+	0x9c1661a651213e2dull, 0x06bea10ca65c084eull,
+	0xc31bfa0fe5698db8ull, 0x486e494fcff30a62ull,
+	0xf3e2f893dec3f126ull, 0x5a89dba3c3efccfaull,
+	0x986ddb5c6b3a76b7ull, 0xf89629465a75e01cull,
+	0xbe89523386091465ull, 0xf6bbb397f1135823ull,
+	0xee2ba6c0678b597full, 0x746aa07ded582e2cull,
+	0x94db483840b717efull, 0xa8c2a44eb4571cdcull,
+	0xba121a4650e4ddebull, 0x92f34d62616ce413ull,
+	0xe896a0d7e51e1566ull, 0x77b020baf9c81d17ull,
+	0x915e2486ef32cd60ull, 0x0ace1474dc1d122eull,
+	0xb5b5ada8aaff80b8ull, 0x0d819992132456baull,
+	0xe3231912d5bf60e6ull, 0x10e1fff697ed6c69ull,
+	0x8df5efabc5979c8full, 0xca8d3ffa1ef463c1ull,
+	0xb1736b96b6fd83b3ull, 0xbd308ff8a6b17cb2ull,
+	0xddd0467c64bce4a0ull, 0xac7cb3f6d05ddbdeull,
+	0x8aa22c0dbef60ee4ull, 0x6bcdf07a423aa96bull,
+	0xad4ab7112eb3929dull, 0x86c16c98d2c953c6ull,
+	0xd89d64d57a607744ull, 0xe871c7bf077ba8b7ull,
+	0x87625f056c7c4a8bull, 0x11471cd764ad4972ull,
+	0xa93af6c6c79b5d2dull, 0xd598e40d3dd89bcfull,
+	0xd389b47879823479ull, 0x4aff1d108d4ec2c3ull,
+	0x843610cb4bf160cbull, 0xcedf722a585139baull,
+	0xa54394fe1eedb8feull, 0xc2974eb4ee658828ull,
+	0xce947a3da6a9273eull, 0x733d226229feea32ull,
+	0x811ccc668829b887ull, 0x0806357d5a3f525full,
+	0xa163ff802a3426a8ull, 0xca07c2dcb0cf26f7ull,
+	0xc9bcff6034c13052ull, 0xfc89b393dd02f0b5ull,
+	0xfc2c3f3841f17c67ull, 0xbbac2078d443ace2ull,
+	0x9d9ba7832936edc0ull, 0xd54b944b84aa4c0dull,
+	0xc5029163f384a931ull, 0x0a9e795e65d4df11ull,
+	0xf64335bcf065d37dull, 0x4d4617b5ff4a16d5ull,
+	0x99ea0196163fa42eull, 0x504bced1bf8e4e45ull,
+	0xc06481fb9bcf8d39ull, 0xe45ec2862f71e1d6ull,
+	0xf07da27a82c37088ull, 0x5d767327bb4e5a4cull,
+	0x964e858c91ba2655ull, 0x3a6a07f8d510f86full,
+	0xbbe226efb628afeaull, 0x890489f70a55368bull,
+	0xeadab0aba3b2dbe5ull, 0x2b45ac74ccea842eull,
+	0x92c8ae6b464fc96full, 0x3b0b8bc90012929dull,
+	0xb77ada0617e3bbcbull, 0x09ce6ebb40173744ull,
+	0xe55990879ddcaabdull, 0xcc420a6a101d0515ull,
+	0x8f57fa54c2a9eab6ull, 0x9fa946824a12232dull,
+	0xb32df8e9f3546564ull, 0x47939822dc96abf9ull,
+	0xdff9772470297ebdull, 0x59787e2b93bc56f7ull,
+	0x8bfbea76c619ef36ull, 0x57eb4edb3c55b65aull,
+	0xaefae51477a06b03ull, 0xede622920b6b23f1ull,
+	0xdab99e59958885c4ull, 0xe95fab368e45ecedull,
+	0x88b402f7fd75539bull, 0x11dbcb0218ebb414ull,
+	0xaae103b5fcd2a881ull, 0xd652bdc29f26a119ull,
+	0xd59944a37c0752a2ull, 0x4be76d3346f0495full,
+	0x857fcae62d8493a5ull, 0x6f70a4400c562ddbull,
+	0xa6dfbd9fb8e5b88eull, 0xcb4ccd500f6bb952ull,
+	0xd097ad07a71f26b2ull, 0x7e2000a41346a7a7ull,
+	0x825ecc24c873782full, 0x8ed400668c0c28c8ull,
+	0xa2f67f2dfa90563bull, 0x728900802f0f32faull,
+	0xcbb41ef979346bcaull, 0x4f2b40a03ad2ffb9ull,
+	0xfea126b7d78186bcull, 0xe2f610c84987bfa8ull,
+	0x9f24b832e6b0f436ull, 0x0dd9ca7d2df4d7c9ull,
+	0xc6ede63fa05d3143ull, 0x91503d1c79720dbbull,
+	0xf8a95fcf88747d94ull, 0x75a44c6397ce912aull,
+	0x9b69dbe1b548ce7cull, 0xc986afbe3ee11abaull,
+	0xc24452da229b021bull, 0xfbe85badce996168ull,
+	0xf2d56790ab41c2a2ull, 0xfae27299423fb9c3ull,
+	0x97c560ba6b0919a5ull, 0xdccd879fc967d41aull,
+	0xbdb6b8e905cb600full, 0x5400e987bbc1c920ull,
+	0xed246723473e3813ull, 0x290123e9aab23b68ull,
+	0x9436c0760c86e30bull, 0xf9a0b6720aaf6521ull,
+	0xb94470938fa89bceull, 0xf808e40e8d5b3e69ull,
+	0xe7958cb87392c2c2ull, 0xb60b1d1230b20e04ull,
+	0x90bd77f3483bb9b9ull, 0xb1c6f22b5e6f48c2ull,
+	0xb4ecd5f01a4aa828ull, 0x1e38aeb6360b1af3ull,
+	0xe2280b6c20dd5232ull, 0x25c6da63c38de1b0ull,
+	0x8d590723948a535full, 0x579c487e5a38ad0eull,
+	0xb0af48ec79ace837ull, 0x2d835a9df0c6d851ull,
+	0xdcdb1b2798182244ull, 0xf8e431456cf88e65ull,
+	0x8a08f0f8bf0f156bull, 0x1b8e9ecb641b58ffull,
+	0xac8b2d36eed2dac5ull, 0xe272467e3d222f3full,
+	0xd7adf884aa879177ull, 0x5b0ed81dcc6abb0full,
+	0x86ccbb52ea94baeaull, 0x98e947129fc2b4e9ull,
+	0xa87fea27a539e9a5ull, 0x3f2398d747b36224ull,
+	0xd29fe4b18e88640eull, 0x8eec7f0d19a03aadull,
+	0x83a3eeeef9153e89ull, 0x1953cf68300424acull,
+	0xa48ceaaab75a8e2bull, 0x5fa8c3423c052dd7ull,
+	0xcdb02555653131b6ull, 0x3792f412cb06794dull,
+	0x808e17555f3ebf11ull, 0xe2bbd88bbee40bd0ull,
+	0xa0b19d2ab70e6ed6ull, 0x5b6aceaeae9d0ec4ull,
+	0xc8de047564d20a8bull, 0xf245825a5a445275ull,
+	0xfb158592be068d2eull, 0xeed6e2f0f0d56712ull,
+	0x9ced737bb6c4183dull, 0x55464dd69685606bull,
+	0xc428d05aa4751e4cull, 0xaa97e14c3c26b886ull,
+	0xf53304714d9265dfull, 0xd53dd99f4b3066a8ull,
+	0x993fe2c6d07b7fabull, 0xe546a8038efe4029ull,
+	0xbf8fdb78849a5f96ull, 0xde98520472bdd033ull,
+	0xef73d256a5c0f77cull, 0x963e66858f6d4440ull,
+	0x95a8637627989aadull, 0xdde7001379a44aa8ull,
+	0xbb127c53b17ec159ull, 0x5560c018580d5d52ull,
+	0xe9d71b689dde71afull, 0xaab8f01e6e10b4a6ull,
+	0x9226712162ab070dull, 0xcab3961304ca70e8ull,
+	0xb6b00d69bb55c8d1ull, 0x3d607b97c5fd0d22ull,
+	0xe45c10c42a2b3b05ull, 0x8cb89a7db77c506aull,
+	0x8eb98a7a9a5b04e3ull, 0x77f3608e92adb242ull,
+	0xb267ed1940f1c61cull, 0x55f038b237591ed3ull,
+	0xdf01e85f912e37a3ull, 0x6b6c46dec52f6688ull,
+	0x8b61313bbabce2c6ull, 0x2323ac4b3b3da015ull,
+	0xae397d8aa96c1b77ull, 0xabec975e0a0d081aull,
+	0xd9c7dced53c72255ull, 0x96e7bd358c904a21ull,
+	0x881cea14545c7575ull, 0x7e50d64177da2e54ull,
+	0xaa242499697392d2ull, 0xdde50bd1d5d0b9e9ull,
+	0xd4ad2dbfc3d07787ull, 0x955e4ec64b44e864ull,
+	0x84ec3c97da624ab4ull, 0xbd5af13bef0b113eull,
+	0xa6274bbdd0fadd61ull, 0xecb1ad8aeacdd58eull,
+	0xcfb11ead453994baull, 0x67de18eda5814af2ull,
+	0x81ceb32c4b43fcf4ull, 0x80eacf948770ced7ull,
+	0xa2425ff75e14fc31ull, 0xa1258379a94d028dull,
+	0xcad2f7f5359a3b3eull, 0x096ee45813a04330ull,
+	0xfd87b5f28300ca0dull, 0x8bca9d6e188853fcull,
+	0x9e74d1b791e07e48ull, 0x775ea264cf55347eull,
+	0xc612062576589ddaull, 0x95364afe032a819eull,
+	0xf79687aed3eec551ull, 0x3a83ddbd83f52205ull,
+	0x9abe14cd44753b52ull, 0xc4926a9672793543ull,
+	0xc16d9a0095928a27ull, 0x75b7053c0f178294ull,
+	0xf1c90080baf72cb1ull, 0x5324c68b12dd6339ull,
+	0x971da05074da7beeull, 0xd3f6fc16ebca5e04ull,
+	0xbce5086492111aeaull, 0x88f4bb1ca6bcf585ull,
+	0xec1e4a7db69561a5ull, 0x2b31e9e3d06c32e6ull,
+	0x9392ee8e921d5d07ull, 0x3aff322e62439fd0ull,
+	0xb877aa3236a4b449ull, 0x09befeb9fad487c3ull,
+	0xe69594bec44de15bull, 0x4c2ebe687989a9b4ull,
+	0x901d7cf73ab0acd9ull, 0x0f9d37014bf60a11ull,
+	0xb424dc35095cd80full, 0x538484c19ef38c95ull,
+	0xe12e13424bb40e13ull, 0x2865a5f206b06fbaull,
+	0x8cbccc096f5088cbull, 0xf93f87b7442e45d4ull,
+	0xafebff0bcb24aafeull, 0xf78f69a51539d749ull,
+	0xdbe6fecebdedd5beull, 0xb573440e5a884d1cull,
+	0x89705f4136b4a597ull, 0x31680a88f8953031ull,
+	0xabcc77118461cefcull, 0xfdc20d2b36ba7c3eull,
+	0xd6bf94d5e57a42bcull, 0x3d32907604691b4dull,
+	0x8637bd05af6c69b5ull, 0xa63f9a49c2c1b110ull,
+	0xa7c5ac471b478423ull, 0x0fcf80dc33721d54ull,
+	0xd1b71758e219652bull, 0xd3c36113404ea4a9ull,
+	0x83126e978d4fdf3bull, 0x645a1cac083126eaull,
+	0xa3d70a3d70a3d70aull, 0x3d70a3d70a3d70a4ull,
+	0xccccccccccccccccull, 0xcccccccccccccccdull,
+	0x8000000000000000ull, 0x0000000000000000ull,
+	0xa000000000000000ull, 0x0000000000000000ull,
+	0xc800000000000000ull, 0x0000000000000000ull,
+	0xfa00000000000000ull, 0x0000000000000000ull,
+	0x9c40000000000000ull, 0x0000000000000000ull,
+	0xc350000000000000ull, 0x0000000000000000ull,
+	0xf424000000000000ull, 0x0000000000000000ull,
+	0x9896800000000000ull, 0x0000000000000000ull,
+	0xbebc200000000000ull, 0x0000000000000000ull,
+	0xee6b280000000000ull, 0x0000000000000000ull,
+	0x9502f90000000000ull, 0x0000000000000000ull,
+	0xba43b74000000000ull, 0x0000000000000000ull,
+	0xe8d4a51000000000ull, 0x0000000000000000ull,
+	0x9184e72a00000000ull, 0x0000000000000000ull,
+	0xb5e620f480000000ull, 0x0000000000000000ull,
+	0xe35fa931a0000000ull, 0x0000000000000000ull,
+	0x8e1bc9bf04000000ull, 0x0000000000000000ull,
+	0xb1a2bc2ec5000000ull, 0x0000000000000000ull,
+	0xde0b6b3a76400000ull, 0x0000000000000000ull,
+	0x8ac7230489e80000ull, 0x0000000000000000ull,
+	0xad78ebc5ac620000ull, 0x0000000000000000ull,
+	0xd8d726b7177a8000ull, 0x0000000000000000ull,
+	0x878678326eac9000ull, 0x0000000000000000ull,
+	0xa968163f0a57b400ull, 0x0000000000000000ull,
+	0xd3c21bcecceda100ull, 0x0000000000000000ull,
+	0x84595161401484a0ull, 0x0000000000000000ull,
+	0xa56fa5b99019a5c8ull, 0x0000000000000000ull,
+	0xcecb8f27f4200f3aull, 0x0000000000000000ull,
+	0x813f3978f8940984ull, 0x4000000000000000ull,
+	0xa18f07d736b90be5ull, 0x5000000000000000ull,
+	0xc9f2c9cd04674edeull, 0xa400000000000000ull,
+	0xfc6f7c4045812296ull, 0x4d00000000000000ull,
+	0x9dc5ada82b70b59dull, 0xf020000000000000ull,
+	0xc5371912364ce305ull, 0x6c28000000000000ull,
+	0xf684df56c3e01bc6ull, 0xc732000000000000ull,
+	0x9a130b963a6c115cull, 0x3c7f400000000000ull,
+	0xc097ce7bc90715b3ull, 0x4b9f100000000000ull,
+	0xf0bdc21abb48db20ull, 0x1e86d40000000000ull,
+	0x96769950b50d88f4ull, 0x1314448000000000ull,
+	0xbc143fa4e250eb31ull, 0x17d955a000000000ull,
+	0xeb194f8e1ae525fdull, 0x5dcfab0800000000ull,
+	0x92efd1b8d0cf37beull, 0x5aa1cae500000000ull,
+	0xb7abc627050305adull, 0xf14a3d9e40000000ull,
+	0xe596b7b0c643c719ull, 0x6d9ccd05d0000000ull,
+	0x8f7e32ce7bea5c6full, 0xe4820023a2000000ull,
+	0xb35dbf821ae4f38bull, 0xdda2802c8a800000ull,
+	0xe0352f62a19e306eull, 0xd50b2037ad200000ull,
+	0x8c213d9da502de45ull, 0x4526f422cc340000ull,
+	0xaf298d050e4395d6ull, 0x9670b12b7f410000ull,
+	0xdaf3f04651d47b4cull, 0x3c0cdd765f114000ull,
+	0x88d8762bf324cd0full, 0xa5880a69fb6ac800ull,
+	0xab0e93b6efee0053ull, 0x8eea0d047a457a00ull,
+	0xd5d238a4abe98068ull, 0x72a4904598d6d880ull,
+	0x85a36366eb71f041ull, 0x47a6da2b7f864750ull,
+	0xa70c3c40a64e6c51ull, 0x999090b65f67d924ull,
+	0xd0cf4b50cfe20765ull, 0xfff4b4e3f741cf6dull,
+	0x82818f1281ed449full, 0xbff8f10e7a8921a4ull,
+	0xa321f2d7226895c7ull, 0xaff72d52192b6a0dull,
+	0xcbea6f8ceb02bb39ull, 0x9bf4f8a69f764490ull,
+	0xfee50b7025c36a08ull, 0x02f236d04753d5b4ull,
+	0x9f4f2726179a2245ull, 0x01d762422c946590ull,
+	0xc722f0ef9d80aad6ull, 0x424d3ad2b7b97ef5ull,
+	0xf8ebad2b84e0d58bull, 0xd2e0898765a7deb2ull,
+	0x9b934c3b330c8577ull, 0x63cc55f49f88eb2full,
+	0xc2781f49ffcfa6d5ull, 0x3cbf6b71c76b25fbull,
+	0xf316271c7fc3908aull, 0x8bef464e3945ef7aull,
+	0x97edd871cfda3a56ull, 0x97758bf0e3cbb5acull,
+	0xbde94e8e43d0c8ecull, 0x3d52eeed1cbea317ull,
+	0xed63a231d4c4fb27ull, 0x4ca7aaa863ee4bddull,
+	0x945e455f24fb1cf8ull, 0x8fe8caa93e74ef6aull,
+	0xb975d6b6ee39e436ull, 0xb3e2fd538e122b44ull,
+	0xe7d34c64a9c85d44ull, 0x60dbbca87196b616ull,
+	0x90e40fbeea1d3a4aull, 0xbc8955e946fe31cdull,
+	0xb51d13aea4a488ddull, 0x6babab6398bdbe41ull,
+	0xe264589a4dcdab14ull, 0xc696963c7eed2dd1ull,
+	0x8d7eb76070a08aecull, 0xfc1e1de5cf543ca2ull,
+	0xb0de65388cc8ada8ull, 0x3b25a55f43294bcbull,
+	0xdd15fe86affad912ull, 0x49ef0eb713f39ebeull,
+	0x8a2dbf142dfcc7abull, 0x6e3569326c784337ull,
+	0xacb92ed9397bf996ull, 0x49c2c37f07965404ull,
+	0xd7e77a8f87daf7fbull, 0xdc33745ec97be906ull,
+	0x86f0ac99b4e8dafdull, 0x69a028bb3ded71a3ull,
+	0xa8acd7c0222311bcull, 0xc40832ea0d68ce0cull,
+	0xd2d80db02aabd62bull, 0xf50a3fa490c30190ull,
+	0x83c7088e1aab65dbull, 0x792667c6da79e0faull,
+	0xa4b8cab1a1563f52ull, 0x577001b891185938ull,
+	0xcde6fd5e09abcf26ull, 0xed4c0226b55e6f86ull,
+	0x80b05e5ac60b6178ull, 0x544f8158315b05b4ull,
+	0xa0dc75f1778e39d6ull, 0x696361ae3db1c721ull,
+	0xc913936dd571c84cull, 0x03bc3a19cd1e38e9ull,
+	0xfb5878494ace3a5full, 0x04ab48a04065c723ull,
+	0x9d174b2dcec0e47bull, 0x62eb0d64283f9c76ull,
+	0xc45d1df942711d9aull, 0x3ba5d0bd324f8394ull,
+	0xf5746577930d6500ull, 0xca8f44ec7ee36479ull,
+	0x9968bf6abbe85f20ull, 0x7e998b13cf4e1ecbull,
+	0xbfc2ef456ae276e8ull, 0x9e3fedd8c321a67eull,
+	0xefb3ab16c59b14a2ull, 0xc5cfe94ef3ea101eull,
+	0x95d04aee3b80ece5ull, 0xbba1f1d158724a12ull,
+	0xbb445da9ca61281full, 0x2a8a6e45ae8edc97ull,
+	0xea1575143cf97226ull, 0xf52d09d71a3293bdull,
+	0x924d692ca61be758ull, 0x593c2626705f9c56ull,
+	0xb6e0c377cfa2e12eull, 0x6f8b2fb00c77836cull,
+	0xe498f455c38b997aull, 0x0b6dfb9c0f956447ull,
+	0x8edf98b59a373fecull, 0x4724bd4189bd5eacull,
+	0xb2977ee300c50fe7ull, 0x58edec91ec2cb657ull,
+	0xdf3d5e9bc0f653e1ull, 0x2f2967b66737e3edull,
+	0x8b865b215899f46cull, 0xbd79e0d20082ee74ull,
+	0xae67f1e9aec07187ull, 0xecd8590680a3aa11ull,
+	0xda01ee641a708de9ull, 0xe80e6f4820cc9495ull,
+	0x884134fe908658b2ull, 0x3109058d147fdcddull,
+	0xaa51823e34a7eedeull, 0xbd4b46f0599fd415ull,
+	0xd4e5e2cdc1d1ea96ull, 0x6c9e18ac7007c91aull,
+	0x850fadc09923329eull, 0x03e2cf6bc604ddb0ull,
+	0xa6539930bf6bff45ull, 0x84db8346b786151cull,
+	0xcfe87f7cef46ff16ull, 0xe612641865679a63ull,
+	0x81f14fae158c5f6eull, 0x4fcb7e8f3f60c07eull,
+	0xa26da3999aef7749ull, 0xe3be5e330f38f09dull,
+	0xcb090c8001ab551cull, 0x5cadf5bfd3072cc5ull,
+	0xfdcb4fa002162a63ull, 0x73d9732fc7c8f7f6ull,
+	0x9e9f11c4014dda7eull, 0x2867e7fddcdd9afaull,
+	0xc646d63501a1511dull, 0xb281e1fd541501b8ull,
+	0xf7d88bc24209a565ull, 0x1f225a7ca91a4226ull,
+	0x9ae757596946075full, 0x3375788de9b06958ull,
+	0xc1a12d2fc3978937ull, 0x0052d6b1641c83aeull,
+	0xf209787bb47d6b84ull, 0xc0678c5dbd23a49aull,
+	0x9745eb4d50ce6332ull, 0xf840b7ba963646e0ull,
+	0xbd176620a501fbffull, 0xb650e5a93bc3d898ull,
+	0xec5d3fa8ce427affull, 0xa3e51f138ab4cebeull,
+	0x93ba47c980e98cdfull, 0xc66f336c36b10137ull,
+	0xb8a8d9bbe123f017ull, 0xb80b0047445d4184ull,
+	0xe6d3102ad96cec1dull, 0xa60dc059157491e5ull,
+	0x9043ea1ac7e41392ull, 0x87c89837ad68db2full,
+	0xb454e4a179dd1877ull, 0x29babe4598c311fbull,
+	0xe16a1dc9d8545e94ull, 0xf4296dd6fef3d67aull,
+	0x8ce2529e2734bb1dull, 0x1899e4a65f58660cull,
+	0xb01ae745b101e9e4ull, 0x5ec05dcff72e7f8full,
+	0xdc21a1171d42645dull, 0x76707543f4fa1f73ull,
+	0x899504ae72497ebaull, 0x6a06494a791c53a8ull,
+	0xabfa45da0edbde69ull, 0x0487db9d17636892ull,
+	0xd6f8d7509292d603ull, 0x45a9d2845d3c42b6ull,
+	0x865b86925b9bc5c2ull, 0x0b8a2392ba45a9b2ull,
+	0xa7f26836f282b732ull, 0x8e6cac7768d7141eull,
+	0xd1ef0244af2364ffull, 0x3207d795430cd926ull,
+	0x8335616aed761f1full, 0x7f44e6bd49e807b8ull,
+	0xa402b9c5a8d3a6e7ull, 0x5f16206c9c6209a6ull,
+	0xcd036837130890a1ull, 0x36dba887c37a8c0full,
+	0x802221226be55a64ull, 0xc2494954da2c9789ull,
+	0xa02aa96b06deb0fdull, 0xf2db9baa10b7bd6cull,
+	0xc83553c5c8965d3dull, 0x6f92829494e5acc7ull,
+	0xfa42a8b73abbf48cull, 0xcb772339ba1f17f9ull,
+	0x9c69a97284b578d7ull, 0xff2a760414536efbull,
+	0xc38413cf25e2d70dull, 0xfef5138519684abaull,
+	0xf46518c2ef5b8cd1ull, 0x7eb258665fc25d69ull,
+	0x98bf2f79d5993802ull, 0xef2f773ffbd97a61ull,
+	0xbeeefb584aff8603ull, 0xaafb550ffacfd8faull,
+	0xeeaaba2e5dbf6784ull, 0x95ba2a53f983cf38ull,
+	0x952ab45cfa97a0b2ull, 0xdd945a747bf26183ull,
+	0xba756174393d88dfull, 0x94f971119aeef9e4ull,
+	0xe912b9d1478ceb17ull, 0x7a37cd5601aab85dull,
+	0x91abb422ccb812eeull, 0xac62e055c10ab33aull,
+	0xb616a12b7fe617aaull, 0x577b986b314d6009ull,
+	0xe39c49765fdf9d94ull, 0xed5a7e85fda0b80bull,
+	0x8e41ade9fbebc27dull, 0x14588f13be847307ull,
+	0xb1d219647ae6b31cull, 0x596eb2d8ae258fc8ull,
+	0xde469fbd99a05fe3ull, 0x6fca5f8ed9aef3bbull,
+	0x8aec23d680043beeull, 0x25de7bb9480d5854ull,
+	0xada72ccc20054ae9ull, 0xaf561aa79a10ae6aull,
+	0xd910f7ff28069da4ull, 0x1b2ba1518094da04ull,
+	0x87aa9aff79042286ull, 0x90fb44d2f05d0842ull,
+	0xa99541bf57452b28ull, 0x353a1607ac744a53ull,
+	0xd3fa922f2d1675f2ull, 0x42889b8997915ce8ull,
+	0x847c9b5d7c2e09b7ull, 0x69956135febada11ull,
+	0xa59bc234db398c25ull, 0x43fab9837e699095ull,
+	0xcf02b2c21207ef2eull, 0x94f967e45e03f4bbull,
+	0x8161afb94b44f57dull, 0x1d1be0eebac278f5ull,
+	0xa1ba1ba79e1632dcull, 0x6462d92a69731732ull,
+	0xca28a291859bbf93ull, 0x7d7b8f7503cfdcfeull,
+	0xfcb2cb35e702af78ull, 0x5cda735244c3d43eull,
+	0x9defbf01b061adabull, 0x3a0888136afa64a7ull,
+	0xc56baec21c7a1916ull, 0x088aaa1845b8fdd0ull,
+	0xf6c69a72a3989f5bull, 0x8aad549e57273d45ull,
+	0x9a3c2087a63f6399ull, 0x36ac54e2f678864bull,
+	0xc0cb28a98fcf3c7full, 0x84576a1bb416a7ddull,
+	0xf0fdf2d3f3c30b9full, 0x656d44a2a11c51d5ull,
+	0x969eb7c47859e743ull, 0x9f644ae5a4b1b325ull,
+	0xbc4665b596706114ull, 0x873d5d9f0dde1feeull,
+	0xeb57ff22fc0c7959ull, 0xa90cb506d155a7eaull,
+	0x9316ff75dd87cbd8ull, 0x09a7f12442d588f2ull,
+	0xb7dcbf5354e9beceull, 0x0c11ed6d538aeb2full,
+	0xe5d3ef282a242e81ull, 0x8f1668c8a86da5faull,
+	0x8fa475791a569d10ull, 0xf96e017d694487bcull,
+	0xb38d92d760ec4455ull, 0x37c981dcc395a9acull,
+	0xe070f78d3927556aull, 0x85bbe253f47b1417ull,
+	0x8c469ab843b89562ull, 0x93956d7478ccec8eull,
+	0xaf58416654a6babbull, 0x387ac8d1970027b2ull,
+	0xdb2e51bfe9d0696aull, 0x06997b05fcc0319eull,
+	0x88fcf317f22241e2ull, 0x441fece3bdf81f03ull,
+	0xab3c2fddeeaad25aull, 0xd527e81cad7626c3ull,
+	0xd60b3bd56a5586f1ull, 0x8a71e223d8d3b074ull,
+	0x85c7056562757456ull, 0xf6872d5667844e49ull,
+	0xa738c6bebb12d16cull, 0xb428f8ac016561dbull,
+	0xd106f86e69d785c7ull, 0xe13336d701beba52ull,
+	0x82a45b450226b39cull, 0xecc0024661173473ull,
+	0xa34d721642b06084ull, 0x27f002d7f95d0190ull,
+	0xcc20ce9bd35c78a5ull, 0x31ec038df7b441f4ull,
+	0xff290242c83396ceull, 0x7e67047175a15271ull,
+	0x9f79a169bd203e41ull, 0x0f0062c6e984d386ull,
+	0xc75809c42c684dd1ull, 0x52c07b78a3e60868ull,
+	0xf92e0c3537826145ull, 0xa7709a56ccdf8a82ull,
+	0x9bbcc7a142b17ccbull, 0x88a66076400bb691ull,
+	0xc2abf989935ddbfeull, 0x6acff893d00ea435ull,
+	0xf356f7ebf83552feull, 0x0583f6b8c4124d43ull,
+	0x98165af37b2153deull, 0xc3727a337a8b704aull,
+	0xbe1bf1b059e9a8d6ull, 0x744f18c0592e4c5cull,
+	0xeda2ee1c7064130cull, 0x1162def06f79df73ull,
+	0x9485d4d1c63e8be7ull, 0x8addcb5645ac2ba8ull,
+	0xb9a74a0637ce2ee1ull, 0x6d953e2bd7173692ull,
+	0xe8111c87c5c1ba99ull, 0xc8fa8db6ccdd0437ull,
+	0x910ab1d4db9914a0ull, 0x1d9c9892400a22a2ull,
+	0xb54d5e4a127f59c8ull, 0x2503beb6d00cab4bull,
+	0xe2a0b5dc971f303aull, 0x2e44ae64840fd61dull,
+	0x8da471a9de737e24ull, 0x5ceaecfed289e5d2ull,
+	0xb10d8e1456105dadull, 0x7425a83e872c5f47ull,
+	0xdd50f1996b947518ull, 0xd12f124e28f77719ull,
+	0x8a5296ffe33cc92full, 0x82bd6b70d99aaa6full,
+	0xace73cbfdc0bfb7bull, 0x636cc64d1001550bull,
+	0xd8210befd30efa5aull, 0x3c47f7e05401aa4eull,
+	0x8714a775e3e95c78ull, 0x65acfaec34810a71ull,
+	0xa8d9d1535ce3b396ull, 0x7f1839a741a14d0dull,
+	0xd31045a8341ca07cull, 0x1ede48111209a050ull,
+	0x83ea2b892091e44dull, 0x934aed0aab460432ull,
+	0xa4e4b66b68b65d60ull, 0xf81da84d5617853full,
+	0xce1de40642e3f4b9ull, 0x36251260ab9d668eull,
+	0x80d2ae83e9ce78f3ull, 0xc1d72b7c6b426019ull,
+	0xa1075a24e4421730ull, 0xb24cf65b8612f81full,
+	0xc94930ae1d529cfcull, 0xdee033f26797b627ull,
+	0xfb9b7cd9a4a7443cull, 0x169840ef017da3b1ull,
+	0x9d412e0806e88aa5ull, 0x8e1f289560ee864eull,
+	0xc491798a08a2ad4eull, 0xf1a6f2bab92a27e2ull,
+	0xf5b5d7ec8acb58a2ull, 0xae10af696774b1dbull,
+	0x9991a6f3d6bf1765ull, 0xacca6da1e0a8ef29ull,
+	0xbff610b0cc6edd3full, 0x17fd090a58d32af3ull,
+	0xeff394dcff8a948eull, 0xddfc4b4cef07f5b0ull,
+	0x95f83d0a1fb69cd9ull, 0x4abdaf101564f98eull,
+	0xbb764c4ca7a4440full, 0x9d6d1ad41abe37f1ull,
+	0xea53df5fd18d5513ull, 0x84c86189216dc5edull,
+	0x92746b9be2f8552cull, 0x32fd3cf5b4e49bb4ull,
+	0xb7118682dbb66a77ull, 0x3fbc8c33221dc2a1ull,
+	0xe4d5e82392a40515ull, 0x0fabaf3feaa5334aull,
+	0x8f05b1163ba6832dull, 0x29cb4d87f2a7400eull,
+	0xb2c71d5bca9023f8ull, 0x743e20e9ef511012ull,
+	0xdf78e4b2bd342cf6ull, 0x914da9246b255416ull,
+	0x8bab8eefb6409c1aull, 0x1ad089b6c2f7548eull,
+	0xae9672aba3d0c320ull, 0xa184ac2473b529b1ull,
+	0xda3c0f568cc4f3e8ull, 0xc9e5d72d90a2741eull,
+	0x8865899617fb1871ull, 0x7e2fa67c7a658892ull,
+	0xaa7eebfb9df9de8dull, 0xddbb901b98feeab7ull,
+	0xd51ea6fa85785631ull, 0x552a74227f3ea565ull,
+	0x8533285c936b35deull, 0xd53a88958f87275full,
+	0xa67ff273b8460356ull, 0x8a892abaf368f137ull,
+	0xd01fef10a657842cull, 0x2d2b7569b0432d85ull,
+	0x8213f56a67f6b29bull, 0x9c3b29620e29fc73ull,
+	0xa298f2c501f45f42ull, 0x8349f3ba91b47b8full,
+	0xcb3f2f7642717713ull, 0x241c70a936219a73ull,
+	0xfe0efb53d30dd4d7ull, 0xed238cd383aa0110ull,
+	0x9ec95d1463e8a506ull, 0xf4363804324a40aaull,
+	0xc67bb4597ce2ce48ull, 0xb143c6053edcd0d5ull,
+	0xf81aa16fdc1b81daull, 0xdd94b7868e94050aull,
+	0x9b10a4e5e9913128ull, 0xca7cf2b4191c8326ull,
+	0xc1d4ce1f63f57d72ull, 0xfd1c2f611f63a3f0ull,
+	0xf24a01a73cf2dccfull, 0xbc633b39673c8cecull,
+	0x976e41088617ca01ull, 0xd5be0503e085d813ull,
+	0xbd49d14aa79dbc82ull, 0x4b2d8644d8a74e18ull,
+	0xec9c459d51852ba2ull, 0xddf8e7d60ed1219eull,
+	0x93e1ab8252f33b45ull, 0xcabb90e5c942b503ull,
+	0xb8da1662e7b00a17ull, 0x3d6a751f3b936243ull,
+	0xe7109bfba19c0c9dull, 0x0cc512670a783ad4ull,
+	0x906a617d450187e2ull, 0x27fb2b80668b24c5ull,
+	0xb484f9dc9641e9daull, 0xb1f9f660802dedf6ull,
+	0xe1a63853bbd26451ull, 0x5e7873f8a0396973ull,
+	0x8d07e33455637eb2ull, 0xdb0b487b6423e1e8ull,
+	0xb049dc016abc5e5full, 0x91ce1a9a3d2cda62ull,
+	0xdc5c5301c56b75f7ull, 0x7641a140cc7810fbull,
+	0x89b9b3e11b6329baull, 0xa9e904c87fcb0a9dull,
+	0xac2820d9623bf429ull, 0x546345fa9fbdcd44ull,
+	0xd732290fbacaf133ull, 0xa97c177947ad4095ull,
+	0x867f59a9d4bed6c0ull, 0x49ed8eabcccc485dull,
+	0xa81f301449ee8c70ull, 0x5c68f256bfff5a74ull,
+	0xd226fc195c6a2f8cull, 0x73832eec6fff3111ull,
+	0x83585d8fd9c25db7ull, 0xc831fd53c5ff7eabull,
+	0xa42e74f3d032f525ull, 0xba3e7ca8b77f5e55ull,
+	0xcd3a1230c43fb26full, 0x28ce1bd2e55f35ebull,
+	0x80444b5e7aa7cf85ull, 0x7980d163cf5b81b3ull,
+	0xa0555e361951c366ull, 0xd7e105bcc332621full,
+	0xc86ab5c39fa63440ull, 0x8dd9472bf3fefaa7ull,
+	0xfa856334878fc150ull, 0xb14f98f6f0feb951ull,
+	0x9c935e00d4b9d8d2ull, 0x6ed1bf9a569f33d3ull,
+	0xc3b8358109e84f07ull, 0x0a862f80ec4700c8ull,
+	0xf4a642e14c6262c8ull, 0xcd27bb612758c0faull,
+	0x98e7e9cccfbd7dbdull, 0x8038d51cb897789cull,
+	0xbf21e44003acdd2cull, 0xe0470a63e6bd56c3ull,
+	0xeeea5d5004981478ull, 0x1858ccfce06cac74ull,
+	0x95527a5202df0ccbull, 0x0f37801e0c43ebc8ull,
+	0xbaa718e68396cffdull, 0xd30560258f54e6baull,
+	0xe950df20247c83fdull, 0x47c6b82ef32a2069ull,
+	0x91d28b7416cdd27eull, 0x4cdc331d57fa5441ull,
+	0xb6472e511c81471dull, 0xe0133fe4adf8e952ull,
+	0xe3d8f9e563a198e5ull, 0x58180fddd97723a6ull,
+	0x8e679c2f5e44ff8full, 0x570f09eaa7ea7648ull,
+};
+
+static inline void strparse_mul128(uint64_t a, uint64_t b, uint64_t *lo, uint64_t *hi) {
+#ifdef __SIZEOF_INT128__
+	const unsigned __int128 r = (unsigned __int128)a * b;
+	*lo = (uint64_t)r;
+	*hi = (uint64_t)(r >> 64);
+#else
+	const uint64_t a0 = (uint32_t)a, a1 = a >> 32, b0 = (uint32_t)b, b1 = b >> 32;
+	const uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+	const uint64_t mid = (p00 >> 32) + (uint32_t)p01 + (uint32_t)p10;
+	*lo = (mid << 32) | (uint32_t)p00;
+	*hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+#endif
 }
-void *_vec_push(void *data, size_t elem_size, size_t nelems, const void *elems) {
-	vec_t *vec = vec_from_data(data);
-	if (vec->len + nelems > vec->capacity) {
-		vec->capacity *= 2;
-		vec = mem_alloc(vec->alloc, vec, vec_size(elem_size, vec->capacity));
-		if (!vec) return NULL;
+
+#define F64_MANTISSA_BITS 52
+#define F64_INF_EXP 0x7FF
+
+// Eisel-Lemire: w * 10^q rounded to the nearest double, as raw bits without the
+// sign. Exact for any w != 0, the caller deals with w being truncated.
+static uint64_t strparse_eisel_lemire(uint64_t w, int64_t q) {
+	if (!w || q < STRPARSE_POW5_MIN) return 0;
+	if (q > STRPARSE_POW5_MAX) return (uint64_t)F64_INF_EXP << F64_MANTISSA_BITS;
+
+	const int lz = __builtin_clzll(w);
+	w <<= lz;
+	const uint64_t *pow5 = strparse_pow5 + 2 * (q - STRPARSE_POW5_MIN);
+	uint64_t lo, hi;
+	strparse_mul128(w, pow5[0], &lo, &hi);
+	// Only the top 55 bits matter, the low half of 5^q only when they could carry
+	if ((hi & 0x1FF) == 0x1FF) {
+		uint64_t lo2, hi2;
+		strparse_mul128(w, pow5[1], &lo2, &hi2);
+		lo += hi2;
+		if (hi2 > lo) hi++;
 	}
 
-	if (elems) {
-		memcpy(vec->data + vec->len * elem_size,
-			elems, nelems * elem_size);
+	const int upper = (int)(hi >> 63);
+	const int shift = upper + 64 - F64_MANTISSA_BITS - 3;
+	uint64_t m = hi >> shift;
+	// floor(log2(10^q)) + 63, plus the bias
+	int32_t e = (int32_t)((((152170 + 65536) * q) >> 16) + 63) + upper - lz + 1023;
+
+	if (e <= 0) {
+		if (-e + 1 >= 64) return 0;
+		m >>= -e + 1;
+		m += m & 1;
+		m >>= 1;
+		// Rounding up can make it the smallest normal, its exponent bit is m's top bit
+		return m;
 	}
-	vec->len += nelems;
-	return vec->data;
+	// Exactly halfway, only possible for these small powers, rounds to even
+	if (lo <= 1 && q >= -4 && q <= 23 && (m & 3) == 1 && (m << shift) == hi) m &= ~1ull;
+	m += m & 1;
+	m >>= 1;
+	if (m >= 2ull << F64_MANTISSA_BITS) {
+		m = 1ull << F64_MANTISSA_BITS;
+		e++;
+	}
+	m &= ~(1ull << F64_MANTISSA_BITS);
+	if (e >= F64_INF_EXP) return (uint64_t)F64_INF_EXP << F64_MANTISSA_BITS;
+	return m | (uint64_t)e << F64_MANTISSA_BITS;
 }
-void _vec_pop(void *data, size_t elem_size, size_t nelems, void *elems) {
-	vec_t *vec = vec_from_data(data);
-	vec->len -= nelems;
-	if (!elems) return;
-	memcpy(elems, vec->data + vec->len * elem_size, nelems * elem_size);
+
+static inline double strparse_from_bits(uint64_t bits) {
+	double d;
+	memcpy(&d, &bits, sizeof(d));
+	return d;
 }
-#endif
 
-//
-// EK_USE_TEST
-//
-#if EK_USE_TEST
-static const char *test_err_file;
-static int test_err_line;
-static bool test_was_bad;
+// Very long inputs whose truncated digits decide the rounding go to strtod. It
+// gets the digits without a radix point so the locale can't get in the way.
+// Halfway points between doubles have at most 768 significant digits, past
+// that the digits only matter as a nonzero digit at the end.
+#define STRPARSE_SLOW_DIGITS 800
+static double strparse_slow(const char *str, size_t len, int64_t exp10) {
+	char buf[STRPARSE_SLOW_DIGITS + 32];
+	size_t n = 0, rest = 0;
+	bool sticky = false;
+	for (size_t i = 0; i < len; i++) {
+		if (!strparse_is_digit(str[i]) || (!n && str[i] == '0')) continue;
+		if (n < STRPARSE_SLOW_DIGITS - 1) {
+			buf[n++] = str[i];
+		} else {
+			rest++;
+			sticky |= str[i] != '0';
+		}
+	}
+	if (sticky) {
+		buf[n++] = '1';
+		rest--;
+	}
+	exp10 += (int64_t)rest;
+	if (exp10 > 100000) exp10 = 100000;
+	if (exp10 < -100000) exp10 = -100000;
 
-#define COLOR(str) "\x1b[" str "m"
+	buf[n++] = 'e';
+	if (exp10 < 0) {
+		buf[n++] = '-';
+		exp10 = -exp10;
+	}
+	char tmp[8];
+	size_t t = 0;
+	do tmp[t++] = (char)('0' + exp10 % 10); while (exp10 /= 10);
+	while (t) buf[n++] = tmp[--t];
+	buf[n] = '\0';
+	return strtod(buf, NULL);
+}
 
-bool test_bad(const char *file, int line) {
-	test_err_file = file;
-	test_err_line = line;
-	test_was_bad = true;
-	return false;
+static bool strparse_match(const char *str, size_t len, const char *word) {
+	size_t i = 0;
+	for (; word[i]; i++) {
+		if (i >= len || (str[i] | 0x20) != word[i]) return false;
+	}
+	return true;
 }
-bool tests_run_foreach(bool (*setup_test)(const test_t *test),
-		const test_t *test_list, size_t list_len, FILE *out) {
-	int passed = 0, tests = 0;
 
-	for (int i = 0; i < list_len; i++) {
-		test_was_bad = false;
+static size_t strparse_special(const char *str, size_t len, double *out) {
+	if (strparse_match(str, len, "inf")) {
+		*out = __builtin_inf();
+		return strparse_match(str, len, "infinity") ? 8 : 3;
+	}
+	if (!strparse_match(str, len, "nan")) return 0;
+	*out = __builtin_nan("");
+	size_t i = 3;
+	if (i < len && str[i] == '(') {
+		size_t j = i + 1;
+		while (j < len && (strparse_is_digit(str[j]) || str[j] == '_'
+			|| ((str[j] | 0x20) >= 'a' && (str[j] | 0x20) <= 'z'))) j++;
+		if (j < len && str[j] == ')') i = j + 1;
+	}
+	return i;
+}
 
-		if (!test_list[i].name && !test_list[i].pfn) {
-			fprintf(out, "\n");
-			continue;
-        	}
+// 10^0 to 10^22 are exact doubles
+static const double strparse_pow10[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
 
-		tests++;
-        	fprintf(out, "%-48s ", test_list[i].name);
-		if (setup_test && !setup_test(test_list + i)) {
-			fprintf(out, COLOR("41;1") "<SETUP FAIL>" COLOR("0") "\n");
-			continue;
+size_t strview_parse_f64(const strview_t *const view, double *out, bool *overflow) {
+	const char *str = view->str;
+	const size_t len = view->len;
+	size_t i = len && (str[0] == '+' || str[0] == '-');
+	const bool neg = i && str[0] == '-';
+	double d;
+
+	if (i < len && !strparse_is_digit(str[i]) && str[i] != '.') {
+		const size_t n = strparse_special(str + i, len - i, &d);
+		if (!n) return 0;
+		*out = neg ? -d : d;
+		if (overflow) *overflow = false;
+		return i + n;
+	}
+
+	// Keep the first 19 digits or so in w, the rest only move the exponent
+	const size_t start = i;
+	uint64_t w = 0;
+	int64_t exp10 = 0;
+	bool truncated = false;
+	size_t ndigits = 0, nfrac = 0;
+#if STRPARSE_SWAR
+	for (uint64_t chunk; w < 100000000000 && i + 8 <= len
+		&& strparse_eight_digits(str + i, &chunk); i += 8) {
+		w = w * 100000000 + strparse_eight_value(chunk);
+		ndigits += 8;
+	}
+#endif
+	for (; i < len && strparse_is_digit(str[i]); i++, ndigits++) {
+		if (w < 1000000000000000000) {
+			w = w * 10 + (uint64_t)(str[i] - '0');
+		} else {
+			exp10++;
+			truncated |= str[i] != '0';
 		}
-        	if (test_list[i].pfn(i) && !test_was_bad) {
-			fprintf(out, " " COLOR("42;1") "PASS" COLOR("0") "\n");
-			passed++;
-        	} else {
-			fprintf(out, COLOR("41;1") "<FAIL");
-			if (test_was_bad) {
-				fprintf(out, " AT %s:%d", test_err_file, test_err_line);
+	}
+	if (i < len && str[i] == '.') {
+		const size_t dot = ++i;
+#if STRPARSE_SWAR
+		for (uint64_t chunk; w < 100000000000 && i + 8 <= len
+			&& strparse_eight_digits(str + i, &chunk); i += 8) {
+			w = w * 100000000 + strparse_eight_value(chunk);
+			exp10 -= 8;
+		}
+#endif
+		for (; i < len && strparse_is_digit(str[i]); i++) {
+			if (w < 1000000000000000000) {
+				w = w * 10 + (uint64_t)(str[i] - '0');
+				exp10--;
+			} else {
+				truncated |= str[i] != '0';
 			}
-			fprintf(out, ">" COLOR("0") "\n");
-        	}
+		}
+		nfrac = i - dot;
+		ndigits += nfrac;
 	}
+	if (!ndigits) return 0;
+	const size_t end = i;
 
-	fprintf(out, "\n%d/%d tests passing (%d%%)\n", passed, tests,
-		(100 * passed) / tests);
+	int64_t exp_part = 0;
+	if (i < len && (str[i] | 0x20) == 'e') {
+		size_t j = i + 1;
+		const bool eneg = j < len && str[j] == '-';
+		j += j < len && (str[j] == '+' || str[j] == '-');
+		if (j < len && strparse_is_digit(str[j])) {
+			for (; j < len && strparse_is_digit(str[j]); j++) {
+				if (exp_part < 100000000) exp_part = exp_part * 10 + (str[j] - '0');
+			}
+			if (eneg) exp_part = -exp_part;
+			i = j;
+		}
+	}
+	exp10 += exp_part;
 
-	return passed == tests;
+	uint64_t bits;
+#if !defined(__FLT_EVAL_METHOD__) || __FLT_EVAL_METHOD__ == 0
+	if (!truncated && w <= 1ull << 53 && exp10 >= -22 && exp10 <= 22) {
+		// Clinger's fast path, both operands are exact so there's one rounding
+		d = (double)w;
+		d = exp10 < 0 ? d / strparse_pow10[-exp10] : d * strparse_pow10[exp10];
+		memcpy(&bits, &d, sizeof(bits));
+	} else
+#endif
+	{
+		bits = strparse_eisel_lemire(w, exp10);
+		// The real value is between w and w+1, if those round the same it's done
+		if (truncated && bits != strparse_eisel_lemire(w + 1, exp10)) {
+			d = strparse_slow(str + start, end - start, exp_part - (int64_t)nfrac);
+			memcpy(&bits, &d, sizeof(bits));
+		}
+	}
+
+	if (overflow) *overflow = bits == (uint64_t)F64_INF_EXP << F64_MANTISSA_BITS;
+	d = strparse_from_bits(bits);
+	*out = neg ? -d : d;
+	return i;
 }
 #endif
 
 //
-// EK_USE_HASH
+// EK_USE_UTF8
 //
-#if EK_USE_HASH
+#if EK_USE_UTF8
 
-static uint64_t load_u64_unaligned(const uint8_t *data) {
-	return (uint64_t)data[0]	<< 8 * 7
-		| (uint64_t)data[1]	<< 8 * 6
-		| (uint64_t)data[2] 	<< 8 * 5
-		| (uint64_t)data[3] 	<< 8 * 4
-		| (uint64_t)data[4] 	<< 8 * 3
-		| (uint64_t)data[5] 	<< 8 * 2
-		| (uint64_t)data[6] 	<< 8 * 1
-		| (uint64_t)data[7];
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define EK_UTF8_SSSE3 1
+#endif
+
+#define UTF8_ASCII_MASK 0x8080808080808080ull
+#define UTF_BAD_CODEPOINT 0xffffffff
+
+// Decodes and validates one codepoint, moving *buf past it
+static inline uint32_t utf8_decode_checked(const uint8_t **buf, const uint8_t *end) {
+	const uint8_t *s = *buf;
+	const uint8_t c = s[0];
+
+	if (c < 0x80) {
+		*buf = s + 1;
+		return c;
+	} else if (c < 0xc2) {
+		// Continuation byte or overlong 2 byte sequence
+		return UTF_BAD_CODEPOINT;
+	} else if (c < 0xe0) {
+		if (end - s < 2 || (s[1] & 0xc0) != 0x80) return UTF_BAD_CODEPOINT;
+		*buf = s + 2;
+		return (c & 0x1f) << 6 | s[1] & 0x3f;
+	} else if (c < 0xf0) {
+		if (end - s < 3 || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80) {
+			return UTF_BAD_CODEPOINT;
+		}
+		if (c == 0xe0 && s[1] < 0xa0) return UTF_BAD_CODEPOINT; // Overlong
+		if (c == 0xed && s[1] >= 0xa0) return UTF_BAD_CODEPOINT; // Surrogate
+		*buf = s + 3;
+		return (c & 0x0f) << 12 | (s[1] & 0x3f) << 6 | s[2] & 0x3f;
+	} else if (c < 0xf5) {
+		if (end - s < 4 || (s[1] & 0xc0) != 0x80 || (s[2] & 0xc0) != 0x80
+			|| (s[3] & 0xc0) != 0x80) {
+			return UTF_BAD_CODEPOINT;
+		}
+		if (c == 0xf0 && s[1] < 0x90) return UTF_BAD_CODEPOINT; // Overlong
+		if (c == 0xf4 && s[1] >= 0x90) return UTF_BAD_CODEPOINT; // Past U+10FFFF
+		*buf = s + 4;
+		return (c & 0x07) << 18 | (s[1] & 0x3f) << 12 | (s[2] & 0x3f) << 6
+			| s[3] & 0x3f;
+	}
+
+	return UTF_BAD_CODEPOINT;
 }
 
-void swapmem(void *const restrict _a, void *const restrict _b, size_t len) {
-	uint8_t *restrict a = _a, *restrict b = _b;
+// Skips whole words of ASCII
+static inline const uint8_t *utf8_skip_ascii(const uint8_t *s, const uint8_t *end) {
+	while (end - s >= 8) {
+		uint64_t word;
+		memcpy(&word, s, sizeof(word));
+		if (word & UTF8_ASCII_MASK) break;
+		s += 8;
+	}
+	return s;
+}
 
-	while (len--) {
-		const uint8_t t = *a;
-		*a++ = *b;
-		*b++ = t;
+static bool utf8_valid_scalar(const uint8_t *s, const uint8_t *end) {
+	while (s < end) {
+		s = utf8_skip_ascii(s, end);
+		if (s == end) break;
+		if (utf8_decode_checked(&s, end) == UTF_BAD_CODEPOINT) return false;
 	}
+	return true;
 }
 
-uint64_t xxhash64_single_lane(const uint8_t *data, size_t len) {
-	static const uint64_t p1 = 0x9e3779b185ebca87ull;
-	static const uint64_t p2 = 0xc2b2ae3d27d4eb4full;
-	static const uint64_t p3 = 0x165667b19e3779f9ull;
-	static const uint64_t p4 = 0x85ebca77c2b2ae63ull;
-	static const uint64_t p5 = 0x27d4eb2f165667c5ull;
+#if EK_UTF8_SSSE3
+#include <immintrin.h>
 
-	uint64_t acc = p5 + len + 1;
-	while (len >= 8) {
-		acc ^= load_u64_unaligned(data);
-		acc = rotl(acc, 27) * p1;
-		acc += p4;
+//
+// The lookup algorithm from "Validating UTF-8 In Less Than One Instruction Per
+// Byte" by Keiser and Lemire. Every error is found from the high nibble of the
+// previous byte, its low nibble and the high nibble of the current byte. Each
+// of those looks up a set of error bits that it could be part of and when all
+// three agree the input is bad. The only thing left over is checking that the
+// 3rd and 4th bytes of long sequences are continuations.
+//
+enum {
+	UTF8_TOO_SHORT = 1 << 0,
+	UTF8_TOO_LONG = 1 << 1,
+	UTF8_OVERLONG_3 = 1 << 2,
+	UTF8_TOO_LARGE = 1 << 3,
+	UTF8_SURROGATE = 1 << 4,
+	UTF8_OVERLONG_2 = 1 << 5,
+	UTF8_TOO_LARGE_1000 = 1 << 6,
+	UTF8_OVERLONG_4 = 1 << 6,
+	UTF8_TWO_CONTS = 1 << 7,
+	UTF8_CARRY = UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS,
+};
 
-		data += 8, len -= 8;
-	}
-	while (len--) {
-		acc ^= *data++ * p5;
-		acc = rotl(acc, 11) * p1;
+static const uint8_t utf8_byte_1_high[16] = {
+	// 0xxx ASCII
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+	// 10xx continuation
+	UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+	// 1100 and 1101 two byte leads
+	UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+	UTF8_TOO_SHORT,
+	// 1110 three byte lead
+	UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+	// 1111 four byte lead
+	UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+};
+static const uint8_t utf8_byte_1_low[16] = {
+	UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4,
+	UTF8_CARRY | UTF8_OVERLONG_2,
+	UTF8_CARRY,
+	UTF8_CARRY,
+	UTF8_CARRY | UTF8_TOO_LARGE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+	UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000,
+};
+static const uint8_t utf8_byte_2_high[16] = {
+	// 0xxx ASCII
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+	// 1000, 1001 and 101x continuations
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3
+		| UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3
+		| UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE
+		| UTF8_TOO_LARGE,
+	UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE
+		| UTF8_TOO_LARGE,
+	// 11xx leads
+	UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+};
+// Anything above these in the last 3 bytes of a block starts a sequence that
+// continues into the next block
+static const uint8_t utf8_max_complete[16] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1,
+};
+
+typedef struct utf8_simd_state {
+	__m128i prev, err, incomplete;
+} utf8_simd_state_t;
+
+__attribute__((target("ssse3")))
+static inline void utf8_check_block(utf8_simd_state_t *st, const __m128i in) {
+	if (!_mm_movemask_epi8(in)) {
+		// All ASCII, so only a sequence cut off by the last block can be wrong
+		st->err = _mm_or_si128(st->err, st->incomplete);
+		st->incomplete = _mm_setzero_si128();
+		st->prev = in;
+		return;
 	}
 
-	acc ^= acc >> 33;
-	acc *= p2;
-	acc ^= acc >> 29;
-	acc *= p3;
-	acc ^= acc >> 32;
+	const __m128i nibble = _mm_set1_epi8(0x0f);
+	const __m128i prev1 = _mm_alignr_epi8(in, st->prev, 15);
+	const __m128i prev2 = _mm_alignr_epi8(in, st->prev, 14);
+	const __m128i prev3 = _mm_alignr_epi8(in, st->prev, 13);
 
-	return acc;
+	const __m128i b1h = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)utf8_byte_1_high),
+		_mm_and_si128(_mm_srli_epi16(prev1, 4), nibble));
+	const __m128i b1l = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)utf8_byte_1_low),
+		_mm_and_si128(prev1, nibble));
+	const __m128i b2h = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)utf8_byte_2_high),
+		_mm_and_si128(_mm_srli_epi16(in, 4), nibble));
+	const __m128i special = _mm_and_si128(_mm_and_si128(b1h, b1l), b2h);
+
+	// Bytes 2 and 3 after a 3 or 4 byte lead have to be continuations
+	const __m128i third = _mm_subs_epu8(prev2, _mm_set1_epi8(0xe0 - 0x80));
+	const __m128i fourth = _mm_subs_epu8(prev3, _mm_set1_epi8((char)(0xf0 - 0x80)));
+	const __m128i must_cont = _mm_and_si128(_mm_or_si128(third, fourth),
+		_mm_set1_epi8((char)0x80));
+
+	st->err = _mm_or_si128(st->err, _mm_xor_si128(must_cont, special));
+	st->incomplete = _mm_subs_epu8(in,
+		_mm_loadu_si128((const __m128i *)utf8_max_complete));
+	st->prev = in;
 }
 
-#define HSET_ENTRY_PSL_BITS 15
-#define HSET_ENTRY_HASH_BITS 48
+__attribute__((target("ssse3")))
+static bool utf8_valid_ssse3(const uint8_t *buf, size_t len) {
+	utf8_simd_state_t st = {
+		.prev = _mm_setzero_si128(),
+		.err = _mm_setzero_si128(),
+		.incomplete = _mm_setzero_si128(),
+	};
 
-typedef struct hset_entry_t {
-	uint64_t used	: 1;
-	uint64_t psl	: HSET_ENTRY_PSL_BITS;
-	uint64_t hash	: HSET_ENTRY_HASH_BITS;
-	uint64_t data[];
-} hset_entry_t;
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(buf + i));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(buf + i + 16));
+		const __m128i c = _mm_loadu_si128((const __m128i *)(buf + i + 32));
+		const __m128i d = _mm_loadu_si128((const __m128i *)(buf + i + 48));
 
-typedef struct hset {
-	mem_alloc_t alloc;
+		// Whole runs of ASCII skip the lookups
+		if (!_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d)))) {
+			st.err = _mm_or_si128(st.err, st.incomplete);
+			st.incomplete = _mm_setzero_si128();
+			st.prev = d;
+			continue;
+		}
+		utf8_check_block(&st, a);
+		utf8_check_block(&st, b);
+		utf8_check_block(&st, c);
+		utf8_check_block(&st, d);
+	}
+	for (; i + 16 <= len; i += 16) {
+		utf8_check_block(&st, _mm_loadu_si128((const __m128i *)(buf + i)));
+	}
 
-	// Size of key value pair
-	uint32_t kvsize, entsize;
+	// Pad the tail with zeros, which also catches sequences that are cut off
+	if (i < len) {
+		uint8_t tail[16] = { 0 };
+		memcpy(tail, buf + i, len - i);
+		utf8_check_block(&st, _mm_loadu_si128((const __m128i *)tail));
+	}
 
-	// Number of entries and capacity
-	uint32_t nents, capacity;
+	st.err = _mm_or_si128(st.err, st.incomplete);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(st.err, _mm_setzero_si128())) == 0xffff;
+}
+#endif
 
-	hset_hash_fn *hash;
+bool utf8_valid(const uint8_t *buf, size_t len) {
+#if EK_UTF8_SSSE3
+	if (len >= 16 && __builtin_cpu_supports("ssse3")) return utf8_valid_ssse3(buf, len);
+#endif
+	return utf8_valid_scalar(buf, buf + len);
+}
 
-	hset_eq_fn *eq;
+// Byte lanes of a word, used to count bytes without a popcount instruction
+#define UTF8_LANE_ONES 0x0101010101010101ull
+#define UTF8_LANE_MAX 255
 
-	hset_entry_t kv[];
-} hset_t;
+// Adds up the byte lanes
+static inline size_t utf8_lanes_sum(const uint64_t lanes) {
+	const uint64_t pairs = (lanes & 0x00ff00ff00ff00ffull)
+		+ (lanes >> 8 & 0x00ff00ff00ff00ffull);
+	return pairs * 0x0001000100010001ull >> 48;
+}
 
-#define hset_from_data(_data) (hset_t *)((uintptr_t)_data \
-				- offsetof(hset_entry_t, data) \
-				- offsetof(hset_t, kv))
+// Counts continuation bytes, the ones that start with 0b10. With leads4 it also
+// counts the 0b11110 leads of 4 byte sequences.
+static size_t utf8_count_bytes(const uint8_t *buf, size_t len, const bool leads4) {
+	size_t n = 0, i = 0;
+	while (i + 8 <= len) {
+		// Each lane counts to at most UTF8_LANE_MAX before it gets summed
+		uint64_t lanes = 0;
+		for (int j = 0; j < UTF8_LANE_MAX && i + 8 <= len; j++, i += 8) {
+			uint64_t word;
+			memcpy(&word, buf + i, sizeof(word));
+			lanes += (word & ~(word << 1) & UTF8_ASCII_MASK) >> 7;
+			if (leads4) {
+				lanes += (word & word << 1 & word << 2 & word << 3
+					& UTF8_ASCII_MASK) >> 7;
+			}
+		}
+		n += utf8_lanes_sum(lanes);
+	}
+	for (; i < len; i++) n += (buf[i] & 0xc0) == 0x80 || leads4 && buf[i] >= 0xf0;
+	return n;
+}
 
-void *hset_init(mem_alloc_t alloc,
-		uint32_t capacity, uint32_t kvsize,
-		hset_hash_fn *hash, hset_eq_fn *eq) {
-	const size_t entsize = align_up(kvsize + sizeof(hset_entry_t),
-				sizeof(hset_entry_t));
-	hset_t *set = mem_alloc(alloc, NULL, sizeof(hset_t) + entsize * (capacity + 1));
-	set->alloc = alloc;
+size_t utf8_count(const uint8_t *buf, size_t len) {
+	// Every byte that isn't a continuation starts a codepoint
+	return len - utf8_count_bytes(buf, len, false);
+}
 
-	set->nents = 0;
-	set->capacity = capacity;
+size_t utf8_utf16_len(const uint8_t *buf, size_t len) {
+	// Codepoints past the BMP need a surrogate pair
+	const size_t conts = utf8_count_bytes(buf, len, false);
+	return len - conts + utf8_count_bytes(buf, len, true) - conts;
+}
 
-	set->kvsize = kvsize;
-	set->entsize = entsize / sizeof(hset_entry_t);
+size_t utf8_to_utf32(const uint8_t *buf, size_t len, uint32_t *out) {
+	const uint8_t *s = buf, *const end = buf + len;
+	uint32_t *const start = out;
 
-	set->hash = hash;
-	set->eq = eq;
+	while (s < end) {
+		// ASCII fast path, widen whole words at a time
+		const uint8_t *const ascii = utf8_skip_ascii(s, end);
+		for (; s < ascii; s++) *out++ = *s;
+		if (s == end) break;
 
-	set->kv[set->entsize * set->capacity] = (hset_entry_t){
-		.used = true,
-		.psl = -1,
-	};
+		const uint32_t c = utf8_decode_checked(&s, end);
+		if (c == UTF_BAD_CODEPOINT) return UTF_INVALID;
+		*out++ = c;
+	}
 
-	return set->kv->data;
-}
-void *hset_deinit(void *_set) {
-	hset_t *set = hset_from_data(_set);
-	return mem_alloc(set->alloc, set, 0);
+	return out - start;
 }
-hset_t *hset_grow(hset_t *set) {
-	void *newset = hset_init(set->alloc, set->capacity * 2, set->kvsize,
-				set->hash, set->eq);
-	if (!newset) return NULL;
-	
-	for (void *iter = hset_next(set->kv->data, NULL); iter;
-		iter = hset_next(set->kv->data, iter)) {
-		// No need to set newset to insert's newset, no growth should happen
-		hset_insert(newset, iter);
+
+size_t utf8_to_utf16(const uint8_t *buf, size_t len, uint16_t *out) {
+	const uint8_t *s = buf, *const end = buf + len;
+	uint16_t *const start = out;
+
+	while (s < end) {
+		const uint8_t *const ascii = utf8_skip_ascii(s, end);
+		for (; s < ascii; s++) *out++ = *s;
+		if (s == end) break;
+
+		uint32_t c = utf8_decode_checked(&s, end);
+		if (c == UTF_BAD_CODEPOINT) return UTF_INVALID;
+		if (c >= 0x10000) {
+			c -= 0x10000;
+			*out++ = 0xd800 | c >> 10;
+			*out++ = 0xdc00 | c & 0x3ff;
+		} else {
+			*out++ = c;
+		}
 	}
 
-	hset_deinit(set->kv->data);
-	return hset_from_data(newset);
+	return out - start;
 }
-void *hset_insert(void *_set, const void *kv) {
-	hset_t *set = hset_from_data(_set);
 
-	// Grow the hash set
-	if (set->nents > set->capacity * 3 / 4) set = hset_grow(set);
+size_t utf32_to_utf8(const uint32_t *buf, size_t len, uint8_t *out) {
+	uint8_t *const start = out;
+
+	for (size_t i = 0; i < len; i++) {
+		const uint32_t c = buf[i];
+		if (c < 0x80) {
+			*out++ = c;
+			continue;
+		}
+		if (c > 0x10ffff || c >= 0xd800 && c < 0xe000) return UTF_INVALID;
+		utf8_codepoint_encode(c, out);
+		out += utf32_to_utf8_len(c);
+	}
 
-	// Get the new entry, entry and keyvalue pair iterators
-	const uint64_t hash = set->hash(kv);
+	return out - start;
+}
 
-	hset_entry_t *tmp = set->kv + set->entsize * set->capacity;
-	*tmp = (hset_entry_t){
-		.used = true,
-		.psl = 0,
-		.hash = hash,
-	};
-	memcpy(tmp->data, kv, set->kvsize);
-	hset_entry_t *iter = set->kv + set->entsize * (hash % set->capacity);
+size_t utf16_to_utf8(const uint16_t *buf, size_t len, uint8_t *out) {
+	uint8_t *const start = out;
 
-	while (iter->used) {
-		if (tmp->psl > iter->psl) {
-			// Swap
-			swapmem(iter, tmp, set->entsize * sizeof(hset_entry_t));
+	for (size_t i = 0; i < len; i++) {
+		uint32_t c = buf[i];
+		if (c < 0x80) {
+			*out++ = c;
+			continue;
 		}
-		if (tmp->hash == iter->hash && set->eq(tmp->data, kv)) {
-			memcpy(iter->data, kv, set->kvsize);
-			goto ret;
+		if (c >= 0xdc00 && c < 0xe000) return UTF_INVALID;
+		if (c >= 0xd800 && c < 0xdc00) {
+			// Needs a low surrogate right after
+			if (i + 1 == len || buf[i + 1] < 0xdc00 || buf[i + 1] >= 0xe000) {
+				return UTF_INVALID;
+			}
+			c = 0x10000 + ((c - 0xd800) << 10 | buf[++i] - 0xdc00);
 		}
-
-		iter += set->entsize;
-		if (iter == tmp) iter = set->kv;
-		tmp->psl++;
+		utf8_codepoint_encode(c, out);
+		out += utf32_to_utf8_len(c);
 	}
 
-	memcpy(iter, tmp, set->entsize * sizeof(hset_entry_t));
-	set->nents++;
+	return out - start;
+}
 
-ret:
-	*tmp = (hset_entry_t){ .psl = -1, .used = true };
-	return set->kv->data;
+#endif
+
+//
+// EK_USE_LOG
+//
+#if EK_USE_LOG
+log_fn *global_log;
+log_lvl_t log_level = LOG_DBG;
+
+static uint64_t log_now_ms(void) {
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
-void hset_remove(void *_set, const void *kv) {
-	hset_t *set = hset_from_data(_set);
 
-	hset_entry_t *ent = (hset_entry_t *)kv - 1;
+bool log_ratelimit(log_ratelimit_t *rl, unsigned burst, unsigned period_ms,
+			unsigned *suppressed) {
+	const uint64_t now = log_now_ms();
+	uint64_t window = __atomic_load_n(&rl->window, __ATOMIC_RELAXED);
 
-	ent->used = false;
-	ent->psl = 0;
-	ent->hash = 0;
-	set->nents--;
+	// Whoever gets here first starts the new window
+	*suppressed = 0;
+	if (!window || now - window >= period_ms) {
+		if (__atomic_compare_exchange_n(&rl->window, &window, now ? now : 1, false,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			*suppressed = __atomic_exchange_n(&rl->suppressed, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&rl->count, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	if (__atomic_load_n(&rl->count, __ATOMIC_RELAXED) < burst
+		&& __atomic_fetch_add(&rl->count, 1, __ATOMIC_RELAXED) < burst) {
+		return true;
+	}
+	__atomic_fetch_add(&rl->suppressed, 1, __ATOMIC_RELAXED);
+	return false;
 }
-void *hset_get(void *_set, const void *key) {
-	hset_t *set = hset_from_data(_set);
+#endif
 
-	const uint64_t mask = (1ull << HSET_ENTRY_HASH_BITS) - 1;
-	const uint64_t hash = set->hash(key) & mask;
-	hset_entry_t *iter = set->kv + set->entsize * (hash % set->capacity);
-	hset_entry_t *const end = set->kv + set->entsize * set->capacity;
-	int psl = 0;
+//
+// EK_USE_LOG_ASYNC
+//
+#if EK_USE_LOG_ASYNC
 
-	while (iter->used) {
-		if (psl > iter->psl) return NULL;
-		if (hash == iter->hash && set->eq(iter->data, key)) return iter->data;
+// Kinds of arguments a conversion takes
+typedef enum log_arg {
+	LOG_ARG_NONE,		// %%
+	LOG_ARG_BAD,		// %n or something unknown, stops the message there
+	LOG_ARG_INT,
+	LOG_ARG_LONG,
+	LOG_ARG_LLONG,
+	LOG_ARG_SIZE,
+	LOG_ARG_INTMAX,
+	LOG_ARG_PTRDIFF,
+	LOG_ARG_DOUBLE,
+	LOG_ARG_LDOUBLE,
+	LOG_ARG_STR,
+	LOG_ARG_PTR,
+} log_arg_t;
 
-		iter += set->entsize;
-		if (iter == end) iter = set->kv;
-		psl++;
+typedef struct log_spec {
+	const char *start, *end;	// From the % to after the conversion
+	log_arg_t arg;
+	bool is_unsigned;
+	bool width_star, prec_star;
+	int prec;			// -1 if not given or given by a *
+} log_spec_t;
+
+// Finds the next conversion in fmt. Returns the end of it or NULL when there
+// aren't any left.
+static const char *log_spec_next(const char *fmt, log_spec_t *spec) {
+	fmt = strchr(fmt, '%');
+	if (!fmt) return NULL;
+	spec->start = fmt++;
+	spec->is_unsigned = spec->width_star = spec->prec_star = false;
+	spec->prec = -1;
+
+	while (*fmt == '-' || *fmt == '+' || *fmt == ' ' || *fmt == '#' || *fmt == '0') fmt++;
+	if (*fmt == '*') spec->width_star = true, fmt++;
+	else while (*fmt >= '0' && *fmt <= '9') fmt++;
+	if (*fmt == '.') {
+		fmt++;
+		if (*fmt == '*') {
+			spec->prec_star = true, fmt++;
+		} else {
+			spec->prec = 0;
+			while (*fmt >= '0' && *fmt <= '9') spec->prec = spec->prec * 10 + *fmt++ - '0';
+		}
 	}
 
-	return NULL;
-}
-void *hset_next(void *_set, void *iter) {
-	hset_t *set = hset_from_data(_set);
-	if (!iter) return set->kv->data;
+	log_arg_t len = LOG_ARG_INT;
+	switch (*fmt) {
+	case 'h': fmt += 1 + (fmt[1] == 'h'); break;
+	case 'l':
+		if (fmt[1] == 'l') len = LOG_ARG_LLONG, fmt += 2;
+		else len = LOG_ARG_LONG, fmt++;
+		break;
+	case 'z': len = LOG_ARG_SIZE, fmt++; break;
+	case 'j': len = LOG_ARG_INTMAX, fmt++; break;
+	case 't': len = LOG_ARG_PTRDIFF, fmt++; break;
+	case 'L': len = LOG_ARG_LDOUBLE, fmt++; break;
+	}
 
-	hset_entry_t *ent = (hset_entry_t *)iter - 1;
-	do {
-		ent += set->entsize;
-	} while (!ent->used);
+	switch (*fmt) {
+	case 'u': case 'x': case 'X': case 'o':
+		spec->is_unsigned = true;
+		// fallthrough
+	case 'd': case 'i':
+		spec->arg = len == LOG_ARG_LDOUBLE ? LOG_ARG_BAD : len;
+		break;
+	case 'c':
+		spec->arg = len == LOG_ARG_INT ? LOG_ARG_INT : LOG_ARG_BAD;
+		break;
+	case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+		spec->arg = len == LOG_ARG_LDOUBLE ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+		break;
+	case 's': spec->arg = len == LOG_ARG_INT ? LOG_ARG_STR : LOG_ARG_BAD; break;
+	case 'p': spec->arg = LOG_ARG_PTR; break;
+	case '%': spec->arg = LOG_ARG_NONE; break;
+	default:
+		spec->arg = LOG_ARG_BAD;
+		spec->end = fmt;
+		return *fmt ? fmt + 1 : fmt;
+	}
 
-	if (ent->psl == (-1ull & (1 << HSET_ENTRY_PSL_BITS) - 1)) return NULL;
-	else return ent->data;
+	spec->end = ++fmt;
+	return fmt;
 }
 
-uint64_t str_hash(const char *str) {
-	return xxhash64_single_lane((const uint8_t *)str, strlen(str));
-}
-bool str_eq(const char *a, const char *b) {
-	return strcmp(a, b) == 0;
-}
+// A message in a ring. Sizes are kept to multiples of 16 so that there is
+// always room for a header at the end of the ring to skip back to the start.
+typedef struct log_record {
+	uint32_t size;		// Bytes taken in the ring
+	uint16_t nargs;		// Argument words written
+	uint16_t lvl;
+	const char *fmt;	// NULL for the padding at the end of the ring
+	uint64_t args[];
+} log_record_t;
 
-#if EK_USE_STRVIEW
-uint64_t strview_hash(const strview_t *sv) {
-	return xxhash64_single_lane((const uint8_t *)sv->str, sv->len);
-}
-#endif
+#define LOG_RECORD_ALIGN 16
+#define LOG_RECORD_MAX_ARGS ((LOG_ASYNC_MAX_RECORD - sizeof(log_record_t)) / sizeof(uint64_t))
 
-#endif
+// The va_args a format takes in order, worked out once per format and cached
+// per thread, so logging doesn't have to parse the format every time
+typedef struct log_step {
+	uint8_t arg;		// LOG_ARG_* or LOG_STEP_PREC
+	bool is_unsigned;
+	int16_t prec;		// For strings, LOG_STEP_STAR if given by a *
+} log_step_t;
 
-#if EK_USE_ARENA
+#define LOG_STEP_PREC 0xff
+#define LOG_STEP_STAR -2
+#define LOG_PLAN_MAX_STEPS 16
+#define LOG_PLAN_CACHE 64
 
-typedef struct fixed_arena {
-	mem_alloc_fn *alloc_fn;
-	uint8_t *ptr;
-	uint8_t data[];
-} fixed_arena_t;
+typedef struct log_plan {
+	const char *fmt;
+	int nsteps;
+	log_step_t steps[LOG_PLAN_MAX_STEPS];
+} log_plan_t;
 
-static void *fixed_arena_realloc(void *buf, void *blk, size_t newsize) {
-	if (!blk) return fixed_arena_alloc(buf, newsize);
-	else return NULL;
+static __thread log_plan_t log_plans[LOG_PLAN_CACHE];
+
+static void log_plan_add(log_plan_t *plan, log_step_t step) {
+	if (plan->nsteps < LOG_PLAN_MAX_STEPS) plan->steps[plan->nsteps++] = step;
 }
-bool fixed_arena_init(void *buf, size_t bufsize) {
-	fixed_arena_t *arena = buf;
-	if (bufsize < sizeof(*arena)) return false;
-	arena->alloc_fn = fixed_arena_realloc;
-	arena->ptr = arena->data + bufsize - sizeof(*arena);
-	return true;
+
+static const log_plan_t *log_plan_get(const char *fmt) {
+	const uint64_t hash = (uintptr_t)fmt * 0x9e3779b97f4a7c15ull;
+	log_plan_t *const plan = log_plans + (hash >> 32) % LOG_PLAN_CACHE;
+	if (plan->fmt == fmt) return plan;
+
+	// Arguments past LOG_PLAN_MAX_STEPS are left off
+	plan->fmt = fmt;
+	plan->nsteps = 0;
+	log_spec_t spec;
+	for (const char *at = fmt; (at = log_spec_next(at, &spec));) {
+		if (spec.arg == LOG_ARG_BAD) break;
+		if (spec.width_star) log_plan_add(plan, (log_step_t){ .arg = LOG_ARG_INT });
+		if (spec.prec_star) log_plan_add(plan, (log_step_t){ .arg = LOG_STEP_PREC });
+		if (spec.arg == LOG_ARG_NONE) continue;
+		log_plan_add(plan, (log_step_t){
+			.arg = spec.arg,
+			.is_unsigned = spec.is_unsigned,
+			.prec = spec.prec_star ? LOG_STEP_STAR
+				: spec.prec > INT16_MAX ? INT16_MAX : spec.prec,
+		});
+	}
+
+	return plan;
 }
-void *fixed_arena_alloc(void *buf, size_t size) {
-	fixed_arena_t *arena = buf;
-	arena->ptr = (uint8_t *)align_dn((uintptr_t)arena->ptr - size, 8);
-	return arena->ptr >= arena->data ? arena->ptr : NULL;
+
+// Copies the arguments into the record and returns its size
+static size_t log_record_write(log_record_t *rec, log_lvl_t lvl, const char *fmt,
+				va_list ap) {
+	const log_plan_t *const plan = log_plan_get(fmt);
+	const size_t cap = LOG_RECORD_MAX_ARGS;
+	size_t n = 0;
+	int prec = -1;
+
+	for (int i = 0; i < plan->nsteps && n < cap; i++) {
+		const log_step_t step = plan->steps[i];
+		switch (step.arg) {
+		case LOG_STEP_PREC:
+			prec = va_arg(ap, int);
+			rec->args[n++] = (int64_t)prec;
+			break;
+		case LOG_ARG_INT:
+			rec->args[n++] = step.is_unsigned ? va_arg(ap, unsigned)
+				: (int64_t)va_arg(ap, int);
+			break;
+		case LOG_ARG_LONG:
+			rec->args[n++] = step.is_unsigned ? va_arg(ap, unsigned long)
+				: (int64_t)va_arg(ap, long);
+			break;
+		case LOG_ARG_LLONG:
+			rec->args[n++] = step.is_unsigned ? va_arg(ap, unsigned long long)
+				: (int64_t)va_arg(ap, long long);
+			break;
+		case LOG_ARG_SIZE:
+			rec->args[n++] = va_arg(ap, size_t);
+			break;
+		case LOG_ARG_INTMAX:
+			rec->args[n++] = step.is_unsigned ? va_arg(ap, uintmax_t)
+				: (int64_t)va_arg(ap, intmax_t);
+			break;
+		case LOG_ARG_PTRDIFF:
+			rec->args[n++] = (int64_t)va_arg(ap, ptrdiff_t);
+			break;
+		case LOG_ARG_DOUBLE:
+		case LOG_ARG_LDOUBLE: {
+			// long doubles lose their extra precision
+			const double d = step.arg == LOG_ARG_DOUBLE ? va_arg(ap, double)
+				: (double)va_arg(ap, long double);
+			memcpy(rec->args + n++, &d, sizeof(d));
+			break;
+		}
+		case LOG_ARG_PTR:
+			rec->args[n++] = (uintptr_t)va_arg(ap, void *);
+			break;
+		case LOG_ARG_STR: {
+			// The length, then the string with its null terminator
+			const char *str = va_arg(ap, const char *);
+			if (n + 2 > cap) goto done;
+			if (!str) str = "(null)";
+			const int p = step.prec == LOG_STEP_STAR ? prec : step.prec;
+			size_t room = (cap - n - 1) * sizeof(uint64_t) - 1;
+			if (p >= 0 && (size_t)p < room) room = p;
+			const size_t len = strnlen(str, room);
+			rec->args[n++] = len;
+			memcpy(rec->args + n, str, len);
+			((char *)(rec->args + n))[len] = '\0';
+			n += (len + sizeof(uint64_t)) / sizeof(uint64_t);
+			break;
+		}
+		}
+	}
+
+done:
+	rec->lvl = lvl;
+	rec->nargs = n;
+	rec->fmt = fmt;
+	rec->size = (sizeof(*rec) + n * sizeof(uint64_t) + LOG_RECORD_ALIGN - 1)
+		& ~(size_t)(LOG_RECORD_ALIGN - 1);
+	return rec->size;
 }
-void fixed_arena_reset_to(void *buf, void *to) {
-	((fixed_arena_t *)buf)->ptr = to;
+
+// Appends to a line, cutting it short if it doesn't fit
+static void log_line_append(char *line, size_t *len, const char *str, size_t n) {
+	if (n > LOG_ASYNC_MAX_LINE - 1 - *len) n = LOG_ASYNC_MAX_LINE - 1 - *len;
+	memcpy(line + *len, str, n);
+	*len += n;
 }
-mem_alloc_t fixed_arena_alloc_fn(void *buf) {
-	return &((fixed_arena_t *)buf)->alloc_fn;
+
+// Formats one argument of a record with snprintf. Any * in the conversion
+// is swapped out for the number that was passed.
+static size_t log_format_arg(char *buf, size_t size, const log_spec_t *spec,
+				const uint64_t *arg, int width, int prec) {
+	char fmt[32];
+	size_t n = 0;
+
+	for (const char *c = spec->start; c < spec->end; c++) {
+		if (n + 12 >= sizeof(fmt)) return 0;
+		if (*c != '*') {
+			fmt[n++] = *c;
+		} else if (c[-1] != '.') {
+			n += sprintf(fmt + n, "%d", width);
+		} else if (prec >= 0) {
+			n += sprintf(fmt + n, "%d", prec);
+		} else {
+			n--; // A negative precision is the same as none
+		}
+	}
+	fmt[n] = '\0';
+
+	const uint64_t v = *arg;
+	double d;
+	int len = 0;
+	switch (spec->arg) {
+	case LOG_ARG_INT:
+		len = spec->is_unsigned ? snprintf(buf, size, fmt, (unsigned)v)
+			: snprintf(buf, size, fmt, (int)v);
+		break;
+	case LOG_ARG_LONG:
+		len = spec->is_unsigned ? snprintf(buf, size, fmt, (unsigned long)v)
+			: snprintf(buf, size, fmt, (long)v);
+		break;
+	case LOG_ARG_LLONG:
+		len = spec->is_unsigned ? snprintf(buf, size, fmt, (unsigned long long)v)
+			: snprintf(buf, size, fmt, (long long)v);
+		break;
+	case LOG_ARG_SIZE:
+		len = snprintf(buf, size, fmt, (size_t)v);
+		break;
+	case LOG_ARG_INTMAX:
+		len = spec->is_unsigned ? snprintf(buf, size, fmt, (uintmax_t)v)
+			: snprintf(buf, size, fmt, (intmax_t)v);
+		break;
+	case LOG_ARG_PTRDIFF:
+		len = snprintf(buf, size, fmt, (ptrdiff_t)v);
+		break;
+	case LOG_ARG_DOUBLE:
+		memcpy(&d, arg, sizeof(d));
+		len = snprintf(buf, size, fmt, d);
+		break;
+	case LOG_ARG_LDOUBLE:
+		memcpy(&d, arg, sizeof(d));
+		len = snprintf(buf, size, fmt, (long double)d);
+		break;
+	case LOG_ARG_PTR:
+		len = snprintf(buf, size, fmt, (void *)(uintptr_t)v);
+		break;
+	case LOG_ARG_STR:
+		len = snprintf(buf, size, fmt, (const char *)(arg + 1));
+		break;
+	default:
+		break;
+	}
+
+	if (len < 0) return 0;
+	return (size_t)len < size ? (size_t)len : size - 1;
 }
 
-#endif
+// Formats a record into a line ending in a newline, returns its length
+static size_t log_record_format(char *line, const log_record_t *rec) {
+	static const char *const names[] = { "ERR", "WARN", "INFO", "DBG" };
+	const uint64_t *arg = rec->args, *const end = rec->args + rec->nargs;
+	const char *text = rec->fmt;
+	size_t len = 0;
+	log_spec_t spec;
 
-#if EK_USE_POOL
+	line[len++] = '[';
+	const char *const name = rec->lvl < arrlen(names) ? names[rec->lvl] : "???";
+	log_line_append(line, &len, name, strlen(name));
+	log_line_append(line, &len, "] ", 2);
 
-typedef struct dynpool_block dynpool_block_t;
-typedef struct dynpool_chunk {
-	union {
-		dynpool_block_t *parent;
-		struct dynpool_chunk *nextfree;
-	};
-	uint8_t data[];
-} dynpool_chunk_t;
+	for (const char *at = text; (at = log_spec_next(at, &spec)); text = at) {
+		log_line_append(line, &len, text, spec.start - text);
+		if (spec.arg == LOG_ARG_BAD) {
+			text = spec.start;
+			break;
+		}
+		if (spec.arg == LOG_ARG_NONE) {
+			log_line_append(line, &len, "%", 1);
+			continue;
+		}
 
-struct dynpool_block {
-	dynpool_block_t *next, *nextfree, *lastfree;
-	size_t nchunks, freeid, elemsz, nalloced;
-	dynpool_chunk_t *free;
-	uint8_t data[];
-};
+		// Messages that got cut short end in ...
+		const int nwords = 1 + spec.width_star + spec.prec_star;
+		if (end - arg < nwords) {
+			log_line_append(line, &len, "...", 3);
+			text = "";
+			break;
+		}
+		const int width = spec.width_star ? (int)*arg++ : 0;
+		const int prec = spec.prec_star ? (int)*arg++ : -1;
+		len += log_format_arg(line + len, LOG_ASYNC_MAX_LINE - len, &spec, arg, width, prec);
+		arg += spec.arg == LOG_ARG_STR ? 1 + (*arg + sizeof(uint64_t)) / sizeof(uint64_t) : 1;
+	}
+	log_line_append(line, &len, text, strlen(text));
+	line[len++] = '\n';
+	return len;
+}
 
-struct dynpool {
-	mem_alloc_fn *interface;
-	size_t elemsz;
+// Each thread that logs gets one of these. The thread is the only producer and
+// the background thread is the only consumer, so they only need to share the
+// head and tail. The padding keeps those on their own cache lines.
+typedef struct log_ring {
+	struct log_ring *next;
 	mem_alloc_t alloc;
-	dynpool_block_t *head, *free;
-	dynpool_block_t first;
+	size_t mask;
+	bool dead;		// Set when the thread exits
+	char pad0[64];
+	size_t head;		// Written by the thread
+	size_t cached_tail;	// The last tail the thread saw
+	char pad1[64];
+	size_t tail;		// Written by the background thread
+	char pad2[64];
+	uint64_t data[];
+} log_ring_t;
+
+#define LOG_ASYNC_BATCH (64 * 1024)
+#define LOG_ASYNC_IDLE_NS 1000000
+
+static struct {
+	pthread_mutex_t lock;	// Guards the list of rings
+	pthread_once_t once;
+	pthread_key_t key;
+	pthread_t thread;
+	log_ring_t *rings;
+	mem_alloc_t alloc;
+	size_t ring_size;
+	log_async_mode_t mode;
+	int fd;
+	bool running;
+	size_t writers;		// Threads in log_async past the running check
+	size_t dropped;
+	size_t passes;		// Times the background thread went over every ring
+	char batch[LOG_ASYNC_BATCH];
+	size_t batch_len;
+} log_async_state = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.once = PTHREAD_ONCE_INIT,
 };
 
-dynpool_t *dynpool_init(mem_alloc_t alloc, size_t initial_chunks, size_t elemsz) {
-	elemsz = align_up(elemsz, sizeof(dynpool_chunk_t)) + sizeof(dynpool_chunk_t);
-	dynpool_t *self = mem_alloc(alloc, NULL, sizeof(*self) + sizeof(dynpool_block_t)
-					+ initial_chunks * elemsz);
-	*self = (struct dynpool){
-		.elemsz = elemsz,
-		.alloc = alloc,
-		.head = &self->first,
-		.free = &self->first,
-		.first = (dynpool_block_t){
-			.elemsz = elemsz,
-			.nchunks = initial_chunks,
-			.next = NULL,
-			.nextfree = NULL,
-			.lastfree = NULL,
-			.free = NULL,
-			.freeid = 0,
-			.nalloced = 0,
-		},
-	};
+static __thread log_ring_t *log_thread_ring;
 
-	return self;
-}
-void dynpool_deinit(dynpool_t *self) {
-	dynpool_block_t *blk = self->head;
-	while (blk) {
-		dynpool_block_t *next = blk->next;
-		if (blk != &self->first) mem_alloc(self->alloc, blk, 0);
-		blk = next;
-	}
-	mem_alloc(self->alloc, self, 0);
+static void log_ring_release(void *ring) {
+	__atomic_store_n(&((log_ring_t *)ring)->dead, true, __ATOMIC_RELEASE);
 }
-static void remove_free_block(dynpool_t *self, dynpool_block_t *blk) {
-	if (blk->lastfree) blk->lastfree->nextfree = blk->nextfree;
-	else self->free = blk->nextfree;
-	if (blk->nextfree) blk->nextfree->lastfree = blk->lastfree;
+static void log_async_make_key(void) {
+	pthread_key_create(&log_async_state.key, log_ring_release);
 }
-void *dynpool_alloc(dynpool_t *self) {
-	if (!self->free) {
-		dynpool_block_t *blk = mem_alloc(self->alloc, NULL,
-				sizeof(*blk) + self->head->nchunks * self->elemsz);
-		*blk = (dynpool_block_t){
-			.elemsz = self->elemsz,
-			.nchunks = self->head->nchunks,
-			.next = self->head,
-			.nextfree = NULL,
-			.lastfree = NULL,
-			.free = NULL,
-			.freeid = 0,
-			.nalloced = 0,
+
+static log_ring_t *log_ring_register(void) {
+	pthread_once(&log_async_state.once, log_async_make_key);
+
+	pthread_mutex_lock(&log_async_state.lock);
+	const size_t size = log_async_state.ring_size;
+	log_ring_t *ring = mem_alloc(log_async_state.alloc, NULL, sizeof(*ring) + size);
+	if (ring) {
+		*ring = (log_ring_t){
+			.next = log_async_state.rings,
+			.alloc = log_async_state.alloc,
+			.mask = size - 1,
 		};
-		self->head = blk;
-		self->free = blk;
+		log_async_state.rings = ring;
 	}
+	pthread_mutex_unlock(&log_async_state.lock);
 
-	dynpool_block_t *blk = self->free;
-	dynpool_chunk_t *chunk;
-	if (blk->freeid != blk->nchunks) {
-		chunk = (dynpool_chunk_t *)(blk->data + (blk->freeid++ * blk->elemsz));
-	} else {
-		chunk = blk->free;
-		blk->free = chunk->nextfree;
-	}
-	chunk->parent = blk;
-	if (++blk->nalloced == blk->nchunks) remove_free_block(self, blk);
-	return chunk->data;
+	if (!ring) return NULL;
+	pthread_setspecific(log_async_state.key, ring);
+	return log_thread_ring = ring;
 }
-void dynpool_free(dynpool_t *self, void *ptr) {
-	if (!ptr) {
-		return;
-	}
-	dynpool_chunk_t *chunk = (dynpool_chunk_t *)((uintptr_t)ptr - offsetof(dynpool_chunk_t, data));
-	dynpool_block_t *blk = chunk->parent;
-	if (blk->nalloced-- == blk->nchunks) {
-		blk->lastfree = NULL;
-		blk->nextfree = self->free;
-		if (blk->nextfree) blk->nextfree->lastfree = blk;
-		self->free = blk;
-	}
 
-	chunk->nextfree = blk->free;
-	blk->free = chunk;
-}
-bool dynpool_empty(const dynpool_t *self) {
-	size_t free_blocks = 0, nblocks = 0;
-	
-	const dynpool_block_t *blk = self->head;
-	while (blk) {
-		nblocks++;
-		blk = blk->next;
+void log_async(log_lvl_t lvl, const char *fmt, ...) {
+	// Counted before looking at running, so stop either sees this thread or
+	// this thread sees stop. Pairs with log_async_main
+	__atomic_fetch_add(&log_async_state.writers, 1, __ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&log_async_state.running, __ATOMIC_SEQ_CST)) goto drop;
+	log_ring_t *ring = log_thread_ring;
+	if (!ring && !(ring = log_ring_register())) goto drop;
+
+	union {
+		log_record_t rec;
+		uint64_t words[LOG_ASYNC_MAX_RECORD / sizeof(uint64_t)];
+	} buf;
+	va_list ap;
+	va_start(ap, fmt);
+	const size_t size = log_record_write(&buf.rec, lvl, fmt, ap);
+	va_end(ap);
+
+	// Records don't wrap, so skip the end of the ring if it doesn't fit there
+	const size_t cap = ring->mask + 1;
+	size_t head = ring->head;
+	const size_t contiguous = cap - (head & ring->mask);
+	const size_t need = contiguous < size ? contiguous + size : size;
+
+	while (head + need - ring->cached_tail > cap) {
+		ring->cached_tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (head + need - ring->cached_tail <= cap) break;
+		if (log_async_state.mode == LOG_ASYNC_DROP
+			|| !__atomic_load_n(&log_async_state.running, __ATOMIC_RELAXED)) {
+			goto drop;
+		}
+		sched_yield();
 	}
 
-	blk = self->free;
-	while (blk) {
-		if (blk->nalloced != 0) return false;
-		free_blocks++;
-		blk = blk->nextfree;
+	uint8_t *const data = (uint8_t *)ring->data;
+	if (contiguous < size) {
+		log_record_t *const pad = (log_record_t *)(data + (head & ring->mask));
+		pad->size = contiguous;
+		pad->fmt = NULL;
+		head += contiguous;
 	}
+	memcpy(data + (head & ring->mask), &buf, size);
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_RELEASE);
+	__atomic_fetch_sub(&log_async_state.writers, 1, __ATOMIC_RELEASE);
+	return;
 
-	return free_blocks == nblocks;
+drop:
+	__atomic_fetch_add(&log_async_state.dropped, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&log_async_state.writers, 1, __ATOMIC_RELEASE);
 }
-void dynpool_fast_clear(dynpool_t *self) {
-	dynpool_block_t *blk = self->head;
-	self->free = NULL;
-	while (blk) {
-		blk->nalloced = 0;
-		blk->free = NULL;
-		blk->freeid = 0;
-		
-		blk->lastfree = NULL;
-		blk->nextfree = self->free;
-		if (blk->nextfree) blk->nextfree->lastfree = blk;
-		self->free = blk;
 
-		blk = blk->next;
+static void log_async_write_batch(void) {
+	const char *buf = log_async_state.batch;
+	size_t len = log_async_state.batch_len;
+
+	while (len) {
+		const ssize_t n = write(log_async_state.fd, buf, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) break; // Nowhere to report it, so the batch is lost
+		buf += n, len -= n;
 	}
+	log_async_state.batch_len = 0;
 }
-size_t dynpool_num_chunks(const dynpool_t *self) {
-	size_t nchunks = 0;
-	dynpool_block_t *blk = self->head;
-	while (blk) {
-		nchunks += blk->nalloced;
-		blk = blk->next;
+
+static char *log_async_line(void) {
+	if (LOG_ASYNC_BATCH - log_async_state.batch_len < LOG_ASYNC_MAX_LINE) {
+		log_async_write_batch();
 	}
-	return nchunks;
+	return log_async_state.batch + log_async_state.batch_len;
 }
 
-typedef struct fixedpool_chunk {
-	struct fixedpool_chunk *next;
-} fixedpool_chunk_t;
+// Formats everything in the ring, returns the number of messages
+static size_t log_ring_drain(log_ring_t *ring) {
+	const uint8_t *const data = (const uint8_t *)ring->data;
+	const size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	size_t tail = ring->tail, n = 0;
 
-typedef struct fixedpool {
-	size_t nchunks, freeid, elemsz;
+	while (tail != head) {
+		const log_record_t *const rec = (const log_record_t *)(data + (tail & ring->mask));
+		if (rec->fmt) {
+			log_async_state.batch_len += log_record_format(log_async_line(), rec);
+			n++;
+		}
+		tail += rec->size;
+	}
+
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	return n;
+}
+
+// Goes over every ring once, freeing the ones whose threads are gone
+static size_t log_async_pass(size_t *reported) {
+	size_t n = 0;
+
+	pthread_mutex_lock(&log_async_state.lock);
+	for (log_ring_t **it = &log_async_state.rings; *it;) {
+		log_ring_t *const ring = *it;
+		const bool dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		n += log_ring_drain(ring);
+		if (dead && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE)) {
+			*it = ring->next;
+			mem_alloc(ring->alloc, ring, 0);
+		} else {
+			it = &ring->next;
+		}
+	}
+	pthread_mutex_unlock(&log_async_state.lock);
+
+	const size_t dropped = __atomic_load_n(&log_async_state.dropped, __ATOMIC_RELAXED);
+	if (dropped != *reported) {
+		char *const line = log_async_line();
+		const int len = snprintf(line, LOG_ASYNC_MAX_LINE,
+			"[WARN] log_async: dropped %zu messages\n", dropped - *reported);
+		log_async_state.batch_len += len;
+		*reported = dropped;
+	}
+
+	log_async_write_batch();
+	__atomic_fetch_add(&log_async_state.passes, 1, __ATOMIC_RELEASE);
+	return n;
+}
+
+static void *log_async_main(void *usr) {
+	size_t reported = __atomic_load_n(&log_async_state.dropped, __ATOMIC_RELAXED);
+
+	for (;;) {
+		// Anything logged before stop was called gets written by the last pass,
+		// including records that are still being copied in when it's called
+		const bool stop = !__atomic_load_n(&log_async_state.running, __ATOMIC_SEQ_CST);
+		while (stop && __atomic_load_n(&log_async_state.writers, __ATOMIC_SEQ_CST)) {
+			sched_yield();
+		}
+		const size_t n = log_async_pass(&reported);
+		if (stop) break;
+		if (!n) nanosleep(&(struct timespec){ .tv_nsec = LOG_ASYNC_IDLE_NS }, NULL);
+	}
+
+	return NULL;
+}
+
+bool log_async_start(mem_alloc_t alloc, size_t ring_size, log_async_mode_t mode,
+			int fd) {
+	if (__atomic_load_n(&log_async_state.running, __ATOMIC_ACQUIRE)) return false;
+
+	// Room for a few of the biggest records
+	size_t size = 4 * LOG_ASYNC_MAX_RECORD;
+	if (!ring_size) ring_size = LOG_ASYNC_RING_SIZE;
+	while (size < ring_size) size *= 2;
+
+	pthread_mutex_lock(&log_async_state.lock);
+	log_async_state.alloc = alloc;
+	log_async_state.ring_size = size;
+	pthread_mutex_unlock(&log_async_state.lock);
+	log_async_state.mode = mode;
+	log_async_state.fd = fd;
+	log_async_state.batch_len = 0;
+	__atomic_store_n(&log_async_state.running, true, __ATOMIC_RELEASE);
+
+	if (pthread_create(&log_async_state.thread, NULL, log_async_main, NULL) != 0) {
+		__atomic_store_n(&log_async_state.running, false, __ATOMIC_RELEASE);
+		return false;
+	}
+	return true;
+}
+
+void log_async_stop(void) {
+	if (!__atomic_load_n(&log_async_state.running, __ATOMIC_ACQUIRE)) return;
+	__atomic_store_n(&log_async_state.running, false, __ATOMIC_SEQ_CST);
+	pthread_join(log_async_state.thread, NULL);
+}
+
+void log_async_flush(void) {
+	// The pass after the current one started after this call
+	const size_t start = __atomic_load_n(&log_async_state.passes, __ATOMIC_ACQUIRE);
+	while (__atomic_load_n(&log_async_state.running, __ATOMIC_ACQUIRE)
+		&& __atomic_load_n(&log_async_state.passes, __ATOMIC_ACQUIRE) < start + 2) {
+		nanosleep(&(struct timespec){ .tv_nsec = LOG_ASYNC_IDLE_NS / 10 }, NULL);
+	}
+}
+
+size_t log_async_dropped(void) {
+	return __atomic_load_n(&log_async_state.dropped, __ATOMIC_RELAXED);
+}
+
+#endif
+
+//
+// EK_USE_VEC
+//
+#if EK_USE_VEC
+
+#define vec_size(elems, capacity) (sizeof(vec_t) + (capacity) * (elems))
+#define vec_from_data(data) ((vec_t *)((uintptr_t)data - offsetof(vec_t, data)))
+
+void *vec_init(mem_alloc_t alloc, size_t elem_size, size_t capacity) {
+	vec_t *vec = mem_alloc(alloc, NULL, vec_size(capacity, elem_size));
+	if (!vec) return NULL;
+	vec->alloc = alloc;
+	vec->len = 0;
+	vec->capacity = capacity;
+	return vec->data;
+}
+void *vec_deinit(void *data) {
+	vec_t *vec = vec_from_data(data);
+	return mem_alloc(vec->alloc, vec, 0);
+}
+void *_vec_push(void *data, size_t elem_size, size_t nelems, const void *elems) {
+	vec_t *vec = vec_from_data(data);
+	if (vec->len + nelems > vec->capacity) {
+		size_t capacity = vec->capacity ? vec->capacity : 1;
+		while (vec->len + nelems > capacity) capacity *= 2;
+		vec = mem_alloc(vec->alloc, vec, vec_size(elem_size, capacity));
+		if (!vec) return NULL;
+		vec->capacity = capacity;
+	}
+
+	if (elems) {
+		memcpy(vec->data + vec->len * elem_size,
+			elems, nelems * elem_size);
+	}
+	vec->len += nelems;
+	return vec->data;
+}
+void _vec_pop(void *data, size_t elem_size, size_t nelems, void *elems) {
+	vec_t *vec = vec_from_data(data);
+	vec->len -= nelems;
+	if (!elems) return;
+	memcpy(elems, vec->data + vec->len * elem_size, nelems * elem_size);
+}
+#endif
+
+//
+// EK_USE_TEST
+//
+#if EK_USE_TEST
+static const char *test_err_file;
+static int test_err_line;
+static bool test_was_bad;
+
+#define COLOR(str) "\x1b[" str "m"
+
+bool test_bad(const char *file, int line) {
+	test_err_file = file;
+	test_err_line = line;
+	test_was_bad = true;
+	return false;
+}
+bool tests_run_foreach(bool (*setup_test)(const test_t *test),
+		const test_t *test_list, size_t list_len, FILE *out) {
+	int passed = 0, tests = 0;
+
+	for (int i = 0; i < list_len; i++) {
+		test_was_bad = false;
+
+		if (!test_list[i].name && !test_list[i].pfn) {
+			fprintf(out, "\n");
+			continue;
+        	}
+
+		tests++;
+        	fprintf(out, "%-48s ", test_list[i].name);
+		if (setup_test && !setup_test(test_list + i)) {
+			fprintf(out, COLOR("41;1") "<SETUP FAIL>" COLOR("0") "\n");
+			continue;
+		}
+        	if (test_list[i].pfn(i) && !test_was_bad) {
+			fprintf(out, " " COLOR("42;1") "PASS" COLOR("0") "\n");
+			passed++;
+        	} else {
+			fprintf(out, COLOR("41;1") "<FAIL");
+			if (test_was_bad) {
+				fprintf(out, " AT %s:%d", test_err_file, test_err_line);
+			}
+			fprintf(out, ">" COLOR("0") "\n");
+        	}
+	}
+
+	fprintf(out, "\n%d/%d tests passing (%d%%)\n", passed, tests,
+		tests ? (100 * passed) / tests : 100);
+
+	return passed == tests;
+}
+
+#if defined(__unix__) || defined(__APPLE__)
+typedef enum test_status {
+	TEST_STATUS_NOT_RUN,
+	TEST_STATUS_PASS,
+	TEST_STATUS_FAIL,
+	TEST_STATUS_SETUP_FAIL,
+	TEST_STATUS_CRASH,
+	TEST_STATUS_TIMEOUT,
+} test_status_t;
+
+// What a worker sends back through its pipe after each test. The file name
+// is a string literal, so the pointer means the same thing in the parent.
+typedef struct test_msg {
+	int index;
+	test_status_t status;
+	int line;
+	const char *file;
+} test_msg_t;
+
+// A process running one test or one group of them
+typedef struct test_job {
+	size_t first, last;
+	pid_t pid;
+	int fd;
+} test_job_t;
+
+static bool test_selected(const test_t *test, const test_opts_t *opts) {
+	return test->pfn && (!opts->filter || strstr(test->name, opts->filter));
+}
+
+static void test_set_timer(unsigned ms) {
+	const struct itimerval timer = {
+		.it_value = { .tv_sec = ms / 1000, .tv_usec = ms % 1000 * 1000 },
+	};
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+static void test_worker(bool (*setup_test)(const test_t *test), const test_t *test_list,
+			const test_job_t *job, const test_opts_t *opts, int fd) {
+	// SIGALRM is left to kill the worker when a test runs too long
+	signal(SIGALRM, SIG_DFL);
+
+	for (size_t i = job->first; i < job->last; i++) {
+		if (!test_selected(test_list + i, opts)) continue;
+		test_msg_t msg = { .index = i };
+
+		test_was_bad = false;
+		if (setup_test && !setup_test(test_list + i)) {
+			msg.status = TEST_STATUS_SETUP_FAIL;
+		} else {
+			test_set_timer(opts->timeout_ms);
+			const bool passed = test_list[i].pfn(i);
+			test_set_timer(0);
+			msg.status = passed && !test_was_bad ? TEST_STATUS_PASS : TEST_STATUS_FAIL;
+		}
+		if (test_was_bad) msg.file = test_err_file, msg.line = test_err_line;
+
+		if (write(fd, &msg, sizeof(msg)) != sizeof(msg)) break;
+	}
+
+	// Skips atexit handlers and stdio buffers that belong to the parent
+	_exit(0);
+}
+
+static bool test_job_start(bool (*setup_test)(const test_t *test), const test_t *test_list,
+			test_job_t *job, const test_opts_t *opts) {
+	int fds[2];
+	if (pipe(fds) != 0) return false;
+
+	job->pid = fork();
+	if (job->pid < 0) {
+		close(fds[0]), close(fds[1]);
+		return false;
+	}
+	if (job->pid == 0) {
+		close(fds[0]);
+		test_worker(setup_test, test_list, job, opts, fds[1]);
+	}
+
+	close(fds[1]);
+	job->fd = fds[0];
+	return true;
+}
+
+// Reads a result. Returns false once the worker is gone, then marks the test
+// it died on and leaves the rest of its tests as not run.
+static bool test_job_read(test_job_t *job, test_msg_t *results) {
+	test_msg_t msg;
+	ssize_t n;
+	do n = read(job->fd, &msg, sizeof(msg)); while (n < 0 && errno == EINTR);
+	if (n == sizeof(msg)) {
+		results[msg.index] = msg;
+		job->first = msg.index + 1;
+		return true;
+	}
+
+	close(job->fd);
+	int status = 0;
+	while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR) {}
+
+	for (size_t i = job->first; i < job->last; i++) {
+		if (results[i].status != TEST_STATUS_NOT_RUN || results[i].index != i) continue;
+		const bool timeout = WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM;
+		results[i].status = timeout ? TEST_STATUS_TIMEOUT : TEST_STATUS_CRASH;
+		results[i].line = WIFSIGNALED(status) ? WTERMSIG(status) : -1;
+		break;
+	}
+	return false;
+}
+
+bool tests_run_parallel(bool (*setup_test)(const test_t *test),
+		const test_t *test_list, size_t list_len, const test_opts_t *opts,
+		FILE *out) {
+	const long online = sysconf(_SC_NPROCESSORS_ONLN);
+	const size_t njobs = opts->jobs > 0 ? (size_t)opts->jobs : online > 0 ? (size_t)online : 1;
+
+	test_msg_t *const results = calloc(list_len, sizeof(*results));
+	test_job_t *const running = calloc(njobs, sizeof(*running));
+	struct pollfd *const fds = calloc(njobs, sizeof(*fds));
+	if (!results || !running || !fds) {
+		free(results), free(running), free(fds);
+		return false;
+	}
+
+	// Selected tests start out as not run, so index marks which ones they are
+	for (size_t i = 0; i < list_len; i++) {
+		results[i].index = test_selected(test_list + i, opts) ? (int)i : -1;
+	}
+
+	// Workers inherit the stdio buffers, so flush them first
+	fflush(out);
+	fflush(stdout);
+	fflush(stderr);
+
+	size_t next = 0;
+	size_t nrunning = 0;
+	for (;;) {
+		// Start jobs until every slot is busy
+		while (nrunning < njobs && next < list_len) {
+			test_job_t job = { .first = next };
+			if (opts->by_group) {
+				while (next < list_len && (test_list[next].pfn || test_list[next].name)) next++;
+			} else {
+				next++;
+			}
+			job.last = next;
+
+			// Skips over the padding, and groups with nothing selected
+			bool any = false;
+			for (size_t i = job.first; i < job.last; i++) {
+				any |= test_selected(test_list + i, opts);
+			}
+			if (opts->by_group && next < list_len) next++;
+			if (!any) continue;
+
+			if (!test_job_start(setup_test, test_list, &job, opts)) break;
+			running[nrunning++] = job;
+		}
+		if (!nrunning) break;
+
+		for (size_t i = 0; i < nrunning; i++) {
+			fds[i] = (struct pollfd){ .fd = running[i].fd, .events = POLLIN };
+		}
+		if (poll(fds, (nfds_t)nrunning, -1) < 0 && errno != EINTR) break;
+
+		for (size_t i = nrunning; i-- > 0;) {
+			if (!fds[i].revents) continue;
+			if (!test_job_read(running + i, results)) running[i] = running[--nrunning];
+		}
+	}
+
+	int passed = 0, tests = 0;
+	for (size_t i = 0; i < list_len; i++) {
+		if (!test_list[i].name && !test_list[i].pfn) {
+			if (!opts->filter) fprintf(out, "\n");
+			continue;
+		}
+		if (results[i].index != i) continue;
+
+		tests++;
+		fprintf(out, "%-48s ", test_list[i].name);
+		switch (results[i].status) {
+		case TEST_STATUS_PASS:
+			fprintf(out, " " COLOR("42;1") "PASS" COLOR("0") "\n");
+			passed++;
+			break;
+		case TEST_STATUS_FAIL:
+			fprintf(out, COLOR("41;1") "<FAIL");
+			if (results[i].file) {
+				fprintf(out, " AT %s:%d", results[i].file, results[i].line);
+			}
+			fprintf(out, ">" COLOR("0") "\n");
+			break;
+		case TEST_STATUS_SETUP_FAIL:
+			fprintf(out, COLOR("41;1") "<SETUP FAIL>" COLOR("0") "\n");
+			break;
+		case TEST_STATUS_CRASH:
+			if (results[i].line < 0) {
+				fprintf(out, COLOR("41;1") "<CRASH, EXITED>" COLOR("0") "\n");
+			} else {
+				fprintf(out, COLOR("41;1") "<CRASH, SIGNAL %d>" COLOR("0") "\n",
+					results[i].line);
+			}
+			break;
+		case TEST_STATUS_TIMEOUT:
+			fprintf(out, COLOR("41;1") "<TIMEOUT>" COLOR("0") "\n");
+			break;
+		default:
+			fprintf(out, COLOR("43;1") "<NOT RUN>" COLOR("0") "\n");
+			break;
+		}
+	}
+
+	fprintf(out, "\n%d/%d tests passing (%d%%)\n", passed, tests,
+		tests ? (100 * passed) / tests : 100);
+
+	free(results), free(running), free(fds);
+	return passed == tests;
+}
+#endif
+
+static double bench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+static double bench_time(bench_fn *fn, size_t iters) {
+	const double start = bench_now_ns();
+	fn(iters);
+	return bench_now_ns() - start;
+}
+static int bench_cmp(const void *a, const void *b) {
+	const double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+bench_result_t bench_run(bench_fn *fn) {
+	bench_result_t res = { .iters = 1 };
+	double samples[BENCH_SAMPLES], total = 0.0;
+
+	// Grow the iterations until a run is long enough to time well, then
+	// scale them to fill a sample. This also warms up the caches.
+	double ns = bench_time(fn, res.iters);
+	while (ns < BENCH_SAMPLE_NS / 16 && res.iters < SIZE_MAX / 16) {
+		res.iters *= ns < BENCH_SAMPLE_NS / 1024 ? 16 : 2;
+		ns = bench_time(fn, res.iters);
+	}
+	if (ns < BENCH_SAMPLE_NS) {
+		res.iters = res.iters * (BENCH_SAMPLE_NS / (ns > 1.0 ? ns : 1.0));
+	}
+
+	for (int i = 0; i < BENCH_SAMPLES; i++) {
+		ns = bench_time(fn, res.iters);
+		total += ns;
+		samples[i] = ns / res.iters;
+	}
+	qsort(samples, BENCH_SAMPLES, sizeof(*samples), bench_cmp);
+
+	// Nearest rank percentiles
+	res.ns_per_op = total / ((double)res.iters * BENCH_SAMPLES);
+	res.ops_per_sec = 1e9 / res.ns_per_op;
+	res.min = samples[0];
+	res.p50 = samples[(BENCH_SAMPLES * 50 + 99) / 100 - 1];
+	res.p90 = samples[(BENCH_SAMPLES * 90 + 99) / 100 - 1];
+	res.p99 = samples[(BENCH_SAMPLES * 99 + 99) / 100 - 1];
+	return res;
+}
+
+void benches_run_foreach(const bench_t *bench_list, size_t list_len,
+		const char *filter, bench_format_t format, FILE *out) {
+	if (format == BENCH_FORMAT_TEXT) {
+		fprintf(out, "%-40s %12s %14s %12s %12s %12s\n", "benchmark", "ns/op",
+			"ops/sec", "p50", "p90", "p99");
+	}
+
+	for (size_t i = 0; i < list_len; i++) {
+		const bench_t *const bench = bench_list + i;
+		if (!bench->name && !bench->pfn) {
+			if (format == BENCH_FORMAT_TEXT && !filter) fprintf(out, "\n");
+			continue;
+		}
+		if (filter && !strstr(bench->name, filter)) continue;
+
+		const bench_result_t res = bench_run(bench->pfn);
+		if (format == BENCH_FORMAT_JSON) {
+			fprintf(out, "{\"name\":\"%s\",\"iters\":%zu,\"samples\":%d,"
+				"\"ns_per_op\":%.3f,\"ops_per_sec\":%.1f,\"min\":%.3f,"
+				"\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f}\n",
+				bench->name, res.iters, BENCH_SAMPLES, res.ns_per_op,
+				res.ops_per_sec, res.min, res.p50, res.p90, res.p99);
+		} else {
+			fprintf(out, "%-40s %12.2f %14.0f %12.2f %12.2f %12.2f\n", bench->name,
+				res.ns_per_op, res.ops_per_sec, res.p50, res.p90, res.p99);
+		}
+		fflush(out);
+	}
+}
+#endif
+
+//
+// EK_USE_HASH
+//
+#if EK_USE_HASH
+
+static uint64_t load_u64_unaligned(const uint8_t *data) {
+	return (uint64_t)data[0]	<< 8 * 7
+		| (uint64_t)data[1]	<< 8 * 6
+		| (uint64_t)data[2] 	<< 8 * 5
+		| (uint64_t)data[3] 	<< 8 * 4
+		| (uint64_t)data[4] 	<< 8 * 3
+		| (uint64_t)data[5] 	<< 8 * 2
+		| (uint64_t)data[6] 	<< 8 * 1
+		| (uint64_t)data[7];
+}
+
+void swapmem(void *const restrict _a, void *const restrict _b, size_t len) {
+	uint8_t *restrict a = _a, *restrict b = _b;
+
+	while (len--) {
+		const uint8_t t = *a;
+		*a++ = *b;
+		*b++ = t;
+	}
+}
+
+uint64_t xxhash64_single_lane(const uint8_t *data, size_t len) {
+	static const uint64_t p1 = 0x9e3779b185ebca87ull;
+	static const uint64_t p2 = 0xc2b2ae3d27d4eb4full;
+	static const uint64_t p3 = 0x165667b19e3779f9ull;
+	static const uint64_t p4 = 0x85ebca77c2b2ae63ull;
+	static const uint64_t p5 = 0x27d4eb2f165667c5ull;
+
+	uint64_t acc = p5 + len + 1;
+	while (len >= 8) {
+		acc ^= load_u64_unaligned(data);
+		acc = rotl(acc, 27) * p1;
+		acc += p4;
+
+		data += 8, len -= 8;
+	}
+	while (len--) {
+		acc ^= *data++ * p5;
+		acc = rotl(acc, 11) * p1;
+	}
+
+	acc ^= acc >> 33;
+	acc *= p2;
+	acc ^= acc >> 29;
+	acc *= p3;
+	acc ^= acc >> 32;
+
+	return acc;
+}
+
+#define HSET_ENTRY_PSL_BITS 15
+#define HSET_ENTRY_HASH_BITS 48
+
+// The all ones psl marks the end of the entries, so psls saturate one below it
+#define HSET_PSL_END ((1u << HSET_ENTRY_PSL_BITS) - 1)
+#define HSET_PSL_MAX (HSET_PSL_END - 1)
+#define HSET_HASH_MASK ((1ull << HSET_ENTRY_HASH_BITS) - 1)
+
+typedef struct hset_entry_t {
+	uint64_t used	: 1;
+	uint64_t psl	: HSET_ENTRY_PSL_BITS;
+	uint64_t hash	: HSET_ENTRY_HASH_BITS;
+	uint64_t data[];
+} hset_entry_t;
+
+typedef struct hset {
+	mem_alloc_t alloc;
+
+	// Size of key value pair
+	uint32_t kvsize, entsize;
+
+	// Number of entries and capacity
+	uint32_t nents, capacity;
+
+	// Times the set grew
+	uint32_t grows;
+
+#if EK_HSET_COUNTERS
+	uint64_t hits, misses, probes;
+#endif
+
+	hset_hash_fn *hash;
+
+	hset_eq_fn *eq;
+
+	hset_entry_t kv[];
+} hset_t;
+
+#define hset_from_data(_data) (hset_t *)((uintptr_t)_data \
+				- offsetof(hset_entry_t, data) \
+				- offsetof(hset_t, kv))
+
+void *hset_init(mem_alloc_t alloc,
+		uint32_t capacity, uint32_t kvsize,
+		hset_hash_fn *hash, hset_eq_fn *eq) {
+	const size_t entsize = align_up(kvsize + sizeof(hset_entry_t),
+				sizeof(hset_entry_t));
+	hset_t *set = mem_alloc(alloc, NULL, sizeof(hset_t) + entsize * (capacity + 1));
+	if (!set) return NULL;
+	memset(set->kv, 0, entsize * capacity);
+	set->alloc = alloc;
+
+	set->nents = 0;
+	set->capacity = capacity;
+	set->grows = 0;
+#if EK_HSET_COUNTERS
+	set->hits = set->misses = set->probes = 0;
+#endif
+
+	set->kvsize = kvsize;
+	set->entsize = entsize / sizeof(hset_entry_t);
+
+	set->hash = hash;
+	set->eq = eq;
+
+	set->kv[set->entsize * set->capacity] = (hset_entry_t){
+		.used = true,
+		.psl = HSET_PSL_END,
+	};
+
+	return set->kv->data;
+}
+void *hset_deinit(void *_set) {
+	hset_t *set = hset_from_data(_set);
+	return mem_alloc(set->alloc, set, 0);
+}
+hset_t *hset_grow(hset_t *set) {
+	void *newset = hset_init(set->alloc,
+				set->capacity ? set->capacity * 2 : 4, set->kvsize,
+				set->hash, set->eq);
+	if (!newset) return NULL;
+	
+	for (void *iter = hset_next(set->kv->data, NULL); iter;
+		iter = hset_next(set->kv->data, iter)) {
+		// No need to set newset to insert's newset, no growth should happen
+		hset_insert(newset, iter);
+	}
+
+	hset_t *const grown = hset_from_data(newset);
+	grown->grows = set->grows + 1;
+#if EK_HSET_COUNTERS
+	grown->hits = set->hits;
+	grown->misses = set->misses;
+	grown->probes = set->probes;
+#endif
+
+	hset_deinit(set->kv->data);
+	return grown;
+}
+void *hset_insert(void *_set, const void *kv) {
+	hset_t *set = hset_from_data(_set);
+
+	// Grow the hash set
+	if ((uint64_t)set->nents * 100 >= (uint64_t)set->capacity * HSET_MAX_LOAD) {
+		hset_t *const grown = hset_grow(set);
+		if (!grown) return NULL;
+		set = grown;
+	}
+
+	// Get the new entry, entry and keyvalue pair iterators. Only the stored
+	// bits of the hash pick the bucket so hset_get and hset_grow agree on it
+	const uint64_t hash = set->hash(kv) & HSET_HASH_MASK;
+
+	hset_entry_t *tmp = set->kv + set->entsize * set->capacity;
+	*tmp = (hset_entry_t){
+		.used = true,
+		.psl = 0,
+		.hash = hash,
+	};
+	memcpy(tmp->data, kv, set->kvsize);
+	hset_entry_t *iter = set->kv + set->entsize * (hash % set->capacity);
+	bool swapped = false;
+
+	while (iter->used) {
+		// Once the new kv has been placed, the key can't be further along
+		if (!swapped && tmp->hash == iter->hash && set->eq(iter->data, kv)) {
+			memcpy(iter->data, kv, set->kvsize);
+			goto ret;
+		}
+		if (tmp->psl > iter->psl) {
+			// Swap
+			swapmem(iter, tmp, set->entsize * sizeof(hset_entry_t));
+			swapped = true;
+		}
+
+		iter += set->entsize;
+		if (iter == tmp) iter = set->kv;
+		if (tmp->psl < HSET_PSL_MAX) tmp->psl++;
+	}
+
+	memcpy(iter, tmp, set->entsize * sizeof(hset_entry_t));
+	set->nents++;
+
+ret:
+	*tmp = (hset_entry_t){ .psl = HSET_PSL_END, .used = true };
+	return set->kv->data;
+}
+void hset_remove(void *_set, const void *kv) {
+	hset_t *set = hset_from_data(_set);
+
+	hset_entry_t *ent = (hset_entry_t *)kv - 1;
+	hset_entry_t *const end = set->kv + set->entsize * set->capacity;
+
+	// Shift the following entries back instead of leaving a hole, so
+	// lookups that probe past this entry still find theirs
+	for (;;) {
+		hset_entry_t *next = ent + set->entsize;
+		if (next == end) next = set->kv;
+		if (!next->used || next->psl == 0) break;
+
+		memcpy(ent, next, set->entsize * sizeof(hset_entry_t));
+		// Saturated psls are only a lower bound, so they stay saturated
+		if (ent->psl < HSET_PSL_MAX) ent->psl--;
+		ent = next;
+	}
+
+	ent->used = false;
+	ent->psl = 0;
+	ent->hash = 0;
+	set->nents--;
+}
+void *hset_get(void *_set, const void *key) {
+	hset_t *set = hset_from_data(_set);
+
+	const uint64_t hash = set->hash(key) & HSET_HASH_MASK;
+	hset_entry_t *iter = set->kv + set->entsize * (hash % set->capacity);
+	hset_entry_t *const end = set->kv + set->entsize * set->capacity;
+	unsigned psl = 0;
+
+	while (iter->used) {
+		if (psl > iter->psl) break;
+#if EK_HSET_COUNTERS
+		set->probes++;
+#endif
+		if (hash == iter->hash && set->eq(iter->data, key)) {
+#if EK_HSET_COUNTERS
+			set->hits++;
+#endif
+			return iter->data;
+		}
+
+		iter += set->entsize;
+		if (iter == end) iter = set->kv;
+		if (psl < HSET_PSL_MAX) psl++;
+	}
+
+#if EK_HSET_COUNTERS
+	set->misses++;
+#endif
+	return NULL;
+}
+void *hset_next(void *_set, void *iter) {
+	hset_t *set = hset_from_data(_set);
+
+	hset_entry_t *ent = iter ? (hset_entry_t *)iter - 1 + set->entsize : set->kv;
+	while (!ent->used) ent += set->entsize;
+
+	if (ent->psl == HSET_PSL_END) return NULL;
+	else return ent->data;
+}
+hset_stats_t hset_stats(void *_set) {
+	hset_t *set = hset_from_data(_set);
+	hset_stats_t stats = {
+		.nents = set->nents,
+		.capacity = set->capacity,
+		.load = set->capacity ? (double)set->nents / set->capacity : 0.0,
+		.grows = set->grows,
+		.bytes = sizeof(hset_t) + (size_t)set->entsize
+			* sizeof(hset_entry_t) * (set->capacity + 1),
+#if EK_HSET_COUNTERS
+		.hits = set->hits,
+		.misses = set->misses,
+		.probes = set->probes,
+#endif
+	};
+	uint64_t total = 0;
+
+	for (void *iter = hset_next(_set, NULL); iter; iter = hset_next(_set, iter)) {
+		const hset_entry_t *ent = (hset_entry_t *)iter - 1;
+		const uint32_t psl = ent->psl;
+
+		total += psl;
+		if (psl > stats.max_psl) stats.max_psl = psl;
+		if (psl == HSET_PSL_MAX) stats.saturated++;
+		stats.psl_hist[psl < HSET_STATS_PSL_BUCKETS ? psl
+				: HSET_STATS_PSL_BUCKETS - 1]++;
+	}
+	if (set->nents) stats.avg_psl = (double)total / set->nents;
+
+	return stats;
+}
+void hset_stats_reset(void *_set) {
+#if EK_HSET_COUNTERS
+	hset_t *set = hset_from_data(_set);
+	set->hits = set->misses = set->probes = 0;
+#else
+	(void)_set;
+#endif
+}
+
+#define CMAP_PSL_MAX UINT16_MAX
+#define CMAP_HASH_MASK (-1ull >> 1)
+#define CMAP_MIN_SLOTS 8
+
+typedef struct cmap_entry {
+	uint64_t deleted	: 1;
+	uint64_t hash		: 63;
+	uint64_t data[];
+} cmap_entry_t;
+
+// idx is the entry index + 1, 0 for an empty slot. tag is the top of the hash
+// so most mismatches are caught without touching the entries
+typedef struct cmap_slot {
+	uint32_t idx;
+	uint16_t psl;
+	uint16_t tag;
+} cmap_slot_t;
+
+typedef struct cmap {
+	mem_alloc_t alloc;
+
+	// Size of key value pair, size of an entry in cmap_entry_t units
+	uint32_t kvsize, entsize;
+
+	// Live entries, entries used including removed ones and room for entries
+	uint32_t nents, nused, ecap;
+
+	// Number of slots, always a power of two
+	uint32_t nslots;
+
+	hset_hash_fn *hash;
+
+	hset_eq_fn *eq;
+
+	cmap_slot_t *slots;
+
+	cmap_entry_t kv[];
+} cmap_t;
+
+#define cmap_from_data(_data) (cmap_t *)((uintptr_t)_data \
+				- offsetof(cmap_entry_t, data) \
+				- offsetof(cmap_t, kv))
+#define cmap_entry(map, i) ((map)->kv + (size_t)(map)->entsize * (i))
+#define cmap_tag(hash) ((uint16_t)((hash) >> 47))
+
+#define cmap_size(entsize, ecap) (sizeof(cmap_t) \
+				+ (size_t)(ecap) * (entsize) * sizeof(cmap_entry_t))
+#define cmap_ecap(nslots) ((uint32_t)((uint64_t)(nslots) * HSET_MAX_LOAD / 100))
+
+static cmap_slot_t *cmap_alloc_slots(mem_alloc_t alloc, uint32_t nslots) {
+	cmap_slot_t *const slots = mem_alloc(alloc, NULL, nslots * sizeof(cmap_slot_t));
+	if (slots) memset(slots, 0, nslots * sizeof(cmap_slot_t));
+	return slots;
+}
+
+// The entries live behind the header like a vec, the slots get their own
+// allocation so they can be replaced without touching the entries
+static cmap_t *cmap_alloc(mem_alloc_t alloc, uint32_t nslots, uint32_t kvsize,
+		hset_hash_fn *hash, hset_eq_fn *eq) {
+	const uint32_t entsize = align_up(kvsize + sizeof(cmap_entry_t),
+				sizeof(cmap_entry_t)) / sizeof(cmap_entry_t);
+	const uint32_t ecap = cmap_ecap(nslots);
+
+	cmap_t *map = mem_alloc(alloc, NULL, cmap_size(entsize, ecap));
+	if (!map) return NULL;
+	if (!(map->slots = cmap_alloc_slots(alloc, nslots))) {
+		mem_alloc(alloc, map, 0);
+		return NULL;
+	}
+
+	map->alloc = alloc;
+	map->kvsize = kvsize;
+	map->entsize = entsize;
+	map->nents = map->nused = 0;
+	map->ecap = ecap;
+	map->nslots = nslots;
+	map->hash = hash;
+	map->eq = eq;
+
+	return map;
+}
+
+// Puts an index for a key that isn't in the table yet
+static void cmap_place(cmap_t *map, uint32_t idx, uint64_t hash) {
+	const uint32_t mask = map->nslots - 1;
+	cmap_slot_t tmp = { .idx = idx + 1, .psl = 0, .tag = cmap_tag(hash) };
+	uint32_t i = hash & mask;
+
+	while (map->slots[i].idx) {
+		if (tmp.psl > map->slots[i].psl) {
+			const cmap_slot_t swap = map->slots[i];
+			map->slots[i] = tmp;
+			tmp = swap;
+		}
+		i = (i + 1) & mask;
+		if (tmp.psl < CMAP_PSL_MAX) tmp.psl++;
+	}
+	map->slots[i] = tmp;
+}
+
+static cmap_slot_t *cmap_find(cmap_t *map, const void *key, uint64_t hash) {
+	const uint32_t mask = map->nslots - 1;
+	const uint16_t tag = cmap_tag(hash);
+	uint32_t i = hash & mask;
+	unsigned psl = 0;
+
+	while (map->slots[i].idx) {
+		cmap_slot_t *const slot = map->slots + i;
+		if (psl > slot->psl) break;
+		if (slot->tag == tag) {
+			const cmap_entry_t *ent = cmap_entry(map, slot->idx - 1);
+			if (ent->hash == hash && map->eq(ent->data, key)) return slot;
+		}
+
+		i = (i + 1) & mask;
+		if (psl < CMAP_PSL_MAX) psl++;
+	}
+
+	return NULL;
+}
+
+// Grows the entries in place when nslots changes, drops the holes and refills
+// the slots from the stored hashes. The map is left as is when out of memory
+static cmap_t *cmap_rebuild(cmap_t *map, uint32_t nslots) {
+	if (nslots != map->nslots) {
+		cmap_slot_t *const slots = cmap_alloc_slots(map->alloc, nslots);
+		if (!slots) return NULL;
+		cmap_t *const grown = mem_alloc(map->alloc, map,
+						cmap_size(map->entsize, cmap_ecap(nslots)));
+		if (!grown) {
+			mem_alloc(map->alloc, slots, 0);
+			return NULL;
+		}
+		map = grown;
+		mem_alloc(map->alloc, map->slots, 0);
+		map->slots = slots;
+		map->nslots = nslots;
+		map->ecap = cmap_ecap(nslots);
+	} else {
+		memset(map->slots, 0, nslots * sizeof(cmap_slot_t));
+	}
+
+	const size_t entbytes = map->entsize * sizeof(cmap_entry_t);
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < map->nused; i++) {
+		cmap_entry_t *const ent = cmap_entry(map, i);
+		if (ent->deleted) continue;
+
+		if (n != i) memcpy(cmap_entry(map, n), ent, entbytes);
+		cmap_place(map, n, cmap_entry(map, n)->hash);
+		n++;
+	}
+	map->nents = map->nused = n;
+
+	return map;
+}
+
+void *cmap_init(mem_alloc_t alloc,
+		uint32_t capacity, uint32_t kvsize,
+		hset_hash_fn *hash, hset_eq_fn *eq) {
+	uint32_t nslots = CMAP_MIN_SLOTS;
+	while ((uint64_t)nslots * HSET_MAX_LOAD / 100 < capacity) nslots *= 2;
+
+	cmap_t *map = cmap_alloc(alloc, nslots, kvsize, hash, eq);
+	if (!map) return NULL;
+	return map->kv->data;
+}
+void *cmap_deinit(void *_map) {
+	cmap_t *map = cmap_from_data(_map);
+	mem_alloc(map->alloc, map->slots, 0);
+	return mem_alloc(map->alloc, map, 0);
+}
+void *cmap_insert(void *_map, const void *kv) {
+	cmap_t *map = cmap_from_data(_map);
+	const uint64_t hash = map->hash(kv) & CMAP_HASH_MASK;
+
+	cmap_slot_t *slot = cmap_find(map, kv, hash);
+	if (slot) {
+		memcpy(cmap_entry(map, slot->idx - 1)->data, kv, map->kvsize);
+		return map->kv->data;
+	}
+
+	if (map->nused == map->ecap) {
+		// Mostly holes, compacting is enough
+		const uint32_t nslots = map->nents < map->ecap / 2
+					? map->nslots : map->nslots * 2;
+		if (!(map = cmap_rebuild(map, nslots))) return NULL;
+	}
+
+	cmap_entry_t *const ent = cmap_entry(map, map->nused);
+	*ent = (cmap_entry_t){ .hash = hash };
+	memcpy(ent->data, kv, map->kvsize);
+	cmap_place(map, map->nused++, hash);
+	map->nents++;
+
+	return map->kv->data;
+}
+void cmap_remove(void *_map, const void *kv) {
+	cmap_t *map = cmap_from_data(_map);
+	const uint32_t mask = map->nslots - 1;
+
+	cmap_entry_t *const ent = (cmap_entry_t *)kv - 1;
+	const uint32_t idx = (ent - map->kv) / map->entsize;
+
+	uint32_t i = ent->hash & mask;
+	while (map->slots[i].idx != idx + 1) i = (i + 1) & mask;
+
+	// Shift the following slots back, like hset_remove
+	for (;;) {
+		const uint32_t next = (i + 1) & mask;
+		if (!map->slots[next].idx || map->slots[next].psl == 0) break;
+
+		map->slots[i] = map->slots[next];
+		if (map->slots[i].psl < CMAP_PSL_MAX) map->slots[i].psl--;
+		i = next;
+	}
+	map->slots[i] = (cmap_slot_t){ 0 };
+
+	ent->deleted = true;
+	map->nents--;
+
+	// Holes at the end can be reused right away
+	while (map->nused && cmap_entry(map, map->nused - 1)->deleted) map->nused--;
+}
+void *cmap_get(void *_map, const void *key) {
+	cmap_t *map = cmap_from_data(_map);
+	const uint64_t hash = map->hash(key) & CMAP_HASH_MASK;
+
+	const cmap_slot_t *slot = cmap_find(map, key, hash);
+	return slot ? cmap_entry(map, slot->idx - 1)->data : NULL;
+}
+void *cmap_next(void *_map, void *iter) {
+	cmap_t *map = cmap_from_data(_map);
+
+	cmap_entry_t *ent = iter ? (cmap_entry_t *)iter - 1 + map->entsize : map->kv;
+	cmap_entry_t *const end = cmap_entry(map, map->nused);
+	while (ent < end && ent->deleted) ent += map->entsize;
+
+	return ent < end ? ent->data : NULL;
+}
+uint32_t cmap_len(const void *_map) {
+	const cmap_t *map = cmap_from_data(_map);
+	return map->nents;
+}
+
+uint64_t str_hash(const char *str) {
+	return xxhash64_single_lane((const uint8_t *)str, strlen(str));
+}
+bool str_eq(const char *a, const char *b) {
+	return strcmp(a, b) == 0;
+}
+
+#if EK_USE_STRVIEW
+uint64_t strview_hash(const strview_t *sv) {
+	return xxhash64_single_lane((const uint8_t *)sv->str, sv->len);
+}
+#endif
+
+#endif
+
+//
+// Memory checks used by the arena and the pools
+//
+#if EK_USE_ARENA || EK_USE_POOL || EK_USE_PAGE
+
+#if defined(__SANITIZE_ADDRESS__)
+#	define EK_ASAN 1
+#elif defined(__has_feature)
+#	if __has_feature(address_sanitizer)
+#		define EK_ASAN 1
+#	endif
+#endif
+
+#ifdef EK_ASAN
+#	include <sanitizer/asan_interface.h>
+#	define mem_poison(ptr, size) ASAN_POISON_MEMORY_REGION(ptr, size)
+#	define mem_unpoison(ptr, size) ASAN_UNPOISON_MEMORY_REGION(ptr, size)
+#else
+#	define mem_poison(ptr, size) ((void)(ptr), (void)(size))
+#	define mem_unpoison(ptr, size) ((void)(ptr), (void)(size))
+#endif
+
+#if EK_MEM_CHECKS
+#	define MEM_CHUNK_LIVE 0x4c4956454c495645ull
+#	define MEM_CHUNK_FREE 0x4652454546524545ull
+#	define MEM_CANARY 0xca7ca7ca7ca7ca7cull
+#	define MEM_POISON 0xdd
+#	define MEM_TAIL sizeof(uint64_t)
+#	define MEM_STATE(chunk) (&(chunk)->state)
+
+mem_check_fail_fn *mem_check_fail;
+
+static void mem_check_failed(const char *msg, const void *ptr) {
+	if (mem_check_fail) {
+		mem_check_fail(msg, ptr);
+		return;
+	}
+	fprintf(stderr, "ek.h: %s (%p)\n", msg, ptr);
+	abort();
+}
+#else
+#	define MEM_TAIL 0
+#	define MEM_STATE(chunk) NULL
+#endif
+
+// Returns false if the chunk can't be freed
+static inline bool mem_chunk_is_live(const uint64_t *state, const void *ptr) {
+#if EK_MEM_CHECKS
+	if (*state == MEM_CHUNK_LIVE) return true;
+	mem_check_failed(*state == MEM_CHUNK_FREE ? "double free"
+		: "freeing a pointer that was never allocated", ptr);
+	return false;
+#else
+	return true;
+#endif
+}
+static inline void mem_chunk_on_alloc(uint64_t *state, uint8_t *data, size_t size,
+				bool recycled) {
+	mem_unpoison(data, size + MEM_TAIL);
+#if EK_MEM_CHECKS
+	if (recycled) {
+		if (*state != MEM_CHUNK_FREE) {
+			mem_check_failed("free list is corrupted", data);
+		}
+		for (size_t i = 0; i < size; i++) {
+			if (data[i] == MEM_POISON) continue;
+			mem_check_failed("chunk was written to after being freed", data);
+			break;
+		}
+	}
+	*state = MEM_CHUNK_LIVE;
+	memcpy(data + size, &(uint64_t){ MEM_CANARY }, MEM_TAIL);
+#endif
+}
+static inline void mem_chunk_on_free(uint64_t *state, uint8_t *data, size_t size) {
+#if EK_MEM_CHECKS
+	uint64_t canary;
+	memcpy(&canary, data + size, MEM_TAIL);
+	if (canary != MEM_CANARY) {
+		mem_check_failed("chunk was written past its end", data);
+	}
+	*state = MEM_CHUNK_FREE;
+	memset(data, MEM_POISON, size);
+#endif
+	mem_poison(data, size);
+}
+
+#endif
+
+//
+// EK_USE_PAGE
+//
+#if EK_USE_PAGE
+
+#if defined(__unix__)
+static size_t page_size(void) {
+	static size_t size;
+	if (!size) size = sysconf(_SC_PAGESIZE);
+	return size;
+}
+static void page_bind_node(void *pages, size_t size, int numa_node) {
+#if defined(__linux__) && defined(SYS_mbind)
+	// Same as MPOL_BIND from numaif.h, without needing libnuma
+	const int mpol_bind = 2;
+	unsigned long nodemask;
+
+	if (numa_node < 0 || numa_node >= sizeof(nodemask) * CHAR_BIT) return;
+	nodemask = 1ul << numa_node;
+
+	// Failing here just leaves the memory wherever the kernel wants it
+	syscall(SYS_mbind, pages, size, mpol_bind, &nodemask,
+		sizeof(nodemask) * CHAR_BIT, 0);
+#endif
+}
+static void *page_map_huge(size_t size) {
+	void *pages;
+
+#if defined(MAP_HUGETLB)
+	pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (pages != MAP_FAILED) return pages;
+#endif
+
+	// No reserved huge pages, so map extra to align the pages to a huge
+	// page boundary and hint for transparent huge pages instead
+	uint8_t *raw = mmap(NULL, size + PAGE_HUGE_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == MAP_FAILED) return NULL;
+
+	uint8_t *aligned = (uint8_t *)align_up((uintptr_t)raw, PAGE_HUGE_SIZE);
+	if (aligned != raw) munmap(raw, aligned - raw);
+	if (aligned + size != raw + size + PAGE_HUGE_SIZE) {
+		munmap(aligned + size, raw + PAGE_HUGE_SIZE - aligned);
+	}
+
+#if defined(MADV_HUGEPAGE)
+	madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
+}
+void *page_map(size_t *size, page_flags_t flags, int numa_node) {
+	void *pages;
+
+	if (flags & PAGE_HUGE) {
+		*size = align_up(*size, PAGE_HUGE_SIZE);
+		pages = page_map_huge(*size);
+	} else {
+		*size = align_up(*size, page_size());
+		pages = mmap(NULL, *size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pages == MAP_FAILED) pages = NULL;
+	}
+
+	if (!pages) return NULL;
+	if (flags & PAGE_NUMA) page_bind_node(pages, *size, numa_node);
+
+	// The address range could have been poisoned by whatever used it last
+	mem_unpoison(pages, *size);
+	return pages;
+}
+void page_unmap(void *pages, size_t size) {
+	if (pages) munmap(pages, size);
+}
+#else
+void *page_map(size_t *size, page_flags_t flags, int numa_node) {
+	void *pages = mem_alloc(mem_stdlib_alloc(), NULL, *size);
+	if (pages) memset(pages, 0, *size);
+	return pages;
+}
+void page_unmap(void *pages, size_t size) {
+	if (pages) mem_alloc(mem_stdlib_alloc(), pages, 0);
+}
+#endif
+
+// Every allocation remembers how big its mapping is right before the
+// returned pointer. Kept at 64 bytes so blocks stay cache line aligned.
+#define PAGE_ALLOC_HEADER 64
+
+static void *page_alloc_realloc(void *usr, void *blk, size_t newsize) {
+	const page_alloc_t *self = usr;
+	uint8_t *pages = blk ? (uint8_t *)blk - PAGE_ALLOC_HEADER : NULL;
+	size_t oldsize = pages ? *(size_t *)pages : 0;
+
+	if (!newsize) {
+		page_unmap(pages, oldsize);
+		return NULL;
+	}
+	if (pages && newsize <= oldsize - PAGE_ALLOC_HEADER) return blk;
+
+	size_t mapsize = newsize + PAGE_ALLOC_HEADER;
+	uint8_t *newpages = page_map(&mapsize, self->flags, self->numa_node);
+	if (!newpages) return NULL;
+	*(size_t *)newpages = mapsize;
+
+	if (pages) {
+		memcpy(newpages + PAGE_ALLOC_HEADER, blk, oldsize - PAGE_ALLOC_HEADER);
+		page_unmap(pages, oldsize);
+	}
+	return newpages + PAGE_ALLOC_HEADER;
+}
+mem_alloc_t page_alloc_init(page_alloc_t *self, page_flags_t flags, int numa_node) {
+	*self = (page_alloc_t){
+		.alloc_fn = page_alloc_realloc,
+		.flags = flags,
+		.numa_node = numa_node,
+	};
+	return &self->alloc_fn;
+}
+
+#endif
+
+#if EK_USE_ARENA
+
+typedef struct fixed_arena {
+	mem_alloc_fn *alloc_fn;
+	uint8_t *ptr;
+#if EK_MEM_CHECKS
+	uint8_t *end;
+#endif
+	uint8_t data[];
+} fixed_arena_t;
+
+// Allocations made through the allocation interface remember their size
+// right before the block, so that they can be reallocated
+#define FIXED_ARENA_HEADER sizeof(size_t)
+
+static void *fixed_arena_realloc(void *buf, void *blk, size_t newsize) {
+	fixed_arena_t *arena = buf;
+	size_t *header = blk ? (size_t *)blk - 1 : NULL;
+
+	if (!newsize) {
+		// Only the last allocation can actually be given back
+		if ((uint8_t *)header == arena->ptr) {
+			fixed_arena_reset_to(buf, (uint8_t *)blk + *header);
+		}
+		return NULL;
+	}
+	if (header && newsize <= *header) return blk;
+
+	if ((uint8_t *)header == arena->ptr) {
+		// Last allocation, so give its space back and take a bigger block
+		// ending at the same spot. Bumping down means the start of the block
+		// still moves, but the old space is reused instead of wasted.
+		const size_t oldsize = *header;
+		uint8_t *top = (uint8_t *)blk + oldsize;
+		if (newsize > (size_t)(top - arena->data) - FIXED_ARENA_HEADER) return NULL;
+
+		uint8_t *newptr = (uint8_t *)align_dn((uintptr_t)top - newsize
+						- FIXED_ARENA_HEADER, 8);
+		// Rounding down can go past the start when data isn't 8 aligned
+		if (newptr < arena->data) return NULL;
+		mem_unpoison(newptr, top - newptr);
+		memmove(newptr + FIXED_ARENA_HEADER, blk, oldsize);
+		arena->ptr = newptr;
+		*(size_t *)newptr = newsize;
+		return newptr + FIXED_ARENA_HEADER;
+	}
+
+	size_t allocsize;
+	if (__builtin_add_overflow(newsize, FIXED_ARENA_HEADER, &allocsize)) return NULL;
+	size_t *newheader = fixed_arena_alloc(buf, allocsize);
+	if (!newheader) return NULL;
+	*newheader = newsize;
+	if (header) memcpy(newheader + 1, blk, *header);
+	return newheader + 1;
+}
+bool fixed_arena_init(void *buf, size_t bufsize) {
+	fixed_arena_t *arena = buf;
+	if (bufsize < sizeof(*arena)) return false;
+	arena->alloc_fn = fixed_arena_realloc;
+	arena->ptr = arena->data + bufsize - sizeof(*arena);
+#if EK_MEM_CHECKS
+	arena->end = arena->ptr;
+#endif
+	mem_poison(arena->data, arena->ptr - arena->data);
+	return true;
+}
+void *fixed_arena_alloc(void *buf, size_t size) {
+	return fixed_arena_alloc_aligned(buf, size, 8);
+}
+void *fixed_arena_alloc_aligned(void *buf, size_t size, size_t align) {
+	fixed_arena_t *arena = buf;
+
+	// Check before subtracting so that a huge size can't wrap the pointer
+	if (size > (size_t)(arena->ptr - arena->data)) return NULL;
+	uint8_t *ptr = (uint8_t *)align_dn((uintptr_t)arena->ptr - size, align);
+	if (ptr < arena->data) return NULL;
+
+	arena->ptr = ptr;
+	mem_unpoison(ptr, size);
+	return ptr;
+}
+void *fixed_arena_alloc_array(void *buf, size_t count, size_t elemsz, size_t align) {
+	size_t size;
+	if (__builtin_mul_overflow(count, elemsz, &size)) return NULL;
+	return fixed_arena_alloc_aligned(buf, size, align);
+}
+void fixed_arena_reset_to(void *buf, void *to) {
+	fixed_arena_t *arena = buf;
+#if EK_MEM_CHECKS
+	if ((uint8_t *)to < arena->ptr || (uint8_t *)to > arena->end) {
+		mem_check_failed("arena reset to a pointer it never gave out", to);
+		return;
+	}
+#endif
+	mem_poison(arena->ptr, (uint8_t *)to - arena->ptr);
+	arena->ptr = to;
+}
+mem_alloc_t fixed_arena_alloc_fn(void *buf) {
+	return &((fixed_arena_t *)buf)->alloc_fn;
+}
+
+#endif
+
+#if EK_USE_POOL
+
+typedef struct dynpool_block dynpool_block_t;
+typedef struct dynpool_chunk {
+	union {
+		dynpool_block_t *parent;
+		struct dynpool_chunk *nextfree;
+	};
+#if EK_MEM_CHECKS
+	uint64_t state;
+#endif
+	uint8_t data[];
+} dynpool_chunk_t;
+
+// Bytes in a chunk that aren't handed out
+#define DYNPOOL_CHUNK_OVERHEAD (sizeof(dynpool_chunk_t) + MEM_TAIL)
+
+struct dynpool_block {
+	dynpool_block_t *next, *nextfree, *lastfree;
+	size_t nchunks, freeid, elemsz, nalloced;
+	dynpool_chunk_t *free;
+	uint8_t data[];
+};
+
+struct dynpool {
+	mem_alloc_fn *interface;
+	size_t elemsz;
+	mem_alloc_t alloc;
+	dynpool_block_t *head, *free;
+
+	// Number of chunks handed out and number of chunks in all blocks
+	size_t nalloced, capacity;
+	dynpool_block_t first;
+};
+
+static void push_free_block(dynpool_t *self, dynpool_block_t *blk) {
+	blk->lastfree = NULL;
+	blk->nextfree = self->free;
+	if (blk->nextfree) blk->nextfree->lastfree = blk;
+	self->free = blk;
+}
+static void remove_free_block(dynpool_t *self, dynpool_block_t *blk) {
+	if (blk->lastfree) blk->lastfree->nextfree = blk->nextfree;
+	else self->free = blk->nextfree;
+	if (blk->nextfree) blk->nextfree->lastfree = blk->lastfree;
+}
+static inline dynpool_chunk_t *dynpool_chunk_from(void *ptr) {
+	if (!ptr) return NULL;
+	return (dynpool_chunk_t *)((uintptr_t)ptr - offsetof(dynpool_chunk_t, data));
+}
+static inline void *dynpool_chunk_alloc(dynpool_block_t *blk, dynpool_chunk_t *chunk,
+					bool recycled) {
+	mem_chunk_on_alloc(MEM_STATE(chunk), chunk->data,
+			blk->elemsz - DYNPOOL_CHUNK_OVERHEAD, recycled);
+	chunk->parent = blk;
+	return chunk->data;
+}
+// Returns false if the chunk should not be put back on the free list
+static inline bool dynpool_chunk_release(dynpool_chunk_t *chunk) {
+	if (!mem_chunk_is_live(MEM_STATE(chunk), chunk->data)) return false;
+	mem_chunk_on_free(MEM_STATE(chunk), chunk->data,
+			chunk->parent->elemsz - DYNPOOL_CHUNK_OVERHEAD);
+	return true;
+}
+
+dynpool_t *dynpool_init(mem_alloc_t alloc, size_t initial_chunks, size_t elemsz) {
+	elemsz = align_up(elemsz, sizeof(dynpool_chunk_t)) + DYNPOOL_CHUNK_OVERHEAD;
+	dynpool_t *self = mem_alloc(alloc, NULL, sizeof(*self) + sizeof(dynpool_block_t)
+					+ initial_chunks * elemsz);
+	if (!self) return NULL;
+	*self = (struct dynpool){
+		.elemsz = elemsz,
+		.alloc = alloc,
+		.head = &self->first,
+		.free = initial_chunks ? &self->first : NULL,
+		.nalloced = 0,
+		.capacity = initial_chunks,
+		.first = (dynpool_block_t){
+			.elemsz = elemsz,
+			.nchunks = initial_chunks,
+			.next = NULL,
+			.nextfree = NULL,
+			.lastfree = NULL,
+			.free = NULL,
+			.freeid = 0,
+			.nalloced = 0,
+		},
+	};
+
+	return self;
+}
+void dynpool_deinit(dynpool_t *self) {
+	dynpool_block_t *blk = self->head;
+	while (blk) {
+		dynpool_block_t *next = blk->next;
+		if (blk != &self->first) mem_alloc(self->alloc, blk, 0);
+		blk = next;
+	}
+	mem_alloc(self->alloc, self, 0);
+}
+static dynpool_block_t *dynpool_grow(dynpool_t *self) {
+	// Each new block doubles the capacity of the pool, up to a cap so that
+	// a single huge block doesn't get pinned by one live chunk
+	size_t nchunks = self->capacity;
+	if (nchunks > DYNPOOL_MAX_BLOCK_CHUNKS) nchunks = DYNPOOL_MAX_BLOCK_CHUNKS;
+	if (!nchunks) nchunks = 1;
+
+	dynpool_block_t *blk = mem_alloc(self->alloc, NULL,
+			sizeof(*blk) + nchunks * self->elemsz);
+	if (!blk) return NULL;
+	*blk = (dynpool_block_t){
+		.elemsz = self->elemsz,
+		.nchunks = nchunks,
+		.next = self->head,
+		.nextfree = NULL,
+		.lastfree = NULL,
+		.free = NULL,
+		.freeid = 0,
+		.nalloced = 0,
+	};
+	self->head = blk;
+	self->capacity += nchunks;
+	push_free_block(self, blk);
+	return blk;
+}
+void *dynpool_alloc(dynpool_t *self) {
+	if (!self->free && !dynpool_grow(self)) return NULL;
+
+	dynpool_block_t *blk = self->free;
+	dynpool_chunk_t *chunk;
+	bool recycled = blk->freeid == blk->nchunks;
+	if (!recycled) {
+		chunk = (dynpool_chunk_t *)(blk->data + (blk->freeid++ * blk->elemsz));
+	} else {
+		chunk = blk->free;
+		blk->free = chunk->nextfree;
+	}
+	self->nalloced++;
+	if (++blk->nalloced == blk->nchunks) remove_free_block(self, blk);
+	return dynpool_chunk_alloc(blk, chunk, recycled);
+}
+size_t dynpool_alloc_n(dynpool_t *self, void **ptrs, size_t n) {
+	size_t i = 0;
+
+	while (i < n) {
+		if (!self->free && !dynpool_grow(self)) break;
+
+		// Take as many chunks as we can out of this block at once
+		dynpool_block_t *blk = self->free;
+		size_t take = blk->nchunks - blk->nalloced;
+		if (take > n - i) take = n - i;
+		blk->nalloced += take;
+		self->nalloced += take;
+		if (blk->nalloced == blk->nchunks) remove_free_block(self, blk);
+
+		while (take && blk->free) {
+			dynpool_chunk_t *chunk = blk->free;
+			blk->free = chunk->nextfree;
+			ptrs[i++] = dynpool_chunk_alloc(blk, chunk, true);
+			take--;
+		}
+
+		uint8_t *data = blk->data + blk->freeid * blk->elemsz;
+		blk->freeid += take;
+		while (take--) {
+			ptrs[i++] = dynpool_chunk_alloc(blk, (dynpool_chunk_t *)data, false);
+			data += blk->elemsz;
+		}
+	}
+
+	return i;
+}
+void dynpool_free_n(dynpool_t *self, void *const *ptrs, size_t n) {
+	size_t i = 0;
+
+	while (i < n) {
+		dynpool_chunk_t *chunk = dynpool_chunk_from(ptrs[i++]);
+		if (!chunk || !dynpool_chunk_release(chunk)) continue;
+
+		// Runs of chunks from the same block are spliced in all at once,
+		// which is the common case for chunks from dynpool_alloc_n
+		dynpool_block_t *blk = chunk->parent;
+		dynpool_chunk_t *head = blk->free;
+		size_t nrun = 0;
+		for (;;) {
+			chunk->nextfree = head;
+			head = chunk;
+			nrun++;
+			if (i == n || !(chunk = dynpool_chunk_from(ptrs[i]))) break;
+			if (chunk->parent != blk) break;
+			i++;
+			if (!dynpool_chunk_release(chunk)) break;
+		}
+
+		if (blk->nalloced == blk->nchunks) push_free_block(self, blk);
+		blk->free = head;
+		blk->nalloced -= nrun;
+		self->nalloced -= nrun;
+	}
+}
+void dynpool_free(dynpool_t *self, void *ptr) {
+	if (!ptr) {
+		return;
+	}
+	dynpool_chunk_t *chunk = dynpool_chunk_from(ptr);
+	if (!dynpool_chunk_release(chunk)) return;
+	dynpool_block_t *blk = chunk->parent;
+	if (blk->nalloced-- == blk->nchunks) push_free_block(self, blk);
+	self->nalloced--;
+
+	chunk->nextfree = blk->free;
+	blk->free = chunk;
+}
+bool dynpool_empty(const dynpool_t *self) {
+	return self->nalloced == 0;
+}
+void dynpool_fast_clear(dynpool_t *self) {
+	dynpool_block_t *blk = self->head;
+	self->free = NULL;
+	self->nalloced = 0;
+	while (blk) {
+		blk->nalloced = 0;
+		blk->free = NULL;
+		blk->freeid = 0;
+		if (blk->nchunks) push_free_block(self, blk);
+		blk = blk->next;
+	}
+}
+size_t dynpool_num_chunks(const dynpool_t *self) {
+	return self->nalloced;
+}
+size_t dynpool_trim(dynpool_t *self) {
+	size_t nfreed = 0;
+	dynpool_block_t **link = &self->head;
+
+	while (*link) {
+		dynpool_block_t *blk = *link;
+		if (blk == &self->first || blk->nalloced) {
+			link = &blk->next;
+			continue;
+		}
+
+		// Unused blocks are always on the free list
+		*link = blk->next;
+		remove_free_block(self, blk);
+		self->capacity -= blk->nchunks;
+		mem_alloc(self->alloc, blk, 0);
+		nfreed++;
+	}
+
+	return nfreed;
+}
+
+typedef struct fixedpool_chunk {
+	struct fixedpool_chunk *next;
+#if EK_MEM_CHECKS
+	uint64_t state;
+#endif
+} fixedpool_chunk_t;
+
+// Without checks, the free list pointer lives inside of the chunk's data and
+// there's no header at all
+#if EK_MEM_CHECKS
+#	define FIXEDPOOL_DATA_OFFSET sizeof(fixedpool_chunk_t)
+#	define FIXEDPOOL_CHUNK_OVERHEAD (sizeof(fixedpool_chunk_t) + MEM_TAIL)
+#else
+#	define FIXEDPOOL_DATA_OFFSET 0
+#	define FIXEDPOOL_CHUNK_OVERHEAD 0
+#endif
+
+typedef struct fixedpool {
+	size_t nchunks, freeid, elemsz;
 	fixedpool_chunk_t *free;
 	uint8_t data[];
 } fixedpool_t;
 
-void fixedpool_init(void *buf, size_t elemsz, size_t buflen) {
-	fixedpool_t *self = buf;
+static inline fixedpool_chunk_t *fixedpool_chunk_from(void *ptr) {
+	return (fixedpool_chunk_t *)((uint8_t *)ptr - FIXEDPOOL_DATA_OFFSET);
+}
+// The link of a free chunk is poisoned along with its data when it has no header
+static inline fixedpool_chunk_t *fixedpool_chunk_next(fixedpool_chunk_t *chunk) {
+	mem_unpoison(&chunk->next, sizeof(chunk->next));
+	fixedpool_chunk_t *next = chunk->next;
+	if (!FIXEDPOOL_DATA_OFFSET) mem_poison(&chunk->next, sizeof(chunk->next));
+	return next;
+}
+static inline void fixedpool_chunk_link(fixedpool_chunk_t *chunk, fixedpool_chunk_t *next) {
+	mem_unpoison(&chunk->next, sizeof(chunk->next));
+	chunk->next = next;
+	if (!FIXEDPOOL_DATA_OFFSET) mem_poison(&chunk->next, sizeof(chunk->next));
+}
+static inline void *fixedpool_chunk_alloc(const fixedpool_t *self,
+					fixedpool_chunk_t *chunk, bool recycled) {
+	uint8_t *data = (uint8_t *)chunk + FIXEDPOOL_DATA_OFFSET;
+	mem_chunk_on_alloc(MEM_STATE(chunk), data,
+			self->elemsz - FIXEDPOOL_CHUNK_OVERHEAD, recycled);
+	return data;
+}
+// Returns false if the chunk should not be put back on the free list
+static inline bool fixedpool_chunk_release(const fixedpool_t *self,
+					fixedpool_chunk_t *chunk) {
+	if (!mem_chunk_is_live(MEM_STATE(chunk), chunk)) return false;
+	mem_chunk_on_free(MEM_STATE(chunk), (uint8_t *)chunk + FIXEDPOOL_DATA_OFFSET,
+			self->elemsz - FIXEDPOOL_CHUNK_OVERHEAD);
+	return true;
+}
+
+void fixedpool_init(void *buf, size_t elemsz, size_t buflen) {
+	fixedpool_t *self = buf;
+
+	if (elemsz < sizeof(void *)) elemsz = sizeof(void *);
+	elemsz = align_up(elemsz, sizeof(void *)) + FIXEDPOOL_CHUNK_OVERHEAD;
+	self->nchunks = (buflen - sizeof(*self)) / elemsz;
+	self->free = NULL;
+	self->freeid = 0;
+	self->elemsz = elemsz;
+	mem_poison(self->data, self->nchunks * elemsz);
+}
+void fixedpool_fast_clear(void *buf) {
+	fixedpool_t *self = buf;
+
+	self->freeid = 0;
+	self->free = NULL;
+	mem_poison(self->data, self->nchunks * self->elemsz);
+}
+void *fixedpool_alloc(void *buf) {
+	fixedpool_t *self = buf;
+
+	if (self->freeid != self->nchunks) {
+		void *chunk = self->data + self->elemsz*(self->freeid++);
+		mem_unpoison(chunk, FIXEDPOOL_DATA_OFFSET);
+		return fixedpool_chunk_alloc(self, chunk, false);
+	}
+	if (!self->free) return NULL;
+	fixedpool_chunk_t *chunk = self->free;
+	self->free = fixedpool_chunk_next(chunk);
+	return fixedpool_chunk_alloc(self, chunk, true);
+}
+void fixedpool_free(void *buf, void *blk) {
+	fixedpool_t *self = buf;
+
+	if (!blk) return;
+	fixedpool_chunk_t *chunk = fixedpool_chunk_from(blk);
+	if (!fixedpool_chunk_release(self, chunk)) return;
+	fixedpool_chunk_link(chunk, self->free);
+	self->free = chunk;
+}
+bool fixedpool_empty(const void *buf) {
+	const fixedpool_t *self = buf;
+
+	if (self->freeid == 0) return 1;
+	size_t nfree = 0;
+	fixedpool_chunk_t *chunk = self->free;
+	while (chunk) {
+		nfree++;
+		chunk = fixedpool_chunk_next(chunk);
+	}
+	return nfree == self->freeid;
+}
+size_t fixedpool_alloc_n(void *buf, void **ptrs, size_t n) {
+	fixedpool_t *self = buf;
+	size_t i = 0;
+
+	while (i < n && self->free) {
+		fixedpool_chunk_t *chunk = self->free;
+		self->free = fixedpool_chunk_next(chunk);
+		ptrs[i++] = fixedpool_chunk_alloc(self, chunk, true);
+	}
+
+	size_t take = self->nchunks - self->freeid;
+	if (take > n - i) take = n - i;
+	uint8_t *data = self->data + self->elemsz * self->freeid;
+	self->freeid += take;
+	while (take--) {
+		mem_unpoison(data, FIXEDPOOL_DATA_OFFSET);
+		ptrs[i++] = fixedpool_chunk_alloc(self, (fixedpool_chunk_t *)data, false);
+		data += self->elemsz;
+	}
+
+	return i;
+}
+void fixedpool_free_n(void *buf, void *const *ptrs, size_t n) {
+	fixedpool_t *self = buf;
+
+	// Link the run together first and then splice it in once
+	fixedpool_chunk_t *head = self->free;
+	for (size_t i = n; i--;) {
+		if (!ptrs[i]) continue;
+		fixedpool_chunk_t *chunk = fixedpool_chunk_from(ptrs[i]);
+		if (!fixedpool_chunk_release(self, chunk)) continue;
+		fixedpool_chunk_link(chunk, head);
+		head = chunk;
+	}
+	self->free = head;
+}
+
+#endif
+
+//
+// EK_USE_PACKET
+//
+#if EK_USE_PACKET
+
+uint32_t packet_htonf(float in) {
+	uint8_t *bytes = (uint8_t*)&in;
+	return (uint32_t)bytes[0] << 24 |
+		(uint32_t)bytes[1] << 16 |
+		(uint32_t)bytes[2] << 8 |
+		(uint32_t)bytes[3];
+}
+float packet_ntohf(uint32_t in) {
+	uint8_t* bytes = (uint8_t*)&in;
+	uint32_t val = (uint32_t)bytes[0] << 24 |
+		(uint32_t)bytes[1] << 16 |
+		(uint32_t)bytes[2] << 8 |
+		(uint32_t)bytes[3];
+	float out;
+	memcpy(&out, &val, sizeof(out));
+	return out;
+}
+
+int packet_bytecount(int head) {
+	return (head / 8) + ((head % 8) ? 1 : 0);
+}
+void packet_write_bit(uint8_t *buf, int *bitlen, int value) {
+	if (value) buf[*bitlen / 8] |= (1 << (*bitlen % 8));
+	else buf[*bitlen / 8] &= ~(1 << (*bitlen % 8));
+	(*bitlen)++;
+}
+int packet_read_bit(const uint8_t *buf, int *bitlen) {
+	int value = buf[*bitlen / 8] & (1 << (*bitlen % 8));
+	(*bitlen)++;
+	return value ? 1 : 0;
+}
+void packet_write_bits(uint8_t *buf, int *bitlen, uint64_t value, int numbits) {
+	// A byte at a time, only touching the bits being written
+	while (numbits) {
+		const int off = *bitlen & 7;
+		const int n = numbits < 8 - off ? numbits : 8 - off;
+		const uint8_t mask = ((1u << n) - 1) << off;
+		uint8_t *byte = buf + (*bitlen >> 3);
+
+		*byte = (*byte & ~mask) | ((uint8_t)value << off & mask);
+		value >>= n;
+		numbits -= n;
+		*bitlen += n;
+	}
+}
+uint64_t packet_read_bits(const uint8_t *buf, int *bitlen, int numbits) {
+	uint64_t value = 0;
+	int nread = 0;
+	while (nread < numbits) {
+		const int off = *bitlen & 7;
+		const int n = numbits - nread < 8 - off ? numbits - nread : 8 - off;
+
+		value |= (uint64_t)(buf[*bitlen >> 3] >> off & ((1u << n) - 1)) << nread;
+		nread += n;
+		*bitlen += n;
+	}
+	return value;
+}
+void packet_write_u8(uint8_t *buf, int *bitlen, uint8_t value) {
+	if (!value) {
+		packet_write_bit(buf, bitlen, 0);
+	}
+	else if (!(value & ~0xf)) {
+		packet_write_bits(buf, bitlen, 1, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)value, 4);
+	}
+	else {
+		packet_write_bits(buf, bitlen, 3, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)value, 8);
+	}
+}
+void packet_write_u16(uint8_t *buf, int *bitlen, uint16_t value) {
+	if (!value) {
+		packet_write_bits(buf, bitlen, 0, 2);
+	}
+	else if (!(value & ~0x1f)) {
+		packet_write_bits(buf, bitlen, 1, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)value, 5);
+	}
+	else if (!(value & ~0xff)) {
+		packet_write_bits(buf, bitlen, 2, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)value, 8);
+	}
+	else {
+		packet_write_bits(buf, bitlen, 3, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)value, 16);
+	}
+}
+void packet_write_u32(uint8_t *buf, int *bitlen, uint32_t value) {
+	if (!value) {
+		packet_write_bits(buf, bitlen, 0, 2);
+	}
+	else if (!(value & ~0x3f)) {
+		packet_write_bits(buf, bitlen, 1, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)value, 6);
+	}
+	else if (!(value & ~0x7ff)) {
+		packet_write_bits(buf, bitlen, 2, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)value, 11);
+	}
+	else {
+		packet_write_bits(buf, bitlen, 3, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)value, 32);
+	}
+}
+void packet_write_s16(uint8_t *buf, int *bitlen, int16_t value) {
+	if (!value) {
+		packet_write_bits(buf, bitlen, 0, 2);
+	}
+	else if (value >= -0x10 && value < 0x10) {
+		packet_write_bits(buf, bitlen, 1, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)(value+0x10), 5);
+	}
+	else if (value >= -0x80 && value < 0x80) {
+		packet_write_bits(buf, bitlen, 2, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)(value+0x80), 8);
+	}
+	else {
+		packet_write_bits(buf, bitlen, 3, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)((int64_t)value+0x8000), 16);
+	}
+}
+void packet_write_s32(uint8_t *buf, int *bitlen, int32_t value) {
+	if (!value) {
+		packet_write_bits(buf, bitlen, 0, 2);
+	}
+	else if (value >= -0x20 && value < 0x20) {
+		packet_write_bits(buf, bitlen, 1, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)(value+0x20), 6);
+	}
+	else if (value >= -0x400 && value < 0x400) {
+		packet_write_bits(buf, bitlen, 2, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)(value+0x400), 11);
+	}
+	else {
+		packet_write_bits(buf, bitlen, 3, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)((int64_t)value+0x80000000), 32);
+	}
+}
+void packet_write_float(uint8_t *buf, int *bitlen, float value) {
+	float a = fabsf(value);
+	uint16_t fixed = 0;
+
+	if (a < 0.001f) {
+		packet_write_bits(buf, bitlen, 0, 2);
+	}
+	else if (a < 8.0f) {
+		packet_write_bits(buf, bitlen, 1, 2);
+		fixed |= value < 0;
+		fixed |= ((uint16_t)a & 0x7) << 1;
+		fixed |= (uint16_t)(fmodf(a, 1.0f) * 1024.0f) << 4;
+		packet_write_bits(buf, bitlen, (uint64_t)fixed, 14);
+	}
+	else if (a < 127.0f) {
+		packet_write_bits(buf, bitlen, 2, 2);
+		fixed |= value < 0;
+		fixed |= ((uint16_t)a & 0x7f) << 1;
+		fixed |= (uint16_t)(fmodf(a, 1.0f) * 256.0f) << 8;
+		packet_write_bits(buf, bitlen, (uint64_t)fixed, 16);
+	}
+	else {
+		packet_write_bits(buf, bitlen, 3, 2);
+		packet_write_bits(buf, bitlen, (uint64_t)packet_htonf(value), 32);
+	}
+}
+
+uint8_t packet_read_u8(const uint8_t *buf, int *bitlen) {
+	uint64_t value;
+	if (!packet_read_bit(buf, bitlen)) {
+		return 0;
+	}
+	else if (!packet_read_bit(buf, bitlen)) {
+		value = packet_read_bits(buf, bitlen, 4);
+		return (uint8_t)value;
+	}
+	else {
+		value = packet_read_bits(buf, bitlen, 8);
+		return (uint8_t)value;
+	}
+}
+uint16_t packet_read_u16(const uint8_t *buf, int *bitlen) {
+	uint64_t value = packet_read_bits(buf, bitlen, 2);
+
+	if (!value) {
+		return 0;
+	}
+	else if (value == 1) {
+		value = packet_read_bits(buf, bitlen, 5);
+		return (uint16_t)value;
+	}
+	else if (value == 2) {
+		value = packet_read_bits(buf, bitlen, 8);
+		return (uint16_t)value;
+	}
+	else {
+		value = packet_read_bits(buf, bitlen, 16);
+		return (uint16_t)value;
+	}
+}
+uint32_t packet_read_u32(const uint8_t *buf, int *bitlen) {
+	uint64_t value = packet_read_bits(buf, bitlen, 2);
+
+	if (!value) {
+		return 0;
+	}
+	else if (value == 1) {
+		value = packet_read_bits(buf, bitlen, 6);
+		return (uint32_t)value;
+	}
+	else if (value == 2) {
+		value = packet_read_bits(buf, bitlen, 11);
+		return (uint32_t)value;
+	}
+	else {
+		value = packet_read_bits(buf, bitlen, 32);
+		return (uint32_t)value;
+	}
+}
+int16_t packet_read_s16(const uint8_t *buf, int *bitlen) {
+	uint64_t value = packet_read_bits(buf, bitlen, 2);
+
+	if (!value) {
+		return 0;
+	}
+	else if (value == 1) {
+		return (int16_t)packet_read_bits(buf, bitlen, 5)-0x10;
+	}
+	else if (value == 2) {
+		return (int16_t)packet_read_bits(buf, bitlen, 8)-0x80;
+	}
+	else {
+		return (int16_t)((int32_t)packet_read_bits(buf, bitlen, 16)-0x8000);
+	}
+}
+int32_t packet_read_s32(const uint8_t *buf, int *bitlen) {
+	uint64_t value = packet_read_bits(buf, bitlen, 2);
+
+	if (!value) {
+		return 0;
+	}
+	else if (value == 1) {
+		return (int32_t)packet_read_bits(buf, bitlen, 6)-0x20;
+	}
+	else if (value == 2) {
+		return (int32_t)packet_read_bits(buf, bitlen, 11)-0x400;
+	}
+	else {
+		return (int32_t)((int64_t)packet_read_bits(buf, bitlen, 32)-0x80000000);
+	}
+}
+void packet_writer_init(packet_writer_t *w, uint8_t *buf, size_t cap, size_t head) {
+	const int off = head & 7;
+
+	*w = (packet_writer_t){
+		.buf = buf,
+		.pos = head >> 3,
+		.cap = cap,
+		.err = (head >> 3) + !!off > cap,
+	};
+
+	// Keep the bits that are already in the first byte
+	if (off && !w->err) {
+		w->acc = buf[w->pos] & ((1u << off) - 1);
+		w->nacc = off;
+	}
+}
+void packet_writer_store_slow(packet_writer_t *w) {
+	// Store what fits, and drop the rest of the word
+	for (int i = 0; i < 4; i++) {
+		if (w->pos >= w->cap) {
+			w->err = true;
+			return;
+		}
+		w->buf[w->pos++] = w->acc >> i * 8;
+	}
+}
+size_t packet_writer_flush(packet_writer_t *w) {
+	while (w->nacc >= 8) {
+		if (w->pos >= w->cap) {
+			w->err = true;
+			break;
+		}
+		w->buf[w->pos++] = w->acc;
+		w->acc >>= 8;
+		w->nacc -= 8;
+	}
+	if (w->nacc && w->pos < w->cap) {
+		const uint8_t mask = (1u << w->nacc) - 1;
+		w->buf[w->pos] = (w->buf[w->pos] & ~mask) | (w->acc & mask);
+	} else if (w->nacc) {
+		w->err = true;
+	}
+	return w->pos * 8 + w->nacc;
+}
+
+void packet_reader_init(packet_reader_t *r, const uint8_t *buf, size_t len, size_t head) {
+	const int off = head & 7;
+
+	*r = (packet_reader_t){
+		.buf = buf,
+		.pos = head >> 3,
+		.len = len,
+		.err = (head >> 3) + !!off > len,
+	};
+	if (off && !r->err) {
+		r->acc = buf[r->pos++] >> off;
+		r->nacc = 8 - off;
+	}
+}
+size_t packet_reader_head(const packet_reader_t *r) {
+	return r->pos * 8 - r->nacc;
+}
+void packet_reader_refill_slow(packet_reader_t *r, int numbits) {
+	while (r->nacc <= 56 && r->pos < r->len) {
+		r->acc |= (uint64_t)r->buf[r->pos++] << r->nacc;
+		r->nacc += 8;
+	}
+
+	// Out of bytes, so the rest of the bits are zeros. pos still moves so
+	// that the head keeps going forward.
+	while (r->nacc < numbits) {
+		r->pos++;
+		r->nacc += 8;
+		r->err = true;
+	}
+}
+
+static void packet_writer_u32_block(packet_writer_t *w, const uint32_t *vals, size_t n) {
+	uint32_t bits = 0;
+	for (size_t i = 0; i < n; i++) bits |= vals[i];
+
+	const int width = bits ? 32 - __builtin_clz(bits) : 0;
+	packet_writer_bits32(w, width, 6);
+	for (size_t i = 0; i < n; i++) packet_writer_bits32(w, vals[i], width);
+}
+void packet_writer_u32_array(packet_writer_t *w, const uint32_t *vals, size_t n) {
+	for (size_t i = 0; i < n; i += PACKET_ARRAY_BLOCK) {
+		const size_t len = n - i < PACKET_ARRAY_BLOCK ? n - i : PACKET_ARRAY_BLOCK;
+		packet_writer_u32_block(w, vals + i, len);
+	}
+}
+void packet_writer_s32_array(packet_writer_t *w, const int32_t *vals, size_t n) {
+	uint32_t zigzag[PACKET_ARRAY_BLOCK];
+
+	for (size_t i = 0; i < n; i += PACKET_ARRAY_BLOCK) {
+		const size_t len = n - i < PACKET_ARRAY_BLOCK ? n - i : PACKET_ARRAY_BLOCK;
+
+		// Small negative numbers need to stay small
+		for (size_t j = 0; j < len; j++) {
+			zigzag[j] = (uint32_t)vals[i + j] << 1 ^ (uint32_t)(vals[i + j] >> 31);
+		}
+		packet_writer_u32_block(w, zigzag, len);
+	}
+}
+static int packet_float_class(float value) {
+	const float a = fabsf(value);
+	if (a < 0.001f) return 0;
+	else if (a < 8.0f) return 1;
+	else if (a < 127.0f) return 2;
+	else return 3;
+}
+void packet_writer_float_array(packet_writer_t *w, const float *vals, size_t n) {
+	for (size_t i = 0; i < n; i += PACKET_ARRAY_BLOCK) {
+		const size_t len = n - i < PACKET_ARRAY_BLOCK ? n - i : PACKET_ARRAY_BLOCK;
+		const float *block = vals + i;
+
+		int class = 0;
+		for (size_t j = 0; j < len; j++) {
+			const int c = packet_float_class(block[j]);
+			class = c > class ? c : class;
+		}
+		packet_writer_bits32(w, class, 2);
+
+		// Same fixed point formats as packet_write_float
+		switch (class) {
+		case 1:
+			for (size_t j = 0; j < len; j++) {
+				const float a = fabsf(block[j]);
+				uint32_t fixed = block[j] < 0;
+				fixed |= ((uint32_t)a & 0x7) << 1;
+				fixed |= (uint16_t)(fmodf(a, 1.0f) * 1024.0f) << 4;
+				packet_writer_bits32(w, fixed, 14);
+			}
+			break;
+		case 2:
+			for (size_t j = 0; j < len; j++) {
+				const float a = fabsf(block[j]);
+				uint32_t fixed = block[j] < 0;
+				fixed |= ((uint32_t)a & 0x7f) << 1;
+				fixed |= (uint16_t)(fmodf(a, 1.0f) * 256.0f) << 8;
+				packet_writer_bits32(w, fixed, 16);
+			}
+			break;
+		case 3:
+			for (size_t j = 0; j < len; j++) {
+				packet_writer_bits32(w, packet_htonf(block[j]), 32);
+			}
+			break;
+		}
+	}
+}
+static void packet_reader_u32_block(packet_reader_t *r, uint32_t *vals, size_t n) {
+	const int width = packet_reader_bits32(r, 6);
+	if (width > 32) {
+		r->err = true;
+		memset(vals, 0, n * sizeof(*vals));
+		return;
+	}
+	for (size_t i = 0; i < n; i++) vals[i] = packet_reader_bits32(r, width);
+}
+void packet_reader_u32_array(packet_reader_t *r, uint32_t *vals, size_t n) {
+	for (size_t i = 0; i < n; i += PACKET_ARRAY_BLOCK) {
+		const size_t len = n - i < PACKET_ARRAY_BLOCK ? n - i : PACKET_ARRAY_BLOCK;
+		packet_reader_u32_block(r, vals + i, len);
+	}
+}
+void packet_reader_s32_array(packet_reader_t *r, int32_t *vals, size_t n) {
+	for (size_t i = 0; i < n; i += PACKET_ARRAY_BLOCK) {
+		const size_t len = n - i < PACKET_ARRAY_BLOCK ? n - i : PACKET_ARRAY_BLOCK;
+		uint32_t *block = (uint32_t *)vals + i;
+
+		packet_reader_u32_block(r, block, len);
+		for (size_t j = 0; j < len; j++) {
+			block[j] = block[j] >> 1 ^ -(block[j] & 1);
+		}
+	}
+}
+void packet_reader_float_array(packet_reader_t *r, float *vals, size_t n) {
+	for (size_t i = 0; i < n; i += PACKET_ARRAY_BLOCK) {
+		const size_t len = n - i < PACKET_ARRAY_BLOCK ? n - i : PACKET_ARRAY_BLOCK;
+		float *block = vals + i;
+
+		switch (packet_reader_bits32(r, 2)) {
+		case 0:
+			for (size_t j = 0; j < len; j++) block[j] = 0.0f;
+			break;
+		case 1:
+			for (size_t j = 0; j < len; j++) {
+				const uint32_t fixed = packet_reader_bits32(r, 14);
+				const float a = (float)(fixed >> 1 & 0x7)
+					+ (float)(fixed >> 4) / 1024.0f;
+				block[j] = fixed & 1 ? -a : a;
+			}
+			break;
+		case 2:
+			for (size_t j = 0; j < len; j++) {
+				const uint32_t fixed = packet_reader_bits32(r, 16);
+				const float a = (float)(fixed >> 1 & 0x7f)
+					+ (float)(fixed >> 8) / 256.0f;
+				block[j] = fixed & 1 ? -a : a;
+			}
+			break;
+		case 3:
+			for (size_t j = 0; j < len; j++) {
+				block[j] = packet_ntohf(packet_reader_bits32(r, 32));
+			}
+			break;
+		}
+	}
+}
+
+float packet_read_float(const uint8_t *buf, int *bitlen) {
+	uint64_t type;
+	float a, sign;
+
+	type = packet_read_bits(buf, bitlen, 2);
+	if (type == 0) {
+		sign = 1.0f;
+		a = 0.0f;
+	}
+	else if (type == 1) {
+		sign = packet_read_bit(buf, bitlen) ? -1.0f : 1.0f;
+		a = (float)packet_read_bits(buf, bitlen, 3);
+		a += (float)packet_read_bits(buf, bitlen, 10) / 1024.0f;
+	}
+	else if (type == 2) {
+		sign = packet_read_bit(buf, bitlen) ? -1.0f : 1.0f;
+		a = (float)packet_read_bits(buf, bitlen, 7);
+		a += (float)packet_read_bits(buf, bitlen, 8) / 256.0f;
+	}
+	else {
+		return packet_ntohf((unsigned int)packet_read_bits(buf, bitlen, 32));
+	}
+
+	return a * sign;
+}
+
+#endif
+
+
+//
+// EK_USE_CACHE
+//
+#if EK_USE_CACHE
+
+typedef struct cache_node {
+	struct cache_node *prev, *next;
+	uint64_t hash;
+	size_t charge;
+
+	// Set on hits for CACHE_CLOCK
+	bool ref;
+
+	uint64_t data[];
+} cache_node_t;
+
+// What the hset holds. Keeping the hash in here means it is only computed once
+// per call, and nodes can be found again without calling the hash function
+typedef struct cache_key {
+	uint64_t hash;
+	const void *data;
+	const cache_t *cache;
+} cache_key_t;
+
+struct cache {
+	mem_alloc_t alloc;
+	cache_key_t *set;
+	dynpool_t *pool;
+
+	uint32_t kvsize;
+	hset_hash_fn *hash;
+	hset_eq_fn *eq;
+
+	cache_evict_fn *evict;
+	void *usr;
+
+	cache_policy_t policy;
+
+	// Circular list through head. For CACHE_LRU the most recently used node
+	// is head.next, for CACHE_CLOCK hand sweeps it and new nodes go behind it
+	cache_node_t head, *hand;
+
+	size_t capacity;
+	cache_stats_t stats;
+};
+
+#define cache_node_from_data(_data) ((cache_node_t *)((uintptr_t)(_data) \
+				- offsetof(cache_node_t, data)))
+
+static uint64_t cache_key_hash(const cache_key_t *key) {
+	return key->hash;
+}
+static bool cache_key_eq(const cache_key_t *a, const cache_key_t *b) {
+	return a->hash == b->hash && a->cache->eq(a->data, b->data);
+}
+
+static void cache_unlink(cache_t *cache, cache_node_t *node) {
+	if (cache->hand == node) cache->hand = node->next;
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+}
+static void cache_link_before(cache_node_t *pos, cache_node_t *node) {
+	node->next = pos;
+	node->prev = pos->prev;
+	pos->prev->next = node;
+	pos->prev = node;
+}
+
+static cache_node_t *cache_victim(cache_t *cache) {
+	if (cache->policy == CACHE_LRU) return cache->head.prev;
+
+	// Give every referenced node a second chance
+	for (;;) {
+		cache_node_t *node = cache->hand;
+		if (node == &cache->head) node = node->next;
+		cache->hand = node->next;
+		if (!node->ref) return node;
+		node->ref = false;
+	}
+}
+
+static void cache_drop(cache_t *cache, cache_node_t *node) {
+	cache_key_t *key = hset_get(cache->set, &(cache_key_t){
+		.hash = node->hash,
+		.data = node->data,
+		.cache = cache,
+	});
+	hset_remove(cache->set, key);
+
+	cache_unlink(cache, node);
+	cache->stats.len--;
+	cache->stats.charge -= node->charge;
+	if (cache->evict) cache->evict(cache->usr, node->data);
+	dynpool_free(cache->pool, node);
+}
+
+static cache_node_t *cache_find(cache_t *cache, const void *key, uint64_t hash) {
+	const cache_key_t *found = hset_get(cache->set, &(cache_key_t){
+		.hash = hash,
+		.data = key,
+		.cache = cache,
+	});
+	return found ? cache_node_from_data(found->data) : NULL;
+}
+
+cache_t *cache_init(mem_alloc_t alloc, size_t capacity, uint32_t kvsize,
+		hset_hash_fn *hash, hset_eq_fn *eq, cache_policy_t policy) {
+	cache_t *cache = mem_alloc(alloc, NULL, sizeof(*cache));
+	if (!cache) return NULL;
+
+	*cache = (cache_t){
+		.alloc = alloc,
+		.kvsize = kvsize,
+		.hash = hash,
+		.eq = eq,
+		.policy = policy,
+		.capacity = capacity,
+	};
+	cache->head.prev = cache->head.next = cache->hand = &cache->head;
+
+	cache->set = hset_init(alloc, 16, sizeof(cache_key_t),
+			(hset_hash_fn *)cache_key_hash, (hset_eq_fn *)cache_key_eq);
+	cache->pool = dynpool_init(alloc, 16, sizeof(cache_node_t) + kvsize);
+	if (!cache->set || !cache->pool) {
+		cache_deinit(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+void cache_deinit(cache_t *cache) {
+	if (!cache) return;
+
+	if (cache->evict) {
+		for (cache_node_t *node = cache->head.next; node != &cache->head;
+				node = node->next) {
+			cache->evict(cache->usr, node->data);
+		}
+	}
+	if (cache->pool) dynpool_deinit(cache->pool);
+	if (cache->set) hset_deinit(cache->set);
+	mem_alloc(cache->alloc, cache, 0);
+}
+void cache_on_evict(cache_t *cache, cache_evict_fn *fn, void *usr) {
+	cache->evict = fn;
+	cache->usr = usr;
+}
+
+static void *cache_get_hashed(cache_t *cache, const void *key, uint64_t hash) {
+	cache_node_t *node = cache_find(cache, key, hash);
+	if (!node) {
+		cache->stats.misses++;
+		return NULL;
+	}
+
+	cache->stats.hits++;
+	if (cache->policy == CACHE_LRU) {
+		cache_unlink(cache, node);
+		cache_link_before(cache->head.next, node);
+	} else {
+		node->ref = true;
+	}
+
+	return node->data;
+}
+void *cache_get(cache_t *cache, const void *key) {
+	return cache_get_hashed(cache, key, cache->hash(key));
+}
+
+static void *cache_put_hashed(cache_t *cache, const void *kv, size_t charge,
+		uint64_t hash) {
+	if (charge > cache->capacity) return NULL;
+
+	cache_node_t *node = cache_find(cache, kv, hash);
+	if (node) {
+		if (cache->evict) cache->evict(cache->usr, node->data);
+		memcpy(node->data, kv, cache->kvsize);
+
+		// Taken off the list while making room so it doesn't evict itself
+		cache_unlink(cache, node);
+		cache->stats.charge -= node->charge;
+		node->charge = 0;
+	}
+
+	while (cache->stats.charge + charge > cache->capacity) {
+		cache_drop(cache, cache_victim(cache));
+		cache->stats.evictions++;
+	}
+
+	if (!node) {
+		if (!(node = dynpool_alloc(cache->pool))) return NULL;
+		node->hash = hash;
+		memcpy(node->data, kv, cache->kvsize);
+
+		cache_key_t *set = hset_insert(cache->set, &(cache_key_t){
+			.hash = hash,
+			.data = node->data,
+			.cache = cache,
+		});
+		if (!set) {
+			dynpool_free(cache->pool, node);
+			return NULL;
+		}
+		cache->set = set;
+		cache->stats.len++;
+	}
+
+	node->charge = charge;
+	node->ref = false;
+	cache->stats.charge += charge;
+	cache_link_before(cache->policy == CACHE_LRU ? cache->head.next : cache->hand, node);
+
+	return node->data;
+}
+void *cache_put(cache_t *cache, const void *kv, size_t charge) {
+	return cache_put_hashed(cache, kv, charge, cache->hash(kv));
+}
+
+static bool cache_remove_hashed(cache_t *cache, const void *key, uint64_t hash) {
+	cache_node_t *node = cache_find(cache, key, hash);
+	if (!node) return false;
+	cache_drop(cache, node);
+	return true;
+}
+bool cache_remove(cache_t *cache, const void *key) {
+	return cache_remove_hashed(cache, key, cache->hash(key));
+}
+
+cache_stats_t cache_stats(const cache_t *cache) {
+	return cache->stats;
+}
+
+// Padded so neighbouring shards don't share the cache line of the lock
+typedef struct cache_shard {
+	pthread_mutex_t lock;
+	cache_t *cache;
+	char pad[64];
+} cache_shard_t;
+
+struct cache_sharded {
+	mem_alloc_t alloc;
+	hset_hash_fn *hash;
+	uint32_t kvsize;
+	size_t mask;
+	cache_shard_t shards[];
+};
+
+// The low bits of the hash pick the bucket in the hset, so use the high ones
+#define cache_shard_of(sc, hash) ((sc)->shards + ((hash) >> 40 & (sc)->mask))
+
+cache_sharded_t *cache_sharded_init(mem_alloc_t alloc, size_t nshards,
+		size_t capacity, uint32_t kvsize,
+		hset_hash_fn *hash, hset_eq_fn *eq, cache_policy_t policy) {
+	size_t n = 1;
+	while (n < nshards) n *= 2;
+
+	cache_sharded_t *sc = mem_alloc(alloc, NULL, sizeof(*sc) + sizeof(cache_shard_t) * n);
+	if (!sc) return NULL;
+	*sc = (cache_sharded_t){
+		.alloc = alloc,
+		.hash = hash,
+		.kvsize = kvsize,
+		.mask = n - 1,
+	};
+
+	for (size_t i = 0; i < n; i++) {
+		cache_shard_t *shard = sc->shards + i;
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->cache = cache_init(alloc, (capacity + n - 1) / n, kvsize, hash, eq, policy);
+		if (!shard->cache) {
+			// Only free the shards that were made
+			for (size_t j = 0; j < i; j++) {
+				cache_deinit(sc->shards[j].cache);
+				pthread_mutex_destroy(&sc->shards[j].lock);
+			}
+			pthread_mutex_destroy(&shard->lock);
+			mem_alloc(alloc, sc, 0);
+			return NULL;
+		}
+	}
+
+	return sc;
+}
+void cache_sharded_deinit(cache_sharded_t *sc) {
+	if (!sc) return;
+	for (size_t i = 0; i <= sc->mask; i++) {
+		cache_deinit(sc->shards[i].cache);
+		pthread_mutex_destroy(&sc->shards[i].lock);
+	}
+	mem_alloc(sc->alloc, sc, 0);
+}
+void cache_sharded_on_evict(cache_sharded_t *sc, cache_evict_fn *fn, void *usr) {
+	for (size_t i = 0; i <= sc->mask; i++) {
+		pthread_mutex_lock(&sc->shards[i].lock);
+		cache_on_evict(sc->shards[i].cache, fn, usr);
+		pthread_mutex_unlock(&sc->shards[i].lock);
+	}
+}
+bool cache_sharded_get(cache_sharded_t *sc, const void *key, void *kv_out) {
+	const uint64_t hash = sc->hash(key);
+	cache_shard_t *shard = cache_shard_of(sc, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	const void *kv = cache_get_hashed(shard->cache, key, hash);
+	if (kv) memcpy(kv_out, kv, sc->kvsize);
+	pthread_mutex_unlock(&shard->lock);
+
+	return kv != NULL;
+}
+bool cache_sharded_put(cache_sharded_t *sc, const void *kv, size_t charge) {
+	const uint64_t hash = sc->hash(kv);
+	cache_shard_t *shard = cache_shard_of(sc, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	const bool put = cache_put_hashed(shard->cache, kv, charge, hash) != NULL;
+	pthread_mutex_unlock(&shard->lock);
+
+	return put;
+}
+bool cache_sharded_remove(cache_sharded_t *sc, const void *key) {
+	const uint64_t hash = sc->hash(key);
+	cache_shard_t *shard = cache_shard_of(sc, hash);
+
+	pthread_mutex_lock(&shard->lock);
+	const bool removed = cache_remove_hashed(shard->cache, key, hash);
+	pthread_mutex_unlock(&shard->lock);
+
+	return removed;
+}
+cache_stats_t cache_sharded_stats(cache_sharded_t *sc) {
+	cache_stats_t sum = { 0 };
+	for (size_t i = 0; i <= sc->mask; i++) {
+		pthread_mutex_lock(&sc->shards[i].lock);
+		const cache_stats_t stats = cache_stats(sc->shards[i].cache);
+		pthread_mutex_unlock(&sc->shards[i].lock);
+
+		sum.hits += stats.hits;
+		sum.misses += stats.misses;
+		sum.evictions += stats.evictions;
+		sum.len += stats.len;
+		sum.charge += stats.charge;
+	}
+	return sum;
+}
+
+#endif
+
+//
+// EK_USE_BLOOM
+//
+#if EK_USE_BLOOM
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define EK_BLOOM_AVX2 1
+#	include <immintrin.h>
+#endif
+
+#define BLOOM_WORDS 8
+#define BLOOM_MAGIC 0x4642454bu	// "EKBF"
+#define BLOOM_VERSION 1
+#define BLOOM_HEADER_SIZE 16
+
+// How many hashes ahead bloom_test_n prefetches blocks
+#define BLOOM_PREFETCH 8
+
+typedef struct bloom_block {
+	uint32_t words[BLOOM_WORDS];
+} bloom_block_t;
+
+struct bloom {
+	mem_alloc_t alloc;
+	uint32_t nblocks;
+
+	// Aligned to the block size inside of the same allocation, so a block
+	// never straddles two cache lines
+	bloom_block_t *blocks;
+};
+
+static bloom_t *bloom_alloc(mem_alloc_t alloc, uint32_t nblocks) {
+	bloom_t *bloom = mem_alloc(alloc, NULL, sizeof(*bloom)
+			+ sizeof(bloom_block_t) * (nblocks + 1));
+	if (!bloom) return NULL;
+
+	bloom->alloc = alloc;
+	bloom->nblocks = nblocks;
+	bloom->blocks = (bloom_block_t *)align_up((uintptr_t)(bloom + 1),
+						sizeof(bloom_block_t));
+	bloom_clear(bloom);
+	return bloom;
+}
+
+static inline const bloom_block_t *bloom_block(const bloom_t *bloom, uint64_t hash) {
+	// Multiply and shift instead of a modulo to pick the block
+	return bloom->blocks + (uint32_t)(((hash >> 32) * bloom->nblocks) >> 32);
+}
+
+// Odd constants from the Parquet split block Bloom filter. Multiplying the low
+// half of the hash by one per word and keeping the top 5 bits picks the bit
+// in that word. They spread the bits better than adding multiples of the high
+// half, which also picks the block.
+static const uint32_t bloom_salts[BLOOM_WORDS] = {
+	0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+	0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u,
+};
+#define bloom_bit(hash, i) (1u << ((uint32_t)(hash) * bloom_salts[i] >> 27))
+
+// False positive rate with nkeys spread over nblocks. The number of keys in
+// a block is about Poisson distributed, and a block with l keys has each bit
+// of a word set with 1 - (31/32)^l.
+static double bloom_fpp(double nkeys, double nblocks) {
+	const double lambda = nkeys / nblocks;
+	if (lambda <= 0.0) return 0.0;
+	const double spread = 10.0 * sqrt(lambda) + 10.0;
+	double fpp = 0.0;
+
+	// Only the loads around lambda matter, in logs since exp(-lambda) underflows
+	for (double l = fmax(0.0, floor(lambda - spread)); l <= lambda + spread; l++) {
+		const double p = exp(l * log(lambda) - lambda - lgamma(l + 1.0));
+		fpp += p * pow(1.0 - pow(31.0 / 32.0, l), BLOOM_WORDS);
+	}
+	return fpp;
+}
+
+bloom_t *bloom_init(mem_alloc_t alloc, size_t nkeys, double fpp) {
+	if (fpp <= 0.0 || fpp >= 1.0) return NULL;
+
+	// Double the blocks until it's good enough, then bisect
+	double lo = 0.0, hi = 1.0;
+	while (bloom_fpp(nkeys, hi) > fpp) {
+		lo = hi;
+		hi *= 2.0;
+		if (hi > UINT32_MAX - 1) return NULL;
+	}
+	while (hi - lo > 1.0) {
+		const double mid = floor((lo + hi) / 2.0);
+		if (bloom_fpp(nkeys, mid) > fpp) lo = mid;
+		else hi = mid;
+	}
+
+	return bloom_alloc(alloc, (uint32_t)hi);
+}
+void bloom_deinit(bloom_t *bloom) {
+	if (bloom) mem_alloc(bloom->alloc, bloom, 0);
+}
+void bloom_clear(bloom_t *bloom) {
+	memset(bloom->blocks, 0, sizeof(bloom_block_t) * bloom->nblocks);
+}
+
+void bloom_add(bloom_t *bloom, uint64_t hash) {
+	bloom_block_t *blk = (bloom_block_t *)bloom_block(bloom, hash);
+	for (int i = 0; i < BLOOM_WORDS; i++) blk->words[i] |= bloom_bit(hash, i);
+}
+bool bloom_test(const bloom_t *bloom, uint64_t hash) {
+	const bloom_block_t *blk = bloom_block(bloom, hash);
+	uint32_t missing = 0;
+	for (int i = 0; i < BLOOM_WORDS; i++) missing |= ~blk->words[i] & bloom_bit(hash, i);
+	return !missing;
+}
+
+#if EK_BLOOM_AVX2
+__attribute__((target("avx2")))
+static size_t bloom_test_n_avx2(const bloom_t *bloom, const uint64_t *hashes,
+		size_t n, bool *maybe) {
+	const __m256i salts = _mm256_loadu_si256((const __m256i *)bloom_salts);
+	const __m256i ones = _mm256_set1_epi32(1);
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		if (i + BLOOM_PREFETCH < n) {
+			__builtin_prefetch(bloom_block(bloom, hashes[i + BLOOM_PREFETCH]));
+		}
+
+		const uint64_t hash = hashes[i];
+		const __m256i bits = _mm256_srli_epi32(
+			_mm256_mullo_epi32(_mm256_set1_epi32((uint32_t)hash), salts), 27);
+		const __m256i mask = _mm256_sllv_epi32(ones, bits);
+		const __m256i blk = _mm256_load_si256((const __m256i *)bloom_block(bloom, hash));
+
+		// Set when every bit of mask is set in blk
+		maybe[i] = _mm256_testc_si256(blk, mask);
+		count += maybe[i];
+	}
+
+	return count;
+}
+#endif
+
+size_t bloom_test_n(const bloom_t *bloom, const uint64_t *hashes, size_t n, bool *maybe) {
+#if EK_BLOOM_AVX2
+	if (__builtin_cpu_supports("avx2")) return bloom_test_n_avx2(bloom, hashes, n, maybe);
+#endif
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (i + BLOOM_PREFETCH < n) {
+			__builtin_prefetch(bloom_block(bloom, hashes[i + BLOOM_PREFETCH]));
+		}
+		maybe[i] = bloom_test(bloom, hashes[i]);
+		count += maybe[i];
+	}
+	return count;
+}
+
+bool bloom_merge(bloom_t *dst, const bloom_t *src) {
+	if (dst->nblocks != src->nblocks) return false;
+
+	uint32_t *restrict d = dst->blocks->words;
+	const uint32_t *restrict s = src->blocks->words;
+	for (size_t i = 0; i < (size_t)dst->nblocks * BLOOM_WORDS; i++) d[i] |= s[i];
+	return true;
+}
+
+static void bloom_put32(uint8_t *buf, uint32_t x) {
+	buf[0] = x;
+	buf[1] = x >> 8;
+	buf[2] = x >> 16;
+	buf[3] = x >> 24;
+}
+static uint32_t bloom_get32(const uint8_t *buf) {
+	return buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+}
+
+size_t bloom_serialized_size(const bloom_t *bloom) {
+	return BLOOM_HEADER_SIZE + sizeof(bloom_block_t) * bloom->nblocks;
+}
+void bloom_serialize(const bloom_t *bloom, void *_buf) {
+	uint8_t *buf = _buf;
+	bloom_put32(buf, BLOOM_MAGIC);
+	bloom_put32(buf + 4, BLOOM_VERSION);
+	bloom_put32(buf + 8, bloom->nblocks);
+	bloom_put32(buf + 12, 0);
+	buf += BLOOM_HEADER_SIZE;
+
+	const size_t nwords = (size_t)bloom->nblocks * BLOOM_WORDS;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(buf, bloom->blocks, nwords * sizeof(uint32_t));
+#else
+	for (size_t i = 0; i < nwords; i++) bloom_put32(buf + i * 4, bloom->blocks->words[i]);
+#endif
+}
+bloom_t *bloom_deserialize(mem_alloc_t alloc, const void *_buf, size_t len) {
+	const uint8_t *buf = _buf;
+	if (len < BLOOM_HEADER_SIZE) return NULL;
+	if (bloom_get32(buf) != BLOOM_MAGIC || bloom_get32(buf + 4) != BLOOM_VERSION) return NULL;
+
+	const uint32_t nblocks = bloom_get32(buf + 8);
+	if (!nblocks || nblocks == UINT32_MAX) return NULL;
+	if ((len - BLOOM_HEADER_SIZE) / sizeof(bloom_block_t) != nblocks
+		|| (len - BLOOM_HEADER_SIZE) % sizeof(bloom_block_t)) return NULL;
+
+	bloom_t *bloom = bloom_alloc(alloc, nblocks);
+	if (!bloom) return NULL;
+	buf += BLOOM_HEADER_SIZE;
+
+	const size_t nwords = (size_t)nblocks * BLOOM_WORDS;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	memcpy(bloom->blocks, buf, nwords * sizeof(uint32_t));
+#else
+	for (size_t i = 0; i < nwords; i++) bloom->blocks->words[i] = bloom_get32(buf + i * 4);
+#endif
+	return bloom;
+}
+
+#endif
+
+//
+// EK_USE_HLL
+//
+#if EK_USE_HLL
+
+#if defined(__SSE2__)
+#	define EK_HLL_SSE2 1
+#	include <emmintrin.h>
+#endif
+
+// Precision of the sparse list. Entries are the 25 bit index shifted over the
+// 6 bit rank, so sorting them puts the highest rank of an index last
+#define HLL_SPARSE_P 25
+#define HLL_SPARSE_RANK_BITS 6
+#define HLL_SPARSE_MIN 64
+
+struct hll {
+	mem_alloc_t alloc;
+	int p;
+
+	// NULL while sparse
+	uint8_t *regs;
+
+	// The first nsorted entries are sorted without duplicate indices, the
+	// rest were appended since
+	uint32_t *sparse;
+	uint32_t nsparse, nsorted, sparse_cap;
+};
+
+static inline uint32_t hll_sparse_entry(uint64_t hash) {
+	const uint32_t idx = hash >> (64 - HLL_SPARSE_P);
+	const uint32_t rank = __builtin_clzll(hash << HLL_SPARSE_P
+				| 1ull << (HLL_SPARSE_P - 1)) + 1;
+	return idx << HLL_SPARSE_RANK_BITS | rank;
+}
+
+// Register and rank at the dense precision for a sparse entry. The index bits
+// the dense registers don't use are the start of the dense rank
+static inline void hll_sparse_to_dense(int p, uint32_t entry, uint32_t *idx, uint8_t *rank) {
+	const uint32_t sidx = entry >> HLL_SPARSE_RANK_BITS;
+	const int extra = HLL_SPARSE_P - p;
+	const uint32_t bits = sidx & ((1u << extra) - 1);
+
+	*idx = sidx >> extra;
+	if (bits) *rank = extra - (31 - __builtin_clz(bits));
+	else *rank = extra + (entry & ((1u << HLL_SPARSE_RANK_BITS) - 1));
+}
+
+static inline void hll_dense_add(hll_t *hll, uint64_t hash) {
+	const uint32_t idx = hash >> (64 - hll->p);
+	const uint8_t rank = __builtin_clzll(hash << hll->p | 1ull << (hll->p - 1)) + 1;
+	if (rank > hll->regs[idx]) hll->regs[idx] = rank;
+}
+
+static int hll_cmp(const void *a, const void *b) {
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+// Sorts the appended entries in and keeps the highest rank of every index
+static void hll_sparse_compact(hll_t *hll) {
+	if (hll->nsorted == hll->nsparse) return;
+	qsort(hll->sparse, hll->nsparse, sizeof(uint32_t), hll_cmp);
+
+	uint32_t n = 0;
+	for (uint32_t i = 0; i < hll->nsparse; i++) {
+		const uint32_t entry = hll->sparse[i];
+		if (n && hll->sparse[n - 1] >> HLL_SPARSE_RANK_BITS
+				== entry >> HLL_SPARSE_RANK_BITS) n--;
+		hll->sparse[n++] = entry;
+	}
+	hll->nsparse = hll->nsorted = n;
+}
+
+static bool hll_to_dense(hll_t *hll) {
+	const size_t m = (size_t)1 << hll->p;
+	uint8_t *regs = mem_alloc(hll->alloc, NULL, m);
+	if (!regs) return false;
+	memset(regs, 0, m);
+
+	for (uint32_t i = 0; i < hll->nsparse; i++) {
+		uint32_t idx;
+		uint8_t rank;
+		hll_sparse_to_dense(hll->p, hll->sparse[i], &idx, &rank);
+		if (rank > regs[idx]) regs[idx] = rank;
+	}
+
+	if (hll->sparse) mem_alloc(hll->alloc, hll->sparse, 0);
+	hll->sparse = NULL;
+	hll->nsparse = hll->nsorted = hll->sparse_cap = 0;
+	hll->regs = regs;
+	return true;
+}
+
+static bool hll_sparse_add(hll_t *hll, uint32_t entry) {
+	if (hll->nsparse == hll->sparse_cap) {
+		hll_sparse_compact(hll);
+
+		// Grow while it's less than half full, or go dense once the list
+		// would be bigger than the registers
+		if (hll->nsparse >= hll->sparse_cap / 2) {
+			const uint32_t cap = hll->sparse_cap ? hll->sparse_cap * 2 : HLL_SPARSE_MIN;
+			if ((size_t)cap * sizeof(uint32_t) > (size_t)1 << hll->p) {
+				if (!hll_to_dense(hll)) return false;
+				uint32_t idx;
+				uint8_t rank;
+				hll_sparse_to_dense(hll->p, entry, &idx, &rank);
+				if (rank > hll->regs[idx]) hll->regs[idx] = rank;
+				return true;
+			}
+
+			uint32_t *sparse = mem_alloc(hll->alloc, hll->sparse, cap * sizeof(uint32_t));
+			if (!sparse) return false;
+			hll->sparse = sparse;
+			hll->sparse_cap = cap;
+		}
+	}
+
+	hll->sparse[hll->nsparse++] = entry;
+	return true;
+}
+
+hll_t *hll_init(mem_alloc_t alloc, int precision) {
+	if (precision < HLL_MIN_PRECISION || precision > HLL_MAX_PRECISION) return NULL;
+
+	hll_t *hll = mem_alloc(alloc, NULL, sizeof(*hll));
+	if (!hll) return NULL;
+	*hll = (hll_t){ .alloc = alloc, .p = precision };
+	return hll;
+}
+void hll_deinit(hll_t *hll) {
+	if (!hll) return;
+	if (hll->regs) mem_alloc(hll->alloc, hll->regs, 0);
+	if (hll->sparse) mem_alloc(hll->alloc, hll->sparse, 0);
+	mem_alloc(hll->alloc, hll, 0);
+}
+void hll_clear(hll_t *hll) {
+	if (hll->regs) memset(hll->regs, 0, (size_t)1 << hll->p);
+	hll->nsparse = hll->nsorted = 0;
+}
+
+bool hll_add(hll_t *hll, uint64_t hash) {
+	if (hll->regs) {
+		hll_dense_add(hll, hash);
+		return true;
+	}
+	return hll_sparse_add(hll, hll_sparse_entry(hash));
+}
+
+// The improved estimator from "New cardinality estimation algorithms for
+// HyperLogLog sketches" by Otmar Ertl. It is unbiased over the whole range
+// without the empirical bias tables of HLL++.
+static double hll_sigma(double x) {
+	if (x == 1.0) return INFINITY;
+	double y = 1.0, z = x, last;
+	do {
+		x *= x;
+		last = z;
+		z += x * y;
+		y += y;
+	} while (z != last);
+	return z;
+}
+static double hll_tau(double x) {
+	if (x == 0.0 || x == 1.0) return 0.0;
+	double y = 1.0, z = 1.0 - x, last;
+	do {
+		x = sqrt(x);
+		last = z;
+		y *= 0.5;
+		z -= (1.0 - x) * (1.0 - x) * y;
+	} while (z != last);
+	return z / 3.0;
+}
+
+uint64_t hll_estimate(hll_t *hll) {
+	if (!hll->regs) {
+		// Linear counting over the sparse indices
+		hll_sparse_compact(hll);
+		const double m = (double)(1u << HLL_SPARSE_P);
+		return (uint64_t)llround(m * log(m / (m - hll->nsparse)));
+	}
+
+	const size_t m = (size_t)1 << hll->p;
+	const int q = 64 - hll->p;
+
+	// Unrolled, the estimator only needs the registers that are 0, the ones
+	// that are q + 1 and the sum of 2^-r over the ones in between
+	double sum = 0.0;
+	uint64_t zeros = 0, maxed = 0;
+	size_t i = 0;
+#if EK_HLL_SSE2
+	const __m128i zero = _mm_setzero_si128(), top = _mm_set1_epi8(q + 1);
+	const __m128i bias = _mm_set1_epi32(127);
+	for (; i + 256 <= m; i += 256) {
+		// 2^-r as a float is just 127 - r in the exponent bits. Floats are
+		// exact enough for 256 registers, the blocks are summed as doubles
+		__m128 acc[4] = { _mm_setzero_ps(), _mm_setzero_ps(),
+				_mm_setzero_ps(), _mm_setzero_ps() };
+		__m128i nzero = zero, nmax = zero;
+
+		for (size_t j = i; j < i + 256; j += 16) {
+			const __m128i r = _mm_loadu_si128((const __m128i *)(hll->regs + j));
+			nzero = _mm_sub_epi8(nzero, _mm_cmpeq_epi8(r, zero));
+			nmax = _mm_sub_epi8(nmax, _mm_cmpeq_epi8(r, top));
+
+			const __m128i r16[2] = { _mm_unpacklo_epi8(r, zero), _mm_unpackhi_epi8(r, zero) };
+			for (int k = 0; k < 2; k++) {
+				const __m128i lo = _mm_unpacklo_epi16(r16[k], zero);
+				const __m128i hi = _mm_unpackhi_epi16(r16[k], zero);
+				acc[k * 2] = _mm_add_ps(acc[k * 2], _mm_castsi128_ps(
+					_mm_slli_epi32(_mm_sub_epi32(bias, lo), 23)));
+				acc[k * 2 + 1] = _mm_add_ps(acc[k * 2 + 1], _mm_castsi128_ps(
+					_mm_slli_epi32(_mm_sub_epi32(bias, hi), 23)));
+			}
+		}
+
+		float lanes[4];
+		_mm_storeu_ps(lanes, _mm_add_ps(_mm_add_ps(acc[0], acc[1]), _mm_add_ps(acc[2], acc[3])));
+		sum += (double)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+		uint64_t counts[2];
+		_mm_storeu_si128((__m128i *)counts, _mm_sad_epu8(nzero, zero));
+		zeros += counts[0] + counts[1];
+		_mm_storeu_si128((__m128i *)counts, _mm_sad_epu8(nmax, zero));
+		maxed += counts[0] + counts[1];
+	}
+#endif
+	for (; i < m; i++) {
+		const uint8_t r = hll->regs[i];
+		sum += ldexp(1.0, -r);
+		zeros += r == 0;
+		maxed += r == q + 1;
+	}
+	sum -= zeros + ldexp((double)maxed, -(q + 1));
+
+	const double z = m * hll_sigma((double)zeros / m) + sum
+		+ ldexp(m * hll_tau(1.0 - (double)maxed / m), -q);
+
+	const double alpha = 0.5 / log(2.0);
+	return (uint64_t)llround(alpha * m * m / z);
+}
+
+bool hll_merge(hll_t *dst, const hll_t *src) {
+	if (dst->p != src->p) return false;
+
+	if (!src->regs) {
+		for (uint32_t i = 0; i < src->nsparse; i++) {
+			if (dst->regs) {
+				uint32_t idx;
+				uint8_t rank;
+				hll_sparse_to_dense(dst->p, src->sparse[i], &idx, &rank);
+				if (rank > dst->regs[idx]) dst->regs[idx] = rank;
+			} else if (!hll_sparse_add(dst, src->sparse[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
+	if (!dst->regs && !hll_to_dense(dst)) return false;
+
+	const size_t m = (size_t)1 << dst->p;
+	size_t i = 0;
+#if EK_HLL_SSE2
+	for (; i + 16 <= m; i += 16) {
+		const __m128i a = _mm_loadu_si128((const __m128i *)(dst->regs + i));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(src->regs + i));
+		_mm_storeu_si128((__m128i *)(dst->regs + i), _mm_max_epu8(a, b));
+	}
+#endif
+	for (; i < m; i++) {
+		if (src->regs[i] > dst->regs[i]) dst->regs[i] = src->regs[i];
+	}
+	return true;
+}
+
+size_t hll_bytes(const hll_t *hll) {
+	return sizeof(*hll) + (hll->regs ? (size_t)1 << hll->p
+				: hll->sparse_cap * sizeof(uint32_t));
+}
+
+#endif
+
+//
+// EK_USE_QUEUE
+//
+#if EK_USE_QUEUE
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define queue_relax() __builtin_ia32_pause()
+#else
+#	define queue_relax() ((void)0)
+#endif
+
+static size_t queue_capacity(size_t capacity) {
+	size_t cap = 1;
+	while (cap < capacity) cap *= 2;
+	return cap;
+}
+
+typedef struct spsc {
+	mem_alloc_t alloc;
+	size_t mask;
+	char pad0[64];
+	size_t head;		// Written by the producer
+	size_t cached_tail;	// The last tail the producer saw
+	char pad1[64];
+	size_t tail;		// Written by the consumer
+	size_t cached_head;	// The last head the consumer saw
+	char pad2[64];
+	uint64_t data[];
+} spsc_t;
+
+#define spsc_from_data(_data) ((spsc_t *)((uintptr_t)(_data) - offsetof(spsc_t, data)))
+
+void *spsc_init(mem_alloc_t alloc, size_t elem_size, size_t capacity) {
+	const size_t cap = queue_capacity(capacity);
+	spsc_t *q = mem_alloc(alloc, NULL, sizeof(spsc_t) + cap * elem_size);
+	if (!q) return NULL;
+
+	q->alloc = alloc;
+	q->mask = cap - 1;
+	q->head = q->cached_tail = 0;
+	q->tail = q->cached_head = 0;
+	return q->data;
+}
+void *spsc_deinit(void *queue) {
+	spsc_t *q = spsc_from_data(queue);
+	return mem_alloc(q->alloc, q, 0);
+}
+
+// Copies n elements starting at ring index idx, in two parts when it wraps
+static void spsc_copy_in(spsc_t *q, size_t esz, size_t idx, size_t n, const uint8_t *elems) {
+	const size_t first = n < q->mask + 1 - idx ? n : q->mask + 1 - idx;
+	memcpy((uint8_t *)q->data + idx * esz, elems, first * esz);
+	memcpy(q->data, elems + first * esz, (n - first) * esz);
+}
+static void spsc_copy_out(const spsc_t *q, size_t esz, size_t idx, size_t n, uint8_t *elems) {
+	const size_t first = n < q->mask + 1 - idx ? n : q->mask + 1 - idx;
+	memcpy(elems, (const uint8_t *)q->data + idx * esz, first * esz);
+	memcpy(elems + first * esz, q->data, (n - first) * esz);
+}
+
+size_t _spsc_push(void *queue, size_t elem_size, size_t nelems, const void *elems) {
+	spsc_t *q = spsc_from_data(queue);
+	const size_t cap = q->mask + 1;
+	const size_t head = q->head;
+
+	// Only look at the consumer's cache line when the old tail says full
+	size_t room = cap - (head - q->cached_tail);
+	if (room < nelems) {
+		q->cached_tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+		room = cap - (head - q->cached_tail);
+	}
+	if (nelems > room) nelems = room;
+	if (!nelems) return 0;
+
+	spsc_copy_in(q, elem_size, head & q->mask, nelems, elems);
+	__atomic_store_n(&q->head, head + nelems, __ATOMIC_RELEASE);
+	return nelems;
+}
+size_t _spsc_pop(void *queue, size_t elem_size, size_t nelems, void *elems) {
+	spsc_t *q = spsc_from_data(queue);
+	const size_t tail = q->tail;
+
+	size_t avail = q->cached_head - tail;
+	if (avail < nelems) {
+		q->cached_head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+		avail = q->cached_head - tail;
+	}
+	if (nelems > avail) nelems = avail;
+	if (!nelems) return 0;
+
+	if (elems) spsc_copy_out(q, elem_size, tail & q->mask, nelems, elems);
+	__atomic_store_n(&q->tail, tail + nelems, __ATOMIC_RELEASE);
+	return nelems;
+}
+size_t spsc_len(const void *queue) {
+	const spsc_t *q = spsc_from_data(queue);
+	return __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)
+		- __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+}
+
+typedef struct mpmc_slot {
+	size_t seq;
+	uint64_t data[];
+} mpmc_slot_t;
+
+typedef struct mpmc {
+	mem_alloc_t alloc;
+	size_t mask;
+
+	// Size of a slot in bytes
+	size_t stride;
+	char pad0[64];
+	size_t enqueue_pos;
+	char pad1[64];
+	size_t dequeue_pos;
+	char pad2[64];
+	uint64_t slots[];
+} mpmc_t;
+
+#define mpmc_from_data(_data) ((mpmc_t *)((uintptr_t)(_data) - offsetof(mpmc_t, slots)))
+#define mpmc_slot(q, pos) ((mpmc_slot_t *)((uint8_t *)(q)->slots \
+				+ ((pos) & (q)->mask) * (q)->stride))
+
+void *mpmc_init(mem_alloc_t alloc, size_t elem_size, size_t capacity) {
+	const size_t cap = queue_capacity(capacity);
+	const size_t stride = align_up(sizeof(mpmc_slot_t) + elem_size, sizeof(uint64_t));
+	mpmc_t *q = mem_alloc(alloc, NULL, sizeof(mpmc_t) + cap * stride);
+	if (!q) return NULL;
+
+	q->alloc = alloc;
+	q->mask = cap - 1;
+	q->stride = stride;
+	q->enqueue_pos = q->dequeue_pos = 0;
+	for (size_t i = 0; i < cap; i++) mpmc_slot(q, i)->seq = i;
+	return q->slots;
+}
+void *mpmc_deinit(void *queue) {
+	mpmc_t *q = mpmc_from_data(queue);
+	return mem_alloc(q->alloc, q, 0);
+}
+
+// Claims up to nelems positions from *pos_ptr. A slot at pos is free for the
+// side that wants it when its seq is pos + ready. If the last slot of a batch
+// is free the ones before it were all claimed by the other side a lap ago,
+// so they only need to be waited on. Returns the number claimed into *pos.
+static size_t mpmc_claim(mpmc_t *q, size_t *pos_ptr, const size_t *other_ptr,
+		size_t ready, size_t nelems, size_t *pos) {
+	const size_t cap = q->mask + 1;
+	// A batch can't lap itself
+	if (nelems > cap) nelems = cap;
+
+	size_t at = __atomic_load_n(pos_ptr, __ATOMIC_RELAXED);
+	for (;;) {
+		size_t n = nelems;
+		while (n) {
+			const size_t last = at + n - 1;
+			const size_t seq = __atomic_load_n(&mpmc_slot(q, last)->seq, __ATOMIC_ACQUIRE);
+			const intptr_t diff = (intptr_t)(seq - (last + ready));
+			if (diff == 0) break;
+			// Someone else claimed it already, the position is old
+			if (diff > 0) goto retry;
+
+			// Too big a batch, guess from where the other side is. Only
+			// done now so single elements don't touch its cache line
+			if (n == nelems && n > 1) {
+				const size_t other = __atomic_load_n(other_ptr, __ATOMIC_RELAXED);
+				const intptr_t avail = ready ? (intptr_t)(other - at)
+							: (intptr_t)(other + cap - at);
+				if (avail > 0 && (size_t)avail < n) {
+					n = avail;
+					continue;
+				}
+			}
+			n /= 2;
+		}
+		if (!n) return 0;
+
+		if (__atomic_compare_exchange_n(pos_ptr, &at, at + n, true,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			*pos = at;
+			return n;
+		}
+		continue;
+retry:
+		at = __atomic_load_n(pos_ptr, __ATOMIC_RELAXED);
+	}
+}
+
+size_t _mpmc_push(void *queue, size_t elem_size, size_t nelems, const void *elems) {
+	mpmc_t *q = mpmc_from_data(queue);
+	size_t pos;
+	nelems = mpmc_claim(q, &q->enqueue_pos, &q->dequeue_pos, 0, nelems, &pos);
+
+	for (size_t i = 0; i < nelems; i++) {
+		mpmc_slot_t *slot = mpmc_slot(q, pos + i);
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + i) queue_relax();
+		memcpy(slot->data, (const uint8_t *)elems + i * elem_size, elem_size);
+		__atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	return nelems;
+}
+size_t _mpmc_pop(void *queue, size_t elem_size, size_t nelems, void *elems) {
+	mpmc_t *q = mpmc_from_data(queue);
+	size_t pos;
+	nelems = mpmc_claim(q, &q->dequeue_pos, &q->enqueue_pos, 1, nelems, &pos);
+
+	for (size_t i = 0; i < nelems; i++) {
+		mpmc_slot_t *slot = mpmc_slot(q, pos + i);
+		while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + i + 1) queue_relax();
+		if (elems) memcpy((uint8_t *)elems + i * elem_size, slot->data, elem_size);
+		__atomic_store_n(&slot->seq, pos + i + q->mask + 1, __ATOMIC_RELEASE);
+	}
+	return nelems;
+}
+size_t mpmc_len(const void *queue) {
+	const mpmc_t *q = mpmc_from_data(queue);
+	const size_t tail = __atomic_load_n(&q->dequeue_pos, __ATOMIC_ACQUIRE);
+	const size_t head = __atomic_load_n(&q->enqueue_pos, __ATOMIC_ACQUIRE);
+	return head > tail ? head - tail : 0;
+}
+
+#endif
+
+//
+// EK_USE_TPOOL
+//
+#if EK_USE_TPOOL
+
+// Slots in each worker's deque, a task that doesn't fit runs right away
+#define TPOOL_DEQUE_SIZE 1024
+
+// Slots in the queue that other threads hand tasks in through
+#define TPOOL_INJECT_SIZE 256
+
+// Task nodes each worker's pool starts with
+#define TPOOL_TASK_CHUNKS 64
+
+// Ranges each worker gets from tpool_parallel_for when there is no grain
+#define TPOOL_RANGES_PER_WORKER 8
+
+// Rounds an idle worker looks for work before going to sleep
+#define TPOOL_IDLE_SPINS 256
+
+// Owner of tasks allocated by threads outside of the pool
+#define TPOOL_NO_OWNER SIZE_MAX
+
+struct task {
+	task_fn *fn;
+
+	// Range tasks have no fn and run range_fn over [begin, end) instead
+	task_range_fn *range_fn;
+	void *arg;
+	size_t begin, end, grain;
+
+	// Worker whose dynpool the node came from
+	size_t owner;
+
+	// Next on the owner's list of nodes that other threads freed
+	task_t *next;
+	int state;
+};
+
+// A task goes from pending to done, or to waited on first when a thread that
+// isn't a worker goes to sleep on it
+enum {
+	TASK_PENDING,
+	TASK_WAITED_ON,
+	TASK_DONE,
+};
+
+typedef struct tpool_worker {
+	// Thieves take from the top, only the worker touches the bottom
+	ptrdiff_t top;
+	char pad0[64];
+	ptrdiff_t bottom;
+	task_t *tasks[TPOOL_DEQUE_SIZE];
+
+	dynpool_t *nodes;
+
+	// Nodes freed by other threads, the worker takes them all back at once
+	task_t *remote_free;
+	tpool_t *pool;
+	uint64_t rng;
+	pthread_t thread;
+	char pad1[64];
+} tpool_worker_t;
+
+struct tpool {
+	mem_alloc_t alloc;
+	size_t nworkers;
+	task_t **inject;
+
+	// Guards sleeping, wake is for idle workers and done for other threads
+	// waiting on tasks
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	size_t nsleeping;
+	bool stop;
+	char pad[64];
+	tpool_worker_t workers[];
+};
+
+// Stands in for tasks that ran inside of task_spawn
+static task_t tpool_ran_task = { .state = TASK_DONE };
 
-	elemsz = align_up(elemsz, sizeof(fixedpool_chunk_t)) + sizeof(fixedpool_chunk_t);
-	self->nchunks = (buflen - sizeof(*self)) / elemsz;
-	self->free = NULL;
-	self->freeid = 0;
-	self->elemsz = elemsz;
+static __thread tpool_worker_t *tpool_self;
+
+static tpool_worker_t *tpool_worker(const tpool_t *pool) {
+	return tpool_self && tpool_self->pool == pool ? tpool_self : NULL;
 }
-void fixedpool_fast_clear(void *buf) {
-	fixedpool_t *self = buf;
 
-	self->freeid = 0;
-	self->free = NULL;
+// Spins for a bit, then gives the core up in case the thread it waits on
+// needs it
+static void tpool_backoff(unsigned *spins) {
+	if (++*spins < 64) queue_relax();
+	else sched_yield();
 }
-void *fixedpool_alloc(void *buf) {
-	fixedpool_t *self = buf;
 
-	if (self->freeid != self->nchunks) {
-		return self->data + self->elemsz*(self->freeid++);
+// Chase-Lev deque with the C11 orderings from "Correct and Efficient
+// Work-Stealing for Weak Memory Models" by Le et al. It doesn't grow, so the
+// worker only has to make sure it never laps a thief.
+static bool tpool_push(tpool_worker_t *w, task_t *task) {
+	const ptrdiff_t b = w->bottom;
+	const ptrdiff_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	if (b - t >= TPOOL_DEQUE_SIZE) return false;
+
+	__atomic_store_n(&w->tasks[b & (TPOOL_DEQUE_SIZE - 1)], task, __ATOMIC_RELAXED);
+	__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+static task_t *tpool_take(tpool_worker_t *w) {
+	const ptrdiff_t b = w->bottom - 1;
+	__atomic_store_n(&w->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ptrdiff_t t = __atomic_load_n(&w->top, __ATOMIC_RELAXED);
+	if (t > b) {
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+		return NULL;
 	}
-	if (!self->free) return NULL;
-	void *ptr = self->free;
-	self->free = self->free->next;
-	return ptr;
+
+	task_t *task = __atomic_load_n(&w->tasks[b & (TPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (t == b) {
+		// The last task, which a thief could be taking as well
+		if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+			task = NULL;
+		}
+		__atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELAXED);
+	}
+	return task;
 }
-void fixedpool_free(void *buf, void *blk) {
-	fixedpool_t *self = buf;
+static task_t *tpool_steal(tpool_worker_t *w) {
+	ptrdiff_t t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	const ptrdiff_t b = __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE);
+	if (t >= b) return NULL;
 
-	if (!blk) return;
-	((fixedpool_chunk_t *)blk)->next = self->free;
-	self->free = blk;
+	task_t *task = __atomic_load_n(&w->tasks[t & (TPOOL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+	if (!__atomic_compare_exchange_n(&w->top, &t, t + 1, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return NULL;
+	}
+	return task;
 }
-bool fixedpool_empty(const void *buf) {
-	const fixedpool_t *self = buf;
 
-	if (self->freeid == 0) return 1;
-	size_t nfree = 0;
-	fixedpool_chunk_t *chunk = self->free;
-	while (chunk) {
-		nfree++;
-		chunk = chunk->next;
+static task_t *tpool_task_new(tpool_t *pool, tpool_worker_t *w) {
+	task_t *task;
+	if (!w) {
+		task = mem_alloc(pool->alloc, NULL, sizeof(*task));
+		if (!task) return NULL;
+		task->owner = TPOOL_NO_OWNER;
+	} else {
+		if (__atomic_load_n(&w->remote_free, __ATOMIC_RELAXED)) {
+			task_t *freed = __atomic_exchange_n(&w->remote_free, NULL, __ATOMIC_ACQUIRE);
+			while (freed) {
+				task_t *next = freed->next;
+				dynpool_free(w->nodes, freed);
+				freed = next;
+			}
+		}
+		task = dynpool_alloc(w->nodes);
+		if (!task) return NULL;
+		task->owner = w - pool->workers;
+	}
+	task->state = TASK_PENDING;
+	return task;
+}
+static void tpool_task_free(tpool_t *pool, tpool_worker_t *w, task_t *task) {
+	if (task == &tpool_ran_task) return;
+	if (task->owner == TPOOL_NO_OWNER) {
+		mem_alloc(pool->alloc, task, 0);
+		return;
+	}
+
+	tpool_worker_t *owner = pool->workers + task->owner;
+	if (owner == w) {
+		dynpool_free(w->nodes, task);
+		return;
+	}
+	// Only the owner takes from the list and it takes all of it, so pushes
+	// don't have to worry about ABA
+	task->next = __atomic_load_n(&owner->remote_free, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&owner->remote_free, &task->next, task, true,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// True when there might be something to run. Pairs with the fence in
+// tpool_wake, either a worker going to sleep sees the new task or whoever
+// added it sees the sleeper.
+static bool tpool_has_work(tpool_t *pool) {
+	if (mpmc_len(pool->inject)) return true;
+	for (size_t i = 0; i < pool->nworkers; i++) {
+		const tpool_worker_t *w = pool->workers + i;
+		if (__atomic_load_n(&w->bottom, __ATOMIC_SEQ_CST)
+				> __atomic_load_n(&w->top, __ATOMIC_SEQ_CST)) {
+			return true;
+		}
+	}
+	return false;
+}
+static void tpool_wake(tpool_t *pool) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&pool->nsleeping, __ATOMIC_RELAXED)) return;
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+static void tpool_sleep(tpool_t *pool) {
+	pthread_mutex_lock(&pool->lock);
+	__atomic_fetch_add(&pool->nsleeping, 1, __ATOMIC_SEQ_CST);
+	if (!pool->stop && !tpool_has_work(pool)) pthread_cond_wait(&pool->wake, &pool->lock);
+	__atomic_fetch_sub(&pool->nsleeping, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Looks in the worker's own deque, then steals starting at a random worker.
+// Tasks from other threads are only picked up when inject is set, so waiting
+// on a task doesn't start on unrelated work.
+static task_t *tpool_find(tpool_t *pool, tpool_worker_t *w, bool inject) {
+	task_t *task = tpool_take(w);
+	if (task) return task;
+
+	w->rng ^= w->rng << 13;
+	w->rng ^= w->rng >> 7;
+	w->rng ^= w->rng << 17;
+	const size_t first = w->rng % pool->nworkers;
+	for (size_t i = 0; i < pool->nworkers; i++) {
+		tpool_worker_t *victim = pool->workers + (first + i) % pool->nworkers;
+		if (victim != w && (task = tpool_steal(victim))) return task;
+	}
+	if (inject && mpmc_pop(pool->inject, 1, &task)) return task;
+	return NULL;
+}
+
+// Hands the task to the pool, or runs it when the worker's deque is full
+static void tpool_submit(tpool_t *pool, tpool_worker_t *w, task_t *task);
+static void tpool_run(tpool_t *pool, tpool_worker_t *w, task_t *task);
+
+static void tpool_range(tpool_t *pool, tpool_worker_t *w, task_range_fn *fn, void *arg,
+		size_t begin, size_t end, size_t grain) {
+	// Every split halves the range, so there can't be more of them than bits
+	task_t *pending[sizeof(size_t) * 8];
+	size_t npending = 0;
+
+	// Leaves the upper halves for thieves and keeps going on the lower one
+	while (end - begin > grain) {
+		task_t *task = tpool_task_new(pool, w);
+		if (!task) break;
+
+		const size_t mid = begin + (end - begin) / 2;
+		task->fn = NULL;
+		task->range_fn = fn;
+		task->arg = arg;
+		task->begin = mid;
+		task->end = end;
+		task->grain = grain;
+		tpool_submit(pool, w, task);
+		pending[npending++] = task;
+		end = mid;
+	}
+	fn(arg, begin, end);
+	while (npending) task_wait(pool, pending[--npending]);
+}
+
+static void tpool_run(tpool_t *pool, tpool_worker_t *w, task_t *task) {
+	if (task->fn) task->fn(task->arg);
+	else tpool_range(pool, w, task->range_fn, task->arg, task->begin, task->end, task->grain);
+
+	// The waiter may free the task as soon as it's done, so it's not touched
+	// after this
+	if (__atomic_exchange_n(&task->state, TASK_DONE, __ATOMIC_ACQ_REL) == TASK_WAITED_ON) {
+		pthread_mutex_lock(&pool->lock);
+		pthread_cond_broadcast(&pool->done);
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+static void tpool_submit(tpool_t *pool, tpool_worker_t *w, task_t *task) {
+	if (!w) {
+		unsigned spins = 0;
+		while (!mpmc_push(pool->inject, 1, &task)) tpool_backoff(&spins);
+	} else if (!tpool_push(w, task)) {
+		tpool_run(pool, w, task);
+		return;
+	}
+	tpool_wake(pool);
+}
+
+static void *tpool_main(void *arg) {
+	tpool_worker_t *w = arg;
+	tpool_t *pool = w->pool;
+	unsigned spins = 0;
+	tpool_self = w;
+
+	while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+		task_t *task = tpool_find(pool, w, true);
+		if (task) {
+			tpool_run(pool, w, task);
+			spins = 0;
+		} else if (spins < TPOOL_IDLE_SPINS) {
+			tpool_backoff(&spins);
+		} else {
+			tpool_sleep(pool);
+			spins = 0;
+		}
+	}
+	return NULL;
+}
+
+static void tpool_stop(tpool_t *pool, size_t nstarted) {
+	pthread_mutex_lock(&pool->lock);
+	__atomic_store_n(&pool->stop, true, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (size_t i = 0; i < nstarted; i++) pthread_join(pool->workers[i].thread, NULL);
+	for (size_t i = 0; i < pool->nworkers; i++) {
+		if (pool->workers[i].nodes) dynpool_deinit(pool->workers[i].nodes);
+	}
+	if (pool->inject) mpmc_deinit(pool->inject);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	mem_alloc(pool->alloc, pool, 0);
+}
+
+tpool_t *tpool_init(mem_alloc_t alloc, size_t nthreads) {
+	if (!nthreads) {
+		const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+	}
+	tpool_t *pool = mem_alloc(alloc, NULL, sizeof(*pool) + nthreads * sizeof(tpool_worker_t));
+	if (!pool) return NULL;
+
+	memset(pool, 0, sizeof(*pool) + nthreads * sizeof(tpool_worker_t));
+	pool->alloc = alloc;
+	pool->nworkers = nthreads;
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	bool ok = (pool->inject = mpmc_init(alloc, sizeof(task_t *), TPOOL_INJECT_SIZE));
+	for (size_t i = 0; ok && i < nthreads; i++) {
+		tpool_worker_t *w = pool->workers + i;
+		w->pool = pool;
+		w->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+		ok = (w->nodes = dynpool_init(alloc, TPOOL_TASK_CHUNKS, sizeof(task_t)));
+	}
+
+	size_t nstarted = 0;
+	while (ok && nstarted < nthreads) {
+		ok = !pthread_create(&pool->workers[nstarted].thread, NULL, tpool_main,
+					pool->workers + nstarted);
+		nstarted += ok;
+	}
+	if (!ok) {
+		tpool_stop(pool, nstarted);
+		return NULL;
+	}
+	return pool;
+}
+void tpool_deinit(tpool_t *pool) {
+	tpool_stop(pool, pool->nworkers);
+}
+size_t tpool_nthreads(const tpool_t *pool) {
+	return pool->nworkers;
+}
+
+task_t *task_spawn(tpool_t *pool, task_fn *fn, void *arg) {
+	tpool_worker_t *w = tpool_worker(pool);
+	task_t *task = tpool_task_new(pool, w);
+	if (!task) {
+		fn(arg);
+		return &tpool_ran_task;
 	}
-	return nfree == self->nchunks;
+	task->fn = fn;
+	task->arg = arg;
+	tpool_submit(pool, w, task);
+	return task;
+}
+
+void task_wait(tpool_t *pool, task_t *task) {
+	tpool_worker_t *w = tpool_worker(pool);
+	if (w) {
+		unsigned spins = 0;
+		while (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_DONE) {
+			task_t *other = tpool_find(pool, w, false);
+			if (other) {
+				tpool_run(pool, w, other);
+				spins = 0;
+			} else {
+				tpool_backoff(&spins);
+			}
+		}
+	} else {
+		// Whoever finishes the task sees the mark and broadcasts, but it has
+		// to take the lock first, so that can't happen before this waits
+		int state = TASK_PENDING;
+		pthread_mutex_lock(&pool->lock);
+		__atomic_compare_exchange_n(&task->state, &state, TASK_WAITED_ON, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+		while (__atomic_load_n(&task->state, __ATOMIC_ACQUIRE) != TASK_DONE) {
+			pthread_cond_wait(&pool->done, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+	tpool_task_free(pool, w, task);
+}
+
+void tpool_parallel_for(tpool_t *pool, size_t begin, size_t end, size_t grain,
+		task_range_fn *fn, void *arg) {
+	if (begin >= end) return;
+	if (!grain) {
+		const size_t nranges = pool->nworkers * TPOOL_RANGES_PER_WORKER;
+		grain = (end - begin + nranges - 1) / nranges;
+	}
+
+	tpool_worker_t *w = tpool_worker(pool);
+	if (w) {
+		tpool_range(pool, w, fn, arg, begin, end, grain);
+		return;
+	}
+	// Splitting starts on a worker so that the halves go on a deque
+	task_t *task = end - begin > grain ? tpool_task_new(pool, NULL) : NULL;
+	if (!task) {
+		fn(arg, begin, end);
+		return;
+	}
+	task->fn = NULL;
+	task->range_fn = fn;
+	task->arg = arg;
+	task->begin = begin;
+	task->end = end;
+	task->grain = grain;
+	tpool_submit(pool, NULL, task);
+	task_wait(pool, task);
 }
 
 #endif
 
 //
-// EK_USE_PACKET
+// EK_USE_BTREE
 //
-#if EK_USE_PACKET
+#if EK_USE_BTREE
 
-uint32_t packet_htonf(float in) {
-	uint8_t *bytes = (uint8_t*)&in;
-	return bytes[0] << 24 |
-		bytes[1] << 16 |
-		bytes[2] << 8 |
-		bytes[3];
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define EK_BTREE_AVX2 1
+#	include <immintrin.h>
+#endif
+
+#define BTREE_KEYS 16
+#define BTREE_MIN_KEYS (BTREE_KEYS / 2)
+
+// Every internal node has at least BTREE_MIN_KEYS + 1 children, so 2^64 keys
+// fit well under this
+#define BTREE_MAX_HEIGHT 32
+
+typedef struct btree_node btree_node_t;
+struct btree_node {
+	// Sorted, the unused ones are UINT64_MAX so searches can always look at
+	// all of them
+	uint64_t keys[BTREE_KEYS];
+	uint32_t n;
+	bool leaf;
+	union {
+		// Keys under children[i] are >= keys[i - 1] and < keys[i]
+		btree_node_t *children[BTREE_KEYS + 1];
+		struct {
+			uint64_t vals[BTREE_KEYS];
+			btree_node_t *next;
+		};
+	};
+};
+
+typedef size_t (btree_rank_fn)(const uint64_t *keys, uint64_t key);
+
+struct btree {
+	mem_alloc_t alloc;
+	dynpool_t *nodes;
+	btree_node_t *root;
+	size_t len;
+	size_t height;
+	btree_rank_fn *rank;
+
+	// Nodes set aside before an insert so that splits can't run out of memory
+	// half way up the tree
+	btree_node_t *spare[BTREE_MAX_HEIGHT];
+	size_t nspare;
+};
+
+// Number of keys < key. The padding is never less than anything.
+static size_t btree_rank_scalar(const uint64_t *keys, uint64_t key) {
+	size_t n = 0;
+	for (int i = 0; i < BTREE_KEYS; i++) n += keys[i] < key;
+	return n;
 }
-float packet_ntohf(uint32_t in) {
-	uint8_t* bytes = (uint8_t*)&in;
-	uint32_t val = bytes[0] << 24 |
-		bytes[1] << 16 |
-		bytes[2] << 8 |
-		bytes[3];
-	return *((float *)&val);
+
+#if EK_BTREE_AVX2
+// There is only a signed compare, so both sides get their top bit flipped
+__attribute__((target("avx2")))
+static size_t btree_rank_avx2(const uint64_t *keys, uint64_t key) {
+	const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+	const __m256i k = _mm256_xor_si256(_mm256_set1_epi64x(key), sign);
+	unsigned mask = 0;
+	for (int i = 0; i < BTREE_KEYS; i += 4) {
+		const __m256i v = _mm256_xor_si256(
+			_mm256_loadu_si256((const __m256i *)(keys + i)), sign);
+		const __m256i lt = _mm256_cmpgt_epi64(k, v);
+		mask |= (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(lt)) << i;
+	}
+	return __builtin_popcount(mask);
 }
+#endif
 
-int packet_bytecount(int head) {
-	return (head / 8) + ((head % 8) ? 1 : 0);
+// Number of keys <= key, which is also the child that key is under
+static size_t btree_rank_le(const btree_t *tree, const btree_node_t *node, uint64_t key) {
+	return key == UINT64_MAX ? node->n : tree->rank(node->keys, key + 1);
 }
-void packet_write_bit(uint8_t *buf, int *bitlen, int value) {
-	if (value) buf[*bitlen / 8] |= (1 << (*bitlen % 8));
-	else buf[*bitlen / 8] &= ~(1 << (*bitlen % 8));
-	(*bitlen)++;
+
+static void btree_pad(btree_node_t *node) {
+	for (size_t i = node->n; i < BTREE_KEYS; i++) node->keys[i] = UINT64_MAX;
 }
-int packet_read_bit(const uint8_t *buf, int *bitlen) {
-	int value = buf[*bitlen / 8] & (1 << (*bitlen % 8));
-	(*bitlen)++;
-	return value ? 1 : 0;
+
+static btree_node_t *btree_node_new(btree_t *tree, bool leaf) {
+	btree_node_t *node = tree->nspare ? tree->spare[--tree->nspare] : dynpool_alloc(tree->nodes);
+	if (!node) return NULL;
+	node->n = 0;
+	node->leaf = leaf;
+	btree_pad(node);
+	if (leaf) node->next = NULL;
+	return node;
 }
-void packet_write_bits(uint8_t *buf, int *bitlen, uint64_t value, int numbits) {
-	int i;
-	for (i = 0; i < numbits; i++)
-		packet_write_bit(buf, bitlen, value & (uint64_t)1 << (uint64_t)i);
+
+btree_t *btree_init(mem_alloc_t alloc) {
+	btree_t *tree = mem_alloc(alloc, NULL, sizeof(*tree));
+	if (!tree) return NULL;
+
+	tree->alloc = alloc;
+	tree->len = 0;
+	tree->height = 1;
+	tree->nspare = 0;
+	tree->rank = btree_rank_scalar;
+#if EK_BTREE_AVX2
+	if (__builtin_cpu_supports("avx2")) tree->rank = btree_rank_avx2;
+#endif
+
+	tree->nodes = dynpool_init(alloc, 16, sizeof(btree_node_t));
+	if (!tree->nodes || !(tree->root = btree_node_new(tree, true))) {
+		if (tree->nodes) dynpool_deinit(tree->nodes);
+		mem_alloc(alloc, tree, 0);
+		return NULL;
+	}
+	return tree;
 }
-uint64_t packet_read_bits(const uint8_t *buf, int *bitlen, int numbits) {
-	uint64_t value = 0, i;
-	for (i = 0; i < numbits; i++) {
-		value |= (uint64_t)packet_read_bit(buf, bitlen) << i;
+void btree_deinit(btree_t *tree) {
+	dynpool_deinit(tree->nodes);
+	mem_alloc(tree->alloc, tree, 0);
+}
+size_t btree_len(const btree_t *tree) {
+	return tree->len;
+}
+
+bool btree_get(const btree_t *tree, uint64_t key, uint64_t *val) {
+	const btree_node_t *node = tree->root;
+	while (!node->leaf) node = node->children[btree_rank_le(tree, node, key)];
+
+	const size_t i = tree->rank(node->keys, key);
+	if (i == node->n || node->keys[i] != key) return false;
+	if (val) *val = node->vals[i];
+	return true;
+}
+
+// Inserts into the subtree under node. When node splits the new right half
+// comes back in *split, along with the lowest key under it in *sep.
+static void btree_insert_at(btree_t *tree, btree_node_t *node, uint64_t key, uint64_t val,
+		uint64_t *sep, btree_node_t **split) {
+	*split = NULL;
+	if (node->leaf) {
+		size_t i = tree->rank(node->keys, key);
+		if (i < node->n && node->keys[i] == key) {
+			node->vals[i] = val;
+			return;
+		}
+		tree->len++;
+
+		btree_node_t *dst = node;
+		if (node->n == BTREE_KEYS) {
+			btree_node_t *right = btree_node_new(tree, true);
+			memcpy(right->keys, node->keys + BTREE_MIN_KEYS, BTREE_MIN_KEYS * sizeof(uint64_t));
+			memcpy(right->vals, node->vals + BTREE_MIN_KEYS, BTREE_MIN_KEYS * sizeof(uint64_t));
+			right->n = node->n = BTREE_MIN_KEYS;
+			btree_pad(node);
+			right->next = node->next;
+			node->next = right;
+			if (i > BTREE_MIN_KEYS) {
+				dst = right;
+				i -= BTREE_MIN_KEYS;
+			}
+			*split = right;
+		}
+
+		memmove(dst->keys + i + 1, dst->keys + i, (dst->n - i) * sizeof(uint64_t));
+		memmove(dst->vals + i + 1, dst->vals + i, (dst->n - i) * sizeof(uint64_t));
+		dst->keys[i] = key;
+		dst->vals[i] = val;
+		dst->n++;
+		if (*split) *sep = (*split)->keys[0];
+		return;
 	}
-	return value;
+
+	const size_t c = btree_rank_le(tree, node, key);
+	uint64_t child_sep;
+	btree_node_t *child_split;
+	btree_insert_at(tree, node->children[c], key, val, &child_sep, &child_split);
+	if (!child_split) return;
+
+	// Lays out all 17 keys and 18 children, then splits them around the
+	// middle key when they don't fit
+	uint64_t keys[BTREE_KEYS + 1];
+	btree_node_t *children[BTREE_KEYS + 2];
+	memcpy(keys, node->keys, c * sizeof(uint64_t));
+	keys[c] = child_sep;
+	memcpy(keys + c + 1, node->keys + c, (node->n - c) * sizeof(uint64_t));
+	memcpy(children, node->children, (c + 1) * sizeof(btree_node_t *));
+	children[c + 1] = child_split;
+	memcpy(children + c + 2, node->children + c + 1, (node->n - c) * sizeof(btree_node_t *));
+
+	const size_t n = node->n + 1;
+	if (n <= BTREE_KEYS) {
+		memcpy(node->keys, keys, n * sizeof(uint64_t));
+		memcpy(node->children, children, (n + 1) * sizeof(btree_node_t *));
+		node->n = n;
+		return;
+	}
+
+	btree_node_t *right = btree_node_new(tree, false);
+	node->n = BTREE_MIN_KEYS;
+	memcpy(node->keys, keys, BTREE_MIN_KEYS * sizeof(uint64_t));
+	memcpy(node->children, children, (BTREE_MIN_KEYS + 1) * sizeof(btree_node_t *));
+	btree_pad(node);
+	right->n = BTREE_KEYS - BTREE_MIN_KEYS;
+	memcpy(right->keys, keys + BTREE_MIN_KEYS + 1, right->n * sizeof(uint64_t));
+	memcpy(right->children, children + BTREE_MIN_KEYS + 1, (right->n + 1) * sizeof(btree_node_t *));
+	*sep = keys[BTREE_MIN_KEYS];
+	*split = right;
+}
+
+bool btree_insert(btree_t *tree, uint64_t key, uint64_t val) {
+	// A split can go all the way up and add a new root
+	while (tree->nspare < tree->height + 1) {
+		btree_node_t *node = dynpool_alloc(tree->nodes);
+		if (!node) return false;
+		tree->spare[tree->nspare++] = node;
+	}
+
+	uint64_t sep;
+	btree_node_t *split;
+	btree_insert_at(tree, tree->root, key, val, &sep, &split);
+	if (split) {
+		btree_node_t *root = btree_node_new(tree, false);
+		root->n = 1;
+		root->keys[0] = sep;
+		root->children[0] = tree->root;
+		root->children[1] = split;
+		tree->root = root;
+		tree->height++;
+	}
+	return true;
+}
+
+// Moves the first n kv pairs of a leaf onto the end of the one before it. For
+// internal nodes it's the first n children, the separator between the nodes
+// comes down in front of their keys and the last key taken goes up instead.
+static void btree_shift_left(btree_node_t *left, btree_node_t *right, size_t n, uint64_t sep) {
+	if (left->leaf) {
+		memcpy(left->keys + left->n, right->keys, n * sizeof(uint64_t));
+		memcpy(left->vals + left->n, right->vals, n * sizeof(uint64_t));
+	} else {
+		left->keys[left->n] = sep;
+		memcpy(left->keys + left->n + 1, right->keys, (n - 1) * sizeof(uint64_t));
+		memcpy(left->children + left->n + 1, right->children, n * sizeof(btree_node_t *));
+	}
+	left->n += n;
+
+	// Everything moved, right is being merged away
+	if (n == right->n + !right->leaf) return;
+
+	memmove(right->keys, right->keys + n, (right->n - n) * sizeof(uint64_t));
+	if (right->leaf) {
+		memmove(right->vals, right->vals + n, (right->n - n) * sizeof(uint64_t));
+	} else {
+		memmove(right->children, right->children + n,
+			(right->n + 1 - n) * sizeof(btree_node_t *));
+	}
+	right->n -= n;
+	btree_pad(right);
+}
+
+// Fixes up children[c] of node after it went under the minimum, by taking
+// a key from a sibling or merging with one
+static void btree_rebalance(btree_t *tree, btree_node_t *node, size_t c) {
+	btree_node_t *child = node->children[c];
+
+	if (c > 0 && node->children[c - 1]->n > BTREE_MIN_KEYS) {
+		btree_node_t *left = node->children[c - 1];
+		memmove(child->keys + 1, child->keys, child->n * sizeof(uint64_t));
+		if (child->leaf) {
+			memmove(child->vals + 1, child->vals, child->n * sizeof(uint64_t));
+			child->keys[0] = left->keys[left->n - 1];
+			child->vals[0] = left->vals[left->n - 1];
+			node->keys[c - 1] = child->keys[0];
+		} else {
+			memmove(child->children + 1, child->children,
+				(child->n + 1) * sizeof(btree_node_t *));
+			child->keys[0] = node->keys[c - 1];
+			child->children[0] = left->children[left->n];
+			node->keys[c - 1] = left->keys[left->n - 1];
+		}
+		child->n++;
+		left->n--;
+		btree_pad(left);
+		return;
+	}
+
+	if (c < node->n && node->children[c + 1]->n > BTREE_MIN_KEYS) {
+		btree_node_t *right = node->children[c + 1];
+		const uint64_t up = right->leaf ? right->keys[1] : right->keys[0];
+		btree_shift_left(child, right, 1, node->keys[c]);
+		node->keys[c] = up;
+		return;
+	}
+
+	// Merges children[c] and the one after it, or the one before it
+	if (c == node->n) c--;
+	btree_node_t *left = node->children[c], *right = node->children[c + 1];
+	btree_shift_left(left, right, right->n + !right->leaf, node->keys[c]);
+	if (left->leaf) left->next = right->next;
+	dynpool_free(tree->nodes, right);
+
+	memmove(node->keys + c, node->keys + c + 1, (node->n - c - 1) * sizeof(uint64_t));
+	memmove(node->children + c + 1, node->children + c + 2,
+		(node->n - c - 1) * sizeof(btree_node_t *));
+	node->n--;
+	btree_pad(node);
+}
+
+static bool btree_remove_at(btree_t *tree, btree_node_t *node, uint64_t key, uint64_t *val) {
+	if (node->leaf) {
+		const size_t i = tree->rank(node->keys, key);
+		if (i == node->n || node->keys[i] != key) return false;
+		if (val) *val = node->vals[i];
+
+		memmove(node->keys + i, node->keys + i + 1, (node->n - i - 1) * sizeof(uint64_t));
+		memmove(node->vals + i, node->vals + i + 1, (node->n - i - 1) * sizeof(uint64_t));
+		node->n--;
+		btree_pad(node);
+		tree->len--;
+		return true;
+	}
+
+	const size_t c = btree_rank_le(tree, node, key);
+	if (!btree_remove_at(tree, node->children[c], key, val)) return false;
+	if (node->children[c]->n < BTREE_MIN_KEYS) btree_rebalance(tree, node, c);
+	return true;
+}
+
+bool btree_remove(btree_t *tree, uint64_t key, uint64_t *val) {
+	if (!btree_remove_at(tree, tree->root, key, val)) return false;
+
+	btree_node_t *root = tree->root;
+	if (!root->leaf && !root->n) {
+		tree->root = root->children[0];
+		tree->height--;
+		dynpool_free(tree->nodes, root);
+	}
+	return true;
+}
+
+// Builds the tree a level at a time from the bottom. Every level spreads its
+// entries evenly over as few nodes as will hold them, which keeps them all at
+// or above the minimum.
+bool btree_bulk_load(btree_t *tree, const btree_kv_t *kvs) {
+	const size_t len = *vec_len(kvs);
+	dynpool_fast_clear(tree->nodes);
+	tree->nspare = 0;
+	tree->len = 0;
+	tree->height = 1;
+	tree->root = btree_node_new(tree, true);
+
+	bool ok = tree->root != NULL;
+	for (size_t i = 1; ok && i < len; i++) ok = kvs[i - 1].key < kvs[i].key;
+	if (!ok || len <= BTREE_KEYS) {
+		for (size_t i = 0; ok && i < len; i++) {
+			tree->root->keys[i] = kvs[i].key;
+			tree->root->vals[i] = kvs[i].val;
+		}
+		if (ok) tree->root->n = len;
+		tree->len = tree->root->n;
+		return ok;
+	}
+
+	// Each node and the lowest key under it, the level above is built over
+	// the start of the same arrays
+	size_t nnodes = (len + BTREE_KEYS - 1) / BTREE_KEYS;
+	btree_node_t **nodes = mem_alloc(tree->alloc, NULL, nnodes * sizeof(*nodes));
+	uint64_t *lows = mem_alloc(tree->alloc, NULL, nnodes * sizeof(*lows));
+	ok = nodes && lows;
+
+	btree_node_t *prev = NULL;
+	for (size_t i = 0, at = 0; ok && i < nnodes; i++) {
+		btree_node_t *leaf = i ? btree_node_new(tree, true) : tree->root;
+		if (!(ok = leaf)) break;
+
+		leaf->n = len / nnodes + (i < len % nnodes);
+		for (size_t j = 0; j < leaf->n; j++, at++) {
+			leaf->keys[j] = kvs[at].key;
+			leaf->vals[j] = kvs[at].val;
+		}
+		if (prev) prev->next = leaf;
+		prev = leaf;
+		nodes[i] = leaf;
+		lows[i] = leaf->keys[0];
+	}
+
+	while (ok && nnodes > 1) {
+		const size_t nchildren = nnodes;
+		nnodes = (nchildren + BTREE_KEYS) / (BTREE_KEYS + 1);
+		for (size_t i = 0, at = 0; i < nnodes; i++) {
+			btree_node_t *node = btree_node_new(tree, false);
+			if (!(ok = node)) break;
+
+			const size_t n = nchildren / nnodes + (i < nchildren % nnodes);
+			const uint64_t low = lows[at];
+			for (size_t j = 0; j < n; j++, at++) {
+				node->children[j] = nodes[at];
+				if (j) node->keys[j - 1] = lows[at];
+			}
+			node->n = n - 1;
+			nodes[i] = node;
+			lows[i] = low;
+		}
+		tree->height++;
+	}
+
+	if (ok) {
+		tree->root = nodes[0];
+		tree->len = len;
+	} else {
+		dynpool_fast_clear(tree->nodes);
+		tree->height = 1;
+		tree->root = btree_node_new(tree, true);
+	}
+	// A NULL block would be allocated, not freed
+	if (nodes) mem_alloc(tree->alloc, nodes, 0);
+	if (lows) mem_alloc(tree->alloc, lows, 0);
+	return ok;
+}
+
+btree_iter_t btree_first(const btree_t *tree) {
+	const btree_node_t *node = tree->root;
+	while (!node->leaf) node = node->children[0];
+	return (btree_iter_t){ .leaf = node, .idx = 0 };
+}
+btree_iter_t btree_lower_bound(const btree_t *tree, uint64_t key) {
+	const btree_node_t *node = tree->root;
+	while (!node->leaf) node = node->children[btree_rank_le(tree, node, key)];
+	return (btree_iter_t){ .leaf = node, .idx = tree->rank(node->keys, key) };
+}
+btree_iter_t btree_upper_bound(const btree_t *tree, uint64_t key) {
+	const btree_node_t *node = tree->root;
+	while (!node->leaf) node = node->children[btree_rank_le(tree, node, key)];
+	return (btree_iter_t){ .leaf = node, .idx = btree_rank_le(tree, node, key) };
+}
+
+bool btree_next(btree_iter_t *iter, btree_kv_t *kv) {
+	const btree_node_t *leaf = iter->leaf;
+	// Bounds past the end of a leaf are at the start of the next one
+	while (leaf && iter->idx >= leaf->n) {
+		leaf = leaf->next;
+		iter->idx = 0;
+	}
+	iter->leaf = leaf;
+	if (!leaf) return false;
+
+	kv->key = leaf->keys[iter->idx];
+	kv->val = leaf->vals[iter->idx];
+	iter->idx++;
+	return true;
+}
+
+#endif
+
+//
+// EK_USE_ART
+//
+#if EK_USE_ART
+
+#if defined(__SSE2__)
+#	include <emmintrin.h>
+#endif
+
+// Prefix bytes kept in a node, longer prefixes are checked against a leaf
+#define ART_PREFIX 16
+
+enum {
+	ART_LEAF,
+	ART_NODE4,
+	ART_NODE16,
+	ART_NODE48,
+	ART_NODE256,
+	ART_NTYPES,
+};
+
+typedef struct art_leaf {
+	strview_t key;
+	void *val;
+} art_leaf_t;
+
+// Children are tagged with the low bit when they're leaves
+typedef struct art_node {
+	uint8_t type;
+	uint16_t n;
+	uint32_t prefix_len;
+	uint8_t prefix[ART_PREFIX];
+
+	// The key that ends right after the prefix, if there is one
+	art_leaf_t *term;
+} art_node_t;
+
+typedef struct art_node4 {
+	art_node_t hdr;
+	uint8_t keys[4];
+	void *children[4];
+} art_node4_t;
+
+typedef struct art_node16 {
+	art_node_t hdr;
+	uint8_t keys[16];
+	void *children[16];
+} art_node16_t;
+
+// index holds a slot in children plus 1, children can have holes in it
+typedef struct art_node48 {
+	art_node_t hdr;
+	uint8_t index[256];
+	void *children[48];
+} art_node48_t;
+
+typedef struct art_node256 {
+	art_node_t hdr;
+	void *children[256];
+} art_node256_t;
+
+struct art {
+	mem_alloc_t alloc;
+	dynpool_t *pools[ART_NTYPES];
+	void *root;
+	size_t len;
+};
+
+static const size_t art_sizes[ART_NTYPES] = {
+	sizeof(art_leaf_t), sizeof(art_node4_t), sizeof(art_node16_t),
+	sizeof(art_node48_t), sizeof(art_node256_t),
+};
+
+#define art_is_leaf(ref) ((uintptr_t)(ref) & 1)
+#define art_leaf(ref) ((art_leaf_t *)((uintptr_t)(ref) & ~(uintptr_t)1))
+#define art_tag(leaf) ((void *)((uintptr_t)(leaf) | 1))
+
+static bool art_key_eq(strview_t a, strview_t b) {
+	return a.len == b.len && !memcmp(a.str, b.str, a.len);
 }
-void packet_write_u8(uint8_t *buf, int *bitlen, uint8_t value) {
-	if (!value) {
-		packet_write_bit(buf, bitlen, 0);
-	}
-	else if (!(value & ~0xf)) {
-		packet_write_bits(buf, bitlen, 1, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)value, 4);
+
+art_t *art_init(mem_alloc_t alloc) {
+	art_t *tree = mem_alloc(alloc, NULL, sizeof(*tree));
+	if (!tree) return NULL;
+
+	tree->alloc = alloc;
+	tree->root = NULL;
+	tree->len = 0;
+	bool ok = true;
+	for (int i = 0; i < ART_NTYPES; i++) {
+		tree->pools[i] = ok ? dynpool_init(alloc, i == ART_NODE256 ? 4 : 64, art_sizes[i]) : NULL;
+		ok = ok && tree->pools[i];
 	}
-	else {
-		packet_write_bits(buf, bitlen, 3, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)value, 8);
+	if (!ok) {
+		art_deinit(tree);
+		return NULL;
 	}
+	return tree;
 }
-void packet_write_u16(uint8_t *buf, int *bitlen, uint16_t value) {
-	if (!value) {
-		packet_write_bits(buf, bitlen, 0, 2);
-	}
-	else if (!(value & ~0x1f)) {
-		packet_write_bits(buf, bitlen, 1, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)value, 5);
-	}
-	else if (!(value & ~0xff)) {
-		packet_write_bits(buf, bitlen, 2, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)value, 8);
-	}
-	else {
-		packet_write_bits(buf, bitlen, 3, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)value, 16);
+void art_deinit(art_t *tree) {
+	for (int i = 0; i < ART_NTYPES; i++) {
+		if (tree->pools[i]) dynpool_deinit(tree->pools[i]);
 	}
+	mem_alloc(tree->alloc, tree, 0);
 }
-void packet_write_u32(uint8_t *buf, int *bitlen, uint32_t value) {
-	if (!value) {
-		packet_write_bits(buf, bitlen, 0, 2);
+size_t art_len(const art_t *tree) {
+	return tree->len;
+}
+
+static art_node_t *art_node_new(art_t *tree, int type) {
+	art_node_t *node = dynpool_alloc(tree->pools[type]);
+	if (!node) return NULL;
+
+	memset(node, 0, art_sizes[type]);
+	node->type = type;
+	return node;
+}
+static void art_node_free(art_t *tree, art_node_t *node) {
+	dynpool_free(tree->pools[node->type], node);
+}
+
+static void **art_find(const art_node_t *node, uint8_t byte) {
+	switch (node->type) {
+	case ART_NODE4: {
+		art_node4_t *n4 = (art_node4_t *)node;
+		for (int i = 0; i < node->n; i++) {
+			if (n4->keys[i] == byte) return n4->children + i;
+		}
+		return NULL;
 	}
-	else if (!(value & ~0x3f)) {
-		packet_write_bits(buf, bitlen, 1, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)value, 6);
+	case ART_NODE16: {
+		art_node16_t *n16 = (art_node16_t *)node;
+#if defined(__SSE2__)
+		const __m128i eq = _mm_cmpeq_epi8(_mm_set1_epi8(byte),
+					_mm_loadu_si128((const __m128i *)n16->keys));
+		const unsigned mask = _mm_movemask_epi8(eq) & ((1u << node->n) - 1);
+		return mask ? n16->children + __builtin_ctz(mask) : NULL;
+#else
+		for (int i = 0; i < node->n; i++) {
+			if (n16->keys[i] == byte) return n16->children + i;
+		}
+		return NULL;
+#endif
 	}
-	else if (!(value & ~0x7ff)) {
-		packet_write_bits(buf, bitlen, 2, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)value, 11);
+	case ART_NODE48: {
+		art_node48_t *n48 = (art_node48_t *)node;
+		return n48->index[byte] ? n48->children + n48->index[byte] - 1 : NULL;
+	}
+	default: {
+		art_node256_t *n256 = (art_node256_t *)node;
+		return n256->children[byte] ? n256->children + byte : NULL;
 	}
-	else {
-		packet_write_bits(buf, bitlen, 3, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)value, 32);
 	}
 }
-void packet_write_s16(uint8_t *buf, int *bitlen, int16_t value) {
-	if (!value) {
-		packet_write_bits(buf, bitlen, 0, 2);
+
+// The first child in byte order
+static void *art_first_child(const art_node_t *node) {
+	switch (node->type) {
+	case ART_NODE4: return ((const art_node4_t *)node)->children[0];
+	case ART_NODE16: return ((const art_node16_t *)node)->children[0];
+	case ART_NODE48: {
+		const art_node48_t *n48 = (const art_node48_t *)node;
+		for (int i = 0; i < 256; i++) if (n48->index[i]) return n48->children[n48->index[i] - 1];
+		return NULL;
 	}
-	else if (value >= -0x10 && value < 0x10) {
-		packet_write_bits(buf, bitlen, 1, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)(value+0x10), 5);
+	default: {
+		const art_node256_t *n256 = (const art_node256_t *)node;
+		for (int i = 0; i < 256; i++) if (n256->children[i]) return n256->children[i];
+		return NULL;
 	}
-	else if (value >= -0x80 && value < 0x80) {
-		packet_write_bits(buf, bitlen, 2, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)(value+0x80), 8);
 	}
-	else {
-		packet_write_bits(buf, bitlen, 3, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)((int64_t)value+0x8000), 16);
+}
+
+// Any leaf under the node, they all have the whole prefix in their keys
+static const art_leaf_t *art_any_leaf(const void *ref) {
+	while (!art_is_leaf(ref)) {
+		const art_node_t *node = ref;
+		if (node->term) return node->term;
+		ref = art_first_child(node);
 	}
+	return art_leaf(ref);
 }
-void packet_write_s32(uint8_t *buf, int *bitlen, int32_t value) {
-	if (!value) {
-		packet_write_bits(buf, bitlen, 0, 2);
+
+// Number of bytes of the node's prefix that match key from depth, which stops
+// short at the end of the key
+static size_t art_prefix_match(const art_node_t *node, strview_t key, size_t depth) {
+	const size_t len = node->prefix_len < key.len - depth ? node->prefix_len : key.len - depth;
+	const size_t stored = len < ART_PREFIX ? len : ART_PREFIX;
+	const uint8_t *bytes = (const uint8_t *)key.str + depth;
+
+	size_t i = 0;
+	while (i < stored && node->prefix[i] == bytes[i]) i++;
+	if (i < stored || i == len) return i;
+
+	const uint8_t *full = (const uint8_t *)art_any_leaf(node)->key.str + depth;
+	while (i < len && full[i] == bytes[i]) i++;
+	return i;
+}
+
+static void art_set_prefix(art_node_t *node, const uint8_t *bytes, size_t len) {
+	node->prefix_len = len;
+	memcpy(node->prefix, bytes, len < ART_PREFIX ? len : ART_PREFIX);
+}
+
+// Adds a child to a node that doesn't have one for byte yet, moving the node
+// to the next size up when it's full
+static bool art_add_child(art_t *tree, void **ref, uint8_t byte, void *child) {
+	art_node_t *node = *ref;
+	switch (node->type) {
+	case ART_NODE4:
+	case ART_NODE16: {
+		const int cap = node->type == ART_NODE4 ? 4 : 16;
+		uint8_t *keys = node->type == ART_NODE4 ? ((art_node4_t *)node)->keys
+							: ((art_node16_t *)node)->keys;
+		void **children = node->type == ART_NODE4 ? ((art_node4_t *)node)->children
+							: ((art_node16_t *)node)->children;
+		if (node->n < cap) {
+			int i = 0;
+			while (i < node->n && keys[i] < byte) i++;
+			memmove(keys + i + 1, keys + i, node->n - i);
+			memmove(children + i + 1, children + i, (node->n - i) * sizeof(void *));
+			keys[i] = byte;
+			children[i] = child;
+			node->n++;
+			return true;
+		}
+
+		art_node_t *grown = art_node_new(tree, node->type + 1);
+		if (!grown) return false;
+		memcpy(grown, node, sizeof(art_node_t));
+		grown->type = node->type + 1;
+		if (node->type == ART_NODE4) {
+			memcpy(((art_node16_t *)grown)->keys, keys, 4);
+			memcpy(((art_node16_t *)grown)->children, children, 4 * sizeof(void *));
+		} else {
+			art_node48_t *n48 = (art_node48_t *)grown;
+			for (int i = 0; i < 16; i++) {
+				n48->index[keys[i]] = i + 1;
+				n48->children[i] = children[i];
+			}
+		}
+		art_node_free(tree, node);
+		*ref = grown;
+		return art_add_child(tree, ref, byte, child);
 	}
-	else if (value >= -0x20 && value < 0x20) {
-		packet_write_bits(buf, bitlen, 1, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)(value+0x20), 6);
+	case ART_NODE48: {
+		art_node48_t *n48 = (art_node48_t *)node;
+		if (node->n < 48) {
+			int slot = 0;
+			while (n48->children[slot]) slot++;
+			n48->children[slot] = child;
+			n48->index[byte] = slot + 1;
+			node->n++;
+			return true;
+		}
+
+		art_node256_t *grown = (art_node256_t *)art_node_new(tree, ART_NODE256);
+		if (!grown) return false;
+		memcpy(grown, node, sizeof(art_node_t));
+		grown->hdr.type = ART_NODE256;
+		for (int i = 0; i < 256; i++) {
+			if (n48->index[i]) grown->children[i] = n48->children[n48->index[i] - 1];
+		}
+		art_node_free(tree, node);
+		*ref = grown;
+		return art_add_child(tree, ref, byte, child);
 	}
-	else if (value >= -0x400 && value < 0x400) {
-		packet_write_bits(buf, bitlen, 2, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)(value+0x400), 11);
+	default: {
+		art_node256_t *n256 = (art_node256_t *)node;
+		n256->children[byte] = child;
+		node->n++;
+		return true;
 	}
-	else {
-		packet_write_bits(buf, bitlen, 3, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)((int64_t)value+0x80000000), 32);
 	}
 }
-void packet_write_float(uint8_t *buf, int *bitlen, float value) {
-	float a = fabsf(value);
-	uint16_t fixed = 0;
 
-	if (a < 0.001f) {
-		packet_write_bits(buf, bitlen, 0, 2);
-	}
-	else if (a < 8.0f) {
-		packet_write_bits(buf, bitlen, 1, 2);
-		fixed |= value < 0;
-		fixed |= ((uint16_t)a & 0x7) << 1;
-		fixed |= (uint16_t)(fmodf(a, 1.0f) * 1024.0f) << 4;
-		packet_write_bits(buf, bitlen, (uint64_t)fixed, 14);
+static bool art_insert_at(art_t *tree, void **ref, art_leaf_t *leaf, size_t depth) {
+	const strview_t key = leaf->key;
+	const uint8_t *bytes = (const uint8_t *)key.str;
+
+	if (art_is_leaf(*ref)) {
+		art_leaf_t *old = art_leaf(*ref);
+		if (art_key_eq(old->key, key)) {
+			*old = *leaf;
+			dynpool_free(tree->pools[ART_LEAF], leaf);
+			return true;
+		}
+
+		// Both go under a new node with the bytes they share as its prefix
+		art_node_t *node = art_node_new(tree, ART_NODE4);
+		if (!node) return false;
+		const uint8_t *old_bytes = (const uint8_t *)old->key.str;
+		size_t shared = 0;
+		while (depth + shared < key.len && depth + shared < old->key.len
+				&& bytes[depth + shared] == old_bytes[depth + shared]) {
+			shared++;
+		}
+		art_set_prefix(node, bytes + depth, shared);
+		depth += shared;
+
+		void *next = node;
+		if (old->key.len == depth) node->term = old;
+		else art_add_child(tree, &next, old_bytes[depth], *ref);
+		if (key.len == depth) node->term = leaf;
+		else art_add_child(tree, &next, bytes[depth], art_tag(leaf));
+		*ref = node;
+		tree->len++;
+		return true;
 	}
-	else if (a < 127.0f) {
-		packet_write_bits(buf, bitlen, 2, 2);
-		fixed |= value < 0;
-		fixed |= ((uint16_t)a & 0x7f) << 1;
-		fixed |= (uint16_t)(fmodf(a, 1.0f) * 256.0f) << 8;
-		packet_write_bits(buf, bitlen, (uint64_t)fixed, 16);
+
+	art_node_t *node = *ref;
+	const size_t matched = art_prefix_match(node, key, depth);
+	if (matched < node->prefix_len) {
+		// Splits the prefix where the key goes its own way. The bytes of the
+		// old prefix past what is stored come from one of its leaves.
+		art_node_t *split = art_node_new(tree, ART_NODE4);
+		if (!split) return false;
+		art_set_prefix(split, bytes + depth, matched);
+
+		const uint8_t *full = node->prefix_len > ART_PREFIX
+			? (const uint8_t *)art_any_leaf(node)->key.str + depth : node->prefix;
+		void *next = split;
+		art_add_child(tree, &next, full[matched], node);
+		memmove(node->prefix, full + matched + 1,
+			ART_PREFIX < node->prefix_len - matched - 1 ? ART_PREFIX : node->prefix_len - matched - 1);
+		node->prefix_len -= matched + 1;
+
+		depth += matched;
+		if (key.len == depth) split->term = leaf;
+		else art_add_child(tree, &next, bytes[depth], art_tag(leaf));
+		*ref = split;
+		tree->len++;
+		return true;
 	}
-	else {
-		packet_write_bits(buf, bitlen, 3, 2);
-		packet_write_bits(buf, bitlen, (uint64_t)packet_htonf(value), 32);
+
+	depth += node->prefix_len;
+	if (key.len == depth) {
+		if (node->term) {
+			*node->term = *leaf;
+			dynpool_free(tree->pools[ART_LEAF], leaf);
+		} else {
+			node->term = leaf;
+			tree->len++;
+		}
+		return true;
 	}
+
+	void **child = art_find(node, bytes[depth]);
+	if (child) return art_insert_at(tree, child, leaf, depth + 1);
+	if (!art_add_child(tree, ref, bytes[depth], art_tag(leaf))) return false;
+	tree->len++;
+	return true;
 }
 
-uint8_t packet_read_u8(const uint8_t *buf, int *bitlen) {
-	uint64_t value;
-	if (!packet_read_bit(buf, bitlen)) {
-		return 0;
-	}
-	else if (!packet_read_bit(buf, bitlen)) {
-		value = packet_read_bits(buf, bitlen, 4);
-		return (uint8_t)value;
+bool art_insert(art_t *tree, strview_t key, void *val) {
+	art_leaf_t *leaf = dynpool_alloc(tree->pools[ART_LEAF]);
+	if (!leaf) return false;
+	leaf->key = key;
+	leaf->val = val;
+
+	if (!tree->root) {
+		tree->root = art_tag(leaf);
+		tree->len++;
+		return true;
 	}
-	else {
-		value = packet_read_bits(buf, bitlen, 8);
-		return (uint8_t)value;
+	if (!art_insert_at(tree, &tree->root, leaf, 0)) {
+		dynpool_free(tree->pools[ART_LEAF], leaf);
+		return false;
 	}
+	return true;
 }
-uint16_t packet_read_u16(const uint8_t *buf, int *bitlen) {
-	uint64_t value = packet_read_bits(buf, bitlen, 2);
 
-	if (!value) {
-		return 0;
-	}
-	else if (value == 1) {
-		value = packet_read_bits(buf, bitlen, 5);
-		return (uint16_t)value;
+// Only the stored prefix bytes are looked at on the way down, the key of the
+// leaf at the end settles it
+bool art_get(const art_t *tree, strview_t key, void **val) {
+	const void *ref = tree->root;
+	const uint8_t *bytes = (const uint8_t *)key.str;
+	size_t depth = 0;
+
+	while (ref && !art_is_leaf(ref)) {
+		const art_node_t *node = ref;
+		if (node->prefix_len) {
+			const size_t len = node->prefix_len < ART_PREFIX ? node->prefix_len : ART_PREFIX;
+			if (depth + node->prefix_len > key.len) return false;
+			if (memcmp(node->prefix, bytes + depth, len)) return false;
+			depth += node->prefix_len;
+		}
+		if (depth == key.len) {
+			ref = node->term ? art_tag(node->term) : NULL;
+			break;
+		}
+		void **child = art_find(node, bytes[depth++]);
+		ref = child ? *child : NULL;
 	}
-	else if (value == 2) {
-		value = packet_read_bits(buf, bitlen, 8);
-		return (uint16_t)value;
+
+	if (!ref || !art_key_eq(art_leaf(ref)->key, key)) return false;
+	if (val) *val = art_leaf(ref)->val;
+	return true;
+}
+
+static void art_remove_child(art_node_t *node, uint8_t byte, void **child) {
+	switch (node->type) {
+	case ART_NODE4:
+	case ART_NODE16: {
+		uint8_t *keys = node->type == ART_NODE4 ? ((art_node4_t *)node)->keys
+							: ((art_node16_t *)node)->keys;
+		void **children = node->type == ART_NODE4 ? ((art_node4_t *)node)->children
+							: ((art_node16_t *)node)->children;
+		const int i = child - children;
+		memmove(keys + i, keys + i + 1, node->n - i - 1);
+		memmove(children + i, children + i + 1, (node->n - i - 1) * sizeof(void *));
+		break;
 	}
-	else {
-		value = packet_read_bits(buf, bitlen, 16);
-		return (uint16_t)value;
+	case ART_NODE48:
+		((art_node48_t *)node)->index[byte] = 0;
+		*child = NULL;
+		break;
+	default:
+		*child = NULL;
+		break;
 	}
+	node->n--;
 }
-uint32_t packet_read_u32(const uint8_t *buf, int *bitlen) {
-	uint64_t value = packet_read_bits(buf, bitlen, 2);
 
-	if (!value) {
-		return 0;
+// Moves a node that lost a child or its term to a smaller size when it has
+// few enough children left, or gets rid of it when it's down to one thing.
+// A smaller node that can't be allocated just means the node stays as it is.
+static void art_shrink(art_t *tree, void **ref) {
+	art_node_t *node = *ref;
+	art_node_t *small = NULL;
+
+	switch (node->type) {
+	case ART_NODE4: {
+		art_node4_t *n4 = (art_node4_t *)node;
+		if (node->n == 0 && node->term) {
+			*ref = art_tag(node->term);
+			art_node_free(tree, node);
+		} else if (node->n == 1 && !node->term) {
+			void *child = n4->children[0];
+			if (!art_is_leaf(child)) {
+				// The child takes this prefix and the byte that led to it
+				// in front of its own prefix
+				art_node_t *next = child;
+				uint8_t prefix[ART_PREFIX] = { 0 };
+				size_t len = node->prefix_len < ART_PREFIX ? node->prefix_len : ART_PREFIX;
+				memcpy(prefix, node->prefix, len);
+				if (len < ART_PREFIX) prefix[len++] = n4->keys[0];
+				if (len < ART_PREFIX) {
+					const size_t rest = ART_PREFIX - len < next->prefix_len
+						? ART_PREFIX - len : next->prefix_len;
+					memcpy(prefix + len, next->prefix, rest);
+				}
+				memcpy(next->prefix, prefix, ART_PREFIX);
+				next->prefix_len += node->prefix_len + 1;
+			}
+			*ref = child;
+			art_node_free(tree, node);
+		}
+		return;
 	}
-	else if (value == 1) {
-		value = packet_read_bits(buf, bitlen, 6);
-		return (uint32_t)value;
+	case ART_NODE16: {
+		art_node16_t *n16 = (art_node16_t *)node;
+		if (node->n > 3 || !(small = art_node_new(tree, ART_NODE4))) return;
+		memcpy(((art_node4_t *)small)->keys, n16->keys, node->n);
+		memcpy(((art_node4_t *)small)->children, n16->children, node->n * sizeof(void *));
+		break;
 	}
-	else if (value == 2) {
-		value = packet_read_bits(buf, bitlen, 11);
-		return (uint32_t)value;
+	case ART_NODE48: {
+		art_node48_t *n48 = (art_node48_t *)node;
+		if (node->n > 12 || !(small = art_node_new(tree, ART_NODE16))) return;
+		art_node16_t *n16 = (art_node16_t *)small;
+		for (int i = 0, j = 0; i < 256; i++) {
+			if (!n48->index[i]) continue;
+			n16->keys[j] = i;
+			n16->children[j++] = n48->children[n48->index[i] - 1];
+		}
+		break;
 	}
-	else {
-		value = packet_read_bits(buf, bitlen, 32);
-		return (uint32_t)value;
+	default: {
+		art_node256_t *n256 = (art_node256_t *)node;
+		if (node->n > 37 || !(small = art_node_new(tree, ART_NODE48))) return;
+		art_node48_t *n48 = (art_node48_t *)small;
+		for (int i = 0, j = 0; i < 256; i++) {
+			if (!n256->children[i]) continue;
+			n48->index[i] = j + 1;
+			n48->children[j++] = n256->children[i];
+		}
+		break;
 	}
+	}
+
+	const uint8_t type = small->type;
+	memcpy(small, node, sizeof(art_node_t));
+	small->type = type;
+	art_node_free(tree, node);
+	*ref = small;
 }
-int16_t packet_read_s16(const uint8_t *buf, int *bitlen) {
-	uint64_t value = packet_read_bits(buf, bitlen, 2);
 
-	if (!value) {
-		return 0;
-	}
-	else if (value == 1) {
-		return (int16_t)packet_read_bits(buf, bitlen, 5)-0x10;
+static art_leaf_t *art_remove_at(art_t *tree, void **ref, strview_t key, size_t depth) {
+	if (art_is_leaf(*ref)) {
+		art_leaf_t *leaf = art_leaf(*ref);
+		if (!art_key_eq(leaf->key, key)) return NULL;
+		*ref = NULL;
+		return leaf;
 	}
-	else if (value == 2) {
-		return (int16_t)packet_read_bits(buf, bitlen, 8)-0x80;
+
+	art_node_t *node = *ref;
+	if (art_prefix_match(node, key, depth) < node->prefix_len) return NULL;
+	depth += node->prefix_len;
+
+	art_leaf_t *leaf;
+	if (depth == key.len) {
+		if (!(leaf = node->term)) return NULL;
+		node->term = NULL;
+	} else {
+		const uint8_t byte = key.str[depth];
+		void **child = art_find(node, byte);
+		if (!child) return NULL;
+		if (!art_is_leaf(*child)) return art_remove_at(tree, child, key, depth + 1);
+
+		leaf = art_leaf(*child);
+		if (!art_key_eq(leaf->key, key)) return NULL;
+		art_remove_child(node, byte, child);
 	}
-	else {
-		return (int16_t)((int32_t)packet_read_bits(buf, bitlen, 16)-0x8000);
+	art_shrink(tree, ref);
+	return leaf;
+}
+
+bool art_remove(art_t *tree, strview_t key, void **val) {
+	if (!tree->root) return false;
+	art_leaf_t *leaf = art_remove_at(tree, &tree->root, key, 0);
+	if (!leaf) return false;
+
+	if (val) *val = leaf->val;
+	dynpool_free(tree->pools[ART_LEAF], leaf);
+	tree->len--;
+	return true;
+}
+
+// Every byte on the way down is checked here, so any key that ends on the way
+// is a prefix of key
+bool art_longest_prefix(const art_t *tree, strview_t key, strview_t *match, void **val) {
+	const void *ref = tree->root;
+	const art_leaf_t *best = NULL;
+	size_t depth = 0;
+
+	while (ref) {
+		if (art_is_leaf(ref)) {
+			const art_leaf_t *leaf = art_leaf(ref);
+			if (leaf->key.len <= key.len && !memcmp(leaf->key.str + depth,
+						key.str + depth, leaf->key.len - depth)) {
+				best = leaf;
+			}
+			break;
+		}
+
+		const art_node_t *node = ref;
+		if (art_prefix_match(node, key, depth) < node->prefix_len) break;
+		depth += node->prefix_len;
+		if (node->term) best = node->term;
+		if (depth == key.len) break;
+
+		void **child = art_find(node, key.str[depth++]);
+		ref = child ? *child : NULL;
 	}
+
+	if (!best) return false;
+	if (match) *match = best->key;
+	if (val) *val = best->val;
+	return true;
 }
-int32_t packet_read_s32(const uint8_t *buf, int *bitlen) {
-	uint64_t value = packet_read_bits(buf, bitlen, 2);
 
-	if (!value) {
-		return 0;
+static bool art_walk(const void *ref, art_iter_fn *fn, void *usr) {
+	if (art_is_leaf(ref)) return fn(usr, art_leaf(ref)->key, art_leaf(ref)->val);
+
+	const art_node_t *node = ref;
+	if (node->term && !fn(usr, node->term->key, node->term->val)) return false;
+	switch (node->type) {
+	case ART_NODE4:
+	case ART_NODE16: {
+		void *const *children = node->type == ART_NODE4
+			? ((const art_node4_t *)node)->children : ((const art_node16_t *)node)->children;
+		for (int i = 0; i < node->n; i++) if (!art_walk(children[i], fn, usr)) return false;
+		return true;
 	}
-	else if (value == 1) {
-		return (int32_t)packet_read_bits(buf, bitlen, 6)-0x20;
+	case ART_NODE48: {
+		const art_node48_t *n48 = (const art_node48_t *)node;
+		for (int i = 0; i < 256; i++) {
+			if (n48->index[i] && !art_walk(n48->children[n48->index[i] - 1], fn, usr)) {
+				return false;
+			}
+		}
+		return true;
 	}
-	else if (value == 2) {
-		return (int32_t)packet_read_bits(buf, bitlen, 11)-0x400;
+	default: {
+		const art_node256_t *n256 = (const art_node256_t *)node;
+		for (int i = 0; i < 256; i++) {
+			if (n256->children[i] && !art_walk(n256->children[i], fn, usr)) return false;
+		}
+		return true;
 	}
-	else {
-		return (int32_t)((int64_t)packet_read_bits(buf, bitlen, 32)-0x80000000);
 	}
 }
-float packet_read_float(const uint8_t *buf, int *bitlen) {
-	uint64_t type;
-	float a, sign;
 
-	type = packet_read_bits(buf, bitlen, 2);
-	if (type == 0) {
-		sign = 1.0f;
-		a = 0.0f;
-	}
-	else if (type == 1) {
-		sign = packet_read_bit(buf, bitlen) ? -1.0f : 1.0f;
-		a = (float)packet_read_bits(buf, bitlen, 3);
-		a += (float)packet_read_bits(buf, bitlen, 10) / 1024.0f;
-	}
-	else if (type == 2) {
-		sign = packet_read_bit(buf, bitlen) ? -1.0f : 1.0f;
-		a = (float)packet_read_bits(buf, bitlen, 7);
-		a += (float)packet_read_bits(buf, bitlen, 8) / 256.0f;
-	}
-	else {
-		return packet_ntohf((unsigned int)packet_read_bits(buf, bitlen, 32));
+bool art_iter_prefix(const art_t *tree, strview_t prefix, art_iter_fn *fn, void *usr) {
+	const void *ref = tree->root;
+	size_t depth = 0;
+
+	while (ref && !art_is_leaf(ref)) {
+		const art_node_t *node = ref;
+		const size_t matched = art_prefix_match(node, prefix, depth);
+		// Everything under a node that the prefix ends in starts with it
+		if (depth + matched == prefix.len) return art_walk(ref, fn, usr);
+		if (matched < node->prefix_len) return true;
+		depth += node->prefix_len;
+
+		void **child = art_find(node, prefix.str[depth++]);
+		ref = child ? *child : NULL;
 	}
 
-	return a * sign;
+	if (!ref) return true;
+	const art_leaf_t *leaf = art_leaf(ref);
+	if (leaf->key.len < prefix.len || memcmp(leaf->key.str, prefix.str, prefix.len)) return true;
+	return fn(usr, leaf->key, leaf->val);
 }
 
 #endif
-
@@ -43,24 +43,59 @@
 #ifndef EK_USE_PACKET
 #	define EK_USE_PACKET EK_FEATURE_OFF
 #endif
+#ifndef EK_USE_PAGE
+#	define EK_USE_PAGE EK_FEATURE_OFF
+#endif
+#ifndef EK_USE_LOG_ASYNC
+#	define EK_USE_LOG_ASYNC EK_FEATURE_OFF
+#endif
+#ifndef EK_USE_CACHE
+#	define EK_USE_CACHE EK_FEATURE_OFF
+#endif
+#ifndef EK_USE_BLOOM
+#	define EK_USE_BLOOM EK_FEATURE_OFF
+#endif
+#ifndef EK_USE_HLL
+#	define EK_USE_HLL EK_FEATURE_OFF
+#endif
+#ifndef EK_USE_QUEUE
+#	define EK_USE_QUEUE EK_FEATURE_OFF
+#endif
+#ifndef EK_USE_TPOOL
+#	define EK_USE_TPOOL EK_FEATURE_OFF
+#endif
+#ifndef EK_USE_BTREE
+#	define EK_USE_BTREE EK_FEATURE_OFF
+#endif
+#ifndef EK_USE_ART
+#	define EK_USE_ART EK_FEATURE_OFF
+#endif
 
 //
 // standard library includes
 //
 #include <stddef.h>
-#if EK_USE_STRVIEW || EK_USE_STRBUF
+#if EK_USE_STRVIEW || EK_USE_STRBUF || EK_USE_PAGE || EK_USE_PACKET || EK_USE_UTF8 \
+	|| EK_USE_LOG
 #	include <string.h>
 #endif
 #if EK_USE_LOG
 #	include <stdarg.h>
 #endif
-#if EK_USE_UTF8 || EK_USE_VEC || EK_USE_HASH
+#if EK_USE_STRVIEW || EK_USE_UTF8 || EK_USE_VEC || EK_USE_HASH || EK_USE_PAGE || EK_USE_PACKET \
+	|| EK_USE_LOG || EK_USE_CACHE || EK_USE_BLOOM || EK_USE_HLL || EK_USE_QUEUE \
+	|| EK_USE_BTREE || EK_USE_ART
 #	include <stdint.h>
 #endif
+#if EK_USE_PACKET
+#	include <math.h>
+#endif
 #if EK_USE_TEST
 #	include <stdio.h>
 #endif
-#if EK_USE_STRVIEW || EK_USE_HASH || EK_USE_TEST
+#if EK_USE_STRVIEW || EK_USE_HASH || EK_USE_TEST || EK_USE_ARENA || EK_USE_POOL \
+	|| EK_USE_PACKET || EK_USE_UTF8 || EK_USE_LOG || EK_USE_CACHE || EK_USE_BLOOM \
+	|| EK_USE_HLL || EK_USE_BTREE || EK_USE_ART
 #	include <stdbool.h>
 #endif
 
@@ -88,6 +123,22 @@ size_t mem_stdlib_allocated_bytes(void);
 
 #endif
 
+//
+// Checked mode for the arena and pools. Catches double frees, use after free
+// writes, overflows past the end of pool chunks and bad arena resets.
+// Compiles to nothing when off. Independently of this, chunks and arena
+// memory are poisoned for AddressSanitizer when building with it.
+//
+#ifndef EK_MEM_CHECKS
+#	define EK_MEM_CHECKS 0
+#endif
+
+#if EK_MEM_CHECKS
+// Called when a check fails. If NULL, the message is printed and abort is called.
+typedef void (mem_check_fail_fn)(const char *msg, const void *ptr);
+extern mem_check_fail_fn *mem_check_fail;
+#endif
+
 //
 // EK_USE_UTIL
 //
@@ -199,6 +250,22 @@ static inline strview_t str_to_strview(const char *str) {
 // Will allocate a temporary buffer on the data segment for the string view will a
 // null terminator. Will only be there until another call to strview_to_str_cmp
 const char *strview_as_str(const strview_t *const view);
+
+// Parse a number from the start of the view in place, without going through a
+// null terminated copy or the locale. They return the number of bytes used,
+// or 0 without touching *out when the view doesn't start with a number.
+// Whitespace isn't skipped. When the number doesn't fit, *out is the closest
+// value that does and *overflow is set. overflow can be NULL.
+//
+// Integers are decimal with an optional sign, u64 doesn't take a '-'.
+size_t strview_parse_i64(const strview_t *const view, int64_t *out, bool *overflow);
+size_t strview_parse_u64(const strview_t *const view, uint64_t *out, bool *overflow);
+
+// Takes what strtod does in the C locale except for hex floats: an optional
+// sign, digits with an optional '.', an optional exponent, and inf, infinity
+// and nan in any case. Rounds to nearest like strtod. Only overflowing to
+// infinity counts as overflow, underflowing to 0 doesn't.
+size_t strview_parse_f64(const strview_t *const view, double *out, bool *overflow);
 #endif
 
 //
@@ -206,7 +273,7 @@ const char *strview_as_str(const strview_t *const view);
 //
 #if EK_USE_UTF8
 static inline int utf8_codepoint_len(const uint8_t start) {
-	const int clz = __builtin_clz(~start << 24);
+	const int clz = __builtin_clz(~((uint32_t)start << 24));
 	return clz + !clz;
 }
 static inline int utf32_to_utf8_len(const uint32_t c) {
@@ -227,13 +294,13 @@ static uint32_t utf8_codepoint_decode(const uint8_t *buf) {
 		out |= *buf++ & 0x3f;
 		break;
 	case 3: 
-		out = (*buf++ & 0x0f) << 18;
+		out = (*buf++ & 0x0f) << 12;
 		out |= (*buf++ & 0x3f) << 6;
 		out |= *buf++ & 0x3f;
 		break;
-	case 4: 
-		out = (*buf++ & 0x07) << 24;
-		out |= (*buf++ & 0x1f) << 18;
+	default: 
+		out = (*buf++ & 0x07) << 18;
+		out |= (*buf++ & 0x3f) << 12;
 		out |= (*buf++ & 0x3f) << 6;
 		out |= *buf++ & 0x3f;
 		break;
@@ -251,23 +318,55 @@ static void utf8_codepoint_encode(const uint32_t c, uint8_t *buf) {
 		*buf++ = c & 0x3f | 0x80;
 		break;
 	case 3: 
-		*buf++ = c >> 18 & 0x0f | 0xe0;
+		*buf++ = c >> 12 & 0x0f | 0xe0;
 		*buf++ = c >> 6 & 0x3f | 0x80;
 		*buf++ = c & 0x3f | 0x80;
 		break;
 	case 4: 
-		*buf++ = c >> 24 & 0x07 | 0xf0;
-		*buf++ = c >> 18 & 0x3f | 0x80;
+		*buf++ = c >> 18 & 0x07 | 0xf0;
+		*buf++ = c >> 12 & 0x3f | 0x80;
 		*buf++ = c >> 6 & 0x3f | 0x80;
 		*buf++ = c & 0x3f | 0x80;
 		break;
 	}
 }
+
+// Returned by the bulk functions when the input isn't valid
+#define UTF_INVALID ((size_t)-1)
+
+// Checks that the buffer is well formed UTF-8. Rejects overlong encodings,
+// surrogates, codepoints past U+10FFFF and truncated sequences. Uses SSSE3
+// when the cpu has it and a word at a time ASCII fast path otherwise.
+bool utf8_valid(const uint8_t *buf, size_t len);
+
+// Number of codepoints in VALID UTF-8
+size_t utf8_count(const uint8_t *buf, size_t len);
+
+// Number of UTF-16 code units needed to hold VALID UTF-8
+size_t utf8_utf16_len(const uint8_t *buf, size_t len);
+
+// Bulk transcoding. These validate as they go and return the number of code
+// units written, or UTF_INVALID. The output needs to fit len code units for
+// UTF-32 and UTF-16, 4 * len bytes from UTF-32 and 3 * len bytes from UTF-16.
+size_t utf8_to_utf32(const uint8_t *buf, size_t len, uint32_t *out);
+size_t utf8_to_utf16(const uint8_t *buf, size_t len, uint16_t *out);
+size_t utf32_to_utf8(const uint32_t *buf, size_t len, uint8_t *out);
+size_t utf16_to_utf8(const uint16_t *buf, size_t len, uint8_t *out);
+
+#if EK_USE_STRVIEW
 static uint32_t strview_next_utf8(strview_t *str) {
 	const uint32_t c = utf8_codepoint_decode((const uint8_t *)str->str);
-	str->str += utf8_codepoint_len(*str->str), str->len--;
+	const int len = utf8_codepoint_len(*str->str);
+	str->str += len, str->len -= len;
 	return c;
 }
+static inline bool strview_valid_utf8(const strview_t *str) {
+	return utf8_valid((const uint8_t *)str->str, str->len);
+}
+static inline size_t strview_count_utf8(const strview_t *str) {
+	return utf8_count((const uint8_t *)str->str, str->len);
+}
+#endif
 #endif
 
 //
@@ -284,15 +383,138 @@ typedef enum log_lvl {
 typedef void (log_fn)(log_lvl_t l, const char *msg, ...);
 
 extern log_fn *global_log;
-#define logmsg(lvl, msg) \
-	if (log_global) log_global(lvl, "%s in %s: " msg, \
-		__func__, \
-		strrchr(__FILE__, '/') + 1 ? strrchr(__FILE__, '/') + 1 : __FILE__)
-#define logfmt(lvl, msg, ...) \
-	if (log_global) log_global(lvl, "%s in %s: " msg, \
-		__func__, \
-		strrchr(__FILE__, '/') + 1 ? strrchr(__FILE__, '/') + 1 : __FILE__, \
-		__VA_ARGS__)
+
+// Messages less important than this compile to nothing
+#ifndef LOG_COMPILE_LEVEL
+#	define LOG_COMPILE_LEVEL LOG_DBG
+#endif
+
+// Messages less important than this are skipped at runtime. Their arguments
+// aren't evaluated.
+extern log_lvl_t log_level;
+
+static inline bool log_enabled(log_lvl_t lvl) {
+	return lvl <= LOG_COMPILE_LEVEL && lvl <= log_level && global_log;
+}
+
+// Just the file name of a path like __FILE__
+static inline const char *log_file_name(const char *path) {
+	const char *const slash = strrchr(path, '/');
+	return slash ? slash + 1 : path;
+}
+
+#define logmsg(lvl, msg) do { \
+	if (log_enabled(lvl)) global_log(lvl, "%s in %s: " msg, \
+		__func__, log_file_name(__FILE__)); \
+} while (0)
+#define logfmt(lvl, msg, ...) do { \
+	if (log_enabled(lvl)) global_log(lvl, "%s in %s: " msg, \
+		__func__, log_file_name(__FILE__), __VA_ARGS__); \
+} while (0)
+
+// State for rate limiting one place that logs
+typedef struct log_ratelimit {
+	uint64_t window;	// When the current window started in ms
+	uint32_t count;		// Messages let through in the window
+	uint32_t suppressed;	// Messages left out in the window
+} log_ratelimit_t;
+
+// Lets through at most burst messages every period_ms. Returns false when the
+// message should be left out. The first message let through in a new window
+// gets the number left out in the last one in *suppressed, 0 otherwise.
+bool log_ratelimit(log_ratelimit_t *rl, unsigned burst, unsigned period_ms,
+			unsigned *suppressed);
+
+// These keep their own state for each place they're used, so a loop that
+// keeps failing can't flood the log. The _every versions log 1 in n calls,
+// the _ratelimit versions log at most burst messages every period_ms and say
+// how many they left out.
+#define logmsg_every(lvl, n, msg) do { \
+	static unsigned _log_calls; \
+	if (log_enabled(lvl) \
+		&& __atomic_fetch_add(&_log_calls, 1, __ATOMIC_RELAXED) % (n) == 0) { \
+		global_log(lvl, "%s in %s: " msg, __func__, log_file_name(__FILE__)); \
+	} \
+} while (0)
+#define logfmt_every(lvl, n, msg, ...) do { \
+	static unsigned _log_calls; \
+	if (log_enabled(lvl) \
+		&& __atomic_fetch_add(&_log_calls, 1, __ATOMIC_RELAXED) % (n) == 0) { \
+		global_log(lvl, "%s in %s: " msg, __func__, log_file_name(__FILE__), \
+			__VA_ARGS__); \
+	} \
+} while (0)
+#define logmsg_ratelimit(lvl, burst, period_ms, msg) do { \
+	static log_ratelimit_t _log_rl; \
+	unsigned _log_skipped; \
+	if (log_enabled(lvl) && log_ratelimit(&_log_rl, burst, period_ms, &_log_skipped)) { \
+		if (_log_skipped) global_log(lvl, "%s in %s: left out %u messages", \
+			__func__, log_file_name(__FILE__), _log_skipped); \
+		global_log(lvl, "%s in %s: " msg, __func__, log_file_name(__FILE__)); \
+	} \
+} while (0)
+#define logfmt_ratelimit(lvl, burst, period_ms, msg, ...) do { \
+	static log_ratelimit_t _log_rl; \
+	unsigned _log_skipped; \
+	if (log_enabled(lvl) && log_ratelimit(&_log_rl, burst, period_ms, &_log_skipped)) { \
+		if (_log_skipped) global_log(lvl, "%s in %s: left out %u messages", \
+			__func__, log_file_name(__FILE__), _log_skipped); \
+		global_log(lvl, "%s in %s: " msg, __func__, log_file_name(__FILE__), \
+			__VA_ARGS__); \
+	} \
+} while (0)
+#endif
+
+//
+// EK_USE_LOG_ASYNC
+//
+// Background logging. log_async is a log_fn, so set global_log to it and the
+// log macros go through it. The calling thread only copies the format pointer
+// and the raw arguments into its own lock-free ring, a background thread
+// formats them and writes them out in batches. Needs pthreads.
+//
+#if EK_USE_LOG_ASYNC
+#if !EK_USE_LOG
+#	error ek.h: include the EK_USE_LOG feature to use async logging
+#endif
+
+// Default size of the ring every logging thread gets, a power of 2
+#ifndef LOG_ASYNC_RING_SIZE
+#	define LOG_ASYNC_RING_SIZE (64 * 1024)
+#endif
+
+// Biggest a single message can be in a ring. Strings are cut short to fit.
+#define LOG_ASYNC_MAX_RECORD 512
+
+// Biggest a formatted line can be
+#define LOG_ASYNC_MAX_LINE 1024
+
+// What a thread does when its ring is full
+typedef enum log_async_mode {
+	LOG_ASYNC_DROP,		// Throw the message away and count it
+	LOG_ASYNC_BLOCK,	// Wait for the background thread to make room
+} log_async_mode_t;
+
+// Starts the background thread writing to the file descriptor. ring_size is
+// the size of each thread's ring, 0 for LOG_ASYNC_RING_SIZE. alloc has to be
+// thread safe since rings are made by the logging threads. Returns false if it
+// is already running or the thread couldn't be made.
+bool log_async_start(mem_alloc_t alloc, size_t ring_size, log_async_mode_t mode,
+			int fd);
+
+// Writes everything still queued and joins the background thread
+void log_async_stop(void);
+
+// Waits until everything logged before the call is written
+void log_async_flush(void);
+
+// Number of messages dropped because a ring was full or it wasn't running
+size_t log_async_dropped(void);
+
+// Supports the printf conversions except %n, up to 16 arguments. %s strings
+// are copied into the ring, every other argument is copied by value. How the
+// format is parsed is cached by its address, so it should be a string literal.
+void log_async(log_lvl_t lvl, const char *fmt, ...);
 #endif
 
 //
@@ -442,6 +664,87 @@ void *hset_get(void *set, const void *key);
 // will return NULL when there is no kv pairs left
 void *hset_next(void *set, void *iter);
 
+// Maximum load of the hashset in percent before hset_insert grows it
+#ifndef HSET_MAX_LOAD
+#	define HSET_MAX_LOAD 75
+#endif
+
+// Count hits, misses and probes of hset_get. Costs a few increments per lookup
+// and makes concurrent lookups on the same hashset racy
+#ifndef EK_HSET_COUNTERS
+#	define EK_HSET_COUNTERS 0
+#endif
+
+// Number of buckets in the probe sequence length histogram, the last bucket
+// counts every entry with a psl of at least HSET_STATS_PSL_BUCKETS - 1
+#define HSET_STATS_PSL_BUCKETS 16
+
+typedef struct hset_stats {
+	uint32_t nents, capacity;
+
+	// nents / capacity
+	double load;
+
+	// Times the hashset grew since hset_init
+	uint32_t grows;
+
+	// Memory used by the hashset, including the header
+	size_t bytes;
+
+	// Probe sequence lengths of the entries
+	uint32_t max_psl;
+	double avg_psl;
+	uint32_t psl_hist[HSET_STATS_PSL_BUCKETS];
+
+	// Entries whose psl no longer fits in an entry, lookups for these fall
+	// back to linear probing. Anything but 0 means the hash function is bad
+	uint32_t saturated;
+
+	// Lookup counters, only counted when built with EK_HSET_COUNTERS=1.
+	// probes is the number of entries compared over all lookups
+	uint64_t hits, misses, probes;
+} hset_stats_t;
+
+// Walks the hashset to collect its stats
+hset_stats_t hset_stats(void *set);
+
+// Resets the lookup counters
+void hset_stats_reset(void *set);
+
+// Compact map, an insertion ordered hashmap. The kv pairs are kept densely in
+// insertion order and the Robin Hood table only holds small indices into
+// them, so iterating is a linear scan. Growing reallocates the kv pairs like
+// a vec and refills the indices from the stored hashes without rehashing.
+// Removed pairs leave a hole until the next time the map is rebuilt.
+
+// Returns the first kv pair. capacity is the number of kv pairs to make
+// room for
+void *cmap_init(mem_alloc_t alloc,
+		uint32_t capacity, uint32_t kvsize,
+		hset_hash_fn *hash, hset_eq_fn *eq);
+
+// Frees the compact map
+void *cmap_deinit(void *map);
+
+// Insert a new kv pair at the end, or overwrite the kv pair with the same key
+// in place. Returns the new pointer to the compact map if it was rebuilt,
+// NULL when out of memory.
+void *cmap_insert(void *map, const void *kv);
+
+// Remove pre-existing keyvalue pair. Pointer must be to kv in the compact map.
+void cmap_remove(void *map, const void *kv);
+
+// Returns kv pair in the compact map that has the same key as key
+void *cmap_get(void *map, const void *key);
+
+// Loops through the compact map in insertion order.
+// if iter is NULL, it will return the first kv pair.
+// will return NULL when there is no kv pairs left
+void *cmap_next(void *map, void *iter);
+
+// Number of kv pairs in the compact map
+uint32_t cmap_len(const void *map);
+
 uint64_t str_hash(const char *str);
 bool str_eq(const char *a, const char *b);
 
@@ -451,14 +754,73 @@ uint64_t strview_hash(const strview_t *sv);
 
 #endif
 
+//
+// EK_USE_PAGE
+//
+#if EK_USE_PAGE
+#if !EK_USE_UTIL
+#	error ek.h: include the EK_USE_UTIL feature to use page allocation
+#endif
+
+// Size of the huge pages asked for by PAGE_HUGE
+#ifndef PAGE_HUGE_SIZE
+#	define PAGE_HUGE_SIZE (2 * 1024 * 1024)
+#endif
+
+typedef enum page_flags {
+	// Try to back the memory with huge pages. Uses MAP_HUGETLB if there are
+	// huge pages reserved, otherwise asks for transparent huge pages.
+	PAGE_HUGE = 1 << 0,
+	// Bind the memory to a NUMA node
+	PAGE_NUMA = 1 << 1,
+} page_flags_t;
+
+// Maps fresh zeroed pages straight from the OS. size is rounded up to the
+// page size (or huge page size) and the mapped size is written back to it.
+// Huge pages and NUMA binding are best effort, and if the OS has no way to
+// map pages this falls back to the stdlib allocator. The result can be given
+// to fixed_arena_init or fixedpool_init.
+void *page_map(size_t *size, page_flags_t flags, int numa_node);
+void page_unmap(void *pages, size_t size);
+
+// Allocation interface that gets every allocation from page_map.
+// Meant for big long lived blocks like the ones dynpool allocates.
+typedef struct page_alloc {
+	mem_alloc_fn *alloc_fn;
+	page_flags_t flags;
+	int numa_node;
+} page_alloc_t;
+
+mem_alloc_t page_alloc_init(page_alloc_t *self, page_flags_t flags, int numa_node);
+
+#endif
+
 //
 // EK_USE_ARENA
 //
 #if EK_USE_ARENA
+#if !EK_USE_UTIL
+#	error ek.h: include the EK_USE_UTIL feature to use arenas
+#endif
 
 bool fixed_arena_init(void *buf, size_t bufsize);
+
+// Returns NULL if there is not enough space left. Memory is aligned to 8 bytes.
 void *fixed_arena_alloc(void *buf, size_t size);
+
+// Same as fixed_arena_alloc, but align can be any power of 2
+void *fixed_arena_alloc_aligned(void *buf, size_t size, size_t align);
+
+// Allocates count elements, returning NULL if count * elemsz overflows
+void *fixed_arena_alloc_array(void *buf, size_t count, size_t elemsz, size_t align);
+#define fixed_arena_new(buf, type, count) \
+	((type *)fixed_arena_alloc_array(buf, count, sizeof(type), __alignof__(type)))
+
 void fixed_arena_reset_to(void *buf, void *to);
+
+// The allocation interface can reallocate blocks. Growing the most recent
+// block reuses its space, so a vec that lives in an arena doesn't leave its
+// old buffers behind. Only the most recent block can be freed.
 mem_alloc_t fixed_arena_alloc_fn(void *buf);
 
 #endif
@@ -470,6 +832,12 @@ mem_alloc_t fixed_arena_alloc_fn(void *buf);
 
 typedef struct dynpool dynpool_t;
 
+// New blocks double the capacity of the pool, but will never hold more
+// chunks than this
+#ifndef DYNPOOL_MAX_BLOCK_CHUNKS
+#	define DYNPOOL_MAX_BLOCK_CHUNKS 4096
+#endif
+
 dynpool_t *dynpool_init(mem_alloc_t alloc, size_t initial_chunks, size_t elemsz);
 void dynpool_deinit(dynpool_t *self);
 void *dynpool_alloc(dynpool_t *self);
@@ -478,12 +846,440 @@ bool dynpool_empty(const dynpool_t *self);
 void dynpool_fast_clear(dynpool_t *self);
 size_t dynpool_num_chunks(const dynpool_t *self);
 
+// Gives every block with no chunks in use back to the allocator, except for
+// the initial block. Returns the number of blocks freed.
+size_t dynpool_trim(dynpool_t *self);
+
+// Allocates n chunks into ptrs in one go. Returns the number of chunks
+// allocated, which is only less than n if the backing allocator failed.
+size_t dynpool_alloc_n(dynpool_t *self, void **ptrs, size_t n);
+void dynpool_free_n(dynpool_t *self, void *const *ptrs, size_t n);
+
 void fixedpool_init(void *buf, size_t elemsz, size_t buflen);
 void fixedpool_fast_clear(void *buf);
 void *fixedpool_alloc(void *buf);
 void fixedpool_free(void *buf, void *blk);
 bool fixedpool_empty(const void *buf);
 
+// Same as the dynpool versions, but will stop short when the pool is full
+size_t fixedpool_alloc_n(void *buf, void **ptrs, size_t n);
+void fixedpool_free_n(void *buf, void *const *ptrs, size_t n);
+
+// Defines a typed pool called name##_t for objects of type. Freed objects are
+// kept in a cache and handed back out by name##_alloc as they were left, so
+// ctor is only called the first time an object comes out of the pool and
+// dtor only when it goes back to the pool with name##_flush or name##_deinit.
+// ctor and dtor are void (*)(type *) and can be NULL.
+#define DYNPOOL_TYPED(name, type, ctor, dtor) \
+	typedef struct name##_node { \
+		struct name##_node *next; \
+		type obj; \
+	} name##_node_t; \
+	typedef struct name { \
+		dynpool_t *pool; \
+		name##_node_t *cache; \
+	} name##_t; \
+	static void (*const name##_ctor)(type *) = ctor; \
+	static void (*const name##_dtor)(type *) = dtor; \
+	static inline bool name##_init(name##_t *self, mem_alloc_t alloc, \
+				size_t initial_chunks) { \
+		self->cache = NULL; \
+		self->pool = dynpool_init(alloc, initial_chunks, \
+					sizeof(name##_node_t)); \
+		return self->pool != NULL; \
+	} \
+	static inline type *name##_alloc(name##_t *self) { \
+		name##_node_t *node = self->cache; \
+		if (node) { \
+			self->cache = node->next; \
+			return &node->obj; \
+		} \
+		if (!(node = dynpool_alloc(self->pool))) return NULL; \
+		if (name##_ctor) name##_ctor(&node->obj); \
+		return &node->obj; \
+	} \
+	static inline void name##_free(name##_t *self, type *obj) { \
+		if (!obj) return; \
+		name##_node_t *node = (name##_node_t *)((uintptr_t)obj \
+					- offsetof(name##_node_t, obj)); \
+		node->next = self->cache; \
+		self->cache = node; \
+	} \
+	static inline void name##_flush(name##_t *self) { \
+		while (self->cache) { \
+			name##_node_t *node = self->cache; \
+			self->cache = node->next; \
+			if (name##_dtor) name##_dtor(&node->obj); \
+			dynpool_free(self->pool, node); \
+		} \
+	} \
+	static inline void name##_deinit(name##_t *self) { \
+		name##_flush(self); \
+		dynpool_deinit(self->pool); \
+	}
+
+#endif
+
+//
+// EK_USE_CACHE
+//
+// Bounded caches. Lookups go through an hset, the kv pairs live in dynpool
+// nodes on an intrusive list that orders them for eviction. Every kv pair is
+// charged against the capacity, so the capacity is a number of entries when
+// every charge is 1 or a number of bytes when the charge is the size of the
+// value. Nothing is allocated once the cache is full.
+//
+#if EK_USE_CACHE
+#if !EK_USE_HASH
+#	error ek.h: include the EK_USE_HASH feature to use caches
+#endif
+#if !EK_USE_POOL
+#	error ek.h: include the EK_USE_POOL feature to use caches
+#endif
+
+typedef enum cache_policy {
+	// Evicts the least recently used kv pair, every hit moves the node
+	CACHE_LRU,
+
+	// Second chance eviction, a hit only sets a bit on the node
+	CACHE_CLOCK,
+} cache_policy_t;
+
+// Called with every kv pair that leaves the cache, whether it was evicted,
+// removed, overwritten or the cache was freed
+typedef void (cache_evict_fn)(void *usr, void *kv);
+
+typedef struct cache cache_t;
+
+typedef struct cache_stats {
+	uint64_t hits, misses, evictions;
+
+	// Number of kv pairs and the sum of their charges
+	size_t len, charge;
+} cache_stats_t;
+
+// Keys are compared with hash and eq like a hset, on the whole kv pair
+cache_t *cache_init(mem_alloc_t alloc, size_t capacity, uint32_t kvsize,
+		hset_hash_fn *hash, hset_eq_fn *eq, cache_policy_t policy);
+void cache_deinit(cache_t *cache);
+void cache_on_evict(cache_t *cache, cache_evict_fn *fn, void *usr);
+
+// Returns the kv pair with the same key, valid until the next put or remove
+void *cache_get(cache_t *cache, const void *key);
+
+// Inserts or overwrites kv and evicts until it fits. Returns the kv pair in
+// the cache, or NULL when charge is over the capacity or allocation failed
+void *cache_put(cache_t *cache, const void *kv, size_t charge);
+
+// Returns false when the key wasn't cached
+bool cache_remove(cache_t *cache, const void *key);
+
+cache_stats_t cache_stats(const cache_t *cache);
+
+// The same cache split into shards by hash, each behind its own mutex. The
+// capacity is split evenly between the shards. Since other threads can evict
+// at any time, kv pairs are copied out instead of handed out. Needs pthreads.
+typedef struct cache_sharded cache_sharded_t;
+
+// nshards is rounded up to a power of 2
+cache_sharded_t *cache_sharded_init(mem_alloc_t alloc, size_t nshards,
+		size_t capacity, uint32_t kvsize,
+		hset_hash_fn *hash, hset_eq_fn *eq, cache_policy_t policy);
+void cache_sharded_deinit(cache_sharded_t *cache);
+
+// Called under the lock of the shard
+void cache_sharded_on_evict(cache_sharded_t *cache, cache_evict_fn *fn, void *usr);
+
+// Copies the kv pair into kv_out
+bool cache_sharded_get(cache_sharded_t *cache, const void *key, void *kv_out);
+bool cache_sharded_put(cache_sharded_t *cache, const void *kv, size_t charge);
+bool cache_sharded_remove(cache_sharded_t *cache, const void *key);
+
+// Sum of the stats of every shard
+cache_stats_t cache_sharded_stats(cache_sharded_t *cache);
+
+#endif
+
+//
+// EK_USE_BLOOM
+//
+// Split block Bloom filter. Every key sets one bit in each of the eight 32 bit
+// words of a single 32 byte block, so a lookup touches one cache line. Keys
+// are given as 64 bit hashes, from xxhash64_single_lane or the hash function
+// of the hset the filter sits in front of. The high half of the hash picks the
+// block, the low half the bits.
+//
+#if EK_USE_BLOOM
+#if !EK_USE_HASH
+#	error ek.h: include the EK_USE_HASH feature to use bloom filters
+#endif
+
+typedef struct bloom bloom_t;
+
+// Sized to have a false positive rate of about fpp once nkeys keys are in
+bloom_t *bloom_init(mem_alloc_t alloc, size_t nkeys, double fpp);
+void bloom_deinit(bloom_t *bloom);
+void bloom_clear(bloom_t *bloom);
+
+void bloom_add(bloom_t *bloom, uint64_t hash);
+
+// False means the key was never added, true means it probably was
+bool bloom_test(const bloom_t *bloom, uint64_t hash);
+
+// Tests n hashes into maybe and returns how many probably were added. Uses
+// AVX2 when the CPU has it and prefetches blocks ahead either way.
+size_t bloom_test_n(const bloom_t *bloom, const uint64_t *hashes, size_t n, bool *maybe);
+
+// Adds every key of src to dst. Both have to be the same size, which filters
+// made with the same nkeys and fpp are. Returns false if they aren't.
+bool bloom_merge(bloom_t *dst, const bloom_t *src);
+
+// Bytes needed to serialize the filter
+size_t bloom_serialized_size(const bloom_t *bloom);
+
+// Writes a little endian header and the blocks to buf
+void bloom_serialize(const bloom_t *bloom, void *buf);
+
+// Returns NULL if buf doesn't hold a serialized filter of len bytes
+bloom_t *bloom_deserialize(mem_alloc_t alloc, const void *buf, size_t len);
+
+#endif
+
+//
+// EK_USE_HLL
+//
+// HyperLogLog distinct counter over 64 bit hashes, like the ones from
+// xxhash64_single_lane or strview_hash. Small counts are kept as a sparse list
+// at a higher precision, which is exact-ish and smaller than the registers,
+// until it would outgrow them. The standard error is about 1.04 / sqrt(2^p).
+//
+#if EK_USE_HLL
+#if !EK_USE_HASH
+#	error ek.h: include the EK_USE_HASH feature to use hyperloglog
+#endif
+
+#define HLL_MIN_PRECISION 4
+#define HLL_MAX_PRECISION 18
+
+typedef struct hll hll_t;
+
+// Uses 2^precision bytes once dense, 14 is 16 KiB and about 0.8% error
+hll_t *hll_init(mem_alloc_t alloc, int precision);
+void hll_deinit(hll_t *hll);
+void hll_clear(hll_t *hll);
+
+// Returns false when it couldn't allocate, the hash is left out then
+bool hll_add(hll_t *hll, uint64_t hash);
+
+// Estimated number of distinct hashes added
+uint64_t hll_estimate(hll_t *hll);
+
+// Adds everything in src to dst, like per thread sketches being combined.
+// Both need the same precision. Returns false if they don't or on allocation
+// failure.
+bool hll_merge(hll_t *dst, const hll_t *src);
+
+// Memory used by the counter
+size_t hll_bytes(const hll_t *hll);
+
+#endif
+
+//
+// EK_USE_QUEUE
+//
+// Bounded lock-free queues for handing work between threads. Like vecs, they
+// are used through a pointer of the element type, which is only there for
+// sizeof and must not be indexed. Capacities are rounded up to a power of 2.
+// Pushes and pops move up to nelems elements and return how many they moved,
+// 0 when the queue is full or empty. Elements are at most 8 byte aligned.
+//
+#if EK_USE_QUEUE
+
+// Single producer, single consumer ring. One thread may push and one may pop.
+void *spsc_init(mem_alloc_t alloc, size_t elem_size, size_t capacity);
+void *spsc_deinit(void *queue);
+
+#define spsc_push(queue, nelems, elems) _spsc_push(queue, sizeof(*(queue)), nelems, elems)
+size_t _spsc_push(void *queue, size_t elem_size, size_t nelems, const void *elems);
+
+// elems can be NULL to drop the elements
+#define spsc_pop(queue, nelems, elems) _spsc_pop(queue, sizeof(*(queue)), nelems, elems)
+size_t _spsc_pop(void *queue, size_t elem_size, size_t nelems, void *elems);
+
+// Only exact when neither end is in use
+size_t spsc_len(const void *queue);
+
+// Multi producer, multi consumer queue, Dmitry Vyukov's bounded queue. Every
+// slot has a sequence number that says whose turn it is, so producers and
+// consumers only contend on their own position. A batch claims its slots with
+// one compare and swap when they are all free, and may then briefly wait on
+// threads that claimed those slots a lap earlier to finish with them.
+void *mpmc_init(mem_alloc_t alloc, size_t elem_size, size_t capacity);
+void *mpmc_deinit(void *queue);
+
+#define mpmc_push(queue, nelems, elems) _mpmc_push(queue, sizeof(*(queue)), nelems, elems)
+size_t _mpmc_push(void *queue, size_t elem_size, size_t nelems, const void *elems);
+
+#define mpmc_pop(queue, nelems, elems) _mpmc_pop(queue, sizeof(*(queue)), nelems, elems)
+size_t _mpmc_pop(void *queue, size_t elem_size, size_t nelems, void *elems);
+
+// Only exact when no thread is using the queue
+size_t mpmc_len(const void *queue);
+
+#endif
+
+//
+// EK_USE_TPOOL
+//
+// A work stealing thread pool. Every worker has a Chase-Lev deque that it
+// pushes and pops tasks at the bottom of, and idle workers steal from the top
+// of the others' deques. Task nodes come from a dynpool per worker, so spawning
+// doesn't allocate once the pools are warm. Threads that aren't workers hand
+// their tasks in through an mpmc queue and sleep while they wait on them.
+//
+#if EK_USE_TPOOL
+#if !EK_USE_POOL
+#	error ek.h: include the EK_USE_POOL feature to use thread pools
+#endif
+#if !EK_USE_QUEUE
+#	error ek.h: include the EK_USE_QUEUE feature to use thread pools
+#endif
+
+typedef struct tpool tpool_t;
+typedef struct task task_t;
+typedef void (task_fn)(void *arg);
+typedef void (task_range_fn)(void *arg, size_t begin, size_t end);
+
+// Starts nthreads workers, or one per online cpu when nthreads is 0
+tpool_t *tpool_init(mem_alloc_t alloc, size_t nthreads);
+
+// Every task has to be done before the pool goes away
+void tpool_deinit(tpool_t *pool);
+size_t tpool_nthreads(const tpool_t *pool);
+
+// Runs fn(arg) on the pool. Every task has to be waited on exactly once, which
+// is also what frees it. When there is no room for the task it runs before
+// task_spawn returns.
+task_t *task_spawn(tpool_t *pool, task_fn *fn, void *arg);
+
+// Workers run other tasks while they wait, other threads go to sleep
+void task_wait(tpool_t *pool, task_t *task);
+
+// Calls fn on ranges that cover [begin, end) in parallel and returns once they
+// are all done. Ranges are split in half until they are at most grain long and
+// thieves take the halves that haven't started yet. A grain of 0 sizes them so
+// that every worker gets about 8 ranges.
+void tpool_parallel_for(tpool_t *pool, size_t begin, size_t end, size_t grain,
+		task_range_fn *fn, void *arg);
+
+#endif
+
+//
+// EK_USE_BTREE
+//
+// An ordered map from uint64_t keys to uint64_t values. It's a B+tree, so
+// the kv pairs are all in the leaves, which are linked in key order for range
+// scans. Nodes come from a dynpool and keep their 16 keys in one 128 byte
+// array that's searched without branches, with AVX2 when the cpu has it.
+// Nodes aren't cache line aligned, so the keys can straddle three lines. Keys
+// that aren't numbers can be ordered by packing a big endian prefix of them
+// into the key.
+//
+#if EK_USE_BTREE
+#if !EK_USE_POOL
+#	error ek.h: include the EK_USE_POOL feature to use btrees
+#endif
+#if !EK_USE_VEC
+#	error ek.h: include the EK_USE_VEC feature to use btrees
+#endif
+
+typedef struct btree btree_t;
+
+typedef struct btree_kv {
+	uint64_t key, val;
+} btree_kv_t;
+
+// A position in the leaves. Any change to the tree invalidates iterators.
+typedef struct btree_iter {
+	const void *leaf;
+	size_t idx;
+} btree_iter_t;
+
+btree_t *btree_init(mem_alloc_t alloc);
+void btree_deinit(btree_t *tree);
+size_t btree_len(const btree_t *tree);
+
+// Replaces the value if the key is already there. Returns false when out of
+// memory.
+bool btree_insert(btree_t *tree, uint64_t key, uint64_t val);
+bool btree_get(const btree_t *tree, uint64_t key, uint64_t *val);
+
+// val can be NULL. Returns false when the key wasn't there.
+bool btree_remove(btree_t *tree, uint64_t key, uint64_t *val);
+
+// Replaces everything in the tree with a vec of btree_kv_t sorted by key,
+// packing the nodes about as full as they go. Returns false when out of
+// memory or when the keys aren't strictly increasing, which leaves the tree
+// empty.
+bool btree_bulk_load(btree_t *tree, const btree_kv_t *kvs);
+
+// The first kv pair, the first with a key >= key and the first with a key
+// > key
+btree_iter_t btree_first(const btree_t *tree);
+btree_iter_t btree_lower_bound(const btree_t *tree, uint64_t key);
+btree_iter_t btree_upper_bound(const btree_t *tree, uint64_t key);
+
+// Gets the kv pair at the iterator and moves it to the next one. Returns false
+// at the end. Iterating [lo, hi) is btree_lower_bound(lo) and then btree_next
+// while the key is < hi.
+bool btree_next(btree_iter_t *iter, btree_kv_t *kv);
+
+#endif
+
+//
+// EK_USE_ART
+//
+// An adaptive radix tree keyed by strviews, from "The Adaptive Radix Tree:
+// ARTful Indexing for Main-Memory Databases" by Leis et al. Inner nodes have
+// room for 4, 16, 48 or 256 children and grow or shrink between those sizes,
+// and runs of bytes with only one child are squashed into the node's prefix.
+// A lookup looks at each byte of the key at most once, however many keys there
+// are. Nodes and leaves come from a dynpool for each size.
+//
+#if EK_USE_ART
+#if !EK_USE_STRVIEW
+#	error ek.h: include the EK_USE_STRVIEW feature to use radix trees
+#endif
+#if !EK_USE_POOL
+#	error ek.h: include the EK_USE_POOL feature to use radix trees
+#endif
+
+typedef struct art art_t;
+
+// Return false to stop iterating
+typedef bool (art_iter_fn)(void *usr, strview_t key, void *val);
+
+art_t *art_init(mem_alloc_t alloc);
+void art_deinit(art_t *tree);
+size_t art_len(const art_t *tree);
+
+// The tree keeps the view, not a copy of the key, so the bytes have to stay
+// put while the key is in the tree. Replaces the value and the view when the
+// key is already there. Returns false when out of memory.
+bool art_insert(art_t *tree, strview_t key, void *val);
+
+// val can be NULL for these
+bool art_get(const art_t *tree, strview_t key, void **val);
+bool art_remove(art_t *tree, strview_t key, void **val);
+
+// Finds the longest key in the tree that key starts with, like a router
+// matching a path against its routes
+bool art_longest_prefix(const art_t *tree, strview_t key, strview_t *match, void **val);
+
+// Calls fn on every key that starts with prefix, in byte order. Returns false
+// when fn stopped it.
+bool art_iter_prefix(const art_t *tree, strview_t prefix, art_iter_fn *fn, void *usr);
+
 #endif
 
 //
@@ -510,6 +1306,68 @@ typedef struct test_s {
 bool tests_run_foreach(bool (*setup_test)(const test_t *test),
 		const test_t *test_list, size_t list_len, FILE *out);
 
+#if defined(__unix__) || defined(__APPLE__)
+typedef struct test_opts {
+	const char *filter;	// Only runs tests with names containing this
+	int jobs;		// Processes run at once, 0 for one per core
+	unsigned timeout_ms;	// Kills a test that runs longer, 0 for no limit
+	bool by_group;		// Fork once for each group between TEST_PADs
+} test_opts_t;
+
+// Runs every test in its own forked process, or each group if by_group is
+// set, so a crash or hang only takes down that test. Results are written in
+// list order once everything has finished. Returns true if all tests passed.
+bool tests_run_parallel(bool (*setup_test)(const test_t *test),
+		const test_t *test_list, size_t list_len, const test_opts_t *opts,
+		FILE *out);
+#endif
+
+// Benchmarks do iters iterations of the work they are measuring
+typedef void (bench_fn)(size_t iters);
+typedef struct bench_s {
+	bench_fn *pfn;
+	const char *name;
+} bench_t;
+
+// Helper macro for adding benchmarks
+#define BENCH_ADD(func_name) ((bench_t){ .pfn = func_name, .name = #func_name }),
+
+// Adds padding into the benchmark output
+#define BENCH_PAD ((bench_t){ .pfn = NULL, .name = NULL }),
+
+// Keeps the compiler from throwing away work whose result isn't used
+#define bench_keep(value) __asm__ __volatile__("" : : "g"(value) : "memory")
+// Makes the compiler assume all memory was read and written
+#define bench_clobber() __asm__ __volatile__("" : : : "memory")
+
+// Number of timed samples taken of each benchmark
+#ifndef BENCH_SAMPLES
+#	define BENCH_SAMPLES 31
+#endif
+// About how long each sample runs, the iterations are picked to fit it
+#ifndef BENCH_SAMPLE_NS
+#	define BENCH_SAMPLE_NS 2000000
+#endif
+
+typedef enum bench_format {
+	BENCH_FORMAT_TEXT,
+	BENCH_FORMAT_JSON,	// One JSON object per line
+} bench_format_t;
+
+typedef struct bench_result {
+	size_t iters;		// Iterations in each sample
+	double ns_per_op;	// Mean over every sample
+	double ops_per_sec;
+	double min, p50, p90, p99; // ns/op of the samples
+} bench_result_t;
+
+// Warms up, calibrates the number of iterations and times the samples
+bench_result_t bench_run(bench_fn *fn);
+
+// Runs the benchmarks whose name contains filter, or all with a NULL filter
+void benches_run_foreach(const bench_t *bench_list, size_t list_len,
+		const char *filter, bench_format_t format, FILE *out);
+
 #endif
 
 //
@@ -538,6 +1396,413 @@ int16_t packet_read_s16(const uint8_t *buf, int *head);
 int32_t packet_read_s32(const uint8_t *buf, int *head);
 float packet_read_float(const uint8_t *buf, int *head);
 
+static inline void packet_store_le32(uint8_t *buf, uint32_t value) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	memcpy(buf, &value, sizeof(value));
+}
+static inline uint32_t packet_load_le32(const uint8_t *buf) {
+	uint32_t value;
+	memcpy(&value, buf, sizeof(value));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value = __builtin_bswap32(value);
+#endif
+	return value;
+}
+
+// Bit writer that collects bits in a 64 bit accumulator and stores them 32
+// bits at a time. Writes the exact same bits as the packet_write_* functions.
+// Never writes past cap bytes. Running out of space sets err, which stays
+// set, so a whole packet can be written before checking it once.
+typedef struct packet_writer {
+	uint8_t *buf;
+
+	// Byte that the accumulator will be stored to and the size of buf
+	size_t pos, cap;
+
+	// Bits that haven't been stored yet, lowest bit first. There are always
+	// less than 32 of them in between calls.
+	uint64_t acc;
+	int nacc;
+
+	bool err;
+} packet_writer_t;
+
+void packet_writer_init(packet_writer_t *w, uint8_t *buf, size_t cap, size_t head);
+
+// Stores the bits left in the accumulator and returns the bit head
+size_t packet_writer_flush(packet_writer_t *w);
+void packet_writer_store_slow(packet_writer_t *w);
+
+static inline void packet_writer_bits32(packet_writer_t *w, uint32_t value, int numbits) {
+	w->acc |= ((uint64_t)value & ((1ull << numbits) - 1)) << w->nacc;
+	w->nacc += numbits;
+	if (w->nacc < 32) return;
+
+	// Only place the bounds are checked
+	if (w->pos + 4 <= w->cap) {
+		packet_store_le32(w->buf + w->pos, (uint32_t)w->acc);
+		w->pos += 4;
+	} else {
+		packet_writer_store_slow(w);
+	}
+	w->acc >>= 32;
+	w->nacc -= 32;
+}
+static inline void packet_writer_bits(packet_writer_t *w, uint64_t value, int numbits) {
+	if (numbits > 32) {
+		packet_writer_bits32(w, (uint32_t)value, 32);
+		value >>= 32, numbits -= 32;
+	}
+	packet_writer_bits32(w, (uint32_t)value, numbits);
+}
+static inline void packet_writer_u8(packet_writer_t *w, uint8_t value) {
+	if (!value) packet_writer_bits32(w, 0, 1);
+	else if (!(value & ~0xf)) packet_writer_bits32(w, 1 | value << 2, 6);
+	else packet_writer_bits32(w, 3 | value << 2, 10);
+}
+static inline void packet_writer_u16(packet_writer_t *w, uint16_t value) {
+	if (!value) packet_writer_bits32(w, 0, 2);
+	else if (!(value & ~0x1f)) packet_writer_bits32(w, 1 | value << 2, 7);
+	else if (!(value & ~0xff)) packet_writer_bits32(w, 2 | value << 2, 10);
+	else packet_writer_bits32(w, 3 | (uint32_t)value << 2, 18);
+}
+static inline void packet_writer_u32(packet_writer_t *w, uint32_t value) {
+	if (!value) packet_writer_bits32(w, 0, 2);
+	else if (!(value & ~0x3f)) packet_writer_bits32(w, 1 | value << 2, 8);
+	else if (!(value & ~0x7ff)) packet_writer_bits32(w, 2 | value << 2, 13);
+	else {
+		packet_writer_bits32(w, 3, 2);
+		packet_writer_bits32(w, value, 32);
+	}
+}
+static inline void packet_writer_s16(packet_writer_t *w, int16_t value) {
+	if (!value) packet_writer_bits32(w, 0, 2);
+	else if (value >= -0x10 && value < 0x10) {
+		packet_writer_bits32(w, 1 | (uint32_t)(value + 0x10) << 2, 7);
+	} else if (value >= -0x80 && value < 0x80) {
+		packet_writer_bits32(w, 2 | (uint32_t)(value + 0x80) << 2, 10);
+	} else {
+		packet_writer_bits32(w, 3 | (uint32_t)(value + 0x8000) << 2, 18);
+	}
+}
+static inline void packet_writer_s32(packet_writer_t *w, int32_t value) {
+	if (!value) packet_writer_bits32(w, 0, 2);
+	else if (value >= -0x20 && value < 0x20) {
+		packet_writer_bits32(w, 1 | (uint32_t)(value + 0x20) << 2, 8);
+	} else if (value >= -0x400 && value < 0x400) {
+		packet_writer_bits32(w, 2 | (uint32_t)(value + 0x400) << 2, 13);
+	} else {
+		packet_writer_bits32(w, 3, 2);
+		packet_writer_bits32(w, (uint32_t)((int64_t)value + 0x80000000), 32);
+	}
+}
+static inline void packet_writer_float(packet_writer_t *w, float value) {
+	const float a = fabsf(value);
+	uint32_t fixed = 0;
+
+	if (a < 0.001f) {
+		packet_writer_bits32(w, 0, 2);
+	} else if (a < 8.0f) {
+		fixed |= value < 0;
+		fixed |= ((uint32_t)a & 0x7) << 1;
+		fixed |= (uint16_t)(fmodf(a, 1.0f) * 1024.0f) << 4;
+		packet_writer_bits32(w, 1 | (fixed & 0x3fff) << 2, 16);
+	} else if (a < 127.0f) {
+		fixed |= value < 0;
+		fixed |= ((uint32_t)a & 0x7f) << 1;
+		fixed |= (uint16_t)(fmodf(a, 1.0f) * 256.0f) << 8;
+		packet_writer_bits32(w, 2 | (fixed & 0xffff) << 2, 18);
+	} else {
+		packet_writer_bits32(w, 3, 2);
+		packet_writer_bits32(w, packet_htonf(value), 32);
+	}
+}
+
+// Bit reader that loads 32 bits at a time into a 64 bit accumulator.
+// Reads the exact same bits as the packet_read_* functions. Never loads past
+// len bytes. Reading past the end reads zeros and sets err, which stays set,
+// so untrusted packets can be decoded fully and checked once at the end.
+typedef struct packet_reader {
+	const uint8_t *buf;
+
+	// Next byte to load and the number of bytes in buf
+	size_t pos, len;
+
+	// Bits that have been loaded but not read yet, lowest bit first
+	uint64_t acc;
+	int nacc;
+
+	bool err;
+} packet_reader_t;
+
+void packet_reader_init(packet_reader_t *r, const uint8_t *buf, size_t len, size_t head);
+size_t packet_reader_head(const packet_reader_t *r);
+void packet_reader_refill_slow(packet_reader_t *r, int numbits);
+
+static inline uint32_t packet_reader_bits32(packet_reader_t *r, int numbits) {
+	if (r->nacc < numbits) {
+		// Only place the bounds are checked
+		if (r->pos + 4 <= r->len) {
+			r->acc |= (uint64_t)packet_load_le32(r->buf + r->pos) << r->nacc;
+			r->pos += 4;
+			r->nacc += 32;
+		} else {
+			packet_reader_refill_slow(r, numbits);
+		}
+	}
+
+	const uint32_t value = r->acc & ((1ull << numbits) - 1);
+	r->acc >>= numbits;
+	r->nacc -= numbits;
+	return value;
+}
+static inline uint64_t packet_reader_bits(packet_reader_t *r, int numbits) {
+	if (numbits <= 32) return packet_reader_bits32(r, numbits);
+	const uint64_t lo = packet_reader_bits32(r, 32);
+	return lo | (uint64_t)packet_reader_bits32(r, numbits - 32) << 32;
+}
+static inline uint8_t packet_reader_u8(packet_reader_t *r) {
+	if (!packet_reader_bits32(r, 1)) return 0;
+	if (!packet_reader_bits32(r, 1)) return packet_reader_bits32(r, 4);
+	return packet_reader_bits32(r, 8);
+}
+static inline uint16_t packet_reader_u16(packet_reader_t *r) {
+	switch (packet_reader_bits32(r, 2)) {
+	case 0: return 0;
+	case 1: return packet_reader_bits32(r, 5);
+	case 2: return packet_reader_bits32(r, 8);
+	default: return packet_reader_bits32(r, 16);
+	}
+}
+static inline uint32_t packet_reader_u32(packet_reader_t *r) {
+	switch (packet_reader_bits32(r, 2)) {
+	case 0: return 0;
+	case 1: return packet_reader_bits32(r, 6);
+	case 2: return packet_reader_bits32(r, 11);
+	default: return packet_reader_bits32(r, 32);
+	}
+}
+static inline int16_t packet_reader_s16(packet_reader_t *r) {
+	switch (packet_reader_bits32(r, 2)) {
+	case 0: return 0;
+	case 1: return (int16_t)packet_reader_bits32(r, 5) - 0x10;
+	case 2: return (int16_t)packet_reader_bits32(r, 8) - 0x80;
+	default: return (int16_t)((int32_t)packet_reader_bits32(r, 16) - 0x8000);
+	}
+}
+static inline int32_t packet_reader_s32(packet_reader_t *r) {
+	switch (packet_reader_bits32(r, 2)) {
+	case 0: return 0;
+	case 1: return (int32_t)packet_reader_bits32(r, 6) - 0x20;
+	case 2: return (int32_t)packet_reader_bits32(r, 11) - 0x400;
+	default: return (int32_t)((int64_t)packet_reader_bits32(r, 32) - 0x80000000);
+	}
+}
+static inline float packet_reader_float(packet_reader_t *r) {
+	float a, sign;
+
+	switch (packet_reader_bits32(r, 2)) {
+	case 0:
+		return 0.0f;
+	case 1:
+		sign = packet_reader_bits32(r, 1) ? -1.0f : 1.0f;
+		a = (float)packet_reader_bits32(r, 3);
+		a += (float)packet_reader_bits32(r, 10) / 1024.0f;
+		return a * sign;
+	case 2:
+		sign = packet_reader_bits32(r, 1) ? -1.0f : 1.0f;
+		a = (float)packet_reader_bits32(r, 7);
+		a += (float)packet_reader_bits32(r, 8) / 256.0f;
+		return a * sign;
+	default:
+		return packet_ntohf(packet_reader_bits32(r, 32));
+	}
+}
+// Arrays are split into blocks of this many values, and every value in a
+// block is written with the same number of bits. Ints get a 6 bit width in
+// front of each block and floats get the same 2 bit size class as
+// packet_write_float, picked from the biggest value in the block. Smaller
+// floats are written in that class too, so a value under 8 only keeps 1/256
+// instead of 1/1024 when its block has a value of 8 or more.
+#define PACKET_ARRAY_BLOCK 32
+
+void packet_writer_u32_array(packet_writer_t *w, const uint32_t *vals, size_t n);
+void packet_writer_s32_array(packet_writer_t *w, const int32_t *vals, size_t n);
+void packet_writer_float_array(packet_writer_t *w, const float *vals, size_t n);
+void packet_reader_u32_array(packet_reader_t *r, uint32_t *vals, size_t n);
+void packet_reader_s32_array(packet_reader_t *r, int32_t *vals, size_t n);
+void packet_reader_float_array(packet_reader_t *r, float *vals, size_t n);
+
+static inline void packet_writer_bool(packet_writer_t *w, bool value) {
+	packet_writer_bits32(w, value, 1);
+}
+static inline bool packet_reader_bool(packet_reader_t *r) {
+	return packet_reader_bits32(r, 1);
+}
+
+//
+// Packet schemas. Describe a message once as an X macro list of
+// X(kind, field) entries, where kind is one of bool, u8, u16, u32, s16, s32
+// or float, and get inline encode and decode functions that can't drift
+// apart. For example:
+/*
+	#define PLAYER_FIELDS(X) \
+		X(u16, id) \
+		X(s32, x) \
+		X(s32, y) \
+		X(float, angle)
+
+	PACKET_SCHEMA_STRUCT(player, PLAYER_FIELDS)
+	PACKET_SCHEMA(player, player_t, PLAYER_FIELDS)
+*/
+// Makes player_t, player_encode, player_decode, player_write, player_read
+// and the player_max_bits/player_max_bytes constants.
+//
+#define PACKET_CTYPE_bool bool
+#define PACKET_CTYPE_u8 uint8_t
+#define PACKET_CTYPE_u16 uint16_t
+#define PACKET_CTYPE_u32 uint32_t
+#define PACKET_CTYPE_s16 int16_t
+#define PACKET_CTYPE_s32 int32_t
+#define PACKET_CTYPE_float float
+
+// Biggest number of bits each kind can be encoded with
+#define PACKET_MAX_BITS_bool 1
+#define PACKET_MAX_BITS_u8 10
+#define PACKET_MAX_BITS_u16 18
+#define PACKET_MAX_BITS_u32 34
+#define PACKET_MAX_BITS_s16 18
+#define PACKET_MAX_BITS_s32 34
+#define PACKET_MAX_BITS_float 34
+
+#define PACKET_SCHEMA_STRUCT_FIELD(kind, field) PACKET_CTYPE_##kind field;
+#define PACKET_SCHEMA_ENCODE_FIELD(kind, field) packet_writer_##kind(w, v->field);
+#define PACKET_SCHEMA_DECODE_FIELD(kind, field) v->field = packet_reader_##kind(r);
+#define PACKET_SCHEMA_MAX_BITS_FIELD(kind, field) + PACKET_MAX_BITS_##kind
+
+#define PACKET_SCHEMA_STRUCT(name, fields) \
+	typedef struct name { \
+		fields(PACKET_SCHEMA_STRUCT_FIELD) \
+	} name##_t;
+
+#define PACKET_SCHEMA(name, type, fields) \
+	enum { \
+		name##_max_bits = 0 fields(PACKET_SCHEMA_MAX_BITS_FIELD), \
+		name##_max_bytes = (name##_max_bits + 7) / 8, \
+	}; \
+	static inline void name##_encode(packet_writer_t *w, const type *v) { \
+		fields(PACKET_SCHEMA_ENCODE_FIELD) \
+	} \
+	static inline void name##_decode(packet_reader_t *r, type *v) { \
+		fields(PACKET_SCHEMA_DECODE_FIELD) \
+	} \
+	/* Returns the number of bytes written, or 0 if it didn't fit */ \
+	static inline size_t name##_write(uint8_t *buf, size_t cap, const type *v) { \
+		packet_writer_t w; \
+		packet_writer_init(&w, buf, cap, 0); \
+		name##_encode(&w, v); \
+		const size_t head = packet_writer_flush(&w); \
+		return w.err ? 0 : (head + 7) / 8; \
+	} \
+	/* Returns false if the packet was too short */ \
+	static inline bool name##_read(const uint8_t *buf, size_t len, type *v) { \
+		packet_reader_t r; \
+		packet_reader_init(&r, buf, len, 0); \
+		name##_decode(&r, v); \
+		return !r.err; \
+	}
+
+//
+// Delta compression for packet schemas. PACKET_DELTA(name, type, fields)
+// makes name_delta_encode and name_delta_decode, which only send the fields
+// that changed from a baseline that both sides have. A delta is a single 0
+// bit if nothing changed, otherwise a 1 bit, a bit mask of the changed fields
+// and then the changed fields. Schemas can have at most 64 fields.
+//
+#define PACKET_DELTA_COUNT_FIELD(kind, field) + 1
+#define PACKET_DELTA_MASK_FIELD(kind, field) \
+	mask |= (uint64_t)(v->field != base->field) << nfield++;
+#define PACKET_DELTA_ENCODE_FIELD(kind, field) \
+	if (mask >> nfield++ & 1) packet_writer_##kind(w, v->field);
+#define PACKET_DELTA_DECODE_FIELD(kind, field) \
+	if (mask >> nfield++ & 1) v->field = packet_reader_##kind(r);
+
+#define PACKET_DELTA(name, type, fields) \
+	enum { \
+		name##_nfields = 0 fields(PACKET_DELTA_COUNT_FIELD), \
+		name##_delta_max_bits = 1 + name##_nfields \
+			fields(PACKET_SCHEMA_MAX_BITS_FIELD), \
+	}; \
+	_Static_assert(name##_nfields <= 64, #name " has too many fields for a delta"); \
+	static inline void name##_delta_encode(packet_writer_t *w, const type *base, \
+					const type *v) { \
+		uint64_t mask = 0; \
+		int nfield = 0; \
+		fields(PACKET_DELTA_MASK_FIELD) \
+		packet_writer_bits32(w, !!mask, 1); \
+		if (!mask) return; \
+		packet_writer_bits(w, mask, name##_nfields); \
+		nfield = 0; \
+		fields(PACKET_DELTA_ENCODE_FIELD) \
+	} \
+	/* base and v can be the same */ \
+	static inline void name##_delta_decode(packet_reader_t *r, const type *base, \
+					type *v) { \
+		if (v != base) *v = *base; \
+		if (!packet_reader_bits32(r, 1)) return; \
+		const uint64_t mask = packet_reader_bits(r, name##_nfields); \
+		int nfield = 0; \
+		fields(PACKET_DELTA_DECODE_FIELD) \
+	}
+
+//
+// Ring buffer of past snapshots by sequence number, to delta against.
+// The sender stores every snapshot it sends and acks them as the other side
+// confirms them, then deltas against name_baseline (or sends everything if
+// there isn't one) and tells the other side which sequence it used. The
+// receiver stores every snapshot it decodes and finds the baseline with
+// name_get. Snapshots older than nslots sequences are forgotten.
+//
+#define PACKET_BASELINES(name, type, nslots) \
+	typedef struct name { \
+		uint32_t seq[nslots]; \
+		bool used[nslots]; \
+		uint32_t acked; \
+		bool has_acked; \
+		type state[nslots]; \
+	} name##_t; \
+	static inline void name##_init(name##_t *self) { \
+		memset(self->used, 0, sizeof(self->used)); \
+		self->has_acked = false; \
+	} \
+	/* Returns where to put the snapshot for seq */ \
+	static inline type *name##_store(name##_t *self, uint32_t seq) { \
+		const size_t slot = seq % (nslots); \
+		self->seq[slot] = seq; \
+		self->used[slot] = true; \
+		return self->state + slot; \
+	} \
+	static inline type *name##_get(name##_t *self, uint32_t seq) { \
+		const size_t slot = seq % (nslots); \
+		if (!self->used[slot] || self->seq[slot] != seq) return NULL; \
+		return self->state + slot; \
+	} \
+	/* Acks older than the current baseline are ignored */ \
+	static inline void name##_ack(name##_t *self, uint32_t seq) { \
+		if (!name##_get(self, seq)) return; \
+		if (self->has_acked && (int32_t)(seq - self->acked) <= 0) return; \
+		self->acked = seq; \
+		self->has_acked = true; \
+	} \
+	/* Newest acked snapshot still in the ring, or NULL */ \
+	static inline type *name##_baseline(name##_t *self, uint32_t *seq) { \
+		if (!self->has_acked) return NULL; \
+		if (seq) *seq = self->acked; \
+		return name##_get(self, self->acked); \
+	}
+
 #endif
 
 #endif
@@ -1,4 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <time.h>
 
 #include "../ek.h"
 
@@ -6,6 +13,71 @@
 bool test_test1(unsigned testid) {
 	return true;
 }
+static size_t test_bench_iters;
+static void test_bench_fn(size_t iters) {
+	for (size_t i = 0; i < iters; i++) bench_keep(i);
+	test_bench_iters += iters;
+}
+static bool test_runner_pass(unsigned testid) {
+	return true;
+}
+static bool test_runner_fail(unsigned testid) {
+	return TEST_BAD;
+}
+static bool test_runner_crash(unsigned testid) {
+	abort();
+	return true;
+}
+static bool test_runner_hang(unsigned testid) {
+	for (;;) pause();
+	return true;
+}
+bool test_runner1(unsigned testid) {
+	static const test_t inner[] = {
+		TEST_ADD(test_runner_pass)
+		TEST_ADD(test_runner_fail)
+		TEST_PAD
+		TEST_ADD(test_runner_crash)
+		TEST_ADD(test_runner_pass)
+		TEST_PAD
+		TEST_ADD(test_runner_hang)
+	};
+	static char buf[4096];
+	const test_opts_t opts[] = {
+		{ .jobs = 2, .timeout_ms = 100 },
+		{ .jobs = 2, .timeout_ms = 100, .by_group = true },
+		{ .jobs = 1, .filter = "pass" },
+	};
+	bool passed[arrlen(opts)];
+
+	for (int i = 0; i < arrlen(opts); i++) {
+		FILE *const f = tmpfile();
+		if (!f) return TEST_BAD;
+		passed[i] = tests_run_parallel(NULL, inner, arrlen(inner), opts + i, f);
+		rewind(f);
+		buf[fread(buf, 1, sizeof(buf) - 1, f)] = '\0';
+		fclose(f);
+
+		if (i == 0 && (!strstr(buf, "FAIL AT") || !strstr(buf, "CRASH, SIGNAL")
+			|| !strstr(buf, "TIMEOUT") || !strstr(buf, "2/5 tests"))) return TEST_BAD;
+		// The crash takes the rest of its group with it
+		if (i == 1 && (!strstr(buf, "NOT RUN") || !strstr(buf, "1/5 tests"))) return TEST_BAD;
+		if (i == 2 && !strstr(buf, "2/2 tests")) return TEST_BAD;
+	}
+	if (passed[0] || passed[1] || !passed[2]) return TEST_BAD;
+
+	return true;
+}
+bool test_bench1(unsigned testid) {
+	const bench_result_t res = bench_run(test_bench_fn);
+
+	// The samples run at least the calibrated number of iterations each
+	if (res.iters < 2 || test_bench_iters < res.iters * BENCH_SAMPLES) return TEST_BAD;
+	if (!(res.min <= res.p50 && res.p50 <= res.p90 && res.p90 <= res.p99)) return TEST_BAD;
+	if (res.ns_per_op <= 0.0 || res.ops_per_sec <= 0.0) return TEST_BAD;
+
+	return true;
+}
 
 // EK_USE_STRVIEW
 bool test_strview1(unsigned testid) {
@@ -43,6 +115,237 @@ bool test_strview4(unsigned testid) {
 	return true;
 }
 
+typedef struct test_strparse_int {
+	const char *str;
+	size_t used;
+	int64_t i64;
+	bool overflow;
+} test_strparse_int_t;
+bool test_strparse1(unsigned testid) {
+	static const test_strparse_int_t cases[] = {
+		{ "0", 1, 0, false },
+		{ "-0", 2, 0, false },
+		{ "+7", 2, 7, false },
+		{ "42abc", 2, 42, false },
+		{ "0000000000000000000000000000001", 31, 1, false },
+		{ "1234567890123", 13, 1234567890123, false },
+		{ "12345678x9", 8, 12345678, false },
+		{ "9223372036854775807", 19, INT64_MAX, false },
+		{ "-9223372036854775808", 20, INT64_MIN, false },
+		{ "9223372036854775808", 19, INT64_MAX, true },
+		{ "-9223372036854775809", 20, INT64_MIN, true },
+		{ "-123456789012345678901234567890 ", 31, INT64_MIN, true },
+		{ "95580060314976929952745", 23, INT64_MAX, true },
+		{ "+77996657235586603318", 21, INT64_MAX, true },
+		{ "-95580060314976929952745", 24, INT64_MIN, true },
+		{ "", 0, 0, false },
+		{ "-", 0, 0, false },
+		{ "+-1", 0, 0, false },
+		{ " 1", 0, 0, false },
+		{ "x1", 0, 0, false },
+	};
+	for (size_t i = 0; i < arrlen(cases); i++) {
+		const strview_t v = str_to_strview(cases[i].str);
+		int64_t out = -1;
+		bool overflow = !cases[i].overflow;
+		if (strview_parse_i64(&v, &out, &overflow) != cases[i].used) return TEST_BAD;
+		if (!cases[i].used) {
+			if (out != -1) return TEST_BAD;
+			continue;
+		}
+		if (out != cases[i].i64 || overflow != cases[i].overflow) return TEST_BAD;
+	}
+
+	uint64_t u;
+	bool overflow;
+	strview_t v = make_strview("18446744073709551615");
+	if (strview_parse_u64(&v, &u, &overflow) != 20 || u != UINT64_MAX || overflow) return TEST_BAD;
+	v = make_strview("18446744073709551616");
+	if (strview_parse_u64(&v, &u, &overflow) != 20 || u != UINT64_MAX || !overflow) return TEST_BAD;
+	v = make_strview("+99999999999999999999999");
+	if (strview_parse_u64(&v, &u, NULL) != 24 || u != UINT64_MAX) return TEST_BAD;
+	v = make_strview("-1");
+	if (strview_parse_u64(&v, &u, NULL)) return TEST_BAD;
+
+	// Only the view is read, not up to a terminator
+	v = (strview_t){ "1234567890", 9 };
+	if (strview_parse_u64(&v, &u, NULL) != 9 || u != 123456789) return TEST_BAD;
+
+	// Against strtoll for every length and split of a random number
+	uint64_t rng = 1;
+	char buf[32];
+	for (int i = 0; i < 4096; i++) {
+		rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+		const int64_t n = (int64_t)(rng >> (i % 63 + 1));
+		const int len = snprintf(buf, sizeof(buf), "%lld", (long long)(i % 2 ? n : -n));
+		v = (strview_t){ buf, (size_t)(len - (len > 4 ? i % 4 : 0)) };
+		int64_t out;
+		if (strview_parse_i64(&v, &out, &overflow) != v.len || overflow) return TEST_BAD;
+		buf[v.len] = '\0';
+		if (out != strtoll(buf, NULL, 10)) return TEST_BAD;
+	}
+
+	return true;
+}
+
+static bool test_strparse_check(const char *str) {
+	const strview_t v = str_to_strview(str);
+	char *end;
+	const double want = strtod(str, &end);
+	double got = 0.0;
+	bool overflow;
+	const size_t used = strview_parse_f64(&v, &got, &overflow);
+	if (used != (size_t)(end - str)) return false;
+	if (!used) return true;
+	if (isnan(want)) return isnan(got) && !signbit(want) == !signbit(got);
+	// Spelling out inf isn't an overflow
+	const bool word = (str[*str == '+' || *str == '-'] | 0x20) == 'i';
+	if (overflow != (isinf(want) && !word)) return false;
+	return !memcmp(&got, &want, sizeof(got));
+}
+bool test_strparse2(unsigned testid) {
+	static const char *cases[] = {
+		"0", "-0", "+0.0", "0e-10000", "1", "1.5", ".5", "5.", "-.5e1", "1e5x", "1e", "1e+",
+		"1.e-", "2.5E-3", "1e308", "1.7976931348623157e308", "1.7976931348623158e308",
+		"1.7976931348623159e308", "1e309", "-1e400", "4.9406564584124654e-324",
+		"2.4703282292062327e-324", "2.4703282292062328e-324", "2.2250738585072011e-308",
+		"2.2250738585072014e-308", "9007199254740993", "9007199254740992.5",
+		"9007199254740993.0000000000000000000000000001", "123456789012345678901234567890",
+		"0.000000000000000000000000000000000000000000001", "3.14159265358979323846264338327950",
+		"1e23", "8.98846567431158e307", "7.2057594037927933e16", "1e-350", "1e999999999999",
+		"00000000000000000000000000000000000000000000000000000000123.45e-2",
+		"inf", "-Infinity", "INFINITE", "nan", "-NaN", "nan(123abc)", "nan(", "in", "na",
+		"", "-", ".", "+.", "e5", ".e5", "-x",
+	};
+	for (size_t i = 0; i < arrlen(cases); i++) {
+		if (!test_strparse_check(cases[i])) return TEST_BAD;
+	}
+
+	uint64_t rng = 7;
+	char buf[1024];
+	for (int i = 0; i < 20000; i++) {
+		rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+		const uint64_t r = rng;
+		rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+
+		// Shortest round trip and shorter, of random bit patterns
+		double d;
+		memcpy(&d, &r, sizeof(d));
+		if (isnan(d)) continue;
+		snprintf(buf, sizeof(buf), "%.*g", (int)(rng % 18) + 1, d);
+		if (!test_strparse_check(buf)) return TEST_BAD;
+
+		// Random digits with random exponents
+		size_t n = 0;
+		const size_t ndigits = rng % 40 + 1;
+		for (size_t j = 0; j < ndigits; j++) {
+			rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+			buf[n++] = (char)('0' + (rng >> 33) % 10);
+			if (j == ndigits / 2 && rng % 2) buf[n++] = '.';
+		}
+		snprintf(buf + n, sizeof(buf) - n, "e%d", (int)(rng >> 40) % 700 - 350);
+		if (!test_strparse_check(buf)) return TEST_BAD;
+
+		// Exactly halfway between two doubles, then just above it
+		if (i % 16) continue;
+		const double lo = fabs(d) < 1e300 ? fabs(d) : 1.0 / fabs(d);
+		const long double mid = (long double)lo + ((long double)nextafter(lo, INFINITY) - lo) / 2;
+		const int len = snprintf(buf, sizeof(buf) - 32, "%.780Le", mid);
+		if (len <= 0 || !test_strparse_check(buf)) return TEST_BAD;
+		char *e = strchr(buf, 'e');
+		char exp[16];
+		snprintf(exp, sizeof(exp), "%s", e);
+		snprintf(e, 32, "00000001%s", exp);
+		if (!test_strparse_check(buf)) return TEST_BAD;
+	}
+
+	return true;
+}
+
+// EK_USE_UTF8
+bool test_utf8_1(unsigned testid) {
+	strview_t v = make_strview("a\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80!");
+	const uint32_t expected[] = { 'a', 0xe9, 0x20ac, 0x1f600, '!' };
+	uint8_t buf[4];
+
+	if (!strview_valid_utf8(&v)) return TEST_BAD;
+	if (strview_count_utf8(&v) != arrlen(expected)) return TEST_BAD;
+	for (int i = 0; i < arrlen(expected); i++) {
+		const char *const at = v.str;
+		if (strview_next_utf8(&v) != expected[i]) return TEST_BAD;
+
+		// Encoding gives back the same bytes
+		utf8_codepoint_encode(expected[i], buf);
+		if (memcmp(buf, at, utf32_to_utf8_len(expected[i])) != 0) return TEST_BAD;
+	}
+	if (v.len != 0) return TEST_BAD;
+
+	return true;
+}
+bool test_utf8_2(unsigned testid) {
+	static const struct {
+		const char *str;
+		bool valid;
+	} cases[] = {
+		{ "\xc3\xa9", true },
+		{ "\xef\xbf\xbf", true },
+		{ "\xf4\x8f\xbf\xbf", true },
+		{ "\x80", false },			// Lone continuation
+		{ "\xc0\x80", false },			// Overlong 2 byte
+		{ "\xe0\x9f\xbf", false },		// Overlong 3 byte
+		{ "\xf0\x8f\xbf\xbf", false },	// Overlong 4 byte
+		{ "\xed\xa0\x80", false },		// Surrogate
+		{ "\xf4\x90\x80\x80", false },	// Past U+10FFFF
+		{ "\xf8\x88\x80\x80\x80", false },	// 5 byte
+		{ "\xe2\x82", false },			// Cut off
+		{ "\xc3\xa9\xa9", false },		// Too many continuations
+		{ "\xe2\x28\xa1", false },		// Not a continuation
+	};
+	uint8_t buf[100];
+
+	// Every offset, so the sequences land across SIMD blocks and the tail
+	for (int i = 0; i < arrlen(cases); i++) {
+		const size_t len = strlen(cases[i].str);
+		for (size_t at = 0; at + len <= sizeof(buf); at++) {
+			memset(buf, 'x', sizeof(buf));
+			memcpy(buf + at, cases[i].str, len);
+			if (utf8_valid(buf, sizeof(buf)) != cases[i].valid) return TEST_BAD;
+			if (utf8_valid(buf, at + len) != cases[i].valid) return TEST_BAD;
+		}
+	}
+
+	return true;
+}
+bool test_utf8_3(unsigned testid) {
+	const char *const text = "Konata \xe6\xb3\x89\xe3\x81\x93\xe3\x81\xaa\xe3\x81\x9f, "
+		"\xf0\x9f\x8d\xab chocolate cornet, caf\xc3\xa9 au lait. The quick brown "
+		"fox jumps over the lazy dog \xf0\x9f\xa6\x8a";
+	const uint8_t *const src = (const uint8_t *)text;
+	const size_t len = strlen(text);
+	uint32_t u32[128];
+	uint16_t u16[128];
+	uint8_t u8[512];
+
+	const size_t ncp = utf8_to_utf32(src, len, u32);
+	if (ncp != utf8_count(src, len)) return TEST_BAD;
+	if (u32[7] != 0x6cc9 || u32[13] != 0x1f36b) return TEST_BAD;
+	if (utf32_to_utf8(u32, ncp, u8) != len || memcmp(u8, src, len) != 0) return TEST_BAD;
+
+	const size_t nunits = utf8_to_utf16(src, len, u16);
+	if (nunits != utf8_utf16_len(src, len) || nunits != ncp + 2) return TEST_BAD;
+	if (u16[13] != 0xd83c || u16[14] != 0xdf6b) return TEST_BAD;
+	if (utf16_to_utf8(u16, nunits, u8) != len || memcmp(u8, src, len) != 0) return TEST_BAD;
+
+	// Bad input is rejected in every direction
+	if (utf8_to_utf32((const uint8_t *)"ab\xed\xa0\x80", 5, u32) != UTF_INVALID) return TEST_BAD;
+	if (utf8_to_utf16((const uint8_t *)"ab\xe2\x82", 4, u16) != UTF_INVALID) return TEST_BAD;
+	if (utf32_to_utf8((const uint32_t[]){ 'a', 0x110000 }, 2, u8) != UTF_INVALID) return TEST_BAD;
+	if (utf16_to_utf8((const uint16_t[]){ 'a', 0xd800 }, 2, u8) != UTF_INVALID) return TEST_BAD;
+	if (utf16_to_utf8((const uint16_t[]){ 0xdc00, 'a' }, 2, u8) != UTF_INVALID) return TEST_BAD;
+
+	return true;
+}
+
 typedef struct test_person {
 	strview_t name;
 	int age;
@@ -106,21 +409,1740 @@ bool test_hset1(unsigned testid) {
 	hset_deinit(map);
 	return true;
 }
+static uint64_t test_u32_hash(const uint32_t *key) {
+	return xxhash64_single_lane((const uint8_t *)key, sizeof(*key));
+}
+static uint64_t test_u32_bad_hash(const uint32_t *key) {
+	return *key & 3;
+}
+static bool test_u32_eq(const uint32_t *a, const uint32_t *b) {
+	return *a == *b;
+}
+bool test_hset2(unsigned testid) {
+	hset_hash_fn *const hashes[] = {
+		(hset_hash_fn *)test_u32_hash,
+		(hset_hash_fn *)test_u32_bad_hash,
+	};
+	hset_stats_t stats[arrlen(hashes)];
+
+	for (int h = 0; h < arrlen(hashes); h++) {
+		uint32_t *set = hset_init(mem_stdlib_alloc(), 8, sizeof(*set),
+					hashes[h], (hset_eq_fn *)test_u32_eq);
+		if (!set) return TEST_BAD;
+
+		for (uint32_t i = 0; i < 1000; i++) set = hset_insert(set, &i);
+		// Overwriting keeps the count
+		for (uint32_t i = 0; i < 1000; i += 7) set = hset_insert(set, &i);
+
+		stats[h] = hset_stats(set);
+		uint32_t total = 0;
+		for (int i = 0; i < HSET_STATS_PSL_BUCKETS; i++) total += stats[h].psl_hist[i];
+		if (stats[h].nents != 1000 || total != 1000) return TEST_BAD;
+		if (stats[h].capacity != 2048 || stats[h].grows != 8) return TEST_BAD;
+		if (stats[h].load * 100 > HSET_MAX_LOAD) return TEST_BAD;
+		if (stats[h].bytes < stats[h].capacity * 2 * sizeof(uint64_t)) return TEST_BAD;
+
+		// Removing has to keep the probe sequences of the rest intact
+		for (uint32_t i = 0; i < 1000; i += 2) hset_remove(set, hset_get(set, &i));
+		for (uint32_t i = 0; i < 1000; i++) {
+			if (!hset_get(set, &i) != !(i & 1)) return TEST_BAD;
+		}
+
+		hset_stats_reset(set);
+		hset_get(set, &(uint32_t){ 1 });
+		hset_get(set, &(uint32_t){ 2 });
+		const hset_stats_t after = hset_stats(set);
+		if (after.nents != 500) return TEST_BAD;
+#if EK_HSET_COUNTERS
+		if (after.hits != 1 || after.misses != 1 || after.probes < 1) return TEST_BAD;
+#else
+		if (after.hits || after.misses || after.probes) return TEST_BAD;
+#endif
+
+		hset_deinit(set);
+	}
+
+	if (stats[0].max_psl > 32 || stats[0].avg_psl > 2.0) return TEST_BAD;
+	// Four buckets for 1000 keys
+	if (stats[1].avg_psl < 100.0 || stats[1].psl_hist[HSET_STATS_PSL_BUCKETS - 1] < 900)
+		return TEST_BAD;
+
+	return true;
+}
+typedef struct test_cmap_kv {
+	uint32_t key, val;
+} test_cmap_kv_t;
+
+bool test_cmap1(unsigned testid) {
+	test_cmap_kv_t *map = cmap_init(mem_stdlib_alloc(), 0, sizeof(*map),
+					(hset_hash_fn *)test_u32_hash,
+					(hset_eq_fn *)test_u32_eq);
+	if (!map) return TEST_BAD;
+
+	// Kept in insertion order, overwriting keeps the position
+	for (uint32_t i = 0; i < 100; i++) {
+		map = cmap_insert(map, &(test_cmap_kv_t){ .key = 99 - i, .val = i });
+	}
+	map = cmap_insert(map, &(test_cmap_kv_t){ .key = 50, .val = 1000 });
+	if (cmap_len(map) != 100) return TEST_BAD;
+
+	uint32_t n = 0;
+	for (test_cmap_kv_t *iter = cmap_next(map, NULL); iter; iter = cmap_next(map, iter)) {
+		if (iter->key != 99 - n) return TEST_BAD;
+		if (iter->val != (iter->key == 50 ? 1000 : n)) return TEST_BAD;
+		n++;
+	}
+	if (n != 100) return TEST_BAD;
+
+	// Removed keys are gone and reinserting puts them at the end
+	for (uint32_t i = 0; i < 100; i += 3) cmap_remove(map, cmap_get(map, &i));
+	map = cmap_insert(map, &(test_cmap_kv_t){ .key = 3, .val = 3 });
+	test_cmap_kv_t *last = NULL;
+	n = 0;
+	for (test_cmap_kv_t *iter = cmap_next(map, NULL); iter; iter = cmap_next(map, iter)) {
+		if (iter->key % 3 == 0 && iter->key != 3) return TEST_BAD;
+		last = iter;
+		n++;
+	}
+	if (n != cmap_len(map) || n != 67 || !last || last->key != 3) return TEST_BAD;
+
+	// Churn so the holes have to be compacted, and check against a plain array
+	static uint32_t ref[512];
+	memset(ref, 0, sizeof(ref));
+	for (uint32_t i = 0; i < 100; i++) {
+		const test_cmap_kv_t *kv = cmap_get(map, &i);
+		if (kv) ref[i] = kv->val + 1;
+	}
+	uint32_t rng = 1;
+	for (int i = 0; i < 20000; i++) {
+		rng = rng * 1103515245 + 12345;
+		const uint32_t key = (rng >> 8) % arrlen(ref);
+		test_cmap_kv_t *kv = cmap_get(map, &key);
+		if (!kv != !ref[key]) return TEST_BAD;
+		if (kv && kv->val + 1 != ref[key]) return TEST_BAD;
+
+		if (rng & 0x80 && kv) {
+			cmap_remove(map, kv);
+			ref[key] = 0;
+		} else {
+			map = cmap_insert(map, &(test_cmap_kv_t){ .key = key, .val = i });
+			if (!map) return TEST_BAD;
+			ref[key] = i + 1;
+		}
+	}
+	n = 0;
+	for (uint32_t i = 0; i < arrlen(ref); i++) n += !!ref[i];
+	if (cmap_len(map) != n) return TEST_BAD;
+	for (test_cmap_kv_t *iter = cmap_next(map, NULL); iter; iter = cmap_next(map, iter)) {
+		if (ref[iter->key] != iter->val + 1) return TEST_BAD;
+		n--;
+	}
+	if (n) return TEST_BAD;
+
+	cmap_deinit(map);
+	return true;
+}
+
+static void test_cache_evict(void *usr, void *kv) {
+	(*(int *)usr)++;
+}
+bool test_cache1(unsigned testid) {
+	const cache_policy_t policies[] = { CACHE_LRU, CACHE_CLOCK };
+
+	for (int p = 0; p < arrlen(policies); p++) {
+		int evicted = 0;
+		cache_t *cache = cache_init(mem_stdlib_alloc(), 3, sizeof(test_cmap_kv_t),
+				(hset_hash_fn *)test_u32_hash, (hset_eq_fn *)test_u32_eq,
+				policies[p]);
+		if (!cache) return TEST_BAD;
+		cache_on_evict(cache, test_cache_evict, &evicted);
+
+		for (uint32_t i = 1; i <= 3; i++) {
+			if (!cache_put(cache, &(test_cmap_kv_t){ .key = i, .val = i * 10 }, 1)) return TEST_BAD;
+		}
+		const test_cmap_kv_t *kv = cache_get(cache, &(uint32_t){ 1 });
+		if (!kv || kv->val != 10) return TEST_BAD;
+
+		// Both policies keep 1 since it was used, 2 is the oldest after it
+		cache_put(cache, &(test_cmap_kv_t){ .key = 4, .val = 40 }, 1);
+		if (evicted != 1 || cache_get(cache, &(uint32_t){ 2 })) return TEST_BAD;
+		if (!cache_get(cache, &(uint32_t){ 1 })) return TEST_BAD;
+		if (!cache_get(cache, &(uint32_t){ 3 })) return TEST_BAD;
+		if (!cache_get(cache, &(uint32_t){ 4 })) return TEST_BAD;
+
+		// Overwriting hands the old kv to the callback, a bigger charge evicts
+		cache_put(cache, &(test_cmap_kv_t){ .key = 4, .val = 41 }, 2);
+		if (evicted != 3) return TEST_BAD;
+		kv = cache_get(cache, &(uint32_t){ 4 });
+		if (!kv || kv->val != 41) return TEST_BAD;
+
+		cache_stats_t stats = cache_stats(cache);
+		if (stats.len != 2 || stats.charge != 3 || stats.evictions != 2) return TEST_BAD;
+		if (stats.misses != 1 || stats.hits != 5) return TEST_BAD;
+
+		if (cache_put(cache, &(test_cmap_kv_t){ .key = 5 }, 4)) return TEST_BAD;
+		if (!cache_remove(cache, &(uint32_t){ 4 }) || cache_remove(cache, &(uint32_t){ 4 })) return TEST_BAD;
+		if (evicted != 4 || cache_stats(cache).charge != 1) return TEST_BAD;
+
+		// Once it's full nothing gets allocated
+		for (uint32_t i = 0; i < 100; i++) cache_put(cache, &(test_cmap_kv_t){ .key = i }, 1);
+#ifndef NDEBUG
+		const size_t allocated = mem_stdlib_allocated_bytes();
+#endif
+		for (uint32_t i = 0; i < 1000; i++) {
+			if (!cache_get(cache, &i)) cache_put(cache, &(test_cmap_kv_t){ .key = i }, 1);
+		}
+#ifndef NDEBUG
+		if (mem_stdlib_allocated_bytes() != allocated) return TEST_BAD;
+#endif
+		if (cache_stats(cache).len != 3) return TEST_BAD;
+
+		evicted = 0;
+		cache_deinit(cache);
+		if (evicted != 3) return TEST_BAD;
+	}
+
+	return true;
+}
+
+typedef struct test_cache_thread {
+	cache_sharded_t *cache;
+	uint32_t seed;
+	bool ok;
+} test_cache_thread_t;
+
+static void *test_cache_thread(void *arg) {
+	test_cache_thread_t *t = arg;
+	uint32_t rng = t->seed;
+	t->ok = true;
+
+	for (int i = 0; i < 20000; i++) {
+		rng = rng * 1103515245 + 12345;
+		const uint32_t key = (rng >> 8) % 1024;
+		test_cmap_kv_t kv;
+
+		if (cache_sharded_get(t->cache, &key, &kv)) {
+			// Values are always derived from the key, whoever put them
+			if (kv.key != key || kv.val != key * 3) t->ok = false;
+		} else if (!cache_sharded_put(t->cache, &(test_cmap_kv_t){ key, key * 3 }, 1)) {
+			t->ok = false;
+		}
+		if (i % 64 == 0) cache_sharded_remove(t->cache, &key);
+	}
+
+	return NULL;
+}
+bool test_cache2(unsigned testid) {
+	cache_sharded_t *cache = cache_sharded_init(mem_stdlib_alloc(), 6, 256,
+				sizeof(test_cmap_kv_t),
+				(hset_hash_fn *)test_u32_hash, (hset_eq_fn *)test_u32_eq,
+				CACHE_CLOCK);
+	if (!cache) return TEST_BAD;
+
+	pthread_t threads[4];
+	test_cache_thread_t args[arrlen(threads)];
+	for (int i = 0; i < arrlen(threads); i++) {
+		args[i] = (test_cache_thread_t){ .cache = cache, .seed = i + 1 };
+		pthread_create(threads + i, NULL, test_cache_thread, args + i);
+	}
+	for (int i = 0; i < arrlen(threads); i++) {
+		pthread_join(threads[i], NULL);
+		if (!args[i].ok) return TEST_BAD;
+	}
+
+	// 8 shards of 32
+	const cache_stats_t stats = cache_sharded_stats(cache);
+	if (stats.hits + stats.misses != 4 * 20000) return TEST_BAD;
+	if (!stats.hits || !stats.evictions || stats.len > 256) return TEST_BAD;
+	if (stats.charge != stats.len) return TEST_BAD;
+
+	cache_sharded_deinit(cache);
+	return true;
+}
+
+static uint64_t test_bloom_key(uint64_t i) {
+	return xxhash64_single_lane((const uint8_t *)&i, sizeof(i));
+}
+bool test_bloom1(unsigned testid) {
+	bloom_t *a = bloom_init(mem_stdlib_alloc(), 10000, 0.01);
+	bloom_t *b = bloom_init(mem_stdlib_alloc(), 10000, 0.01);
+	if (!a || !b) return TEST_BAD;
+	if (bloom_init(mem_stdlib_alloc(), 10, 0.0)) return TEST_BAD;
+	bloom_t *empty = bloom_init(mem_stdlib_alloc(), 0, 0.01);
+	if (!empty || bloom_test(empty, 1)) return TEST_BAD;
+	bloom_deinit(empty);
+
+	for (uint64_t i = 0; i < 10000; i++) bloom_add(i & 1 ? a : b, test_bloom_key(i));
+	if (!bloom_merge(a, b)) return TEST_BAD;
+
+	// No false negatives, and about the false positive rate asked for
+	static uint64_t hashes[100000];
+	static bool maybe[arrlen(hashes)];
+	for (uint64_t i = 0; i < arrlen(hashes); i++) hashes[i] = test_bloom_key(i);
+	size_t positives = bloom_test_n(a, hashes, arrlen(hashes), maybe);
+	for (size_t i = 0; i < arrlen(hashes); i++) {
+		if (maybe[i] != bloom_test(a, hashes[i])) return TEST_BAD;
+		if (i < 10000 && !maybe[i]) return TEST_BAD;
+	}
+	const double fpr = (double)(positives - 10000) / (arrlen(hashes) - 10000);
+	if (fpr > 0.015) return TEST_BAD;
+
+	// Round trips through flat memory, and bad buffers are turned down
+	const size_t size = bloom_serialized_size(a);
+	uint8_t *buf = malloc(size);
+	if (!buf) return TEST_BAD;
+	bloom_serialize(a, buf);
+	bloom_t *c = bloom_deserialize(mem_stdlib_alloc(), buf, size);
+	if (!c) return TEST_BAD;
+	if (bloom_test_n(c, hashes, arrlen(hashes), maybe) != positives) return TEST_BAD;
+	if (bloom_deserialize(mem_stdlib_alloc(), buf, size - 1)) return TEST_BAD;
+	buf[0] ^= 1;
+	if (bloom_deserialize(mem_stdlib_alloc(), buf, size)) return TEST_BAD;
+	free(buf);
+
+	bloom_t *small = bloom_init(mem_stdlib_alloc(), 10, 0.01);
+	if (!small || bloom_merge(a, small)) return TEST_BAD;
+	bloom_clear(c);
+	if (bloom_test_n(c, hashes, arrlen(hashes), maybe)) return TEST_BAD;
+
+	bloom_deinit(a);
+	bloom_deinit(b);
+	bloom_deinit(c);
+	bloom_deinit(small);
+	return true;
+}
+
+bool test_hll1(unsigned testid) {
+	const uint64_t counts[] = { 0, 1, 100, 2000, 100000 };
+
+	for (int c = 0; c < arrlen(counts); c++) {
+		// Four sketches, like four threads, over overlapping ranges
+		hll_t *sketches[4];
+		for (int s = 0; s < arrlen(sketches); s++) {
+			if (!(sketches[s] = hll_init(mem_stdlib_alloc(), 14))) return TEST_BAD;
+		}
+		hll_t *all = hll_init(mem_stdlib_alloc(), 14);
+		if (!all) return TEST_BAD;
+
+		for (uint64_t i = 0; i < counts[c]; i++) {
+			const uint64_t hash = test_bloom_key(i);
+			if (!hll_add(all, hash) || !hll_add(all, hash)) return TEST_BAD;
+			if (!hll_add(sketches[i % 4], hash)) return TEST_BAD;
+			if (!hll_add(sketches[(i + 1) % 4], hash)) return TEST_BAD;
+		}
+		// The last one stays sparse for the small counts
+		hll_add(sketches[0], test_bloom_key(1000000));
+		for (int s = 1; s < arrlen(sketches); s++) {
+			if (!hll_merge(sketches[0], sketches[s])) return TEST_BAD;
+		}
+
+		const uint64_t n = counts[c], est = hll_estimate(all);
+		const uint64_t merged = hll_estimate(sketches[0]);
+		// Sparse counts are exact at these sizes, dense ones within 3%
+		if (n <= 2000 && (est != n || merged != n + 1)) return TEST_BAD;
+		if (n > 2000 && (fabs((double)est - n) > n * 0.03
+			|| fabs((double)merged - n) > n * 0.03)) return TEST_BAD;
+		if (hll_bytes(all) > sizeof(uint32_t) * 4096 + 256) return TEST_BAD;
+
+		for (int s = 0; s < arrlen(sketches); s++) hll_deinit(sketches[s]);
+		hll_clear(all);
+		if (hll_estimate(all)) return TEST_BAD;
+		hll_deinit(all);
+	}
+
+	hll_t *a = hll_init(mem_stdlib_alloc(), 10);
+	hll_t *b = hll_init(mem_stdlib_alloc(), 12);
+	if (!a || !b || hll_merge(a, b)) return TEST_BAD;
+	if (hll_init(mem_stdlib_alloc(), HLL_MAX_PRECISION + 1)) return TEST_BAD;
+	hll_deinit(a);
+	hll_deinit(b);
+
+	return true;
+}
+
+bool test_queue1(unsigned testid) {
+	for (int kind = 0; kind < 2; kind++) {
+		uint32_t *q = kind ? mpmc_init(mem_stdlib_alloc(), sizeof(*q), 5)
+				: spsc_init(mem_stdlib_alloc(), sizeof(*q), 5);
+		if (!q) return TEST_BAD;
+#define test_queue_push(n, elems) (kind ? mpmc_push(q, n, elems) : spsc_push(q, n, elems))
+#define test_queue_pop(n, elems) (kind ? mpmc_pop(q, n, elems) : spsc_pop(q, n, elems))
+#define test_queue_len() (kind ? mpmc_len(q) : spsc_len(q))
+
+		uint32_t in[20], out[20];
+		for (uint32_t i = 0; i < arrlen(in); i++) in[i] = i;
+
+		// Rounded up to 8, and batches stop short when full or empty
+		if (test_queue_pop(1, out) != 0) return TEST_BAD;
+		if (test_queue_push(10, in) != 8 || test_queue_len() != 8) return TEST_BAD;
+		if (test_queue_push(1, in) != 0) return TEST_BAD;
+		if (test_queue_pop(3, out) != 3 || out[0] != 0 || out[2] != 2) return TEST_BAD;
+
+		// Wraps around the end of the ring
+		if (test_queue_push(5, in + 8) != 3) return TEST_BAD;
+		if (test_queue_pop(1, NULL) != 1) return TEST_BAD;
+		if (test_queue_pop(20, out) != 7) return TEST_BAD;
+		for (uint32_t i = 0; i < 7; i++) {
+			if (out[i] != i + 4) return TEST_BAD;
+		}
+		if (test_queue_len() != 0) return TEST_BAD;
+
+#undef test_queue_push
+#undef test_queue_pop
+#undef test_queue_len
+		if (kind) mpmc_deinit(q);
+		else spsc_deinit(q);
+	}
+
+	return true;
+}
+
+#define TEST_QUEUE_THREADS 3
+#define TEST_QUEUE_ITEMS 30000
+
+typedef struct test_queue_thread {
+	uint64_t *q;
+	bool mpmc;
+	uint32_t id;
+
+	// Shared between the consumers, they stop once it has everything
+	uint64_t *popped;
+	uint64_t sum;
+	bool ok;
+} test_queue_thread_t;
+
+// Items are the producer id in the top bits and a counter in the rest
+static void *test_queue_producer(void *arg) {
+	test_queue_thread_t *t = arg;
+	uint64_t items[7];
+	uint64_t next = 0;
+
+	while (next < TEST_QUEUE_ITEMS) {
+		size_t n = 1 + next % arrlen(items);
+		if (n > TEST_QUEUE_ITEMS - next) n = TEST_QUEUE_ITEMS - next;
+		for (size_t i = 0; i < n; i++) items[i] = (uint64_t)t->id << 32 | (next + i);
+
+		const size_t pushed = t->mpmc ? mpmc_push(t->q, n, items) : spsc_push(t->q, n, items);
+		if (!pushed) sched_yield();
+		next += pushed;
+	}
+	return NULL;
+}
+static void *test_queue_consumer(void *arg) {
+	test_queue_thread_t *t = arg;
+	uint64_t items[5], last[TEST_QUEUE_THREADS];
+	memset(last, 0xff, sizeof(last));
+	t->ok = true;
+
+	const uint64_t want = t->mpmc ? TEST_QUEUE_ITEMS * TEST_QUEUE_THREADS : TEST_QUEUE_ITEMS;
+	while (__atomic_load_n(t->popped, __ATOMIC_RELAXED) < want) {
+		const size_t n = t->mpmc ? mpmc_pop(t->q, arrlen(items), items)
+					: spsc_pop(t->q, arrlen(items), items);
+		if (!n) {
+			sched_yield();
+			continue;
+		}
+
+		for (size_t i = 0; i < n; i++) {
+			const uint32_t producer = items[i] >> 32;
+			const uint64_t seq = items[i] & 0xffffffff;
+			// Every consumer sees the items of a producer in order
+			if (producer >= TEST_QUEUE_THREADS) t->ok = false;
+			else if (last[producer] != UINT64_MAX && seq <= last[producer]) t->ok = false;
+			else last[producer] = seq;
+			t->sum += seq;
+		}
+		__atomic_fetch_add(t->popped, n, __ATOMIC_RELAXED);
+	}
+	return NULL;
+}
+
+bool test_queue2(unsigned testid) {
+	const uint64_t per_producer = (uint64_t)TEST_QUEUE_ITEMS * (TEST_QUEUE_ITEMS - 1) / 2;
+	pthread_t threads[TEST_QUEUE_THREADS * 2];
+	uint64_t popped = 0;
+
+	// One to one through the spsc ring
+	uint64_t *q = spsc_init(mem_stdlib_alloc(), sizeof(*q), 64);
+	if (!q) return TEST_BAD;
+	test_queue_thread_t prod = { .q = q }, cons = { .q = q, .popped = &popped };
+	pthread_create(threads, NULL, test_queue_producer, &prod);
+	pthread_create(threads + 1, NULL, test_queue_consumer, &cons);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	spsc_deinit(q);
+	if (!cons.ok || popped != TEST_QUEUE_ITEMS || cons.sum != per_producer) return TEST_BAD;
+
+	// Many to many through the mpmc queue
+	q = mpmc_init(mem_stdlib_alloc(), sizeof(*q), 64);
+	if (!q) return TEST_BAD;
+	test_queue_thread_t prods[TEST_QUEUE_THREADS], conss[TEST_QUEUE_THREADS];
+	popped = 0;
+	for (uint32_t i = 0; i < TEST_QUEUE_THREADS; i++) {
+		prods[i] = (test_queue_thread_t){ .q = q, .mpmc = true, .id = i };
+		conss[i] = (test_queue_thread_t){ .q = q, .mpmc = true, .popped = &popped };
+		pthread_create(threads + i, NULL, test_queue_producer, prods + i);
+		pthread_create(threads + TEST_QUEUE_THREADS + i, NULL, test_queue_consumer, conss + i);
+	}
+	for (int i = 0; i < arrlen(threads); i++) pthread_join(threads[i], NULL);
+	mpmc_deinit(q);
+
+	uint64_t sum = 0;
+	for (int i = 0; i < TEST_QUEUE_THREADS; i++) {
+		if (!conss[i].ok) return TEST_BAD;
+		sum += conss[i].sum;
+	}
+	if (popped != TEST_QUEUE_ITEMS * TEST_QUEUE_THREADS) return TEST_BAD;
+	if (sum != per_producer * TEST_QUEUE_THREADS) return TEST_BAD;
+
+	return true;
+}
+
+typedef struct test_tpool_sum {
+	uint8_t *seen;
+	uint64_t sum;
+	size_t nranges;
+} test_tpool_sum_t;
+
+static void test_tpool_sum(void *arg, size_t begin, size_t end) {
+	test_tpool_sum_t *t = arg;
+	uint64_t sum = 0;
+	for (size_t i = begin; i < end; i++) {
+		__atomic_fetch_add(t->seen + i, 1, __ATOMIC_RELAXED);
+		sum += i;
+	}
+	__atomic_fetch_add(&t->sum, sum, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&t->nranges, 1, __ATOMIC_RELAXED);
+}
+
+typedef struct test_fib {
+	tpool_t *pool;
+	unsigned n;
+	uint64_t result;
+} test_fib_t;
+
+static void test_fib(void *arg) {
+	test_fib_t *t = arg;
+	if (t->n < 2) {
+		t->result = t->n;
+		return;
+	}
+	test_fib_t a = { t->pool, t->n - 1 }, b = { t->pool, t->n - 2 };
+	task_t *task = task_spawn(t->pool, test_fib, &a);
+	test_fib(&b);
+	task_wait(t->pool, task);
+	t->result = a.result + b.result;
+}
+
+static void test_tpool_count(void *arg) {
+	__atomic_fetch_add((uint64_t *)arg, 1, __ATOMIC_RELAXED);
+}
+
+bool test_tpool1(unsigned testid) {
+	enum { n = 100000 };
+	tpool_t *pool = tpool_init(mem_stdlib_alloc(), 4);
+	if (!pool || tpool_nthreads(pool) != 4) return TEST_BAD;
+	uint8_t *seen = calloc(n, 1);
+
+	// Every index exactly once with the automatic grain
+	test_tpool_sum_t sum = { .seen = seen };
+	tpool_parallel_for(pool, 0, n, 0, test_tpool_sum, &sum);
+	if (sum.sum != (uint64_t)n * (n - 1) / 2) return TEST_BAD;
+	if (sum.nranges < 4 * 8 || sum.nranges > 4 * 8 * 2) return TEST_BAD;
+	for (size_t i = 0; i < n; i++) if (seen[i] != 1) return TEST_BAD;
+
+	// Down to single indices, and empty ranges call nothing
+	memset(seen, 0, n);
+	sum = (test_tpool_sum_t){ .seen = seen };
+	tpool_parallel_for(pool, 5, 1000, 1, test_tpool_sum, &sum);
+	tpool_parallel_for(pool, 7, 7, 0, test_tpool_sum, &sum);
+	if (sum.nranges != 995 || sum.sum != (uint64_t)999 * 1000 / 2 - 10) return TEST_BAD;
+	for (size_t i = 0; i < n; i++) if (seen[i] != (i >= 5 && i < 1000)) return TEST_BAD;
+	free(seen);
+
+	// Fork and join from inside the pool
+	test_fib_t fib = { pool, 20 };
+	task_wait(pool, task_spawn(pool, test_fib, &fib));
+	if (fib.result != 6765) return TEST_BAD;
+
+	// More tasks from outside than the inject queue holds
+	task_t *tasks[1000];
+	uint64_t count = 0;
+	for (int i = 0; i < arrlen(tasks); i++) tasks[i] = task_spawn(pool, test_tpool_count, &count);
+	for (int i = 0; i < arrlen(tasks); i++) task_wait(pool, tasks[i]);
+	if (count != arrlen(tasks)) return TEST_BAD;
+
+	tpool_deinit(pool);
+	return true;
+}
+
+#define TEST_TPOOL_TASKS 4096
+
+typedef struct test_tpool_spawner {
+	tpool_t *pool;
+	task_t **tasks;
+	uint64_t count;
+} test_tpool_spawner_t;
+
+// Leaves tasks for another thread to wait on and free
+static void test_tpool_spawn(void *arg, size_t begin, size_t end) {
+	test_tpool_spawner_t *t = arg;
+	for (size_t i = begin; i < end; i++) {
+		t->tasks[i] = task_spawn(t->pool, test_tpool_count, &t->count);
+	}
+}
+
+typedef struct test_tpool_caller {
+	tpool_t *pool;
+	task_t *tasks[TEST_TPOOL_TASKS];
+	bool ok;
+} test_tpool_caller_t;
+
+static void *test_tpool_caller(void *arg) {
+	test_tpool_caller_t *t = arg;
+	test_tpool_spawner_t spawner = { .pool = t->pool, .tasks = t->tasks };
+	t->ok = true;
+
+	for (int round = 0; round < 20; round++) {
+		spawner.count = 0;
+		tpool_parallel_for(t->pool, 0, TEST_TPOOL_TASKS, 64, test_tpool_spawn, &spawner);
+		for (int i = 0; i < TEST_TPOOL_TASKS; i++) task_wait(t->pool, t->tasks[i]);
+		if (spawner.count != TEST_TPOOL_TASKS) t->ok = false;
+	}
+	return NULL;
+}
+bool test_tpool2(unsigned testid) {
+	tpool_t *pool = tpool_init(mem_stdlib_alloc(), 0);
+	if (!pool || !tpool_nthreads(pool)) return TEST_BAD;
+	tpool_deinit(pool);
+
+	// Threads outside of the pool share it and free the workers' tasks
+	pool = tpool_init(mem_stdlib_alloc(), 3);
+	if (!pool) return TEST_BAD;
+	pthread_t threads[3];
+	test_tpool_caller_t *callers = calloc(arrlen(threads), sizeof(*callers));
+	for (int i = 0; i < arrlen(threads); i++) {
+		callers[i].pool = pool;
+		pthread_create(threads + i, NULL, test_tpool_caller, callers + i);
+	}
+	for (int i = 0; i < arrlen(threads); i++) {
+		pthread_join(threads[i], NULL);
+		if (!callers[i].ok) return TEST_BAD;
+	}
+	free(callers);
+	tpool_deinit(pool);
+	return true;
+}
+
+// Checks that the keys in [lo, hi) are the multiples of step with values of
+// key * 2. Callers check the length for anything past hi.
+static bool test_btree_range(const btree_t *tree, uint64_t lo, uint64_t hi, uint64_t step) {
+	btree_iter_t it = btree_lower_bound(tree, lo);
+	btree_kv_t kv;
+	uint64_t want = (lo + step - 1) / step * step;
+	while (btree_next(&it, &kv) && kv.key < hi) {
+		if (kv.key != want || kv.val != kv.key * 2) return false;
+		want += step;
+	}
+	return want >= hi;
+}
+
+bool test_btree1(unsigned testid) {
+	btree_t *tree = btree_init(mem_stdlib_alloc());
+	if (!tree) return TEST_BAD;
+	btree_kv_t kv;
+	uint64_t val;
+
+	btree_iter_t it = btree_first(tree);
+	if (btree_len(tree) || btree_next(&it, &kv) || btree_get(tree, 0, NULL)) return TEST_BAD;
+
+	// Every third key, inserted in a scrambled order so leaves split in the
+	// middle as well as at the end
+	enum { n = 3000 };
+	for (uint64_t i = 0; i < n; i++) {
+		const uint64_t key = (i * 1021 % n) * 3;
+		if (!btree_insert(tree, key, key)) return TEST_BAD;
+	}
+	for (uint64_t i = 0; i < n; i++) btree_insert(tree, i * 3, i * 6);
+	if (btree_len(tree) != n) return TEST_BAD;
+	for (uint64_t i = 0; i < n * 3; i++) {
+		if (btree_get(tree, i, &val) != (i % 3 == 0)) return TEST_BAD;
+		if (i % 3 == 0 && val != i * 2) return TEST_BAD;
+	}
+	if (!test_btree_range(tree, 0, n * 3, 3)) return TEST_BAD;
+	if (!test_btree_range(tree, 100, 200, 3) || !test_btree_range(tree, 4000, 4001, 3)) {
+		return TEST_BAD;
+	}
+
+	// Bounds between keys, on keys and past the end
+	it = btree_lower_bound(tree, 301);
+	if (!btree_next(&it, &kv) || kv.key != 303) return TEST_BAD;
+	it = btree_lower_bound(tree, 300);
+	if (!btree_next(&it, &kv) || kv.key != 300) return TEST_BAD;
+	it = btree_upper_bound(tree, 300);
+	if (!btree_next(&it, &kv) || kv.key != 303) return TEST_BAD;
+	it = btree_upper_bound(tree, (n - 1) * 3);
+	if (btree_next(&it, &kv)) return TEST_BAD;
+	it = btree_lower_bound(tree, UINT64_MAX);
+	if (btree_next(&it, &kv)) return TEST_BAD;
+
+	// The largest key doesn't get mixed up with the padding
+	btree_insert(tree, UINT64_MAX, 7);
+	it = btree_upper_bound(tree, UINT64_MAX - 1);
+	if (!btree_next(&it, &kv) || kv.key != UINT64_MAX || kv.val != 7) return TEST_BAD;
+	if (!btree_remove(tree, UINT64_MAX, &val) || val != 7) return TEST_BAD;
+
+	// Removing the odd multiples merges and borrows all over the tree
+	for (uint64_t i = 1; i < n; i += 2) {
+		if (!btree_remove(tree, i * 3, NULL)) return TEST_BAD;
+	}
+	if (btree_remove(tree, 3, NULL) || btree_remove(tree, 1, NULL)) return TEST_BAD;
+	if (btree_len(tree) != n / 2 || !test_btree_range(tree, 0, n * 3, 6)) return TEST_BAD;
+	for (uint64_t i = 0; i < n; i += 2) {
+		if (!btree_remove(tree, i * 3, NULL)) return TEST_BAD;
+	}
+	it = btree_first(tree);
+	if (btree_len(tree) || btree_next(&it, &kv)) return TEST_BAD;
+
+	// Bulk loads, big enough for three levels
+	btree_kv_t *kvs = vec_init(mem_stdlib_alloc(), sizeof(*kvs), 0);
+	for (uint64_t i = 0; i < 20000; i++) kvs = vec_push(kvs, 1, &(btree_kv_t){ i * 5, i * 10 });
+	if (!btree_bulk_load(tree, kvs) || btree_len(tree) != 20000) return TEST_BAD;
+	if (!test_btree_range(tree, 0, 100000, 5)) return TEST_BAD;
+	if (!test_btree_range(tree, 12345, 23456, 5)) return TEST_BAD;
+	for (uint64_t i = 0; i < 20000; i += 7) {
+		if (!btree_get(tree, i * 5, &val) || val != i * 10 || btree_get(tree, i * 5 + 1, NULL)) {
+			return TEST_BAD;
+		}
+	}
+
+	// Loaded trees take changes like any other
+	for (uint64_t i = 0; i < 20000; i++) btree_insert(tree, i * 5 + 1, 0);
+	for (uint64_t i = 0; i < 20000; i++) btree_remove(tree, i * 5 + 1, NULL);
+	if (btree_len(tree) != 20000 || !test_btree_range(tree, 0, 100000, 5)) return TEST_BAD;
+
+	*vec_len(kvs) = 3;
+	if (!btree_bulk_load(tree, kvs) || btree_len(tree) != 3) return TEST_BAD;
+	if (!test_btree_range(tree, 0, 15, 5) || btree_get(tree, 15, NULL)) return TEST_BAD;
+
+	kvs[1].key = 0;
+	if (btree_bulk_load(tree, kvs) || btree_len(tree)) return TEST_BAD;
+	vec_deinit(kvs);
+
+	btree_deinit(tree);
+	return true;
+}
+
+// Random inserts and removes checked against a bitmap of the keys
+bool test_btree2(unsigned testid) {
+	enum { nkeys = 4096 };
+	btree_t *tree = btree_init(mem_stdlib_alloc());
+	if (!tree) return TEST_BAD;
+	bool *has = calloc(nkeys, sizeof(*has));
+	size_t len = 0;
+	uint32_t rng = 12345;
+
+	for (int round = 0; round < 200000; round++) {
+		rng = rng * 1103515245 + 12345;
+		const uint64_t key = (rng >> 8) % nkeys;
+		// Mostly inserts for the first half, then mostly removes
+		const bool insert = (rng >> 28) < (round < 100000 ? 11 : 5);
+
+		if (insert) {
+			if (!btree_insert(tree, key, key * 2)) return TEST_BAD;
+			len += !has[key];
+			has[key] = true;
+		} else {
+			if (btree_remove(tree, key, NULL) != has[key]) return TEST_BAD;
+			len -= has[key];
+			has[key] = false;
+		}
+		if (btree_len(tree) != len) return TEST_BAD;
+		if (round % 20000) continue;
+
+		btree_iter_t it = btree_first(tree);
+		btree_kv_t kv;
+		for (uint64_t k = 0; k < nkeys; k++) {
+			if (!has[k]) continue;
+			if (!btree_next(&it, &kv) || kv.key != k || kv.val != k * 2) return TEST_BAD;
+		}
+		if (btree_next(&it, &kv)) return TEST_BAD;
+
+		for (uint64_t k = 0; k < nkeys; k += 13) {
+			uint64_t lower = k, upper = k + 1;
+			while (lower < nkeys && !has[lower]) lower++;
+			while (upper < nkeys && !has[upper]) upper++;
+			it = btree_lower_bound(tree, k);
+			if (btree_next(&it, &kv) ? kv.key != lower : lower != nkeys) return TEST_BAD;
+			it = btree_upper_bound(tree, k);
+			if (btree_next(&it, &kv) ? kv.key != upper : upper != nkeys) return TEST_BAD;
+		}
+	}
+
+	free(has);
+	btree_deinit(tree);
+	return true;
+}
+
+// Collects what art_iter_prefix finds, stopping after max
+typedef struct test_art_seen {
+	strview_t keys[64];
+	size_t n, max;
+} test_art_seen_t;
+
+static bool test_art_collect(void *usr, strview_t key, void *val) {
+	test_art_seen_t *seen = usr;
+	if (val != key.str) return false;
+	seen->keys[seen->n++] = key;
+	return seen->n < seen->max;
+}
+
+static bool test_art_match(const art_t *tree, const char *path, const char *want) {
+	strview_t match;
+	void *val;
+	if (!art_longest_prefix(tree, str_to_strview(path), &match, &val)) return !want;
+	return want && val == match.str && strview_eq(&match, &(strview_t){ want, strlen(want) });
+}
+
+bool test_art1(unsigned testid) {
+	static const char *const routes[] = {
+		"/", "/api", "/api/v1", "/api/v1/users", "/api/v1/users/", "/api/v2",
+		"/static/", "/static/css/", "/a/very/long/shared/prefix/one",
+		"/a/very/long/shared/prefix/two", "/a/very/long/shared/prefix/two/more",
+	};
+	art_t *tree = art_init(mem_stdlib_alloc());
+	if (!tree) return TEST_BAD;
+	if (art_get(tree, make_strview(""), NULL) || test_art_match(tree, "/", "/")) return TEST_BAD;
+
+	// Values point at the key so lookups can check them
+	for (int i = 0; i < arrlen(routes); i++) {
+		if (!art_insert(tree, str_to_strview(routes[i]), (void *)routes[i])) return TEST_BAD;
+	}
+	art_insert(tree, str_to_strview(routes[3]), (void *)routes[3]);
+	if (art_len(tree) != arrlen(routes)) return TEST_BAD;
+	for (int i = 0; i < arrlen(routes); i++) {
+		void *val;
+		if (!art_get(tree, str_to_strview(routes[i]), &val) || val != routes[i]) return TEST_BAD;
+	}
+	if (art_get(tree, make_strview("/api/v"), NULL) || art_get(tree, make_strview("/apix"), NULL)
+			|| art_get(tree, make_strview("/a/very/long/shared/prefix/thr"), NULL)) {
+		return TEST_BAD;
+	}
+
+	if (!test_art_match(tree, "/api/v1/users/42", "/api/v1/users/")) return TEST_BAD;
+	if (!test_art_match(tree, "/api/v1/user", "/api/v1")) return TEST_BAD;
+	if (!test_art_match(tree, "/api/v3", "/api")) return TEST_BAD;
+	if (!test_art_match(tree, "/index.html", "/")) return TEST_BAD;
+	if (!test_art_match(tree, "/a/very/long/shared/prefix/two/mor", "/a/very/long/shared/prefix/two")) {
+		return TEST_BAD;
+	}
+	// Goes wrong past the stored part of a long prefix
+	if (!test_art_match(tree, "/a/very/long/shared/pre-fix/one", "/")) return TEST_BAD;
+	if (!test_art_match(tree, "api", NULL)) return TEST_BAD;
+
+	// In byte order, shorter keys first
+	test_art_seen_t seen = { .max = 64 };
+	if (!art_iter_prefix(tree, make_strview("/api/v1"), test_art_collect, &seen)) return TEST_BAD;
+	if (seen.n != 3 || seen.keys[0].str != routes[2] || seen.keys[1].str != routes[3]
+			|| seen.keys[2].str != routes[4]) {
+		return TEST_BAD;
+	}
+	seen = (test_art_seen_t){ .max = 64 };
+	art_iter_prefix(tree, make_strview("/a/very/long/shared/prefix/t"), test_art_collect, &seen);
+	if (seen.n != 2 || seen.keys[0].str != routes[9]) return TEST_BAD;
+	seen = (test_art_seen_t){ .max = 64 };
+	art_iter_prefix(tree, make_strview("/static/css/x"), test_art_collect, &seen);
+	art_iter_prefix(tree, make_strview("/b"), test_art_collect, &seen);
+	if (seen.n) return TEST_BAD;
+	seen = (test_art_seen_t){ .max = 4 };
+	if (art_iter_prefix(tree, make_strview(""), test_art_collect, &seen) || seen.n != 4) return TEST_BAD;
+	if (seen.keys[0].str != routes[0] || seen.keys[1].str != routes[8]) return TEST_BAD;
+
+	// Removing keys in the middle of paths and at the ends of them
+	void *val;
+	if (!art_remove(tree, make_strview("/api/v1"), &val) || val != routes[2]) return TEST_BAD;
+	if (art_remove(tree, make_strview("/api/v1"), NULL)) return TEST_BAD;
+	if (!test_art_match(tree, "/api/v1/user", "/api")) return TEST_BAD;
+	if (!art_remove(tree, make_strview("/a/very/long/shared/prefix/two"), NULL)) return TEST_BAD;
+	if (!test_art_match(tree, "/a/very/long/shared/prefix/two/more/", routes[10])) return TEST_BAD;
+	if (!art_remove(tree, make_strview("/a/very/long/shared/prefix/one"), NULL)) return TEST_BAD;
+	if (!test_art_match(tree, "/a/very/long/shared/prefix/two/more", routes[10])) return TEST_BAD;
+	if (art_len(tree) != arrlen(routes) - 3) return TEST_BAD;
+	for (int i = 0; i < arrlen(routes); i++) art_remove(tree, str_to_strview(routes[i]), NULL);
+	if (art_len(tree) || test_art_match(tree, "/", "/")) return TEST_BAD;
+
+	// The empty key is a prefix of everything
+	art_insert(tree, make_strview(""), NULL);
+	if (!art_longest_prefix(tree, make_strview("/x"), NULL, NULL)) return TEST_BAD;
+	art_deinit(tree);
+	return true;
+}
+
+#define TEST_ART_KEYS 6000
+
+static int test_art_cmp(const void *a, const void *b) {
+	const strview_t *x = a, *y = b;
+	const int c = memcmp(x->str, y->str, x->len < y->len ? x->len : y->len);
+	return c ? c : (x->len > y->len) - (x->len < y->len);
+}
+
+typedef struct test_art_walk {
+	const strview_t *keys;
+	size_t n;
+	bool ok;
+} test_art_walk_t;
+
+static bool test_art_check_next(void *usr, strview_t key, void *val) {
+	test_art_walk_t *walk = usr;
+	if (val != key.str || !strview_eq(&key, walk->keys + walk->n++)) walk->ok = false;
+	return walk->ok;
+}
+
+// Random keys over a few shapes: short ones that fill up wide nodes, and long
+// ones that share prefixes past what nodes store
+bool test_art2(unsigned testid) {
+	art_t *tree = art_init(mem_stdlib_alloc());
+	if (!tree) return TEST_BAD;
+	char *bytes = malloc(TEST_ART_KEYS * 40);
+	strview_t *keys = malloc(TEST_ART_KEYS * sizeof(*keys));
+	bool *in = calloc(TEST_ART_KEYS, sizeof(*in));
+	uint32_t rng = 99;
+	size_t nkeys = 0;
+
+	for (size_t i = 0; i < TEST_ART_KEYS; i++) {
+		char *key = bytes + i * 40;
+		rng = rng * 1103515245 + 12345;
+		size_t len = (rng >> 16) % 4;
+		if (rng >> 30) {
+			memcpy(key, "some/shared/path/that/is/long/", 30);
+			len = 30 + (rng >> 12) % 8;
+			if (rng & (1 << 20)) key[18 + (rng >> 21) % 8] = 'Q';
+		}
+		for (size_t j = len >= 30 ? 30 : 0; j < len; j++) {
+			rng = rng * 1103515245 + 12345;
+			key[j] = len >= 30 ? 'a' + (rng >> 16) % 3 : (char)(rng >> 16);
+		}
+		const strview_t view = { key, len };
+		bool dup = false;
+		for (size_t j = 0; j < nkeys && !dup; j++) dup = strview_eq(&view, keys + j);
+		if (!dup) keys[nkeys++] = view;
+	}
+
+	for (size_t i = 0; i < nkeys; i++) {
+		if (!art_insert(tree, keys[i], (void *)keys[i].str)) return TEST_BAD;
+		in[i] = true;
+	}
+	if (art_len(tree) != nkeys) return TEST_BAD;
+
+	for (int round = 0; round < 3; round++) {
+		size_t nin = 0;
+		strview_t *sorted = malloc(nkeys * sizeof(*sorted));
+		for (size_t i = 0; i < nkeys; i++) {
+			void *val = NULL;
+			if (art_get(tree, keys[i], &val) != in[i] || (in[i] && val != keys[i].str)) {
+				return TEST_BAD;
+			}
+			if (in[i]) sorted[nin++] = keys[i];
+		}
+		qsort(sorted, nin, sizeof(*sorted), test_art_cmp);
+		test_art_walk_t walk = { .keys = sorted, .ok = true };
+		if (!art_iter_prefix(tree, make_strview(""), test_art_check_next, &walk)) return TEST_BAD;
+		if (!walk.ok || walk.n != nin || art_len(tree) != nin) return TEST_BAD;
+
+		// Longest prefixes of every key with a byte chopped off or added
+		for (size_t i = 0; i < nkeys; i += 7) {
+			char path[48];
+			const size_t len = keys[i].len + (i % 2 ? 1 : 0) - (i % 2 || !keys[i].len ? 0 : 1);
+			memcpy(path, keys[i].str, keys[i].len);
+			path[keys[i].len] = 'b';
+			const strview_t query = { path, len };
+
+			const strview_t *want = NULL;
+			for (size_t j = 0; j < nin; j++) {
+				if (sorted[j].len <= len && !memcmp(sorted[j].str, path, sorted[j].len)
+						&& (!want || sorted[j].len > want->len)) {
+					want = sorted + j;
+				}
+			}
+			strview_t match;
+			if (art_longest_prefix(tree, query, &match, NULL) != !!want) return TEST_BAD;
+			if (want && !strview_eq(&match, want)) return TEST_BAD;
+		}
+		free(sorted);
+
+		// Takes out about half of what's left
+		for (size_t i = round; i < nkeys; i += 2) {
+			if (art_remove(tree, keys[i], NULL) != in[i]) return TEST_BAD;
+			in[i] = false;
+		}
+	}
+
+	for (size_t i = 0; i < nkeys; i++) art_remove(tree, keys[i], NULL);
+	if (art_len(tree)) return TEST_BAD;
+
+	free(in);
+	free(keys);
+	free(bytes);
+	art_deinit(tree);
+	return true;
+}
+
+// EK_USE_POOL
+bool test_dynpool1(unsigned testid) {
+	void *ptrs[64];
+	dynpool_t *pool = dynpool_init(mem_stdlib_alloc(), 4, sizeof(int));
+	if (!pool) return TEST_BAD;
+	if (!dynpool_empty(pool)) return TEST_BAD;
+
+	for (int i = 0; i < arrlen(ptrs); i++) {
+		if (!(ptrs[i] = dynpool_alloc(pool))) return TEST_BAD;
+		*(int *)ptrs[i] = i;
+	}
+	if (dynpool_num_chunks(pool) != arrlen(ptrs)) return TEST_BAD;
+	for (int i = 0; i < arrlen(ptrs); i++) {
+		if (*(int *)ptrs[i] != i) return TEST_BAD;
+	}
+
+	// Blocks are in use, nothing can be trimmed
+	if (dynpool_trim(pool) != 0) return TEST_BAD;
+
+	for (int i = 0; i < arrlen(ptrs); i++) dynpool_free(pool, ptrs[i]);
+	if (!dynpool_empty(pool)) return TEST_BAD;
+
+	// 4 + 4 + 8 + 16 + 32 chunks, everything but the first block goes
+	if (dynpool_trim(pool) != 4) return TEST_BAD;
+	if (!(ptrs[0] = dynpool_alloc(pool))) return TEST_BAD;
+	if (dynpool_num_chunks(pool) != 1) return TEST_BAD;
+
+	dynpool_deinit(pool);
+	return true;
+}
+
+bool test_dynpool2(unsigned testid) {
+	void *ptrs[100];
+	dynpool_t *pool = dynpool_init(mem_stdlib_alloc(), 8, sizeof(int));
+	if (!pool) return TEST_BAD;
+
+	if (dynpool_alloc_n(pool, ptrs, 3) != 3) return TEST_BAD;
+	dynpool_free(pool, ptrs[1]);
+	dynpool_free(pool, ptrs[2]);
+	if (dynpool_alloc_n(pool, ptrs + 1, arrlen(ptrs) - 1) != arrlen(ptrs) - 1) {
+		return TEST_BAD;
+	}
+	if (dynpool_num_chunks(pool) != arrlen(ptrs)) return TEST_BAD;
+	for (int i = 0; i < arrlen(ptrs); i++) *(int *)ptrs[i] = i;
+	for (int i = 0; i < arrlen(ptrs); i++) {
+		if (*(int *)ptrs[i] != i) return TEST_BAD;
+	}
+
+	dynpool_free_n(pool, ptrs, arrlen(ptrs));
+	if (!dynpool_empty(pool)) return TEST_BAD;
+	if (dynpool_alloc_n(pool, ptrs, arrlen(ptrs)) != arrlen(ptrs)) return TEST_BAD;
+	if (dynpool_num_chunks(pool) != arrlen(ptrs)) return TEST_BAD;
+
+	dynpool_deinit(pool);
+	return true;
+}
+
+static int test_node_ctors;
+static void test_node_ctor(int *node) {
+	*node = 0;
+	test_node_ctors++;
+}
+DYNPOOL_TYPED(test_nodepool, int, test_node_ctor, NULL)
+
+bool test_dynpool3(unsigned testid) {
+	test_nodepool_t pool;
+	if (!test_nodepool_init(&pool, mem_stdlib_alloc(), 4)) return TEST_BAD;
+
+	test_node_ctors = 0;
+	int *a = test_nodepool_alloc(&pool);
+	int *b = test_nodepool_alloc(&pool);
+	if (!a || !b || *a || *b || test_node_ctors != 2) return TEST_BAD;
+	*b = 42;
+
+	// Recycled objects come back as they were left
+	test_nodepool_free(&pool, b);
+	if (test_nodepool_alloc(&pool) != b || *b != 42) return TEST_BAD;
+	if (test_node_ctors != 2) return TEST_BAD;
+
+	test_nodepool_free(&pool, a);
+	test_nodepool_free(&pool, b);
+	test_nodepool_flush(&pool);
+	if (!dynpool_empty(pool.pool)) return TEST_BAD;
+
+	test_nodepool_deinit(&pool);
+	return true;
+}
+
+bool test_fixedpool1(unsigned testid) {
+	uint64_t buf[128];
+	void *ptrs[16];
+
+	fixedpool_init(buf, sizeof(int), sizeof(buf));
+	if (!fixedpool_empty(buf)) return TEST_BAD;
+	if (fixedpool_alloc_n(buf, ptrs, arrlen(ptrs)) != arrlen(ptrs)) return TEST_BAD;
+	if (fixedpool_empty(buf)) return TEST_BAD;
+	fixedpool_free_n(buf, ptrs, arrlen(ptrs));
+	if (!fixedpool_empty(buf)) return TEST_BAD;
+
+	// Free list first, then the rest of the buffer until it runs out
+	size_t n = 0;
+	while (fixedpool_alloc_n(buf, ptrs, 1)) n++;
+	if (n < arrlen(ptrs)) return TEST_BAD;
+
+	return true;
+}
+
+// EK_USE_ARENA
+bool test_arena1(unsigned testid) {
+	static uint64_t buf[512];
+	if (!fixed_arena_init(buf, sizeof(buf))) return TEST_BAD;
+
+	uint8_t *simd = fixed_arena_alloc_aligned(buf, 100, 64);
+	if (!simd || (uintptr_t)simd % 64) return TEST_BAD;
+	double *arr = fixed_arena_new(buf, double, 10);
+	if (!arr || (uintptr_t)arr % __alignof__(double)) return TEST_BAD;
+	if ((uint8_t *)(arr + 10) > simd) return TEST_BAD;
+
+	// Neither of these can wrap around
+	if (fixed_arena_alloc(buf, SIZE_MAX - 4)) return TEST_BAD;
+	if (fixed_arena_new(buf, uint64_t, SIZE_MAX / 2)) return TEST_BAD;
+	if (fixed_arena_alloc(buf, 8) != (uint8_t *)arr - 8) return TEST_BAD;
+
+	return true;
+}
+bool test_arena2(unsigned testid) {
+	static uint64_t buf[512];
+	if (!fixed_arena_init(buf, sizeof(buf))) return TEST_BAD;
+
+	int *v = vec_init(fixed_arena_alloc_fn(buf), sizeof(int), 1);
+	if (!v) return TEST_BAD;
+	for (int i = 0; i < 512; i++) {
+		if (!(v = vec_push(v, 1, &i))) return TEST_BAD;
+	}
+	for (int i = 0; i < 512; i++) {
+		if (v[i] != i) return TEST_BAD;
+	}
+
+	// Growing the last allocation reuses its space, so it all fits
+	if (vec_capacity(v) != 512) return TEST_BAD;
+
+	vec_deinit(v);
+	if (!fixed_arena_alloc(buf, sizeof(buf) - 64)) return TEST_BAD;
+
+	return true;
+}
+
+// EK_MEM_CHECKS, ASan would catch the bad accesses before the checks can
+#if EK_MEM_CHECKS && !defined(__SANITIZE_ADDRESS__)
+static const char *test_mem_check_msg;
+static void test_mem_check_fail(const char *msg, const void *ptr) {
+	test_mem_check_msg = msg;
+}
+
+bool test_mem_checks1(unsigned testid) {
+	uint64_t buf[64];
+	mem_check_fail = test_mem_check_fail;
+	test_mem_check_msg = NULL;
+
+	dynpool_t *pool = dynpool_init(mem_stdlib_alloc(), 1, sizeof(int));
+	int *a = dynpool_alloc(pool);
+	dynpool_free(pool, a);
+	if (test_mem_check_msg) return TEST_BAD;
+	dynpool_free(pool, a);
+	if (!test_mem_check_msg) return TEST_BAD;
+	if (!dynpool_empty(pool)) return TEST_BAD;
+
+	// Write after free gets caught when the chunk is handed out again
+	test_mem_check_msg = NULL;
+	*a = 1;
+	if (dynpool_alloc(pool) != a || !test_mem_check_msg) return TEST_BAD;
+	dynpool_deinit(pool);
+
+	test_mem_check_msg = NULL;
+	fixedpool_init(buf, sizeof(int), sizeof(buf));
+	int *b = fixedpool_alloc(buf);
+	b[2] = 0; // Past the padding and into the canary
+	fixedpool_free(buf, b);
+	if (!test_mem_check_msg) return TEST_BAD;
+	test_mem_check_msg = NULL;
+	fixedpool_free(buf, b);
+	if (!test_mem_check_msg) return TEST_BAD;
+
+	test_mem_check_msg = NULL;
+	fixed_arena_init(buf, sizeof(buf));
+	fixed_arena_alloc(buf, 16);
+	fixed_arena_reset_to(buf, buf);
+	if (!test_mem_check_msg) return TEST_BAD;
+
+	mem_check_fail = NULL;
+	return true;
+}
+#endif
+
+// EK_USE_PAGE
+bool test_page1(unsigned testid) {
+	size_t size = 100;
+	uint8_t *pages = page_map(&size, PAGE_HUGE | PAGE_NUMA, 0);
+	if (!pages) return TEST_BAD;
+	if (size != PAGE_HUGE_SIZE) return TEST_BAD;
+	if (pages[0] || pages[size - 1]) return TEST_BAD;
+
+	if (!fixed_arena_init(pages, size)) return TEST_BAD;
+	if (!fixed_arena_alloc(pages, 1024 * 1024)) return TEST_BAD;
+	page_unmap(pages, size);
+
+	page_alloc_t backing;
+	dynpool_t *pool = dynpool_init(page_alloc_init(&backing, PAGE_HUGE, 0),
+				1024, sizeof(int));
+	if (!pool) return TEST_BAD;
+	for (int i = 0; i < 4096; i++) {
+		int *x = dynpool_alloc(pool);
+		if (!x) return TEST_BAD;
+		*x = i;
+	}
+	dynpool_deinit(pool);
+
+	return true;
+}
+
+// EK_USE_LOG
+static int test_log_calls, test_log_left_out;
+static void test_log_count(log_lvl_t lvl, const char *msg, ...) {
+	test_log_calls++;
+	test_log_left_out += strstr(msg, "left out") != NULL;
+}
+static int test_log_arg(int *evaluated) {
+	return ++*evaluated;
+}
+bool test_log1(unsigned testid) {
+	log_fn *const old = global_log;
+	const log_lvl_t old_level = log_level;
+	int evaluated = 0;
+	global_log = test_log_count;
+	test_log_calls = 0;
+
+	// Skipped messages don't evaluate their arguments
+	log_level = LOG_WARN;
+	logfmt(LOG_INFO, "%d", test_log_arg(&evaluated));
+	logfmt(LOG_ERR, "%d", test_log_arg(&evaluated));
+	logmsg(LOG_WARN, "warn");
+	log_level = LOG_DBG;
+	logfmt(LOG_DBG, "%d", test_log_arg(&evaluated));
+
+	global_log = old;
+	log_level = old_level;
+	if (test_log_calls != 3 || evaluated != 2) return TEST_BAD;
+
+	return true;
+}
+bool test_log2(unsigned testid) {
+	log_fn *const old = global_log;
+	global_log = test_log_count;
+	test_log_calls = 0;
+
+	for (int i = 0; i < 100; i++) logfmt_every(LOG_ERR, 10, "%d", i);
+	const int every = test_log_calls;
+
+	// Once the window is over the next message says how many were left out
+	int limited[2];
+	test_log_left_out = 0;
+	for (int round = 0; round < 2; round++) {
+		test_log_calls = 0;
+		for (int i = 0; i < 1000; i++) logfmt_ratelimit(LOG_ERR, 5, 100, "%d", i);
+		limited[round] = test_log_calls;
+		nanosleep(&(struct timespec){ .tv_nsec = 150 * 1000 * 1000 }, NULL);
+	}
+
+	global_log = old;
+	if (every != 10 || limited[0] != 5 || limited[1] != 6) return TEST_BAD;
+	if (test_log_left_out != 1) return TEST_BAD;
+
+	return true;
+}
+
+// EK_USE_LOG_ASYNC
+static size_t test_read_log(FILE *f, char *buf, size_t size) {
+	fflush(f);
+	rewind(f);
+	const size_t len = fread(buf, 1, size - 1, f);
+	buf[len] = '\0';
+	return len;
+}
+static void *test_log_thread(void *usr) {
+	for (int i = 0; i < 100; i++) log_async(LOG_DBG, "thread %d", i);
+	return NULL;
+}
+bool test_log_async1(unsigned testid) {
+	static char buf[16 * 1024];
+	FILE *const f = tmpfile();
+	if (!f) return TEST_BAD;
+	if (!log_async_start(mem_stdlib_alloc(), 0, LOG_ASYNC_BLOCK, fileno(f))) return TEST_BAD;
+
+	const strview_t name = make_strview("kagami hiiragi");
+	char *const temp = strdup("gone");
+	log_async(LOG_INFO, "%d %u %ld %zu %x %c", -1, 2u, -3l, (size_t)4, 255, 'k');
+	log_async(LOG_WARN, "%.*s %5.2f%% [%-6s] [%*d]", 6, name.str, 99.5, temp, 4, 7);
+	free(temp); // The string was copied, so it can go right away
+
+	log_fn *const old = global_log;
+	global_log = log_async;
+	logfmt(LOG_ERR, "bad %s", "thing");
+	logmsg(LOG_DBG, "plain");
+	global_log = old;
+
+	// Messages from other threads can be written in any order
+	log_async_flush();
+	pthread_t thread;
+	pthread_create(&thread, NULL, test_log_thread, NULL);
+	pthread_join(thread, NULL);
+
+	// Strings too big for a record are cut short
+	char big[1000];
+	memset(big, 'x', sizeof(big) - 1);
+	big[sizeof(big) - 1] = '\0';
+	log_async_flush();
+	log_async(LOG_INFO, "%s%d", big, 1);
+	log_async_stop();
+
+	test_read_log(f, buf, sizeof(buf));
+	fclose(f);
+	if (strncmp(buf, "[INFO] -1 2 -3 4 ff k\n"
+		"[WARN] kagami 99.50% [gone  ] [   7]\n"
+		"[ERR] test_log_async1 in test.c: bad thing\n"
+		"[DBG] test_log_async1 in test.c: plain\n", 123) != 0) return TEST_BAD;
+	if (!strstr(buf, "[DBG] thread 0\n") || !strstr(buf, "[DBG] thread 99\n")) return TEST_BAD;
+
+	const char *const last = strrchr(buf, '[');
+	if (!last || strlen(last) > LOG_ASYNC_MAX_RECORD) return TEST_BAD;
+	if (strcmp(last + strlen(last) - 4, "...\n") != 0) return TEST_BAD;
+
+	return true;
+}
+bool test_log_async2(unsigned testid) {
+	static char buf[1024 * 1024];
+	FILE *const f = tmpfile();
+	if (!f) return TEST_BAD;
+
+	// Everything gets either written or counted as dropped
+	const size_t dropped = log_async_dropped();
+	if (!log_async_start(mem_stdlib_alloc(), 1, LOG_ASYNC_DROP, fileno(f))) return TEST_BAD;
+	for (int i = 0; i < 20000; i++) log_async(LOG_INFO, "message %d", i);
+	log_async_stop();
+	log_async(LOG_INFO, "not running");
+
+	test_read_log(f, buf, sizeof(buf));
+	fclose(f);
+	size_t written = 0;
+	for (const char *at = buf; (at = strstr(at, "message ")); at++) written++;
+	if (written + log_async_dropped() - dropped != 20001) return TEST_BAD;
+
+	return true;
+}
+static void *test_log_until_stopped(void *usr) {
+	size_t *const sent = usr;
+	for (size_t i = 0; !__atomic_load_n(sent + 1, __ATOMIC_ACQUIRE); i++) {
+		log_async(LOG_INFO, "racing %zu", i);
+		__atomic_store_n(sent, i + 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+bool test_log_async3(unsigned testid) {
+	static char buf[4 * 1024 * 1024];
+
+	// Stopping while other threads are mid message loses nothing uncounted
+	for (int round = 0; round < 8; round++) {
+		FILE *const f = tmpfile();
+		if (!f) return TEST_BAD;
+		const size_t dropped = log_async_dropped();
+		if (!log_async_start(mem_stdlib_alloc(), 0, round % 2 ? LOG_ASYNC_DROP
+			: LOG_ASYNC_BLOCK, fileno(f))) return TEST_BAD;
+
+		pthread_t threads[3];
+		size_t sent[arrlen(threads)][2] = { 0 };
+		for (int i = 0; i < arrlen(threads); i++) {
+			pthread_create(threads + i, NULL, test_log_until_stopped, sent[i]);
+		}
+		while (__atomic_load_n(&sent[0][0], __ATOMIC_ACQUIRE) < 100 * (size_t)(round + 1)) {
+			sched_yield();
+		}
+		log_async_stop();
+		size_t total = 0;
+		for (int i = 0; i < arrlen(threads); i++) {
+			__atomic_store_n(&sent[i][1], 1, __ATOMIC_RELEASE);
+			pthread_join(threads[i], NULL);
+			total += sent[i][0];
+		}
+
+		test_read_log(f, buf, sizeof(buf));
+		fclose(f);
+		size_t written = 0;
+		for (const char *at = buf; (at = strstr(at, "racing ")); at++) written++;
+		if (written + log_async_dropped() - dropped != total) return TEST_BAD;
+	}
+
+	return true;
+}
+
+// EK_USE_PACKET
+static uint32_t test_rand_state = 1;
+static uint32_t test_rand(void) {
+	test_rand_state ^= test_rand_state << 13;
+	test_rand_state ^= test_rand_state >> 17;
+	test_rand_state ^= test_rand_state << 5;
+	return test_rand_state;
+}
+
+bool test_packet1(unsigned testid) {
+	uint8_t a[512] = { 0 }, b[512] = { 0 };
+	int heada = 3, headb = 3;
+	packet_writer_t w;
+
+	// Bits before the head must be kept
+	a[0] = b[0] = 0x5;
+	packet_writer_init(&w, b, sizeof(b), headb);
+	for (int i = 0; i < 100; i++) {
+		const int numbits = test_rand() % 33;
+		const uint32_t value = test_rand();
+		for (int bit = 0; bit < numbits; bit++) {
+			packet_write_bit(a, &heada, value >> bit & 1);
+		}
+		packet_writer_bits(&w, value, numbits);
+	}
+	headb = packet_writer_flush(&w);
+	if (heada != headb) return TEST_BAD;
+	if (memcmp(a, b, sizeof(a)) != 0) return TEST_BAD;
+
+	return true;
+}
+bool test_packet2(unsigned testid) {
+	uint8_t a[1024] = { 0 }, b[1024] = { 0 };
+	int heada = 0;
+	packet_writer_t w;
+	packet_reader_t r;
+
+	packet_writer_init(&w, b, sizeof(b), 0);
+	for (int i = 0; i < 64; i++) {
+		const int32_t v = (int32_t)test_rand() >> (test_rand() % 32);
+		const float f = (float)(int32_t)test_rand() / (float)(1 << (test_rand() % 31));
+		packet_write_u8(a, &heada, v);
+		packet_write_u16(a, &heada, v);
+		packet_write_u32(a, &heada, v);
+		packet_write_s16(a, &heada, v);
+		packet_write_s32(a, &heada, v);
+		packet_write_float(a, &heada, f);
+		packet_writer_u8(&w, v);
+		packet_writer_u16(&w, v);
+		packet_writer_u32(&w, v);
+		packet_writer_s16(&w, v);
+		packet_writer_s32(&w, v);
+		packet_writer_float(&w, f);
+	}
+	if (packet_writer_flush(&w) != heada) return TEST_BAD;
+	if (memcmp(a, b, sizeof(a)) != 0) return TEST_BAD;
+
+	// Only give the reader the bytes that were written
+	int head = 0;
+	packet_reader_init(&r, b, packet_bytecount(heada), 0);
+	for (int i = 0; i < 64; i++) {
+		if (packet_read_u8(a, &head) != packet_reader_u8(&r)) return TEST_BAD;
+		if (packet_read_u16(a, &head) != packet_reader_u16(&r)) return TEST_BAD;
+		if (packet_read_u32(a, &head) != packet_reader_u32(&r)) return TEST_BAD;
+		if (packet_read_s16(a, &head) != packet_reader_s16(&r)) return TEST_BAD;
+		if (packet_read_s32(a, &head) != packet_reader_s32(&r)) return TEST_BAD;
+		if (packet_read_float(a, &head) != packet_reader_float(&r)) return TEST_BAD;
+	}
+	if (packet_reader_head(&r) != heada || head != heada) return TEST_BAD;
+	if (r.err || w.err) return TEST_BAD;
+
+	return true;
+}
+bool test_packet3(unsigned testid) {
+	uint8_t buf[16];
+	packet_writer_t w;
+	packet_reader_t r;
+
+	// Only the first 5 bytes can be written to
+	memset(buf, 0xaa, sizeof(buf));
+	packet_writer_init(&w, buf, 5, 0);
+	packet_writer_s32(&w, -1000000);
+	if (w.err) return TEST_BAD;
+	packet_writer_s32(&w, -1000000);
+	packet_writer_flush(&w);
+	if (!w.err) return TEST_BAD;
+	if (buf[5] != 0xaa) return TEST_BAD;
+
+	packet_writer_init(&w, buf, 5, 0);
+	packet_writer_u32(&w, 0x12345678);
+	if (packet_writer_flush(&w) != 34 || w.err) return TEST_BAD;
+
+	// Truncated packet
+	packet_reader_init(&r, buf, 4, 0);
+	packet_reader_u32(&r);
+	if (!r.err) return TEST_BAD;
+
+	packet_reader_init(&r, buf, 5, 0);
+	if (packet_reader_u32(&r) != 0x12345678 || r.err) return TEST_BAD;
+	while (!r.err) packet_reader_bits(&r, 64);
+	if (packet_reader_head(&r) <= 40) return TEST_BAD;
+
+	packet_reader_init(&r, buf, 5, 41);
+	if (!r.err) return TEST_BAD;
+
+	return true;
+}
+
+#define TEST_PLAYER_FIELDS(X) \
+	X(u16, id) \
+	X(bool, alive) \
+	X(s32, x) \
+	X(s32, y) \
+	X(s16, health) \
+	X(u8, team) \
+	X(u32, score) \
+	X(float, angle)
+
+PACKET_SCHEMA_STRUCT(test_player, TEST_PLAYER_FIELDS)
+PACKET_SCHEMA(test_player, test_player_t, TEST_PLAYER_FIELDS)
+
+bool test_packet_schema1(unsigned testid) {
+	uint8_t a[test_player_max_bytes] = { 0 }, b[test_player_max_bytes] = { 0 };
+	const test_player_t p = {
+		.id = 1234, .alive = true, .x = -5, .y = 1 << 20, .health = 100,
+		.team = 3, .score = 0xffffffff, .angle = -3.5f,
+	};
+	test_player_t out;
+
+	if (test_player_max_bits != 18 + 1 + 34 + 34 + 18 + 10 + 34 + 34) return TEST_BAD;
+
+	// Same bits as writing the fields by hand
+	int head = 0;
+	packet_write_u16(a, &head, p.id);
+	packet_write_bit(a, &head, p.alive);
+	packet_write_s32(a, &head, p.x);
+	packet_write_s32(a, &head, p.y);
+	packet_write_s16(a, &head, p.health);
+	packet_write_u8(a, &head, p.team);
+	packet_write_u32(a, &head, p.score);
+	packet_write_float(a, &head, p.angle);
+
+	const size_t len = test_player_write(b, sizeof(b), &p);
+	if (len != packet_bytecount(head)) return TEST_BAD;
+	if (memcmp(a, b, sizeof(a)) != 0) return TEST_BAD;
+
+	if (!test_player_read(b, len, &out)) return TEST_BAD;
+	if (out.id != p.id || out.alive != p.alive || out.x != p.x || out.y != p.y
+		|| out.health != p.health || out.team != p.team
+		|| out.score != p.score || out.angle != p.angle) return TEST_BAD;
+	if (test_player_read(b, len - 1, &out)) return TEST_BAD;
+	if (test_player_write(b, len - 1, &p)) return TEST_BAD;
+
+	return true;
+}
+
+PACKET_DELTA(test_player, test_player_t, TEST_PLAYER_FIELDS)
+PACKET_BASELINES(test_player_baselines, test_player_t, 4)
+
+bool test_packet_delta1(unsigned testid) {
+	uint8_t buf[test_player_delta_max_bits / 8 + 1];
+	const test_player_t base = {
+		.id = 7, .alive = true, .x = 100000, .y = -100000, .health = 90,
+		.team = 1, .score = 5000, .angle = 1.25f,
+	};
+	test_player_t p = base, out;
+	packet_writer_t w;
+	packet_reader_t r;
+
+	// Nothing changed, so only a single bit
+	packet_writer_init(&w, buf, sizeof(buf), 0);
+	test_player_delta_encode(&w, &base, &p);
+	if (packet_writer_flush(&w) != 1) return TEST_BAD;
+
+	p.x += 3;
+	p.alive = false;
+	packet_writer_init(&w, buf, sizeof(buf), 0);
+	test_player_delta_encode(&w, &base, &p);
+	const size_t head = packet_writer_flush(&w);
+	if (head != 1 + test_player_nfields + 1 + 34 || w.err) return TEST_BAD;
+
+	packet_reader_init(&r, buf, packet_bytecount(head), 0);
+	test_player_delta_decode(&r, &base, &out);
+	if (r.err || packet_reader_head(&r) != head) return TEST_BAD;
+	if (out.x != p.x || out.alive || out.y != p.y || out.id != p.id
+		|| out.score != p.score || out.angle != p.angle) return TEST_BAD;
+
+	return true;
+}
+bool test_packet_delta2(unsigned testid) {
+	test_player_baselines_t b;
+	uint32_t seq;
+
+	test_player_baselines_init(&b);
+	if (test_player_baselines_baseline(&b, &seq)) return TEST_BAD;
+	for (uint32_t i = 10; i < 13; i++) test_player_baselines_store(&b, i)->id = i;
+
+	test_player_baselines_ack(&b, 11);
+	test_player_baselines_ack(&b, 10);
+	test_player_t *base = test_player_baselines_baseline(&b, &seq);
+	if (!base || seq != 11 || base->id != 11) return TEST_BAD;
+
+	// Never sent, or already forgotten
+	test_player_baselines_ack(&b, 20);
+	if (test_player_baselines_baseline(&b, &seq) != base) return TEST_BAD;
+	for (uint32_t i = 13; i < 16; i++) test_player_baselines_store(&b, i)->id = i;
+	if (test_player_baselines_baseline(&b, &seq)) return TEST_BAD;
+	if (test_player_baselines_get(&b, 12)->id != 12) return TEST_BAD;
+
+	return true;
+}
+
+bool test_packet_array1(unsigned testid) {
+	static int32_t s[1000], sout[1000];
+	static uint32_t u[1000], uout[1000];
+	static float f[1000], fout[1000];
+	static uint8_t buf[16 * 1024];
+	packet_writer_t w;
+	packet_reader_t r;
+
+	for (int i = 0; i < arrlen(s); i++) {
+		// Blocks with different sizes of numbers
+		const int shift = i / PACKET_ARRAY_BLOCK * 7 % 32;
+		s[i] = (int32_t)test_rand() >> shift;
+		u[i] = test_rand() >> shift;
+		f[i] = (float)(int32_t)test_rand() / (float)(1u << (i / PACKET_ARRAY_BLOCK % 31));
+	}
+	s[0] = INT32_MIN, s[1] = INT32_MAX, u[2] = 0;
+	for (int i = 64; i < 96; i++) s[i] = u[i] = f[i] = 0;
+
+	packet_writer_init(&w, buf, sizeof(buf), 0);
+	packet_writer_s32_array(&w, s, arrlen(s));
+	packet_writer_u32_array(&w, u, arrlen(u) - 5);
+	packet_writer_float_array(&w, f, arrlen(f));
+	const size_t head = packet_writer_flush(&w);
+	if (w.err) return TEST_BAD;
+
+	packet_reader_init(&r, buf, packet_bytecount(head), 0);
+	packet_reader_s32_array(&r, sout, arrlen(sout));
+	packet_reader_u32_array(&r, uout, arrlen(uout) - 5);
+	packet_reader_float_array(&r, fout, arrlen(fout));
+	if (r.err || packet_reader_head(&r) != head) return TEST_BAD;
+	if (memcmp(s, sout, sizeof(s)) != 0) return TEST_BAD;
+	if (memcmp(u, uout, sizeof(u) - 5 * sizeof(*u)) != 0) return TEST_BAD;
+
+	// Floats lose at most the precision of their block's size class
+	for (int i = 0; i < arrlen(f); i++) {
+		if (fabsf(fout[i] - f[i]) > fabsf(f[i]) * 1e-6f + 1.0f / 256.0f) {
+			return TEST_BAD;
+		}
+	}
+
+	// The same small value alone, next to a value of 8 and next to a raw one
+	for (int i = 0; i < 3 * PACKET_ARRAY_BLOCK; i++) f[i] = 0.3f;
+	f[PACKET_ARRAY_BLOCK + 1] = 9.0f;
+	f[2 * PACKET_ARRAY_BLOCK + 1] = 1000.0f;
+	packet_writer_init(&w, buf, sizeof(buf), 0);
+	packet_writer_float_array(&w, f, 3 * PACKET_ARRAY_BLOCK);
+	packet_reader_init(&r, buf, packet_bytecount(packet_writer_flush(&w)), 0);
+	packet_reader_float_array(&r, fout, 3 * PACKET_ARRAY_BLOCK);
+	if (r.err || fout[0] != 307.0f / 1024.0f) return TEST_BAD;
+	if (fout[PACKET_ARRAY_BLOCK] != 76.0f / 256.0f) return TEST_BAD;
+	if (fout[2 * PACKET_ARRAY_BLOCK] != 0.3f) return TEST_BAD;
+
+	return true;
+}
 
 static const test_t tests[] = {
 	TEST_ADD(test_test1)
+	TEST_ADD(test_bench1)
+	TEST_ADD(test_runner1)
 	TEST_PAD
 	TEST_ADD(test_strview1)
 	TEST_ADD(test_strview2)
 	TEST_ADD(test_strview3)
 	TEST_ADD(test_strview4)
+	TEST_ADD(test_strparse1)
+	TEST_ADD(test_strparse2)
+	TEST_PAD
+	TEST_ADD(test_utf8_1)
+	TEST_ADD(test_utf8_2)
+	TEST_ADD(test_utf8_3)
 	TEST_PAD
 	TEST_ADD(test_xxhash64_single_lane)
 	TEST_PAD
 	TEST_ADD(test_hset1)
+	TEST_ADD(test_hset2)
+	TEST_ADD(test_cmap1)
+	TEST_ADD(test_bloom1)
+	TEST_ADD(test_hll1)
+	TEST_PAD
+	TEST_ADD(test_arena1)
+	TEST_ADD(test_arena2)
+	TEST_PAD
+	TEST_ADD(test_dynpool1)
+	TEST_ADD(test_dynpool2)
+	TEST_ADD(test_dynpool3)
+	TEST_ADD(test_fixedpool1)
+#if EK_MEM_CHECKS && !defined(__SANITIZE_ADDRESS__)
+	TEST_ADD(test_mem_checks1)
+#endif
+	TEST_PAD
+	TEST_ADD(test_cache1)
+	TEST_ADD(test_cache2)
+	TEST_PAD
+	TEST_ADD(test_queue1)
+	TEST_ADD(test_queue2)
+	TEST_PAD
+	TEST_ADD(test_tpool1)
+	TEST_ADD(test_tpool2)
+	TEST_PAD
+	TEST_ADD(test_btree1)
+	TEST_ADD(test_btree2)
+	TEST_PAD
+	TEST_ADD(test_art1)
+	TEST_ADD(test_art2)
+	TEST_PAD
+	TEST_ADD(test_page1)
+	TEST_PAD
+	TEST_ADD(test_log1)
+	TEST_ADD(test_log2)
+	TEST_ADD(test_log_async1)
+	TEST_ADD(test_log_async2)
+	TEST_ADD(test_log_async3)
+	TEST_PAD
+	TEST_ADD(test_packet1)
+	TEST_ADD(test_packet2)
+	TEST_ADD(test_packet3)
+	TEST_ADD(test_packet_schema1)
+	TEST_ADD(test_packet_delta1)
+	TEST_ADD(test_packet_delta2)
+	TEST_ADD(test_packet_array1)
 };
 
+// Usage: test [--serial] [--group] [-j jobs] [-t timeout_ms] [filter]
 int main(int argc, char **argv) {
-	return !tests_run_foreach(NULL, tests, arrlen(tests), stdout);
+	test_opts_t opts = { .timeout_ms = 30000 };
+	bool serial = false;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--serial") == 0) serial = true;
+		else if (strcmp(argv[i], "--group") == 0) opts.by_group = true;
+		else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) opts.jobs = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) opts.timeout_ms = atoi(argv[++i]);
+		else opts.filter = argv[i];
+	}
+
+	if (serial) {
+		// Keeps the pads so the groups still line up in the output
+		static test_t selected[arrlen(tests)];
+		size_t n = 0;
+		for (size_t i = 0; i < arrlen(tests); i++) {
+			if (!tests[i].pfn || !opts.filter || strstr(tests[i].name, opts.filter)) {
+				selected[n++] = tests[i];
+			}
+		}
+		return !tests_run_foreach(NULL, selected, n, stdout);
+	}
+	return !tests_run_parallel(NULL, tests, arrlen(tests), &opts, stdout);
 }
 